@@ -28,6 +28,8 @@ void display_clock(GFX_CTX *g, int x, int y, uint32_t tm);
 void dma2d_clock(int x, int y, uint32_t tm, int ds);
 void generate_background(void);
 void generate_digits(void);
+int load_assets(void);
+void copy_background(void *src);
 
 /*
  * relocate the heap to the DRAM, 10MB at 0xC0000000
@@ -536,12 +538,57 @@ bg_draw_pixel(void *fb, int x, int y, GFX_COLOR color)
 	*((uint32_t *) fb + (y * 800) + x) = color.raw;
 }
 
+void draw_background(void);
+void gen_background(void *buf, const void *params);
+
 /*
- * This generates a "pleasant" background which looks a bit
- * like graph paper.
+ * This generates the background through the render cache (see
+ * util/render_cache.c) so it is only actually drawn the first
+ * time, or when something in 'bg_params' changes. The cache can't
+ * tell if the drawing code changes, so bump the version if you
+ * change draw_background().
+ */
+static const struct {
+	int		version;
+	int		w, h;
+	int		minor, major;	/* grid spacing */
+} bg_params = { 1, 800, 480, 25, 50 };
+
+static int bg_drawn;
+
+void
+gen_background(void *buf __attribute__((unused)),
+				const void *params __attribute__((unused)))
+{
+	draw_background();
+	bg_drawn = 1;
+}
+
+/*
+ * If it was just drawn it is already in BACKGROUND_FB, and render_cache()
+ * hands back the copy it saved in the FLASH. Copying that back over the
+ * top would be 1.5MB for nothing, so it is only copied if it came from
+ * the cache.
  */
 void
 generate_background(void)
+{
+	void *bg;
+
+	bg_drawn = 0;
+	bg = render_cache("background", &bg_params, sizeof(bg_params),
+				(void *) BACKGROUND_FB, 800 * 480 * 4, gen_background);
+	if (! bg_drawn && (bg != (void *) BACKGROUND_FB)) {
+		copy_background(bg);
+	}
+}
+
+/*
+ * This draws a "pleasant" background which looks a bit
+ * like graph paper.
+ */
+void
+draw_background(void)
 {
 	int i, x, y;
 	uint32_t *t;
@@ -650,42 +697,127 @@ print_digit(int n) {
  * drawn here with a box that is DISP_WIDTH + SKEW_MAX
  * pixels wide, but DISP_HEIGHT pixels high.
  */
+void gen_digit(void *buf, const void *params);
+
+struct digit_params {
+	int	n;			/* 0 - 9, 10 is ':', 11 is '.' */
+	int	w, h;
+	int	thick, gap;	/* segment thickness, gap between segments */
+};
+
 void
-generate_digits(void)
+gen_digit(void *buf, const void *params)
 {
+	const struct digit_params *dp = params;
+	struct digit_fb digit;
 	GFX_CTX	local_gfx;
 	GFX_CTX	*g;
-	int w, h;
+
+	digit.w = dp->w;
+	digit.h = dp->h;
+	digit.data = buf;
+	g = gfx_init(&local_gfx, digit_draw_pixel, dp->w, dp->h,
+				   GFX_FONT_LARGE, (void *)&digit);
+	if (dp->n < 10) {
+		draw_digit(g, 0, 0, dp->n, DIGIT_BODY_COLOR, DIGIT_OUTLINE_COLOR);
+	} else if (dp->n == 10) {
+		draw_colon(g, 0, 0, DIGIT_BODY_COLOR, DIGIT_OUTLINE_COLOR);
+	} else {
+		draw_dp(g, 0, 0, DIGIT_BODY_COLOR, DIGIT_OUTLINE_COLOR);
+	}
+}
+
+/*
+ * Each digit goes through the render cache. If it was already in
+ * the FLASH the digit is blitted straight from there and the RAM
+ * we drew it into isn't needed.
+ */
+void
+generate_digits(void)
+{
+	struct digit_params dp;
+	uint8_t *buf;
 	int i;
 
-	w = DISP_WIDTH + SKEW_MAX;
-	h = DISP_HEIGHT;
-	for (i = 0; i < 10; i++) {
-		digits[i].w = w;
-		digits[i].h = h;
-		digits[i].data = calloc(w * h, sizeof(uint8_t));
-		printf("Digit %d @0x%0X\n", i, (unsigned int)(digits[i].data));
-		g = gfx_init(&local_gfx, digit_draw_pixel, w, h,
-					   GFX_FONT_LARGE, (void *)&digits[i]);
-		draw_digit(g, 0, 0, i, DIGIT_BODY_COLOR, DIGIT_OUTLINE_COLOR);
-	}
-	/* colon */
-	w = SEG_THICK + SKEW_MAX;
-	h = DISP_HEIGHT;
-	digits[10].data = calloc(w * h, sizeof(uint8_t));
-	digits[10].w = w;
-	digits[10].h = h;
-	g = gfx_init(&local_gfx, digit_draw_pixel, w, h,
-						GFX_FONT_LARGE, (void *)&digits[10]);
-	draw_colon(g, 0, 0, DIGIT_BODY_COLOR, DIGIT_OUTLINE_COLOR);
-
-	/* decimal */
-	digits[11].w = w;
-	digits[11].h = h;
-	digits[11].data = calloc(w * h, sizeof(uint8_t));
-	g = gfx_init(&local_gfx, digit_draw_pixel, w, h,
-						GFX_FONT_LARGE, (void *)&digits[11]);
-	draw_dp(g, 0, 0, DIGIT_BODY_COLOR, DIGIT_OUTLINE_COLOR);
+	for (i = 0; i < 12; i++) {
+		dp.n = i;
+		dp.w = (i < 10) ? DISP_WIDTH + SKEW_MAX : SEG_THICK + SKEW_MAX;
+		dp.h = DISP_HEIGHT;
+		dp.thick = SEG_THICK;
+		dp.gap = SEG_GAP;
+		buf = calloc(dp.w * dp.h, sizeof(uint8_t));
+		digits[i].w = dp.w;
+		digits[i].h = dp.h;
+		digits[i].data = render_cache("digit", &dp, sizeof(dp), buf,
+											dp.w * dp.h, gen_digit);
+		if (digits[i].data != buf) {
+			free(buf);
+		}
+	}
+}
+
+/*
+ * The digits and the background can also come out of an asset
+ * archive in the QSPI FLASH (see util/assets.c and mkassets.pl)
+ * if you have put one there. The digits are blitted straight out of
+ * the mapped FLASH, the background is copied into BACKGROUND_FB
+ * since it gets copied to the screen every frame and SDRAM is
+ * quicker to read than the FLASH.
+ *
+ * The two don't overlap. The archive is only ever written from your
+ * computer, it is how you would replace the art with something that
+ * wasn't drawn by this code. Without one the code draws its own and
+ * the render cache saves that, so the drawing only happens once.
+ */
+#define ASSET_ADDR	0x400000
+
+/* and this is where the render cache lives */
+#define RENDER_CACHE_ADDR	0x800000
+#define RENDER_CACHE_SIZE	0x400000
+
+static const char *asset_names[13] = {
+	"digit0", "digit1", "digit2", "digit3", "digit4",
+	"digit5", "digit6", "digit7", "digit8", "digit9",
+	"colon", "dp", "background"
+};
+
+void
+copy_background(void *src)
+{
+	DMA2D_CR = DMA2D_SET(CR, MODE, DMA2D_CR_MODE_M2M);
+	DMA2D_FGPFCCR = 0x0;
+	DMA2D_FGMAR = (uint32_t) src;
+	DMA2D_FGOR = 0;
+	DMA2D_OOR =	0;
+	DMA2D_NLR = DMA2D_SET(NLR, PL, 800) | 480;
+	DMA2D_OMAR = (uint32_t) BACKGROUND_FB;
+	DMA2D_CR |= DMA2D_CR_START;
+	while ((DMA2D_CR & DMA2D_CR_START));
+}
+
+int
+load_assets(void)
+{
+	DMA2D_BITMAP bm;
+	int i;
+
+	if (asset_open(ASSET_ADDR) < 13) {
+		return -1;
+	}
+	for (i = 0; i < 12; i++) {
+		if (asset_get(asset_names[i], &bm) || (bm.mode != DMA2D_L8) ||
+			(bm.stride != bm.w) || (bm.h != DISP_HEIGHT)) {
+			return -1;
+		}
+		digits[i].w = bm.w;
+		digits[i].h = bm.h;
+		digits[i].data = bm.buf;
+	}
+	if (asset_get(asset_names[12], &bm) || (bm.w != 800) || (bm.h != 480)) {
+		return -1;
+	}
+	copy_background(bm.buf);
+	return 0;
 }
 
 /*
@@ -815,6 +947,8 @@ uint32_t frame_times[N_FRAMES] = {
 };
 
 int te_lock = 1;
+/* send frame times as telemetry metrics (decode with util/telemetry.pl) */
+int telem_on = 0;
 
 static void
 draw_pixel(void *buf, int x, int y, GFX_COLOR c)
@@ -830,162 +964,297 @@ draw_pixel(void *buf, int x, int y, GFX_COLOR c)
  * has various 'bling' levels, and it tracks performance
  * by measuring how long it takes to go from one frame
  * to the next.
+ *
+ * It used to be one big loop (draw, check the touch panel, check
+ * the console, around again), now it is a set of event handlers
+ * (see util/event.c). Drawing a frame is a low priority event that
+ * posts itself again when the frame is done, so key presses and
+ * touches are handled between frames at high priority. With the
+ * TE lock on the finished frame waits for the display's tearing
+ * effect interrupt rather than spinning on the pin, and switching
+ * modes every 10 seconds is a timer rather than a state machine.
+ *
+ * Touches go through the gesture recognizer (util/gesture.c), a tap
+ * or a swipe to the left switches to the next mode, a swipe to the
+ * right goes back one, and a long press turns auto switching on or
+ * off. Everything it recognizes is printed on the console.
  */
-int
-main(void) {
+#define EV_FRAME	(EV_USER + 0)	/* draw the next frame */
+#define EV_SWITCH	(EV_USER + 1)	/* time to switch modes */
+
+static GFX_CTX local_context;
+static GFX_CTX *g;
+static int opt, ds;
+static int auto_switch;		/* switch modes every 10 seconds */
+static int touch_trace;		/* print the touch records for gesture_replay */
+static int flip_pending;	/* frame is drawn, waiting for TE */
+static int first_frame = 1;
+static int f_ndx;
+static uint32_t t0;
+static struct event_timer switch_timer;
+static struct gesture_state gestures;
+
+static void draw_frame(struct event *ev);
+static void frame_done(void);
+static void flip_frame(struct event *ev);
+static void switch_mode(struct event *ev);
+static void touched(struct event *ev);
+static void gesture(const struct gesture *gs, void *arg);
+static void keypress(struct event *ev);
+
+/*
+ * Draw one frame, then flip it now or (with the TE lock) when the
+ * display says it is ready.
+ */
+static void
+draw_frame(struct event *ev __attribute__((unused)))
+{
 	int	i;
-	uint32_t t1, t0;
+	uint32_t t1;
 	char buf[35];
 	char *scr_opt;
-	int f_ndx = 0;
 	float avg_frame;
-	int	can_switch;
-	int	opt, ds;
-	touch_event *te;
 
-	GFX_CTX local_context;
-	GFX_CTX *g;
+	switch (opt) {
+	default:
+	case 0:
+		/* very slow way to clear the screen */
+		scr_opt = "manual clear";
+		gfx_fill_screen(g, GFX_COLOR_WHITE);
+		break;
+	case 1:
+		/* faster, using a tight loop */
+		scr_opt = "dedicated loop";
+		lcd_clear(0xff7f7f);
+		break;
+	case 2:
+		/* fastest? Using DMA2D to fill screen */
+		scr_opt = "DMA 2D Fill";
+		dma2d_fill(0xf8ecc2);
+		break;
+	case 3:
+		/* still fast, using DMA2D to pre-populate BG */
+		scr_opt = "DMA 2D Background";
+		dma2d_bgfill();
+		break;
+	case 4:
+		/* Now render all of the digits with DMA2D */
+		scr_opt = "DMA 2D Digits";
+		ds = 0;
+		dma2d_bgfill();
+		break;
+	case 5:
+		/* still fast, using DMA2D to render drop shadows */
+		scr_opt = "DMA 2D Shadowed Digits";
+		ds = 1;
+		dma2d_bgfill();
+		break;
+	}
 
-	/* Enable the clock to the DMA2D device */
-	rcc_periph_clock_enable(RCC_DMA2D);
-	fprintf(stderr, "DMA2D Demo program : Digits Gone Wild\n");
+	/*
+	 * The first four options (0, 1, 2, 3) all render the digits
+	 * in software every time, options 4 and 5 use the DMA2
+	 * device to render the digits
+	 */
+	if (opt < 4) {
+		display_clock(g, 25, 20, mtime());
+	} else {
+		dma2d_clock(25, 20, mtime(), ds);
+	}
+	for (i = 0; i < 10; i++) {
+		if (opt < 4) {
+			draw_digit(g, 25 + i * (DISP_WIDTH + 8), 350, i,
+										GFX_COLOR_GREEN, GFX_COLOR_BLACK);
+		} else {
+			if (ds) {
+				dma2d_digit(35 + i * (DISP_WIDTH + 8), 360, i, SHADOW, SHADOW);
+			}
+			dma2d_digit(25 + i * (DISP_WIDTH + 8), 350, i, 0xff40c040, 0xff000000);
+		}
+	}
 
-	printf("Generate background\n");
-	generate_background();
-	printf("Generate digits\n");
-	generate_digits();
+	/* In both cases we write the notes using the graphics library */
+	gfx_set_text_color(g, GFX_COLOR_BLACK, GFX_COLOR_BLACK);
+	gfx_set_text_size(g, 3);
+	gfx_set_text_cursor(g, 25, 55 + DISP_HEIGHT + ((gfx_get_text_height(g) * 3) + 2));
+	gfx_puts(g, (char *)"Hello world from DMA2D!");
+	t1 = mtime();
 
-	g = gfx_init(&local_context, draw_pixel, 800, 480, GFX_FONT_LARGE, 
-						(void *)FRAMEBUFFER_ADDRESS);
-	opt = 5; /* screen clearing mode */
-	can_switch = -1; /* auto switching every 10 seconds */
-	t0 = mtime();
-	ds = 0;
-	
-	while (1) {
-		switch (opt) {
-		default:
-		case 0:
-			/* very slow way to clear the screen */
-			scr_opt = "manual clear";
-			gfx_fill_screen(g, GFX_COLOR_WHITE);
-			break;
-		case 1:
-			/* faster, using a tight loop */
-			scr_opt = "dedicated loop";
-			lcd_clear(0xff7f7f);
-			break;
-		case 2:
-			/* fastest? Using DMA2D to fill screen */
-			scr_opt = "DMA 2D Fill";
-			dma2d_fill(0xf8ecc2);
-			break;
-		case 3:
-			/* still fast, using DMA2D to pre-populate BG */
-			scr_opt = "DMA 2D Background";
-			dma2d_bgfill();
-			break;
-		case 4:
-			/* Now render all of the digits with DMA2D */
-			scr_opt = "DMA 2D Digits";
-			ds = 0;
-			dma2d_bgfill();
-			break;
-		case 5:
-			/* still fast, using DMA2D to render drop shadows */
-			scr_opt = "DMA 2D Shadowed Digits";
-			ds = 1;
-			dma2d_bgfill();
-			break;
-		}
+	/* this computes a running average of the last 10 frames */
+	/* XXX cleanup text BUG: Text height doesn't reflect magnify */
+	frame_times[f_ndx] = t1 - t0;
+	if (telem_on) {
+		telem_metric(1, t1 - t0);
+		telem_metric(2, opt);
+	}
+	f_ndx = (f_ndx + 1) % N_FRAMES;
+	for (i = 0, avg_frame = 0; i < N_FRAMES; i++) {
+		avg_frame += frame_times[i];
+	}
+	avg_frame = avg_frame / (float) N_FRAMES;
+	snprintf(buf, 35, "FPS: %6.2f", 1000.0 / avg_frame);
+	gfx_set_text_cursor(g, 25, 55 + DISP_HEIGHT + 2 * ((gfx_get_text_height(g) * 3) + 2));
+	gfx_puts(g, (char *)buf);
+	gfx_set_text_cursor(g, 25, 55 + DISP_HEIGHT + 3 * ((gfx_get_text_height(g) * 3) + 2));
+	gfx_puts(g, "TEST: ");
+	gfx_puts(g, scr_opt);
+	t0 = t1;
+	if (te_lock) {
+		flip_pending = 1;
+		return;
+	}
+	lcd_flip(0);
+	frame_done();
+}
 
-		/* This little state machine implements an automatic switch
-		 * every 10 seconds unless you've disabled it with the 'd'
-		 * command.
-		 */
-		if (((t0 / 1000) % 10 == 0) && (can_switch > 0)) {
-			opt = (opt + 1) % MAX_OPTS;
-			can_switch = 0;
-		} else  if (((t0 / 1000) % 10 != 0) && (can_switch == 0)) {
-			can_switch = 1;
-		}
-		te = get_touch(0);
-		if (te != NULL) {
-			if (te->tp[0].evt) {
-				opt = (opt + 1) % MAX_OPTS;
-			}
-		}
+/*
+ * The frame is on its way to the display, start the next one.
+ */
+static void
+frame_done(void)
+{
+	if (first_frame) {
+		/* mtime() started counting at reset */
+		printf("First frame up %u mS after reset\n", (unsigned int) mtime());
+		first_frame = 0;
+	}
+	/* a finger held still doesn't interrupt, check for long presses */
+	gesture_tick(&gestures, mtime());
+	if (opt == 2) {
+		/* XXX doesn't display clock data if we don't pause here */
+		msleep(100);
+	}
+	(void) event_post(EV_FRAME, EV_PRIO_LOW, 0);
+}
 
+/*
+ * The tearing effect line went high, if a frame is waiting send it.
+ */
+static void
+flip_frame(struct event *ev __attribute__((unused)))
+{
+	if (flip_pending) {
+		flip_pending = 0;
+		lcd_flip(0);
+		frame_done();
+	}
+}
 
-		/*
-		 * The first four options (0, 1, 2, 3) all render the digits
-		 * in software every time, options 4 and 5 use the DMA2
-		 * device to render the digits
-		 */
-		if (opt < 4) {
-			display_clock(g, 25, 20, mtime());
-		} else {
-			dma2d_clock(25, 20, mtime(), ds);
-		}
-		for (i = 0; i < 10; i++) {
-			if (opt < 4) {
-				draw_digit(g, 25 + i * (DISP_WIDTH + 8), 350, i,
-											GFX_COLOR_GREEN, GFX_COLOR_BLACK);
-			} else {
-				if (ds) {
-					dma2d_digit(35 + i * (DISP_WIDTH + 8), 360, i, SHADOW, SHADOW);
-				}
-				dma2d_digit(25 + i * (DISP_WIDTH + 8), 350, i, 0xff40c040, 0xff000000);
+static void
+switch_mode(struct event *ev __attribute__((unused)))
+{
+	if (auto_switch) {
+		opt = (opt + 1) % MAX_OPTS;
+	}
+}
+
+/*
+ * Take all the touches that have come in and let the gesture
+ * recognizer have a look at them. With touch_trace on they are
+ * printed too, in the form util/host/gesture_replay reads, so you
+ * can save a trace of something the recognizer got wrong.
+ */
+static void
+touched(struct event *ev __attribute__((unused)))
+{
+	static const char *kinds[] = { "down", "move", "up" };
+	struct touch_record recs[8];
+	touch_point *a, *b;
+	int i, n;
+
+	while ((n = touch_drain(recs, 8)) > 0) {
+		for (i = 0; i < n; i++) {
+			if (touch_trace) {
+				a = &recs[i].te.tp[0];
+				b = &recs[i].te.tp[1];
+				printf("T %u %s %d %d %d %d %d %d %d %d %d\n",
+					(unsigned int) recs[i].when, kinds[recs[i].kind],
+					recs[i].te.n, a->evt, a->tid, a->x, a->y,
+					b->evt, b->tid, b->x, b->y);
 			}
+			gesture_feed(&gestures, &recs[i]);
 		}
+	}
+}
 
-		/* In both cases we write the notes using the graphics library */
-		gfx_set_text_color(g, GFX_COLOR_BLACK, GFX_COLOR_BLACK);
-		gfx_set_text_size(g, 3);
-		gfx_set_text_cursor(g, 25, 55 + DISP_HEIGHT + ((gfx_get_text_height(g) * 3) + 2));
-		gfx_puts(g, (char *)"Hello world from DMA2D!");
-		t1 = mtime();
-
-		/* this computes a running average of the last 10 frames */
-		/* XXX cleanup text BUG: Text height doesn't reflect magnify */
-		frame_times[f_ndx] = t1 - t0;
-		f_ndx = (f_ndx + 1) % N_FRAMES;
-		for (i = 0, avg_frame = 0; i < N_FRAMES; i++) {
-			avg_frame += frame_times[i];
+static void
+gesture(const struct gesture *gs, void *arg __attribute__((unused)))
+{
+	static const char *dirs[] = { "", "left", "right", "up", "down" };
+
+	switch (gs->type) {
+	case GESTURE_TAP:
+		opt = (opt + 1) % MAX_OPTS;
+		break;
+	case GESTURE_SWIPE:
+		if (gs->dir == GESTURE_LEFT) {
+			opt = (opt + 1) % MAX_OPTS;
+		} else if (gs->dir == GESTURE_RIGHT) {
+			opt = (opt + MAX_OPTS - 1) % MAX_OPTS;
+		}
+		printf("Swipe %s (%d, %d) in %u mS\n", dirs[gs->dir], gs->dx, gs->dy,
+										(unsigned int)(gs->when - gs->start));
+		return;
+	case GESTURE_LONG_PRESS:
+		auto_switch = (auto_switch == 0);
+		printf("Auto switching %s\n", (auto_switch) ? "enabled" : "disabled");
+		break;
+	case GESTURE_PINCH:
+	case GESTURE_ROTATE:
+		/* these come with every move, just show where they ended up */
+		if (gs->phase == GESTURE_END) {
+			printf("%s ended, scale %5.2f, turned %6.1f degrees\n",
+							gesture_name(gs->type), gs->scale, gs->angle);
 		}
-		avg_frame = avg_frame / (float) N_FRAMES;
-		snprintf(buf, 35, "FPS: %6.2f", 1000.0 / avg_frame);
-		gfx_set_text_cursor(g, 25, 55 + DISP_HEIGHT + 2 * ((gfx_get_text_height(g) * 3) + 2));
-		gfx_puts(g, (char *)buf);
-		gfx_set_text_cursor(g, 25, 55 + DISP_HEIGHT + 3 * ((gfx_get_text_height(g) * 3) + 2));
-		gfx_puts(g, "TEST: ");
-		gfx_puts(g, scr_opt);
-		lcd_flip(te_lock);
-		if (opt == 2) {
-			/* XXX doesn't display clock data if we don't pause here */
-			msleep(100);
+		return;
+	case GESTURE_DRAG:
+		if (gs->phase != GESTURE_END) {
+			return;
 		}
-		/*
-		 * The demo runs continuously but it watches for characters
-		 * typed at the console. There are a few options you can select.
-		 */
-		i = console_getc(0);
-		switch (i) {
+		break;
+	default:
+		break;
+	}
+	printf("%s at %d, %d\n", gesture_name(gs->type), gs->x, gs->y);
+}
+
+/*
+ * The demo watches for characters typed at the console. There
+ * are a few options you can select.
+ */
+static void
+keypress(struct event *ev __attribute__((unused)))
+{
+	int c;
+
+	while ((c = console_getc(0)) != 0) {
+		switch (c) {
 		case 's':
 			opt = (opt + 1) % MAX_OPTS;
 			printf("Switched to : %s\n", demo_options[opt]);
 			break;
 		case 'd':
-			can_switch = -1;
+			auto_switch = 0;
 			printf("Auto switching disabled\n");
 			break;
 		case 'e':
-			can_switch = 0;
+			auto_switch = 1;
 			printf("Auto switching enabled\n");
 			break;
 		case 't':
 			te_lock = (te_lock == 0);
 			printf("We are %s for the TE bit to be set\n", (te_lock) ? "WAITING" : "NOT WAITING");
+			if ((te_lock == 0) && flip_pending) {
+				flip_frame(NULL);
+			}
+			break;
+		case 'm':
+			telem_on = (telem_on == 0);
+			telem_log((telem_on) ? "frame metrics on" : "frame metrics off");
+			break;
+		case 'g':
+			touch_trace = (touch_trace == 0);
+			printf("Touch trace %s\n", (touch_trace) ? "on" : "off");
 			break;
 		default:
 			printf("Options:\n");
@@ -993,9 +1262,54 @@ main(void) {
 			printf("\td - disable auto-switching of demo mode\n");
 			printf("\te - enable auto-switching of demo mode\n");
 			printf("\tt - enable/disable Tearing effect lock wait\n");
-		case 0:
+			printf("\tm - send frame times as telemetry (1 = mS, 2 = mode)\n");
+			printf("\tg - print touch records (for gesture_replay)\n");
 			break;
 		}
-		t0 = t1;
 	}
 }
+
+int
+main(void) {
+	struct rc_stats rcs;
+
+	/* Enable the clock to the DMA2D device */
+	rcc_periph_clock_enable(RCC_DMA2D);
+	fprintf(stderr, "DMA2D Demo program : Digits Gone Wild\n");
+
+	t0 = mtime();
+	if (load_assets() == 0) {
+		printf("Loaded assets from FLASH in %u mS\n", (unsigned int)(mtime() - t0));
+	} else {
+		rc_init(RENDER_CACHE_ADDR, RENDER_CACHE_SIZE);
+		printf("Generate background\n");
+		generate_background();
+		printf("Generate digits\n");
+		generate_digits();
+		rc_get_stats(&rcs);
+		printf("Background and digits took %u mS (%u cached, %u drawn)\n",
+			(unsigned int)(mtime() - t0), (unsigned int) rcs.hits,
+			(unsigned int) rcs.misses);
+	}
+
+	g = gfx_init(&local_context, draw_pixel, 800, 480, GFX_FONT_LARGE, 
+						(void *)FRAMEBUFFER_ADDRESS);
+	opt = 5; /* screen clearing mode */
+	auto_switch = 0; /* 'e' turns on switching every 10 seconds */
+	ds = 0;
+
+	timebase_init();
+	event_init();
+	event_handler_set(EV_FRAME, draw_frame);
+	event_handler_set(EV_LCD_TE, flip_frame);
+	event_handler_set(EV_SWITCH, switch_mode);
+	gesture_init(&gestures, NULL, gesture, NULL);
+	event_handler_set(EV_TOUCH, touched);
+	event_handler_set(EV_CONSOLE, keypress);
+	event_te_enable();
+	event_timer_start(&switch_timer, 10000000, 10000000, EV_SWITCH,
+														EV_PRIO_NORMAL, 0);
+	t0 = mtime();
+	(void) event_post(EV_FRAME, EV_PRIO_LOW, 0);
+	event_loop();
+}
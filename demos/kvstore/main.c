@@ -0,0 +1,159 @@
+/*
+ * Key/Value store demo
+ *
+ * Copyright (c) 2016, Chuck McManis (cmcmanis@mcmanis.com)
+ *
+ * A small command line for poking at the key/value store in the
+ * QSPI FLASH. Values survive a reset (or a power cycle) so you can
+ * set something, press the reset button, and get it back.
+ *
+ *	set <key> <value>	- store a value
+ *	get <key>		- print a value
+ *	del <key>		- delete a key
+ *	stats			- erase counts and write amplification
+ *	stress <n>		- re-write a handful of keys 'n' times
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../util/util.h"
+
+/* The last 256K of the FLASH, well away from the other demos */
+#define KV_BASE		0xfc0000
+#define KV_SECTORS	64
+
+#define LINE_MAX	80
+
+static void show_stats(void);
+static void stress(int n);
+static int get_line(char *buf, int len);
+
+static void
+show_stats(void)
+{
+	struct kv_stats st;
+
+	kv_get_stats(&st);
+	printf("Keys: %u, free sub-sectors: %u\n", (unsigned int) st.keys,
+										(unsigned int) st.free_sectors);
+	printf("Erases: %u, compactions: %u, erase count min/max %u/%u\n",
+		(unsigned int) st.erases, (unsigned int) st.compactions,
+		(unsigned int) st.min_erase, (unsigned int) st.max_erase);
+	printf("User bytes: %u, FLASH bytes: %u\n",
+		(unsigned int) st.user_bytes, (unsigned int) st.flash_bytes);
+	if (st.user_bytes) {
+		printf("Write amplification: %u.%02u\n",
+			(unsigned int) (st.flash_bytes / st.user_bytes),
+			(unsigned int) (((st.flash_bytes % st.user_bytes) * 100) /
+				st.user_bytes));
+	}
+}
+
+/*
+ * Hammer on 8 keys, this is the case where a "re-write the block"
+ * scheme would wear out the FLASH and the log has to keep up by
+ * compacting in the background.
+ */
+static void
+stress(int n)
+{
+	char key[16];
+	uint32_t val;
+	uint32_t t0, t1;
+	int i;
+
+	printf("Writing %d values ...\n", n);
+	t0 = mtime();
+	for (i = 0; i < n; i++) {
+		snprintf(key, sizeof(key), "stress%d", i & 7);
+		val = i;
+		if (kv_set(key, (uint8_t *) &val, sizeof(val)) != 0) {
+			printf("kv_set failed at %d\n", i);
+			break;
+		}
+		kv_service();
+	}
+	t1 = mtime();
+	printf("   ... took %u mS\n", (unsigned int) (t1 - t0));
+	show_stats();
+}
+
+/*
+ * Read a line from the console but keep the store's background
+ * compaction going while waiting for the user to type.
+ */
+static int
+get_line(char *buf, int len)
+{
+	int n = 0;
+	char c;
+
+	while (1) {
+		c = console_getc(0);
+		if (c == 0) {
+			kv_service();
+			continue;
+		}
+		if (c == '\r') {
+			console_puts("\n");
+			buf[n] = 0;
+			return n;
+		}
+		if (((c == '\010') || (c == '\177')) && (n > 0)) {
+			console_puts("\010 \010");
+			n--;
+		} else if ((c >= ' ') && (n < len - 1)) {
+			console_putc(c);
+			buf[n++] = c;
+		}
+	}
+}
+
+int
+main(void)
+{
+	char line[LINE_MAX];
+	uint8_t val[KV_MAX_VALUE + 1];
+	char *cmd, *key, *arg;
+	int n;
+
+	printf("QSPI FLASH Key/Value store demo\n");
+	n = kv_init(KV_BASE, KV_SECTORS);
+	printf("Store has %d keys\n", n);
+	show_stats();
+	while (1) {
+		console_puts("kv> ");
+		get_line(line, sizeof(line));
+		cmd = strtok(line, " ");
+		key = strtok(NULL, " ");
+		arg = strtok(NULL, "");
+		if (cmd == NULL) {
+			continue;
+		}
+		if ((strcmp(cmd, "set") == 0) && key && arg) {
+			if (kv_set(key, (uint8_t *) arg, strlen(arg)) != 0) {
+				printf("Failed.\n");
+			}
+		} else if ((strcmp(cmd, "get") == 0) && key) {
+			n = kv_get(key, val, KV_MAX_VALUE);
+			if (n < 0) {
+				printf("'%s' not found\n", key);
+			} else {
+				val[n] = 0;
+				printf("%s = '%s'\n", key, (char *) val);
+			}
+		} else if ((strcmp(cmd, "del") == 0) && key) {
+			if (kv_delete(key) != 0) {
+				printf("'%s' not found\n", key);
+			}
+		} else if (strcmp(cmd, "stats") == 0) {
+			show_stats();
+		} else if (strcmp(cmd, "stress") == 0) {
+			stress((key) ? atoi(key) : 1000);
+		} else {
+			printf("Commands: set <key> <value>, get <key>, del <key>, "
+				   "stats, stress [n]\n");
+		}
+		toggle_led(GREEN_LED);
+	}
+}
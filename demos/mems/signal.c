@@ -14,28 +14,60 @@
 #include <math.h>
 #include <complex.h>
 #include "signal.h"
+#include "../util/util.h"
 
 #ifndef M_PI
 #define M_PI		3.14159265358979323846	/* pi */
 #endif
 
+/*
+ * Sample buffers come out of the memory regions (see util/region.c).
+ * The sample_buffer structures themselves are small and come and go
+ * so they come from a pool in the internal SRAM. The samples can be
+ * big so they come from an arena in the SDRAM, which works like a
+ * stack. They tend to be freed in the reverse order they were
+ * allocated, which gives the memory back right away. One that is
+ * freed out of order is given back when the ones after it are, and
+ * when they have all been freed the arena is reset. If either runs
+ * out, malloc() is used.
+ */
+#define SIGNAL_BUFFERS		16
+#define SIGNAL_ARENA_SIZE	(2 * 1024 * 1024)
+
+static struct pool sb_pool;
+static struct arena sb_arena;
+static int sb_ready;
+static int sb_count;
+
+#define in_pool(p)	(((uint8_t *)(p) >= sb_pool.mem) && \
+		((uint8_t *)(p) < sb_pool.mem + sb_pool.size * sb_pool.count))
+#define in_arena(p)	(((uint8_t *)(p) >= sb_arena.base) && \
+		((uint8_t *)(p) < sb_arena.end))
+
 /*
  * alloc_buf( ... )
  *
- * Allocate a signal buffer. Basically this code is a very simple memory allocator
- * that starts at 0xc0000000 (where DRAM starts on the STM32F469-Disco board) and
- * starts eating chunks each time you allocate. There isn't an "actual" memory
- * allocator here so free doesn't actually do anything. Also it doesn't know
- * about malloc/free so it might give weird results if you've adjusted malloc
- * to use that space.
+ * Allocate a signal buffer of 'size' samples, cleared to zero.
  */
 sample_buffer *
 alloc_buf(int size) {
 	sample_buffer *res;
 
-	res = malloc(sizeof(sample_buffer));
-	res->data = malloc(sizeof(sample_t) * size);
+	if (! sb_ready) {
+		pool_init(&sb_pool, REGION_SRAM, sizeof(sample_buffer), SIGNAL_BUFFERS);
+		arena_init(&sb_arena, REGION_SDRAM, SIGNAL_ARENA_SIZE);
+		sb_ready = 1;
+	}
+	res = pool_alloc(&sb_pool);
+	if (res == NULL) {
+		res = malloc(sizeof(sample_buffer));
+	}
+	res->data = arena_alloc(&sb_arena, sizeof(sample_t) * size, 8);
+	if (res->data == NULL) {
+		res->data = malloc(sizeof(sample_t) * size);
+	}
 	res->n = size;
+	sb_count++;
 	/* clear it to zeros */
 	reset_minmax(res);
 	clear_samples(res);
@@ -47,10 +79,21 @@ alloc_buf(int size) {
 void
 free_buf(sample_buffer *sb)
 {
-	free(sb->data);
+	if (in_arena(sb->data)) {
+		arena_free(&sb_arena, sb->data);
+	} else {
+		free(sb->data);
+	}
 	sb->data = 0x0;
 	sb->n = 0;
-	free(sb);
+	if (in_pool(sb)) {
+		pool_free(&sb_pool, sb);
+	} else {
+		free(sb);
+	}
+	if (--sb_count == 0) {
+		arena_reset(&sb_arena);
+	}
 	return;
 }
 
@@ -8,6 +8,10 @@
 
 
 void draw_pixel(int x, int y, uint16_t color);
+void erase_timing(void);
+void cache_timing(void);
+void mapped_update(void);
+void program_timing(void);
 
 #define GWIDTH	16	
 #define GHEIGHT	256
@@ -49,6 +53,192 @@ draw_pixel(int x, int y, uint16_t color)
 	buffer[y*16 + x] = color & 0xff;
 }
 
+/*
+ * Compare the time it takes to erase 1MB of FLASH using 4K
+ * sub-sector erases one at a time, against the range erase which
+ * uses 64K sector erases wherever it can. The region used is the
+ * second megabyte of FLASH so the test data at 0 is left alone.
+ */
+#define ERASE_TEST_ADDR	0x100000
+#define ERASE_TEST_LEN	0x100000
+
+void
+erase_timing(void)
+{
+	uint32_t t0, t1, t_sub, t_range;
+	uint32_t blk;
+
+	qspi_unmap_flash();
+	printf("Erasing 1MB with 4K sub-sector erases ...\n");
+	t0 = mtime();
+	for (blk = ERASE_TEST_ADDR >> 12;
+			blk < ((ERASE_TEST_ADDR + ERASE_TEST_LEN) >> 12); blk++) {
+		qspi_erase_block(blk);
+	}
+	t1 = mtime();
+	t_sub = t1 - t0;
+	printf("   ... took %u mS\n", (unsigned int) t_sub);
+
+	printf("Erasing 1MB with range erase ...\n");
+	t0 = mtime();
+	qspi_erase_range(ERASE_TEST_ADDR, ERASE_TEST_LEN);
+	while (qspi_busy()) {
+		/* the CPU is free to do other things here */
+		toggle_led(GREEN_LED);
+		msleep(100);
+	}
+	t1 = mtime();
+	t_range = t1 - t0;
+	printf("   ... took %u mS\n", (unsigned int) t_range);
+	if (t_range) {
+		printf("Range erase was %u.%02u times faster\n",
+			(unsigned int) (t_sub / t_range),
+			(unsigned int) (((t_sub % t_range) * 100) / t_range));
+	}
+	qspi_map_flash();
+}
+
+/*
+ * Compare lots of small scattered reads (like pulling glyphs out
+ * of a font) done with qspi_read_flash() directly, and through the
+ * read cache. The reads are 16 bytes each out of the first 32K of
+ * the FLASH, with the same pseudo-random sequence both times.
+ */
+#define CACHE_TEST_READS	20000
+#define CACHE_TEST_SPAN		0x8000
+static uint8_t cache_mem[16384];
+
+void
+cache_timing(void)
+{
+	struct qspi_cache_stats st;
+	uint8_t glyph[16];
+	uint32_t t0, t1, t_raw, t_cache;
+	int i;
+
+	qspi_unmap_flash();
+	printf("%d scattered 16 byte reads with qspi_read_flash() ...\n",
+												CACHE_TEST_READS);
+	srand(1);
+	t0 = mtime();
+	for (i = 0; i < CACHE_TEST_READS; i++) {
+		qspi_read_flash((rand() % CACHE_TEST_SPAN) & ~0xf, glyph, 16);
+	}
+	t1 = mtime();
+	t_raw = t1 - t0;
+	printf("   ... took %u mS\n", (unsigned int) t_raw);
+
+	qspi_cache_init(cache_mem, sizeof(cache_mem));
+	printf("Same reads through a %dK read cache ...\n",
+										(int) sizeof(cache_mem) / 1024);
+	srand(1);
+	t0 = mtime();
+	for (i = 0; i < CACHE_TEST_READS; i++) {
+		qspi_cache_read((rand() % CACHE_TEST_SPAN) & ~0xf, glyph, 16);
+	}
+	t1 = mtime();
+	t_cache = t1 - t0;
+	qspi_cache_get_stats(&st, 1);
+	printf("   ... took %u mS, %u hits, %u misses\n", (unsigned int) t_cache,
+				(unsigned int) st.hits, (unsigned int) st.misses);
+	qspi_map_flash();
+}
+
+/*
+ * Time programming 256K of FLASH with the pipelined write engine, 16K
+ * at a time out of the cache test buffer. The datasheet says a 256 byte
+ * page programs in 0.5 mS (typical), so if the next page is always
+ * ready when the chip finishes, the best we can hope for is about 500K
+ * bytes per second. The region is the third megabyte of the FLASH, it
+ * is erased first (not timed) and one chunk is read back to check it.
+ */
+#define PROG_TEST_ADDR	0x200000
+#define PROG_TEST_LEN	0x40000
+#define PAGE_PROGRAM_US	500		/* typical, from the N25Q128 datasheet */
+
+void
+program_timing(void)
+{
+	uint8_t check[256];
+	uint32_t t0, t1, addr, rate, best;
+	int i, bad = 0;
+
+	for (i = 0; i < (int) sizeof(cache_mem); i++) {
+		cache_mem[i] = (uint8_t) (i * 7 + (i >> 8));
+	}
+	qspi_unmap_flash();
+	printf("Erasing %uK at 0x%x ...\n", PROG_TEST_LEN / 1024, PROG_TEST_ADDR);
+	qspi_erase_range(PROG_TEST_ADDR, PROG_TEST_LEN);
+	if (qspi_wait()) {
+		printf("   ... erase failed\n");
+		qspi_map_flash();
+		return;
+	}
+	printf("Programming %uK ...\n", PROG_TEST_LEN / 1024);
+	t0 = mtime();
+	for (addr = PROG_TEST_ADDR; addr < PROG_TEST_ADDR + PROG_TEST_LEN;
+												addr += sizeof(cache_mem)) {
+		if (qspi_write_flash(addr, cache_mem, sizeof(cache_mem))) {
+			printf("   ... write failed at 0x%x\n", (unsigned int) addr);
+			qspi_map_flash();
+			return;
+		}
+	}
+	t1 = mtime();
+	if (t1 == t0) {
+		t1++;
+	}
+	rate = (PROG_TEST_LEN / 1024) * 1000 / (t1 - t0);
+	best = (256 * 1000000 / PAGE_PROGRAM_US) / 1024;
+	printf("   ... took %u mS, %u KB/second (%u%% of the %u KB/second "
+		"the datasheet page program time allows)\n", (unsigned int) (t1 - t0),
+		(unsigned int) rate, (unsigned int) (rate * 100 / best),
+		(unsigned int) best);
+	qspi_read_flash(PROG_TEST_ADDR + PROG_TEST_LEN - sizeof(check), check,
+															sizeof(check));
+	for (i = 0; i < (int) sizeof(check); i++) {
+		if (check[i] != cache_mem[sizeof(cache_mem) - sizeof(check) + i]) {
+			bad++;
+		}
+	}
+	if (bad) {
+		printf("   ... %d bytes read back wrong!\n", bad);
+	}
+	qspi_map_flash();
+}
+
+/*
+ * Re-write part of the FLASH while it is mapped. There is no
+ * un-map or re-map here, the QSPI code switches modes for us and
+ * the begin/end update calls keep it from switching back in between
+ * the erase and the write. When we read it back through the mapped
+ * window the new data is there.
+ */
+#define UPDATE_ADDR		0x1000
+
+void
+mapped_update(void)
+{
+	static int count;
+	char msg[64];
+	uint8_t *p;
+	int len;
+
+	len = snprintf(msg, sizeof(msg), "Mapped update #%d at %u mS",
+											++count, (unsigned int) mtime());
+	qspi_begin_update();
+	qspi_erase_range(UPDATE_ADDR, 4096);
+	qspi_wait();
+	qspi_write_flash_async(UPDATE_ADDR, (uint8_t *) msg, len + 1);
+	qspi_end_update();
+	p = qspi_mapped_addr(UPDATE_ADDR);
+	if (p == NULL) {
+		printf("FLASH didn't come back mapped!\n");
+		return;
+	}
+	printf("Read back from %p : %s\n", p, (char *) p);
+}
+
 int
 main(void)
 {
@@ -120,6 +310,14 @@ main(void)
 			hex_dump(0, page, 256);
 			printf("Re-map the flash\n");
 			qspi_map_flash();
+		} else if (c == 'e') {
+			erase_timing();
+		} else if (c == 'c') {
+			cache_timing();
+		} else if (c == 'w') {
+			mapped_update();
+		} else if (c == 'p') {
+			program_timing();
 		} else if (c == 'f') {
 			printf("Demonstrating un-map failure: Unmap flash start ...\n");
 			qspi_unmap_flash();
@@ -123,6 +123,81 @@ dump_page(uint8_t *addr, uint8_t *base)
 	return addr;
 }
 
+/*
+ * Test all 16MB of SDRAM, either the quick test (which is what
+ * runs at boot) or March-C, and say how long it took.
+ */
+void memory_test(int march);
+
+void
+memory_test(int march)
+{
+	struct memtest_result res;
+	uint32_t t0, t1;
+	int errors;
+
+	res.errors = 0;
+	t0 = mtime();
+	if (march) {
+		errors = memtest_march_c((uint32_t *) SDRAM_BASE_ADDRESS, 16 * 1024 * 1024, &res);
+	} else {
+		errors = memtest_quick((uint32_t *) SDRAM_BASE_ADDRESS, 16 * 1024 * 1024, &res);
+	}
+	t1 = mtime();
+	if (errors) {
+		printf("%s%d errors%s, first at 0x%08x (expected 0x%08x, read 0x%08x)\n",
+			console_color(RED), errors, console_color(NONE),
+			(unsigned int) res.fail_addr, (unsigned int) res.expected,
+			(unsigned int) res.actual);
+	} else {
+		printf("%sPassed%s\n", console_color(GREEN), console_color(NONE));
+	}
+	printf("Took %u mS\n", (unsigned int)(t1 - t0));
+}
+
+/*
+ * Time a hex_dump() of 64K of SDRAM (4096 lines). With the console
+ * dropping what doesn't fit the time is just what the formatting
+ * costs, with it blocking (and flushed at the end) it is how long the
+ * UART takes. The last one is the same dump in bulk mode.
+ */
+void dump_timing(void);
+static uint32_t time_dump(int flags, int policy);
+
+static uint32_t
+time_dump(int flags, int policy)
+{
+	uint32_t t0;
+
+	console_tx_policy(policy);
+	t0 = mtime();
+	hex_dump_ex(0, SDRAM_BASE_ADDRESS, 65536, 16, flags);
+	console_flush();
+	t0 = mtime() - t0;
+	console_tx_policy(CONSOLE_TX_BLOCK);
+	printf("\n");
+	return (t0) ? t0 : 1;
+}
+
+void
+dump_timing(void)
+{
+	int color = (*console_color(NONE)) ? HEXDUMP_COLOR : 0;
+	uint32_t fmt, bulk, wire;
+
+	fmt = time_dump(color, CONSOLE_TX_DROP);
+	bulk = time_dump(color | HEXDUMP_BULK, CONSOLE_TX_DROP);
+	wire = time_dump(color, CONSOLE_TX_BLOCK);
+	printf("64K hex dump (4096 lines):\n");
+	printf("  formatting %u mS (%u lines/sec)\n", (unsigned int) fmt,
+		(unsigned int)(4096000 / fmt));
+	printf("  bulk mode  %u mS (%u lines/sec)\n", (unsigned int) bulk,
+		(unsigned int)(4096000 / bulk));
+	printf("  to send    %u mS (%u lines/sec)\n", (unsigned int) wire,
+		(unsigned int)(4096000 / wire));
+	printf("  %u characters dropped\n", (unsigned int) console_tx_dropped());
+}
+
 /*
  * Let this be defined if you want to see the Hard Fault test
  * in action. A bit of code at the beginning here trys to write
@@ -142,10 +217,12 @@ int
 main(void)
 {
 	int i;
-	uint32_t test_val;
-	uint32_t *test_buf;
+	struct memtest_bg bg;
 	uint8_t *addr;
 	char	c;
+	struct membench_result res[MEMBENCH_MAX];
+	int	n, prof, cur;
+	const char *name;
 
 	fprintf(stderr,"\nSDRAM Example.\n");
 #ifdef FAULT_TEST
@@ -158,6 +235,8 @@ main(void)
 	addr = SDRAM_BASE_ADDRESS; 
 	(void) dump_page(addr, NULL);
 	printf("Status register is 0x%x\n", (int) FMC_SDSR);
+	printf("Boot self test: ");
+	memory_test(0);
 	printf("Now writing new values \n");
 	addr = SDRAM_BASE_ADDRESS; 
 	for (i = 0; i < 256; i++) {
@@ -172,19 +251,62 @@ main(void)
 		switch (c = console_getc(1)) {
 		case 't':
 		case 'T':
-			test_buf = (uint32_t *)(SDRAM_BASE_ADDRESS);
-			printf("Testing Memory\n");
-			for (test_val = 0; test_val < 1000000; test_val++) {
-				*test_buf++ = test_val;
+			printf("Testing Memory (quick)\n");
+			memory_test(0);
+			addr = SDRAM_BASE_ADDRESS;
+			break;
+		case 'm':
+		case 'M':
+			printf("Testing Memory (March-C)\n");
+			memory_test(1);
+			addr = SDRAM_BASE_ADDRESS;
+			break;
+		case 'i':
+		case 'I':
+			printf("Background March-C over the first 8MB, press a key to stop\n");
+			memtest_bg_start(&bg, (uint32_t *) SDRAM_BASE_ADDRESS, 8 * 1024 * 1024);
+			while (console_getc(0) == 0) {
+				if (memtest_bg_step(&bg, 10)) {
+					printf("Pass %u, %u errors\n", (unsigned int) bg.passes,
+						(unsigned int) bg.result.errors);
+				}
 			}
-			test_buf = (uint32_t *)(SDRAM_BASE_ADDRESS);
-			for (test_val = 0; test_val < 1000000; test_val++) {
-				if (*test_buf != test_val) {
-					printf("Memory should have %u, but instead has %u\n", (unsigned int) test_val,
-								(unsigned int) *test_buf);
+			addr = SDRAM_BASE_ADDRESS;
+			break;
+		case 'b':
+		case 'B':
+			/* 8MB at the start of SDRAM, well clear of the frame buffer */
+			printf("Benchmarking SDRAM\n");
+			n = membench_run(SDRAM_BASE_ADDRESS, 8 * 1024 * 1024, res, MEMBENCH_MAX);
+			membench_print(res, n);
+			addr = SDRAM_BASE_ADDRESS;
+			break;
+		case 'r':
+		case 'R':
+			/* the same benchmarks with each of the FMC timing profiles */
+			cur = sdram_get_profile();
+			for (prof = 0; (name = sdram_profile_name(prof)) != NULL; prof++) {
+				printf("%sProfile %d: %s%s\n", console_color(YELLOW), prof, name,
+							console_color(NONE));
+				if (sdram_set_profile(prof) != 0) {
+					printf("  (too fast for this HCLK)\n");
+					continue;
 				}
-				test_buf++;
+				n = membench_run(SDRAM_BASE_ADDRESS, 8 * 1024 * 1024, res, MEMBENCH_MAX);
+				membench_print(res, n);
 			}
+			sdram_set_profile(cur);
+			addr = SDRAM_BASE_ADDRESS;
+			break;
+		case 'h':
+		case 'H':
+			dump_timing();
+			break;
+		case 'l':
+		case 'L':
+			printf("Turning on the display (benchmarks will include LTDC contention)\n");
+			lcd_init();
+			lcd_clear(0x000040);
 			break;
 		case 'f':
 		case 'F':
@@ -270,6 +392,13 @@ main(void)
 			printf(" f 0 - fill current page with 0\n");
 			printf(" f i - fill current page with 0 to 255\n");
 			printf(" f f - fill current page with 0xff\n");
+			printf(" t - quick memory test (all 16MB)\n");
+			printf(" m - March-C memory test (all 16MB)\n");
+			printf(" i - background March-C until a key is pressed\n");
+			printf(" h - time a 64K hex dump\n");
+			printf(" b - SDRAM bandwidth/latency benchmarks\n");
+			printf(" r - run the benchmarks with each FMC timing profile\n");
+			printf(" l - turn on the LCD (to measure LTDC contention)\n");
 			printf(" ? - this message\n");
 			break;
 		}
@@ -429,10 +429,20 @@ render_buffer(int opt)
 	uint32_t	buf_char;
 	uint8_t		attr;
 	unsigned char c;
+	uint32_t	g0;
+	static int	prof_render = -1, prof_glyph, prof_clear;
 
+	if (prof_render < 0) {
+		prof_render = prof_timer("render");
+		prof_glyph = prof_timer("glyph");
+		prof_clear = prof_timer("clear");
+	}
+	prof_trace(1, opt);
 	t0 = mtime();
+	g0 = prof_start();
 	if (opt) {
 		clear_screen(current_bg_color);
+		(void) prof_stop(prof_clear, g0);
 	}
 	for (row = 0; row < TERM_HEIGHT; row ++) {
 		for (col = 0; col < TERM_WIDTH; col++) {
@@ -453,13 +463,18 @@ render_buffer(int opt)
 					t = bg; bg = fg; fg = t;
 				}
 				f = (attr & TERM_CHAR_BOLD) ? &bold_font : &regular_font;
-				dma2d_char(get_glyph(f, c), f->w, f->h,
+				{
+					PROF_SCOPE(prof_glyph);
+					dma2d_char(get_glyph(f, c), f->w, f->h,
 						   addr, __term_color_table[fg], __term_color_table[bg]);
+				}
 			}
 		}
 	}
 	lcd_flip(0);
 	t1 = mtime();
+	(void) prof_stop(prof_render, g0);
+	prof_trace(2, opt);
 	return (t1 - t0);
 }
 
@@ -611,7 +626,7 @@ main(void) {
 	printf("Splash Screen renders in %d mS on option 0\n", (int) bnch);
 	bnch = splash_screen(1);
 	printf("Splash Screen renders in %d mS on option 1\n", (int) bnch);
-	printf("Please type characters :\n");
+	printf("Please type characters (^P shows the render profile) :\n");
 	while (1) {
 
 		if ((c = console_getc(0)) != 0) {
@@ -630,6 +645,12 @@ main(void) {
 					}
 				}
 			}
+			/* ^P prints the render profile */
+			if (c == 0x10) {
+				prof_dump();
+				prof_trace_dump(16);
+				prof_reset();
+			}
 			if (c == 0x1a) {
 				for (c = 0; c < 30; c++) {
 					snprintf(buf, 81, "This is a test line # %d\n", c);
@@ -42,6 +42,39 @@
  *								 `I2S3_SD` or `SPI3_MOSI`)
  * PA8 (`USART1_CK`) is on pin 3 (PD6 can be `USART2_RX`)
  */
+
+/*
+ * Experiment 9: How close to on time are the TIM2 one-shot timers
+ * from timebase.c? Start a few and see how late each one ran.
+ */
+static const uint32_t jitter_us[] = { 50, 250, 1000, 2500, 40000 };
+#define N_JITTER	(sizeof(jitter_us) / sizeof(uint32_t))
+static struct utimer jitter_timer[N_JITTER];
+static volatile uint32_t jitter_fired[N_JITTER];
+
+static void
+jitter_func(void *arg)
+{
+	*(volatile uint32_t *) arg = uclock();
+}
+
+static void
+jitter_test(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < N_JITTER; i++) {
+		jitter_fired[i] = 0;
+		utimer_start(&jitter_timer[i], jitter_us[i], jitter_func,
+										(void *) &jitter_fired[i]);
+	}
+	msleep(50);
+	for (i = 0; i < N_JITTER; i++) {
+		printf("%6u uS timer ran %u uS late\n", (unsigned int) jitter_us[i],
+			(unsigned int)(jitter_fired[i] - jitter_timer[i].when));
+	}
+}
+
 int
 main(void)
 {
@@ -110,7 +143,12 @@ main(void)
 	TIM3_CCR2 = 0;
 	TIM3_CCR1 = 10;
 	TIM3_CR1 = TIM_CR1_CEN;
-	printf("Timer should be running + increments, - decrements\n");
+	/*
+	 * TIM2 microsecond clock (the SysTick stops ticking). This has to
+	 * come after TIMPRE is set since that changes the timer clock.
+	 */
+	timebase_init();
+	printf("Timer should be running + increments, - decrements, j tries the TIM2 timers\n");
 
 	printf("Now setting up the USART\n");
 	USART_BRR(USART1) = 2 << 4; 
@@ -177,6 +215,9 @@ main(void)
 			case ']':
 				USART_BRR(USART1)++;
 				break;
+			case 'j':
+				jitter_test();
+				break;
 			case ' ':
 				printf("ARR = 0x%05x, BRR = 0x%05x\n", 
 					(unsigned int) TIM3_ARR, (unsigned int) USART_BRR(USART1));
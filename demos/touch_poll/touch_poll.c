@@ -169,7 +169,7 @@ main(void)
 	fprintf(stderr, "I2C Example Code (polling)\n");
 
 	/* initialize the i2c_device handle for the touch panel controller */
-	touch_device = i2c_init(1, I2C_400KHZ, 0x54);
+	touch_device = i2c_init(1, 0x54, I2C_400KHZ);
 	if (touch_device == NULL) {
 		fprintf(stderr, "Unable to initialize i2c\n");
 		while (1);
@@ -0,0 +1,175 @@
+/*
+ * assets.c - bitmaps packed into the QSPI FLASH
+ *
+ * Copyright (c) 2016, Chuck McManis (cmcmanis@mcmanis.com)
+ *
+ * Art made on your computer (PGM/PPM images) can be packed by
+ * mkassets.pl into an archive and written to the QSPI FLASH.
+ * The pixels are stored in the native DMA2D color modes so when the
+ * FLASH is memory mapped the DMA2D can blit straight out of it. The
+ * DMA2D_BITMAP you get back from asset_get() points into the mapped
+ * window at 0x90000000, nothing is copied into RAM.
+ *
+ * Things the board draws for itself at boot go in the render cache
+ * (render_cache.c) instead, which notices when the drawing changes.
+ *
+ * Archive layout (all little endian):
+ *	Header (16 bytes)
+ *		magic		- 'ASET'
+ *		version		- ASSET_VERSION
+ *		count		- number of directory entries
+ *		size		- size of the whole archive in bytes
+ *		check		- FNV-1a hash of the directory entries
+ *	Directory (count entries of 48 bytes)
+ *		name		- 16 bytes, NUL padded
+ *		offset, size	- where the pixels are (from the archive start)
+ *		w, h, stride	- size in pixels, stride in bytes
+ *		mode		- DMA2D_ARGB8888 ... DMA2D_A4
+ *		fg, bg		- default colors for A4/A8 bitmaps
+ *		clut_offset	- where the CLUT is (0 if none)
+ *		clut_len	- number of ARGB8888 CLUT entries
+ *	Pixel data and CLUTs, each starting on a 16 byte boundary.
+ */
+#include <stdint.h>
+#include <string.h>
+#include "../util/util.h"
+
+#define ASSET_MAGIC		0x54455341	/* 'ASET' */
+#define ASSET_VERSION	1
+#define ASSET_NAME_LEN	16
+
+struct asset_header {
+	uint32_t	magic;
+	uint16_t	version;
+	uint16_t	count;
+	uint32_t	size;
+	uint32_t	check;
+};
+
+struct asset_entry {
+	char		name[ASSET_NAME_LEN];
+	uint32_t	offset;
+	uint32_t	size;
+	uint16_t	w, h;
+	uint16_t	stride;
+	uint8_t		mode;
+	uint8_t		reserved;
+	uint32_t	fg, bg;
+	uint32_t	clut_offset;
+	uint16_t	clut_len;
+	uint16_t	reserved2;
+};
+
+/* the archive that asset_get() looks in */
+static uint32_t asset_base;
+static const struct asset_header *asset_hdr;
+static const struct asset_entry *asset_dir;
+
+static uint32_t asset_check(const uint8_t *data, int len);
+
+/*
+ * FNV-1a over the directory, enough to tell a real archive
+ * from stale FLASH.
+ */
+static uint32_t
+asset_check(const uint8_t *data, int len)
+{
+	uint32_t h = 0x811c9dc5;
+
+	while (len-- > 0) {
+		h ^= *data++;
+		h *= 0x01000193;
+	}
+	return h;
+}
+
+/*
+ * asset_open( ... )
+ *
+ * Look for an asset archive at FLASH address 'addr'. Maps the
+ * FLASH if it isn't already. Returns the number of assets in the
+ * archive or -1 if there isn't a valid one there.
+ */
+int
+asset_open(uint32_t addr)
+{
+	const struct asset_header *hdr;
+
+	asset_hdr = NULL;
+	asset_dir = NULL;
+	qspi_map_flash();
+	if (addr >= 0x1000000) {
+		return -1;
+	}
+	hdr = (const struct asset_header *) qspi_mapped_addr(addr);
+	/* written so that a stale 'size' can't overflow the test */
+	if ((hdr == NULL) || (hdr->magic != ASSET_MAGIC) ||
+		(hdr->version != ASSET_VERSION) || (hdr->count == 0) ||
+		(hdr->size > 0x1000000 - addr) ||
+		(hdr->size < sizeof(struct asset_header) +
+							hdr->count * sizeof(struct asset_entry))) {
+		return -1;
+	}
+	if (hdr->check != asset_check((const uint8_t *)(hdr + 1),
+							hdr->count * sizeof(struct asset_entry))) {
+		return -1;
+	}
+	asset_base = addr;
+	asset_hdr = hdr;
+	asset_dir = (const struct asset_entry *)(hdr + 1);
+	return hdr->count;
+}
+
+/*
+ * asset_get( ... )
+ *
+ * Fill in 'bm' to describe the asset called 'name' in the open
+ * archive. The pixel data (and CLUT) are left in the FLASH. Returns
+ * 0 if it was found, -1 if not (or if its entry points outside the
+ * archive).
+ *
+ * Note the pointers are only good while the FLASH is mapped, see
+ * qspi_mapped_addr() if something else might be writing to it.
+ */
+int
+asset_get(const char *name, DMA2D_BITMAP *bm)
+{
+	const struct asset_entry *e;
+	uint32_t size;
+	int i;
+
+	if (asset_hdr == NULL) {
+		return -1;
+	}
+	for (i = 0, e = asset_dir; i < asset_hdr->count; i++, e++) {
+		if (strncmp(e->name, name, ASSET_NAME_LEN) == 0) {
+			break;
+		}
+	}
+	if (i == asset_hdr->count) {
+		return -1;
+	}
+	/*
+	 * The directory is checked, but not that it makes sense, so don't
+	 * hand out pointers to anything that isn't inside the archive.
+	 */
+	size = asset_hdr->size;
+	if ((e->offset > size) || (e->size > size - e->offset)) {
+		return -1;
+	}
+	if (e->clut_offset && ((e->clut_offset > size) ||
+						(e->clut_len * 4u > size - e->clut_offset))) {
+		return -1;
+	}
+	bm->buf = (void *)(FLASH_BASE_ADDRESS + asset_base + e->offset);
+	bm->mode = e->mode;
+	bm->w = e->w;
+	bm->h = e->h;
+	bm->stride = e->stride;
+	bm->fg.raw = e->fg;
+	bm->bg.raw = e->bg;
+	bm->maxc = e->clut_len;
+	bm->clut = (e->clut_offset) ?
+			(uint32_t *)(FLASH_BASE_ADDRESS + asset_base + e->clut_offset) : NULL;
+	return 0;
+}
@@ -26,6 +26,16 @@
 #define HSI_PLLCFGR_PLL_MASK	0x0f037fff
 #define RCC_PLLCFGR_PLLSRC_SHIFT		22
 
+/* The over-drive bits (STM32F42x/43x/469/479 only) */
+#ifndef PWR_CR_ODEN
+#define PWR_CR_ODEN				(1 << 16)
+#define PWR_CR_ODSWEN			(1 << 17)
+#define PWR_CSR_ODRDY			(1 << 16)
+#define PWR_CSR_ODSWRDY			(1 << 17)
+#endif
+#define PWR_CR_VOS_SCALE1		(3 << 14)
+#define FLASH_ACR_WS_MASK		0xf
+
 
 /* The internal clock frequency on the F4 chip */
 #define HSI_FREQUENCY		16000000
@@ -181,11 +191,11 @@ uint32_t get_pll_frequency(uint32_t hse_frequency)
 }
 
 /*
- * These for the STM32F411RE, others nominally 84Mhz/42Mhz but they seem
- * to work.
+ * These are for the STM32F469, at 168Mhz they work out to 84Mhz/42Mhz
+ * and at 180Mhz (over-drive) 90Mhz/45Mhz.
  */
-#define RCC_APB2_MAX_CLOCK		100000000
-#define RCC_APB1_MAX_CLOCK		50000000
+#define RCC_APB2_MAX_CLOCK		90000000
+#define RCC_APB1_MAX_CLOCK		45000000
 
 /* These are the constants used in the table in V8 of the F4 reference manual */
 #define FLASH_WS_2V7			30000000
@@ -193,6 +203,72 @@ uint32_t get_pll_frequency(uint32_t hse_frequency)
 #define FLASH_WS_2V1			22000000
 #define FLASH_WS_1V8			20000000
 
+static void overdrive(int on);
+static void flash_setup(uint32_t hclk);
+static void __clock_changed(void);
+
+/*
+ * These get called when clock_setup() changes the bus clocks so that
+ * things like the console baud rate can be fixed up. If you didn't
+ * link in the code that has them these do nothing.
+ */
+#pragma weak console_reclock = __clock_changed
+#pragma weak i2c_reclock = __clock_changed
+#pragma weak sdram_reclock = __clock_changed
+
+static void
+__clock_changed(void)
+{
+	return;
+}
+
+/*
+ * Above 168Mhz the core regulator has to be in "over-drive" mode. The
+ * sequence (from RM0386) is to turn on ODEN with the PLL running (but
+ * not yet the system clock), wait for it to be ready, then switch the
+ * regulator over with ODSWEN, and wait for that. Turning it off again
+ * is only allowed while running from the HSI or HSE.
+ */
+static void
+overdrive(int on)
+{
+	rcc_periph_clock_enable(RCC_PWR);
+	if (on) {
+		if (PWR_CSR & PWR_CSR_ODSWRDY) {
+			return; /* already on */
+		}
+		PWR_CR |= PWR_CR_ODEN;
+		while ((PWR_CSR & PWR_CSR_ODRDY) == 0) ;
+		PWR_CR |= PWR_CR_ODSWEN;
+		while ((PWR_CSR & PWR_CSR_ODSWRDY) == 0) ;
+	} else {
+		if ((PWR_CR & (PWR_CR_ODEN | PWR_CR_ODSWEN)) == 0) {
+			return;
+		}
+		PWR_CR &= ~(PWR_CR_ODEN | PWR_CR_ODSWEN);
+		while (PWR_CSR & PWR_CSR_ODSWRDY) ;
+	}
+}
+
+/*
+ * Set the flash wait states for 'hclk' and turn on the ART accelerator
+ * (the instruction and data caches) and prefetch. From the table in
+ * RM0386 (at 2.7 - 3.6V) it is one more wait state for every 30Mhz so
+ * 168Mhz and 180Mhz both need 5. The caches have to be off while they
+ * are reset, they may have stale lines in them from before.
+ */
+static void
+flash_setup(uint32_t hclk)
+{
+	uint32_t ws = ((hclk - 1) / FLASH_WS_2V7) & FLASH_ACR_WS_MASK;
+
+	FLASH_ACR = ws;
+	FLASH_ACR = ws | FLASH_ACR_ICRST | FLASH_ACR_DCRST;
+	FLASH_ACR = ws | FLASH_ACR_ICEN | FLASH_ACR_DCEN | FLASH_ACR_PRFTEN;
+	/* make sure it took before the clock goes up */
+	while ((FLASH_ACR & FLASH_ACR_WS_MASK) != ws) ;
+}
+
 /*--------------------------------------------------------------------*/
 /** @brief Configure the F4 HSI Clock
  *
@@ -220,6 +296,7 @@ hsi_clock_setup(uint32_t frequency __attribute__((unused)))
 	rcc_apb1_frequency = HSI_FREQUENCY;
 	rcc_apb2_frequency = HSI_FREQUENCY;
 	osc_off(RCC_HSE);
+	overdrive(0);
 }
 
 /**
@@ -244,6 +321,7 @@ hse_clock_setup(uint32_t hse_frequency)
 	rcc_apb1_frequency = hse_frequency;
 	rcc_apb2_frequency = hse_frequency;
 	osc_off(RCC_HSI);
+	overdrive(0);
 }
 	
 
@@ -260,7 +338,10 @@ hse_clock_setup(uint32_t hse_frequency)
  *
  * In addtion to the core clock speed the function also sets the APB1 and APB2 peripheral clocks
  * to their maximum values. This involves changing prescalers to divide down the system clock
- * if it is running faster than the peripheral maximums (50Mhz and 100Mhz respectively).
+ * if it is running faster than the peripheral maximums (45Mhz and 90Mhz respectively).
+ *
+ * Above 168Mhz (up to 180Mhz) it turns on over-drive, and below that it
+ * turns it off again.
  *
  * The clock setting code assumes >2.6V operation and assumes you are in
  * "normal" power mode (not power saving). If you are running in low power mode you
@@ -269,13 +350,21 @@ hse_clock_setup(uint32_t hse_frequency)
 void
 pll_clock_setup(uint32_t pll_bits, uint32_t input_freq)
 {
-	uint32_t flash_ws;
 	uint32_t apb_div;
 
 	/* First make sure we won't halt, switch to generic HSI mode */
 	hsi_clock_setup(HSI_FREQUENCY);
 
 	/* At this point we're running on HSI at HSI_FREQUENCY clocks */
+
+	/*
+	 * The PLL has to be off to change it (and the regulator scale),
+	 * nothing is using it now.
+	 */
+	osc_off(RCC_PLL);
+	while (RCC_CR & RCC_CR_PLLRDY) ;
+	overdrive(0);
+	PWR_CR |= PWR_CR_VOS_SCALE1;
 	
 	/* Clear old bits, reset source to HSI, then OR in new bits */
 	RCC_PLLCFGR = (RCC_PLLCFGR & ~(RCC_PLLCFGR_PLL_MASK | RCC_PLLCFGR_PLLSRC))
@@ -338,21 +427,23 @@ pll_clock_setup(uint32_t pll_bits, uint32_t input_freq)
 			break;
 	}
 
-	/* Compute flash wait states (at > 2.6V) */
-	flash_ws = ((rcc_ahb_frequency + (FLASH_WS_2V7 - 1)) / FLASH_WS_2V7) & 0x7;
-	/* Configure flash settings. */
-	flash_set_ws(FLASH_ACR_ICEN | FLASH_ACR_DCEN | flash_ws);
+	if (rcc_ahb_frequency > PLL_SYSCLK_MAX) {
+		overdrive(1);
+	}
+
+	/* Flash wait states (at > 2.6V) and the ART accelerator */
+	flash_setup(rcc_ahb_frequency);
 
 	/* Select PLL as SYSCLK source. */
 	set_sysclk(RCC_PLL);
 }
 
-#define warn(n)
-
-static const int pllp_candidates[4] = {2, 4, 6, 8};
-
 static uint32_t compute_pll_bits(int desired_frequency, int input_frequency);
 
+/* what pll_solve() came up with last time, for dump_clock() */
+static struct pll_solution clock_solution;
+static int clock_solved;
+
 /*
  * This function takes a 'desired' frequency in Hz, and an 'input'
  * frequency in Hz, and computes values for the PLL multipliers on
@@ -360,74 +451,33 @@ static uint32_t compute_pll_bits(int desired_frequency, int input_frequency);
  * using the HSI oscillator, if it is provided it assumes you are
  * using an external (HSE) oscillator.
  *
+ * All of the searching is done by pll_solve() (in pll.c), we ask it
+ * for 48 MHz on Q if it can (it isn't required, the chip works fine
+ * without it, USB doesn't) and for a VCO input that lets the PLLSAI
+ * make the 384 MHz that lcd_init() sets it up for. Over 168 MHz it is
+ * allowed to go to 180 MHz, which needs over-drive.
+ *
  * The output is a set of bits suitable for feeding into the rcc_pll_clock_setup().
  */
 static uint32_t
 compute_pll_bits(int desired_frequency, int input_frequency)
 {
-	uint32_t pllr, pllm, plln, pllq, pllp, vco;
-	int i, src;
-
-	src = 1;
-	if (input_frequency == 0) {
-		src = 0;
-		input_frequency = HSI_FREQUENCY;
-	}
-	pllp = 0;
-	for (i = 0; (i < 4) && (pllp == 0); i++) {
-		vco = desired_frequency * pllp_candidates[i];
-		/* if VCO lands in the "good" range its a winner */
-		if ((vco >= 192000000) && (vco <= 433000000)) {
-			pllp = pllp_candidates[i];
-		}
+	struct pll_request req = { 0 };
+	struct pll_solution *sol = &clock_solution;
+
+	req.input = input_frequency;
+	req.sysclk = desired_frequency;
+	req.sai_vco = 384000000;
+	if ((uint32_t) desired_frequency > PLL_SYSCLK_MAX) {
+		req.flags |= PLL_OVERDRIVE;
 	}
-	if (pllp == 0) {
-		return 0; /* can't make that frequency */
+	if (pll_solve(&req, sol) != 0) {
+		return 0; /* Can't get there from here */
 	}
-	vco = desired_frequency * pllp;
-	/*
-	 * Compute divisor for closest to 2,000,000 Mhz without going over
-	 * later, if this version of pllm doesn't work, we can increment it
-	 * by 1 until the division would cause the input frequency to the
-	 * PLL to drop below 1MHz.
-	 */
-	pllm = (input_frequency + 1999999) / 2000000;
-	plln = (vco * pllm) / input_frequency;
-
-	/* now check to see if plln is an integral multiplier */
-	if (((input_frequency * plln)/pllm) != vco) {
-		plln = 0;
-		/* if not, try other versions of pllm that might get us there */
-		while (((input_frequency / pllm) >= 1000000)  && (plln == 0)) {
-			uint32_t tplln;
-			tplln = (vco * pllm) / input_frequency;
-			if ((input_frequency * tplln) / pllm == vco) {
-				/* found one! */
-				plln = tplln;
-				break;
-			}
-			pllm++;
-		}
-		/* no value of PLLM works either, so we're stuck */
-		if (plln == 0) {
-			return 0; /* Can't get there from here */
-		}
-        }
-	pllq = vco / 48000000;
-	if ((pllq * 48000000) != vco) {
-		/* not sure what the right answer here is, the chip will work but USB won't */
-		warn("won't work for USB\n");
-	}
-
-	pllr = vco / 60000000;
-	_clock_parameters.pllr = pllr;
-	_clock_parameters.pllm = pllm;
-	_clock_parameters.plln = plln;
-	_clock_parameters.pllp = pllp;
-	_clock_parameters.pllq = pllq;
-	_clock_parameters.pllp_real = ((pllp / 2) - 1);
-	_clock_parameters.src = src;
-	return (PLL_CONFIG_BITS(pllr, ((pllp / 2) - 1), plln, pllq, pllm, src));
+	clock_solved = 1;
+	_clock_parameters = sol->p;
+	return (PLL_CONFIG_BITS(sol->p.pllr, sol->p.pllp_real, sol->p.plln,
+							sol->p.pllq, sol->p.pllm, sol->p.src));
 }
 
 /* Set up a timer to create 1mS ticks. */
@@ -450,6 +500,10 @@ systick_setup(int tick_rate)
  */
 uint32_t
 clock_setup(uint32_t desired_frequency, uint32_t hse_frequency) {
+	uint32_t ahb = rcc_ahb_frequency;
+	uint32_t apb1 = rcc_apb1_frequency;
+	uint32_t apb2 = rcc_apb2_frequency;
+
 	if (desired_frequency == hse_frequency) {
 		hse_clock_setup(desired_frequency);
 	} else if ((hse_frequency == 0) && (desired_frequency == HSI_FREQUENCY)) {
@@ -462,6 +516,13 @@ clock_setup(uint32_t desired_frequency, uint32_t hse_frequency) {
 		pll_clock_setup(cfgr_bits, hse_frequency);
 	}
 	systick_setup(1000);
+	/* fix up anything that was set up for the old bus clocks */
+	if ((ahb != rcc_ahb_frequency) || (apb1 != rcc_apb1_frequency) ||
+		(apb2 != rcc_apb2_frequency)) {
+		console_reclock();
+		i2c_reclock();
+		sdram_reclock();
+	}
 	return rcc_ahb_frequency;
 }
 
@@ -472,32 +533,75 @@ clock_setup(uint32_t desired_frequency, uint32_t hse_frequency) {
 static volatile uint32_t system_millis;
 static volatile uint32_t delay_millis;
 
+/*
+ * If something else (timebase.c) keeps time these point at its
+ * versions of mtime() and msleep()
+ */
+static uint32_t (*timebase_mtime)(void);
+static void (*timebase_msleep)(uint32_t);
+
 /* Called when systick fires */
 void
 sys_tick_handler(void) {
     system_millis++;
-	/* simple countdown timer */
+#ifdef SYSTICK_TOGGLE_PB15
+	/* put a scope on PB15 to see the ticks (you have to set it up as an output) */
 	gpio_toggle(GPIOB, GPIO15);
+#endif
+	/* simple countdown timer */
 	if (delay_millis) {
 		delay_millis--;
 	}
 }
 
-/* sleep for delay milliseconds */
+/*
+ * sleep for delay milliseconds, the CPU waits in WFI between
+ * ticks rather than spinning.
+ */
 void
 msleep(uint32_t delay)
 {
+	if (timebase_msleep) {
+		timebase_msleep(delay);
+		return;
+	}
 	delay_millis = delay;
-    while (delay_millis) ;
+	while (delay_millis) {
+		__asm__ volatile ("wfi");
+	}
 }
 
 /* return the time */
 uint32_t
 mtime()
 {
+	if (timebase_mtime) {
+		return timebase_mtime();
+	}
     return system_millis;
 }
 
+/*
+ * clock_set_timebase( ... )
+ *
+ * Hand mtime() and msleep() to some other clock and turn off the
+ * SysTick interrupt, or pass NULLs to go back to the SysTick.
+ */
+void
+clock_set_timebase(uint32_t (*now)(void), void (*sleep)(uint32_t))
+{
+	if (now && sleep) {
+		systick_interrupt_disable();
+		timebase_mtime = now;
+		timebase_msleep = sleep;
+	} else {
+		system_millis = mtime();
+		timebase_mtime = NULL;
+		timebase_msleep = NULL;
+		systick_interrupt_enable();
+	}
+}
+
 /*
  * time_string(uint32_t)
  *
@@ -567,6 +671,10 @@ dump_clock(void)
 	printf("PLL Parameters: R:%d, P:%d(%d), M:%d, Q:%d, N:%d, SRC=%s\n",
 			p.pllr, p.pllp, p.pllp_real, p.pllm, p.pllq, p.plln,
 			(p.src == 1) ? "HSE" : "HSI");
+	if (clock_solved) {
+		/* and what those work out to be */
+		pll_print(&clock_solution);
+	}
 	return &p;
 }
 
@@ -25,10 +25,12 @@
  */
 
 #include <stdint.h>
+#include <string.h>
 #include <ctype.h>
 #include <libopencm3/stm32/gpio.h>
 #include <libopencm3/stm32/rcc.h>
 #include <libopencm3/stm32/usart.h>
+#include <libopencm3/stm32/dma.h>
 #include <libopencm3/cm3/nvic.h>
 #include <libopencm3/stm32/iwdg.h>
 #include <libopencm3/cm3/scb.h>
@@ -48,16 +50,61 @@
 /* Default Color state (enabled) */
 static int __console_color_state = 1;
 
-/* This is a ring buffer to holding characters as they are typed
- * it maintains both the place to put the next character received
- * from the UART, and the place where the last character was
- * read by the program.
+/* This is a ring buffer to holding characters as they are typed.
+ * DMA1 stream 1 (channel 4 is USART3_RX) puts them there in circular
+ * mode, so the place to put the next character received is worked
+ * out from how many transfers the DMA has left, and we keep the place
+ * where the last character was read by the program.
+ *
+ * The DMA doesn't interrupt for every character, instead the USART
+ * interrupts when the line goes idle (the end of a burst) and the
+ * DMA when the buffer is half and all the way full. Each time the
+ * handler looks at what came in since the last time, for a ^C and
+ * to see if the program has fallen so far behind that the DMA has
+ * written over characters it hadn't read yet.
+ *
+ * The buffer has to be in normal SRAM (not CCM) for the DMA to
+ * reach it.
  */
+#ifndef RECV_BUF_SIZE
+#define RECV_BUF_SIZE	512
+#endif
+#define RECV_DMA		DMA1
+#define RECV_DMA_STREAM	DMA_STREAM1
+#define RECV_DMA_CHANNEL	DMA_SxCR_CHSEL_4
+static char recv_buf[RECV_BUF_SIZE];
+static volatile int recv_ndx_cur;		/* Next place to read */
+static int recv_ndx_seen;				/* How far the handler has looked */
+static uint32_t recv_read;				/* Characters the program has read */
+static struct console_stats console_stat;
 
-#define RECV_BUF_SIZE	128		/* Arbitrary buffer size */
-char recv_buf[RECV_BUF_SIZE];
-volatile int recv_ndx_nxt;		/* Next place to store */
-volatile int recv_ndx_cur;		/* Next place to read */
+/*
+ * And this is the ring buffer for characters on their way out. The
+ * program puts characters in and the interrupt handler takes them
+ * out whenever the USART is ready for another one, so printf() only
+ * waits for the UART if it gets more than XMIT_BUF_SIZE characters
+ * ahead of it (or not at all if the policy is to drop them).
+ * XMIT_BUF_SIZE has to be a power of 2.
+ */
+#ifndef XMIT_BUF_SIZE
+#define XMIT_BUF_SIZE	1024
+#endif
+#define XMIT_MASK		(XMIT_BUF_SIZE - 1)
+static char xmit_buf[XMIT_BUF_SIZE];
+static volatile int xmit_ndx_nxt;		/* Next place to store */
+static volatile int xmit_ndx_cur;		/* Next character to send */
+static int xmit_policy = CONSOLE_TX_BLOCK;
+static volatile uint32_t xmit_dropped;
+static int console_baud_rate;			/* so it can be redone after a clock change */
+
+static int console_polled(void);
+static void console_drain(void);
+static int recv_ndx_nxt(void);
+static void console_rx_check(void);
+static void null_rx_hook(void);
+
+/* called when characters arrive, event.c uses this */
+#pragma weak console_rx_hook = null_rx_hook
 
 /* For interrupt handling we add a new function which is called
  * when recieve interrupts happen. The name (usart3_isr) is created
@@ -73,45 +120,242 @@ volatile int recv_ndx_cur;		/* Next place to read */
 void usart3_isr(void)
 {
 	uint32_t	reg;
-	int			i;
 
-	do {
-		reg = USART_SR(CONSOLE_UART);
-		if (reg & USART_SR_RXNE) {
-			recv_buf[recv_ndx_nxt] = USART_DR(CONSOLE_UART);
+	reg = USART_SR(CONSOLE_UART);
+	if (reg & (USART_SR_IDLE | USART_SR_ORE | USART_SR_FE | USART_SR_NE)) {
+		/* reading SR then DR clears these */
+		(void) USART_DR(CONSOLE_UART);
+		if (reg & USART_SR_ORE) {
+			console_stat.rx_overrun++;
+		}
+		if (reg & USART_SR_FE) {
+			console_stat.rx_framing++;
+		}
+		if (reg & USART_SR_NE) {
+			console_stat.rx_noise++;
+		}
+		console_rx_check();
+	}
+
+	/* Room to send another character? */
+	if ((reg & USART_SR_TXE) && (USART_CR1(CONSOLE_UART) & USART_CR1_TXEIE)) {
+		if (xmit_ndx_cur != xmit_ndx_nxt) {
+			USART_DR(CONSOLE_UART) = (uint16_t) xmit_buf[xmit_ndx_cur] & 0xff;
+			xmit_ndx_cur = (xmit_ndx_cur + 1) & XMIT_MASK;
+		} else {
+			/* nothing left, stop asking */
+			usart_disable_tx_interrupt(CONSOLE_UART);
+		}
+	}
+}
+
+/*
+ * The DMA is half way or all the way through the buffer.
+ */
+void dma1_stream1_isr(void)
+{
+	dma_clear_interrupt_flags(RECV_DMA, RECV_DMA_STREAM, DMA_HTIF | DMA_TCIF);
+	console_rx_check();
+}
+
+/*
+ * Where the DMA will put the next character.
+ */
+static int
+recv_ndx_nxt(void)
+{
+	return (RECV_BUF_SIZE -
+		dma_get_number_of_data(RECV_DMA, RECV_DMA_STREAM)) % RECV_BUF_SIZE;
+}
+
+/*
+ * Look at what has arrived since the last time (from the
+ * interrupt handlers).
+ */
+static void
+console_rx_check(void)
+{
+	int	nxt;
+
+	nxt = recv_ndx_nxt();
+	/* the half/full interrupts mean this is never a whole buffer */
+	console_stat.rx_bytes += (nxt - recv_ndx_seen + RECV_BUF_SIZE) % RECV_BUF_SIZE;
 #ifdef RESET_ON_CTRLC
-			/*
-			 * This bit of code will jump to the ResetHandler if you
-			 * hit ^C
-			 */
-			if (recv_buf[recv_ndx_nxt] == '\003') {
-				scb_reset_system();
-				return; /* never actually reached */
-			}
+	/*
+	 * This bit of code will jump to the ResetHandler if you
+	 * hit ^C
+	 */
+	while (recv_ndx_seen != nxt) {
+		if (recv_buf[recv_ndx_seen] == '\003') {
+			scb_reset_system();
+			return; /* never actually reached */
+		}
+		recv_ndx_seen = (recv_ndx_seen + 1) % RECV_BUF_SIZE;
+	}
 #endif
-			/* Check for "overrun" */
-			i = (recv_ndx_nxt + 1) % RECV_BUF_SIZE;
-			if (i != recv_ndx_cur) {
-				recv_ndx_nxt = i;
+	recv_ndx_seen = nxt;
+	/*
+	 * Check for "overrun", the oldest characters got written over.
+	 * This is done with running counts since the indexes alone can't
+	 * tell "all caught up" from "a whole buffer behind". (the program
+	 * can read characters before we've counted them, hence signed)
+	 */
+	if ((int32_t)(console_stat.rx_bytes - recv_read) >= RECV_BUF_SIZE) {
+		console_stat.rx_lost++;
+		recv_ndx_cur = nxt;
+		recv_read = console_stat.rx_bytes;
+	}
+	if (recv_ndx_cur != nxt) {
+		console_rx_hook();
+	}
+}
+
+static void
+null_rx_hook(void)
+{
+	return;
+}
+
+/*
+ * console_get_stats(struct console_stats *st)
+ *
+ * Byte and error counts for the console.
+ */
+void
+console_get_stats(struct console_stats *st)
+{
+	*st = console_stat;
+	st->tx_dropped = xmit_dropped;
+}
+
+/*
+ * If we're in an exception handler (a hard fault say) or interrupts
+ * are off, the USART interrupt isn't going to empty the buffer, so
+ * the output has to be sent the old fashioned way.
+ */
+static int
+console_polled(void)
+{
+	/* VECTACTIVE is non-zero in any exception handler */
+	return ((SCB_ICSR & 0x1ff) != 0) || cm_is_masked_interrupts();
+}
+
+/*
+ * Send everything in the buffer by polling the USART, with
+ * interrupts off so that the interrupt handler doesn't also
+ * take characters out.
+ */
+static void
+console_drain(void)
+{
+	uint32_t	mask;
+
+	mask = cm_mask_interrupts(1);
+	while (xmit_ndx_cur != xmit_ndx_nxt) {
+		while ((USART_SR(CONSOLE_UART) & USART_SR_TXE) == 0) ;
+		USART_DR(CONSOLE_UART) = (uint16_t) xmit_buf[xmit_ndx_cur] & 0xff;
+		xmit_ndx_cur = (xmit_ndx_cur + 1) & XMIT_MASK;
+	}
+	cm_mask_interrupts(mask);
+}
+
+/*
+ * int console_write(const char *s, int len)
+ *
+ * Queue 'len' characters to be sent (no newline translation).
+ * When the buffer is full this either waits for room or drops
+ * what doesn't fit, depending on the policy. Returns the number
+ * of characters queued.
+ */
+int
+console_write(const char *s, int len)
+{
+	int	done = 0;
+	int	room, n;
+
+	if (console_polled()) {
+		/* keep things in order, buffered stuff goes first */
+		console_drain();
+		for (done = 0; done < len; done++) {
+			while ((USART_SR(CONSOLE_UART) & USART_SR_TXE) == 0) ;
+			USART_DR(CONSOLE_UART) = (uint16_t) s[done] & 0xff;
+		}
+		return len;
+	}
+	while (done < len) {
+		/* one slot is always left empty so full != empty */
+		room = (xmit_ndx_cur - xmit_ndx_nxt - 1) & XMIT_MASK;
+		if (room == 0) {
+			if (xmit_policy == CONSOLE_TX_DROP) {
+				xmit_dropped += len - done;
+				break;
 			}
+			continue;	/* the interrupt will make some room */
 		}
-	/* can read back-to-back interrupts */
-	} while ((reg & USART_SR_RXNE) != 0);
+		n = len - done;
+		if (n > room) {
+			n = room;
+		}
+		/* don't go past the end of the buffer in one copy */
+		if (n > XMIT_BUF_SIZE - xmit_ndx_nxt) {
+			n = XMIT_BUF_SIZE - xmit_ndx_nxt;
+		}
+		memcpy(&xmit_buf[xmit_ndx_nxt], s + done, n);
+		xmit_ndx_nxt = (xmit_ndx_nxt + n) & XMIT_MASK;
+		done += n;
+		usart_enable_tx_interrupt(CONSOLE_UART);
+	}
+	return done;
 }
 
 /*
  * console_putc(char c)
  *
- * Send the character 'c' to the USART, wait for the USART
- * transmit buffer to be empty first.
+ * Queue the character 'c' to be sent to the USART.
  */
 void console_putc(char c)
 {
-	uint32_t	reg;
-	do {
-		reg = USART_SR(CONSOLE_UART);
-	} while ((reg & USART_SR_TXE) == 0);
-	USART_DR(CONSOLE_UART) = (uint16_t) c & 0xff;
+	(void) console_write(&c, 1);
+}
+
+/*
+ * console_flush()
+ *
+ * Wait until everything queued has been sent, including the
+ * last character in the USART.
+ */
+void
+console_flush(void)
+{
+	if (console_polled()) {
+		console_drain();
+	} else {
+		while (xmit_ndx_cur != xmit_ndx_nxt) ;
+	}
+	while ((USART_SR(CONSOLE_UART) & USART_SR_TC) == 0) ;
+}
+
+/*
+ * console_tx_policy(int policy)
+ *
+ * What to do when the transmit buffer is full, CONSOLE_TX_BLOCK
+ * (the default) waits for room, CONSOLE_TX_DROP throws away what
+ * doesn't fit (and counts it).
+ */
+void
+console_tx_policy(int policy)
+{
+	xmit_policy = policy;
+}
+
+/*
+ * How many characters have been dropped because the
+ * buffer was full.
+ */
+uint32_t
+console_tx_dropped(void)
+{
+	return xmit_dropped;
 }
 
 /*
@@ -125,33 +369,45 @@ char console_getc(int wait)
 {
 	char		c = 0;
 
-	while ((wait != 0) && (recv_ndx_cur == recv_ndx_nxt));
-	if (recv_ndx_cur != recv_ndx_nxt) {
+	uint32_t	mask;
+
+	while ((wait != 0) && (recv_ndx_cur == recv_ndx_nxt()));
+	/* the interrupt handler can move recv_ndx_cur if we fell behind */
+	mask = cm_mask_interrupts(1);
+	if (recv_ndx_cur != recv_ndx_nxt()) {
 		c = recv_buf[recv_ndx_cur];
 		recv_ndx_cur = (recv_ndx_cur + 1) % RECV_BUF_SIZE;
+		recv_read++;
 	}
+	cm_mask_interrupts(mask);
 	return c;
 }
 
 /*
  * void console_puts(char *s)
  *
- * Send a string to the console, one character at a time, return
- * after the last character, as indicated by a NUL character, is
- * reached.
+ * Send a string to the console, return after the last character,
+ * as indicated by a NUL character, has been queued.
  *
  * Translate '\n' in the string (newline) to \n\r (newline + 
  * carraige return)
  */
 void console_puts(char *s)
 {
+	char *t;
+
 	while (*s != '\000') {
-		console_putc(*s);
-		/* Add in a carraige return, after sending line feed */
-		if (*s == '\n') {
-			console_putc('\r');
+		/* queue everything up to the next newline in one go */
+		for (t = s; (*t != '\000') && (*t != '\n'); t++) ;
+		if (t > s) {
+			(void) console_write(s, t - s);
+		}
+		if (*t == '\n') {
+			/* Add in a carraige return, after sending line feed */
+			(void) console_write("\n\r", 2);
+			t++;
 		}
-		s++;
+		s = t;
 	}
 }
 
@@ -232,6 +488,7 @@ void console_setup(int baud)
 	rcc_periph_clock_enable(RCC_USART3);
 
 	/* Set up USART/UART parameters using the libopencm3 helper functions */
+	console_baud_rate = baud;
 	usart_set_baudrate(CONSOLE_UART, baud);
 	usart_set_databits(CONSOLE_UART, 8);
 	usart_set_stopbits(CONSOLE_UART, USART_STOPBITS_1);
@@ -240,11 +497,35 @@ void console_setup(int baud)
 	usart_set_flow_control(CONSOLE_UART, USART_FLOWCONTROL_NONE);
 	usart_enable(CONSOLE_UART);
 
-	/* Enable interrupts from the USART */
+	/* The DMA fills the receive buffer, around and around */
+	rcc_periph_clock_enable(RCC_DMA1);
+	dma_stream_reset(RECV_DMA, RECV_DMA_STREAM);
+	dma_channel_select(RECV_DMA, RECV_DMA_STREAM, RECV_DMA_CHANNEL);
+	dma_set_priority(RECV_DMA, RECV_DMA_STREAM, DMA_SxCR_PL_HIGH);
+	dma_set_transfer_mode(RECV_DMA, RECV_DMA_STREAM,
+									DMA_SxCR_DIR_PERIPHERAL_TO_MEM);
+	dma_set_memory_size(RECV_DMA, RECV_DMA_STREAM, DMA_SxCR_MSIZE_8BIT);
+	dma_set_peripheral_size(RECV_DMA, RECV_DMA_STREAM, DMA_SxCR_PSIZE_8BIT);
+	dma_enable_memory_increment_mode(RECV_DMA, RECV_DMA_STREAM);
+	dma_enable_circular_mode(RECV_DMA, RECV_DMA_STREAM);
+	dma_set_peripheral_address(RECV_DMA, RECV_DMA_STREAM,
+								(uint32_t) &USART_DR(CONSOLE_UART));
+	dma_set_memory_address(RECV_DMA, RECV_DMA_STREAM, (uint32_t) recv_buf);
+	dma_set_number_of_data(RECV_DMA, RECV_DMA_STREAM, RECV_BUF_SIZE);
+	dma_enable_half_transfer_interrupt(RECV_DMA, RECV_DMA_STREAM);
+	dma_enable_transfer_complete_interrupt(RECV_DMA, RECV_DMA_STREAM);
+	recv_ndx_cur = recv_ndx_seen = 0;
+	recv_read = console_stat.rx_bytes;
+	dma_enable_stream(RECV_DMA, RECV_DMA_STREAM);
+	usart_enable_rx_dma(CONSOLE_UART);
+
+	/* Enable interrupts from the USART and the DMA */
 	nvic_enable_irq(NVIC_USART3_IRQ);
+	nvic_enable_irq(NVIC_DMA1_STREAM1_IRQ);
 
-	/* Specifically enable recieve interrupts */
-	usart_enable_rx_interrupt(CONSOLE_UART);
+	/* Interrupt at the end of a burst, and on errors */
+	USART_CR1(CONSOLE_UART) |= USART_CR1_IDLEIE;
+	USART_CR3(CONSOLE_UART) |= USART_CR3_EIE;
 }
 
 /*
@@ -252,9 +533,22 @@ void console_setup(int baud)
  */
 void console_baud(int baud_rate)
 {
+	console_baud_rate = baud_rate;
 	usart_set_baudrate(CONSOLE_UART, baud_rate);
 }
 
+/*
+ * The baud rate divisor comes from the APB1 clock, clock_setup()
+ * calls this when that changes so the console keeps working. A
+ * character that was going out right then is probably garbage.
+ */
+void console_reclock(void)
+{
+	if (console_baud_rate) {
+		usart_set_baudrate(CONSOLE_UART, console_baud_rate);
+	}
+}
+
 char *
 console_color(TERM_COLOR c)
 {
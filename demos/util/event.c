@@ -0,0 +1,347 @@
+/*
+ * event.c - a simple run to completion event loop
+ *
+ * Copyright (c) 2016, Chuck McManis (cmcmanis@mcmanis.com)
+ *
+ * Most of the demos have a main() that is one big loop, poll the
+ * console, poll the touch panel, draw a frame, wait for the display,
+ * and around again. Everything waits on everything else. This is
+ * the alternative: interrupt handlers (and timers) post events into
+ * queues, and event_loop() takes them out one at a time and calls
+ * the handler for that kind of event. Each handler runs until it
+ * returns (no threads, no stacks) so it should do a bit of work and
+ * if there is more to do post another event to come back to it.
+ * When there is nothing to do the CPU waits in WFI.
+ *
+ * There are EV_PRIOS queues, all of the EV_PRIO_HIGH events are
+ * handled before any EV_PRIO_NORMAL ones and so on. So if drawing a
+ * frame is a low priority event that re-posts itself, typing at the
+ * console or touching the screen gets handled between frames rather
+ * than when the loop gets around to it.
+ *
+ * The events that come from hardware:
+ *	EV_CONSOLE	- characters arrived at the console (console.c)
+ *	EV_TOUCH	- the touch panel has a new touch (touch.c)
+ *	EV_DMA2D	- a DMA2D transfer finished (if you set TCIE)
+ *	EV_LCD_TE	- the display's tearing effect line went high, it
+ *			  is a good time to lcd_flip() (after event_te_enable())
+ * are posted with event_post_once(), so there is only ever one of
+ * each waiting and a flood of interrupts can't fill the queue. The
+ * handler should take everything that is there (all the characters
+ * typed, say) rather than assume one event is one thing.
+ *
+ * Event timers need timebase.o (they are utimers underneath).
+ */
+#include <stdint.h>
+#include <libopencm3/stm32/rcc.h>
+#include <libopencm3/stm32/gpio.h>
+#include <libopencm3/stm32/exti.h>
+#include <libopencm3/stm32/syscfg.h>
+#include <libopencm3/stm32/dma2d.h>
+#include <libopencm3/cm3/nvic.h>
+#include <libopencm3/cm3/cortex.h>
+#include "../util/util.h"
+
+struct event_queue {
+	struct event	ev[EV_QUEUE_SIZE];
+	volatile uint32_t	head, tail;	/* running counts, head - tail is the depth */
+};
+
+static struct event_queue ev_queue[EV_PRIOS];
+static event_handler ev_handlers[EV_MAX_TYPES];
+static volatile uint32_t ev_pending;	/* types queued with event_post_once() */
+static struct event_stats ev_stat;
+
+#pragma weak event_idle = __event_idle
+
+static void __event_idle(void);
+static int ev_put(int type, int prio, uint32_t arg, int once);
+static void ev_timer_fire(void *arg);
+
+/*
+ * By default there is nothing to do when idle.
+ */
+static void
+__event_idle(void)
+{
+	return;
+}
+
+/*
+ * These are the hooks the drivers call, defined here they replace
+ * the empty ones.
+ */
+void
+console_rx_hook(void)
+{
+	(void) event_post_once(EV_CONSOLE, EV_PRIO_HIGH, 0);
+}
+
+void
+touch_hook(touch_event *te)
+{
+	(void) event_post_once(EV_TOUCH, EV_PRIO_HIGH, (uint32_t) te->n);
+}
+
+/*
+ * The DMA2D finished (only if TCIE was set when it was started).
+ */
+void
+dma2d_isr(void)
+{
+	DMA2D_IFCR = (1 << 1);	/* CTCIF */
+	(void) event_post_once(EV_DMA2D, EV_PRIO_NORMAL, 0);
+}
+
+/*
+ * The tearing effect line (PJ2) went high.
+ */
+void
+exti2_isr(void)
+{
+	EXTI_PR = (1 << 2);
+	(void) event_post_once(EV_LCD_TE, EV_PRIO_NORMAL, 0);
+}
+
+/*
+ * Add an event to a queue with interrupts off (any interrupt
+ * handler can post). With 'once' it isn't added if there is already
+ * one of that type waiting. Returns 0, or -1 if the queue was full
+ * or there is no such type.
+ */
+static int
+ev_put(int type, int prio, uint32_t arg, int once)
+{
+	struct event_queue *q;
+	struct event *e;
+	uint32_t mask;
+	int res = 0;
+
+	/* there'd be no handler for it, and a negative one breaks the shifts */
+	if ((type < 0) || (type >= EV_MAX_TYPES)) {
+		return -1;
+	}
+	if ((prio < 0) || (prio >= EV_PRIOS)) {
+		prio = EV_PRIO_LOW;
+	}
+	q = &ev_queue[prio];
+	mask = cm_mask_interrupts(1);
+	if (once && (type < 32) && (ev_pending & (1u << type))) {
+		cm_mask_interrupts(mask);
+		return 0;
+	}
+	if ((q->head - q->tail) >= EV_QUEUE_SIZE) {
+		ev_stat.dropped++;
+		res = -1;
+	} else {
+		e = &q->ev[q->head % EV_QUEUE_SIZE];
+		e->type = type;
+		e->prio = prio;
+		e->arg = arg;
+		e->once = (once && (type < 32));
+		q->head++;
+		ev_stat.posted++;
+		if (e->once) {
+			ev_pending |= (1u << type);
+		}
+	}
+	cm_mask_interrupts(mask);
+	return res;
+}
+
+/*
+ * event_post( ... )
+ *
+ * Queue an event of 'type' at priority 'prio' with 'arg' for the
+ * handler. Can be called from an interrupt handler. Returns 0, or
+ * -1 if that queue is full (and the event was dropped) or 'type'
+ * isn't 0 to EV_MAX_TYPES - 1.
+ */
+int
+event_post(int type, int prio, uint32_t arg)
+{
+	return ev_put(type, prio, arg, 0);
+}
+
+/*
+ * event_post_once( ... )
+ *
+ * Same, but if an event of this type posted this way is already
+ * waiting, don't add another one.
+ */
+int
+event_post_once(int type, int prio, uint32_t arg)
+{
+	return ev_put(type, prio, arg, 1);
+}
+
+/*
+ * event_handler_set( ... )
+ *
+ * Call 'h' for events of 'type' (NULL to ignore them).
+ */
+void
+event_handler_set(int type, event_handler h)
+{
+	if ((type >= 0) && (type < EV_MAX_TYPES)) {
+		ev_handlers[type] = h;
+	}
+}
+
+/*
+ * event_dispatch( ... )
+ *
+ * Take the oldest event from the highest priority queue that has
+ * one and call its handler. Returns 1 if there was one, 0 if all
+ * the queues were empty.
+ */
+int
+event_dispatch(void)
+{
+	struct event_queue *q;
+	struct event ev;
+	uint32_t mask;
+	int p;
+
+	for (p = 0; p < EV_PRIOS; p++) {
+		q = &ev_queue[p];
+		if (q->head != q->tail) {
+			break;
+		}
+	}
+	if (p == EV_PRIOS) {
+		return 0;
+	}
+	mask = cm_mask_interrupts(1);
+	ev = q->ev[q->tail % EV_QUEUE_SIZE];
+	q->tail++;
+	if (ev.once) {
+		/*
+		 * A new one can be posted now. Only for the one that set the
+		 * bit, the same type posted with event_post() could be ahead
+		 * of it in this queue or in another one.
+		 */
+		ev_pending &= ~(1u << ev.type);
+	}
+	cm_mask_interrupts(mask);
+	ev_stat.dispatched++;
+	if ((ev.type < EV_MAX_TYPES) && ev_handlers[ev.type]) {
+		ev_handlers[ev.type](&ev);
+	}
+	return 1;
+}
+
+/*
+ * event_loop( ... )
+ *
+ * Handle events forever. When the queues are empty event_idle()
+ * is called (define your own if you want) and then the CPU waits
+ * for an interrupt. The queues are checked with interrupts off so
+ * an event posted just before the WFI still wakes it up.
+ */
+void
+event_loop(void)
+{
+	int p;
+
+	while (1) {
+		while (event_dispatch()) ;
+		event_idle();
+		cm_disable_interrupts();
+		for (p = 0; p < EV_PRIOS; p++) {
+			if (ev_queue[p].head != ev_queue[p].tail) {
+				break;
+			}
+		}
+		if (p == EV_PRIOS) {
+			ev_stat.idle++;
+			__asm__ volatile ("wfi");
+		}
+		cm_enable_interrupts();
+	}
+}
+
+/*
+ * Event timers are utimers that post an event when they go off,
+ * and start themselves again if they repeat.
+ */
+static void
+ev_timer_fire(void *arg)
+{
+	struct event_timer *et = arg;
+
+	(void) event_post(et->type, et->prio, et->arg);
+	if (et->period) {
+		utimer_start(&et->timer, et->period, ev_timer_fire, et);
+	}
+}
+
+/*
+ * event_timer_start( ... )
+ *
+ * Post an event 'us' microseconds from now, and then every 'period'
+ * microseconds after that (if 'period' isn't 0).
+ */
+void
+event_timer_start(struct event_timer *et, uint32_t us, uint32_t period,
+											int type, int prio, uint32_t arg)
+{
+	et->period = period;
+	et->type = type;
+	et->prio = prio;
+	et->arg = arg;
+	utimer_start(&et->timer, us, ev_timer_fire, et);
+}
+
+int
+event_timer_cancel(struct event_timer *et)
+{
+	et->period = 0;
+	return utimer_cancel(&et->timer);
+}
+
+/*
+ * event_te_enable( ... )
+ *
+ * Post EV_LCD_TE every time the display's tearing effect line (PJ2)
+ * goes high, which is when the display has finished reading its
+ * memory and lcd_flip() won't tear. lcd_init() has already set the
+ * pin up as an input.
+ */
+void
+event_te_enable(void)
+{
+	rcc_periph_clock_enable(RCC_SYSCFG);
+	SYSCFG_EXTICR1 = (SYSCFG_EXTICR1 & ~(0xf << 8)) | (0x9 << 8); /* port J */
+	EXTI_IMR |= (1 << 2);
+	EXTI_RTSR |= (1 << 2);
+	EXTI_PR = (1 << 2);
+	nvic_enable_irq(NVIC_EXTI2_IRQ);
+}
+
+/*
+ * event_init( ... )
+ *
+ * Empty the queues, forget the handlers, and turn on the DMA2D
+ * interrupt (which only happens if a transfer sets TCIE).
+ */
+void
+event_init(void)
+{
+	int i;
+
+	for (i = 0; i < EV_PRIOS; i++) {
+		ev_queue[i].head = ev_queue[i].tail = 0;
+	}
+	for (i = 0; i < EV_MAX_TYPES; i++) {
+		ev_handlers[i] = NULL;
+	}
+	ev_pending = 0;
+	nvic_enable_irq(NVIC_DMA2D_IRQ);
+}
+
+void
+event_get_stats(struct event_stats *st)
+{
+	*st = ev_stat;
+}
@@ -0,0 +1,423 @@
+/*
+ * gesture.c - turn touch panel records into gestures
+ *
+ * Copyright (c) 2016, Chuck McManis (cmcmanis@mcmanis.com)
+ *
+ * The touch panel only tells you where up to two fingers are and
+ * whether each one just went down, is still down, or just came up.
+ * What you usually want to know is what the person meant, a tap on a
+ * button, a swipe to the next page, two fingers pinching to zoom. This
+ * code watches the touch_record's from touch_drain() go by and calls
+ * your handler with a struct gesture when it sees one of:
+ *
+ *	GESTURE_TAP		- down and up quickly without moving
+ *	GESTURE_DOUBLE_TAP	- a second tap soon after, and near, the first
+ *	GESTURE_LONG_PRESS	- down and held still for a while
+ *	GESTURE_SWIPE		- a quick movement and lift (with a direction)
+ *	GESTURE_DRAG		- one finger moving (BEGIN, MOVE..., END)
+ *	GESTURE_PINCH		- two fingers getting closer or further apart
+ *	GESTURE_ROTATE		- two fingers turning around each other
+ *
+ * The distances and times that decide which is which are in a struct
+ * gesture_config, gesture_defaults has values that feel right on the
+ * 800 x 480 panel on this board. Each record is handled as it arrives,
+ * there is a small state machine and nothing is buffered so it is the
+ * same small amount of work for every record.
+ *
+ * Some notes on how it behaves:
+ *	- A tap is reported as soon as the finger lifts, it doesn't wait to
+ *	  see if there will be a second one. So a double tap is a tap
+ *	  followed by a double tap, don't have a tap do something that
+ *	  would get in the way of the double tap.
+ *	- A swipe is a quick drag, so it is reported after the drag ends.
+ *	- A long press happens while the finger is still down, and the
+ *	  panel doesn't send anything if the finger doesn't move, so call
+ *	  gesture_tick() every so often (50 - 100mS is plenty) if you want
+ *	  to see them on time. Moving after a long press starts a drag.
+ *	- Once a second finger comes down nothing that happens until all
+ *	  the fingers are lifted is a tap, swipe, or drag.
+ *
+ * Like pll.c there is nothing in here that touches the hardware, the
+ * time comes from the records, so you can build it on a PC and feed it
+ * touches you have saved to see what it does with them.
+ */
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <math.h>
+#include "../util/util.h"
+
+/* where the state machine is */
+#define GS_IDLE		0	/* no fingers down */
+#define GS_PRESS	1	/* one finger down, might be a tap */
+#define GS_HELD		2	/* the long press has been reported */
+#define GS_DRAG		3	/* one finger moving */
+#define GS_TWO		4	/* two fingers down */
+#define GS_WAIT		5	/* was two fingers, wait for all of them to lift */
+
+#define NO_EVENT	3	/* FT6206 event flag for an unused point */
+#define PI			3.14159265f
+
+const struct gesture_config gesture_defaults = {
+	.tap_slop = 20,
+	.tap_ms = 300,
+	.double_ms = 350,
+	.double_slop = 40,
+	.long_ms = 600,
+	.swipe_dist = 100,
+	.swipe_ms = 400,
+	.pinch_slop = 20,
+	.rotate_slop = 10,
+};
+
+static const char *gesture_names[] = {
+	"none", "tap", "double tap", "long press", "swipe", "drag", "pinch",
+	"rotate"
+};
+
+static int dist2(int x0, int y0, int x1, int y1);
+static void emit(struct gesture_state *gs, struct gesture *g);
+static void emit_at(struct gesture_state *gs, int type, int phase,
+												uint32_t when);
+static void one_up(struct gesture_state *gs, uint32_t when);
+static void two_points(const touch_event *te, const touch_point **a,
+												const touch_point **b);
+static void two_start(struct gesture_state *gs, const touch_event *te,
+												uint32_t when);
+static void two_move(struct gesture_state *gs, const touch_event *te,
+												uint32_t when);
+static void two_end(struct gesture_state *gs, uint32_t when);
+
+/*
+ * Distance squared, saves a square root when all we want to know is
+ * if it is further than something.
+ */
+static int
+dist2(int x0, int y0, int x1, int y1)
+{
+	return ((x1 - x0) * (x1 - x0)) + ((y1 - y0) * (y1 - y0));
+}
+
+static void
+emit(struct gesture_state *gs, struct gesture *g)
+{
+	gs->count[g->type]++;
+	if (gs->func) {
+		gs->func(g, gs->arg);
+	}
+}
+
+/*
+ * Report a one finger gesture at the latest position.
+ */
+static void
+emit_at(struct gesture_state *gs, int type, int phase, uint32_t when)
+{
+	struct gesture g = { 0 };
+
+	g.type = type;
+	g.phase = phase;
+	g.x = gs->x;
+	g.y = gs->y;
+	g.dx = gs->x - gs->x0;
+	g.dy = gs->y - gs->y0;
+	g.scale = 1.0f;
+	g.start = gs->t0;
+	g.when = when;
+	emit(gs, &g);
+}
+
+/*
+ * The one finger came up, decide if it was a tap or a swipe.
+ */
+static void
+one_up(struct gesture_state *gs, uint32_t when)
+{
+	const struct gesture_config *cfg = gs->cfg;
+	struct gesture g = { 0 };
+	uint32_t held = when - gs->t0;
+	int dx = gs->x - gs->x0;
+	int dy = gs->y - gs->y0;
+	int moved = dist2(gs->x0, gs->y0, gs->x, gs->y);
+	int was = gs->state;
+
+	gs->state = GS_IDLE;
+	if (was == GS_DRAG) {
+		emit_at(gs, GESTURE_DRAG, GESTURE_END, when);
+	}
+	if ((held <= cfg->swipe_ms) &&
+		(moved >= cfg->swipe_dist * cfg->swipe_dist)) {
+		g.type = GESTURE_SWIPE;
+		if (abs(dx) > abs(dy)) {
+			g.dir = (dx > 0) ? GESTURE_RIGHT : GESTURE_LEFT;
+		} else {
+			g.dir = (dy > 0) ? GESTURE_DOWN : GESTURE_UP;
+		}
+		g.x = gs->x;
+		g.y = gs->y;
+		g.dx = dx;
+		g.dy = dy;
+		g.scale = 1.0f;
+		g.start = gs->t0;
+		g.when = when;
+		emit(gs, &g);
+		gs->tap_ok = 0;
+		return;
+	}
+	if ((was != GS_PRESS) || (held > cfg->tap_ms)) {
+		gs->tap_ok = 0;
+		return;
+	}
+	/* a tap, maybe the second of a double */
+	if (gs->tap_ok && ((gs->t0 - gs->tap_t) <= cfg->double_ms) &&
+		(dist2(gs->tap_x, gs->tap_y, gs->x, gs->y) <=
+								cfg->double_slop * cfg->double_slop)) {
+		gs->tap_ok = 0;
+		emit_at(gs, GESTURE_DOUBLE_TAP, 0, when);
+		return;
+	}
+	gs->tap_ok = 1;
+	gs->tap_x = gs->x;
+	gs->tap_y = gs->y;
+	gs->tap_t = when;
+	emit_at(gs, GESTURE_TAP, 0, when);
+}
+
+/*
+ * The two points in touch id order, the panel doesn't promise to keep
+ * a finger in the same slot and if they swapped it would look like a
+ * half turn.
+ */
+static void
+two_points(const touch_event *te, const touch_point **a, const touch_point **b)
+{
+	if (te->tp[1].tid < te->tp[0].tid) {
+		*a = &te->tp[1];
+		*b = &te->tp[0];
+	} else {
+		*a = &te->tp[0];
+		*b = &te->tp[1];
+	}
+}
+
+/*
+ * A second finger came down, remember how far apart they are and at
+ * what angle, pinches and rotations are measured from there.
+ */
+static void
+two_start(struct gesture_state *gs, const touch_event *te, uint32_t when)
+{
+	const touch_point *a, *b;
+
+	if (gs->state == GS_DRAG) {
+		emit_at(gs, GESTURE_DRAG, GESTURE_END, when);
+	}
+	two_points(te, &a, &b);
+	gs->d0 = sqrtf((float) dist2(a->x, a->y, b->x, b->y));
+	gs->a0 = atan2f((float)(b->y - a->y), (float)(b->x - a->x));
+	gs->pinching = 0;
+	gs->rotating = 0;
+	gs->tap_ok = 0;
+	gs->state = GS_TWO;
+}
+
+/*
+ * The two fingers moved, a pinch starts once the spacing has changed
+ * by more than pinch_slop and a rotate once they have turned more
+ * than rotate_slop degrees. After that every move is reported.
+ */
+static void
+two_move(struct gesture_state *gs, const touch_event *te, uint32_t when)
+{
+	const struct gesture_config *cfg = gs->cfg;
+	const touch_point *a, *b;
+	struct gesture g = { 0 };
+	float d, turn;
+
+	two_points(te, &a, &b);
+	d = sqrtf((float) dist2(a->x, a->y, b->x, b->y));
+	turn = atan2f((float)(b->y - a->y), (float)(b->x - a->x)) - gs->a0;
+	/* keep it in -180 to 180 degrees */
+	if (turn > PI) {
+		turn -= 2.0f * PI;
+	} else if (turn < -PI) {
+		turn += 2.0f * PI;
+	}
+	turn = turn * 180.0f / PI;
+	g.x = (a->x + b->x) / 2;
+	g.y = (a->y + b->y) / 2;
+	g.scale = (gs->d0 > 0) ? d / gs->d0 : 1.0f;
+	g.angle = turn;
+	g.start = gs->t0;
+	g.when = when;
+	if (gs->pinching || (fabsf(d - gs->d0) > (float) cfg->pinch_slop)) {
+		g.type = GESTURE_PINCH;
+		g.phase = (gs->pinching) ? GESTURE_MOVE : GESTURE_BEGIN;
+		gs->pinching = 1;
+		emit(gs, &g);
+	}
+	if (gs->rotating || (fabsf(turn) > (float) cfg->rotate_slop)) {
+		g.type = GESTURE_ROTATE;
+		g.phase = (gs->rotating) ? GESTURE_MOVE : GESTURE_BEGIN;
+		gs->rotating = 1;
+		emit(gs, &g);
+	}
+	gs->last_scale = g.scale;
+	gs->last_angle = turn;
+}
+
+/*
+ * One of the fingers came up, finish any pinch or rotate.
+ */
+static void
+two_end(struct gesture_state *gs, uint32_t when)
+{
+	struct gesture g = { 0 };
+
+	g.x = gs->x;
+	g.y = gs->y;
+	g.phase = GESTURE_END;
+	g.scale = gs->last_scale;
+	g.angle = gs->last_angle;
+	g.start = gs->t0;
+	g.when = when;
+	if (gs->pinching) {
+		g.type = GESTURE_PINCH;
+		emit(gs, &g);
+	}
+	if (gs->rotating) {
+		g.type = GESTURE_ROTATE;
+		emit(gs, &g);
+	}
+	gs->pinching = 0;
+	gs->rotating = 0;
+	gs->state = GS_WAIT;
+}
+
+/*
+ * gesture_init( ... )
+ *
+ * Get 'gs' ready to recognize gestures with the thresholds in 'cfg'
+ * (NULL for gesture_defaults), calling 'func(gesture, arg)' for each
+ * one it sees.
+ */
+void
+gesture_init(struct gesture_state *gs, const struct gesture_config *cfg,
+											gesture_handler func, void *arg)
+{
+	int i;
+
+	gs->cfg = (cfg) ? cfg : &gesture_defaults;
+	gs->func = func;
+	gs->arg = arg;
+	gs->state = GS_IDLE;
+	gs->tap_ok = 0;
+	gs->pinching = 0;
+	gs->rotating = 0;
+	gs->last_scale = 1.0f;
+	gs->last_angle = 0;
+	for (i = 0; i < GESTURE_TYPES; i++) {
+		gs->count[i] = 0;
+	}
+}
+
+/*
+ * gesture_tick( ... )
+ *
+ * Let the recognizer know what time it is ('now' in mS, the same
+ * clock as the records) so a finger that is held still becomes a long
+ * press without waiting for the panel to say something.
+ */
+void
+gesture_tick(struct gesture_state *gs, uint32_t now)
+{
+	if ((gs->state == GS_PRESS) && ((now - gs->t0) >= gs->cfg->long_ms)) {
+		gs->state = GS_HELD;
+		gs->tap_ok = 0;
+		emit_at(gs, GESTURE_LONG_PRESS, 0, now);
+	}
+}
+
+/*
+ * gesture_feed( ... )
+ *
+ * Hand the recognizer the next touch record, any gestures it
+ * completes are passed to the handler before this returns.
+ */
+void
+gesture_feed(struct gesture_state *gs, const struct touch_record *r)
+{
+	const struct gesture_config *cfg = gs->cfg;
+	const touch_event *te = &r->te;
+	int n = te->n;
+
+	/* the lift is sometimes reported with no point, keep the last one */
+	if (te->tp[0].evt != NO_EVENT) {
+		gs->x = te->tp[0].x;
+		gs->y = te->tp[0].y;
+	}
+	gesture_tick(gs, r->when);
+	switch (gs->state) {
+	case GS_IDLE:
+		if (n == 0) {
+			break;
+		}
+		gs->x0 = gs->x;
+		gs->y0 = gs->y;
+		gs->t0 = r->when;
+		if (n > 1) {
+			two_start(gs, te, r->when);
+		} else {
+			gs->state = GS_PRESS;
+		}
+		break;
+	case GS_PRESS:
+	case GS_HELD:
+	case GS_DRAG:
+		if (n == 0) {
+			one_up(gs, r->when);
+			break;
+		}
+		if (n > 1) {
+			two_start(gs, te, r->when);
+			break;
+		}
+		if (gs->state == GS_DRAG) {
+			emit_at(gs, GESTURE_DRAG, GESTURE_MOVE, r->when);
+		} else if (dist2(gs->x0, gs->y0, gs->x, gs->y) >
+										cfg->tap_slop * cfg->tap_slop) {
+			gs->state = GS_DRAG;
+			emit_at(gs, GESTURE_DRAG, GESTURE_BEGIN, r->when);
+		}
+		break;
+	case GS_TWO:
+		if (n < 2) {
+			two_end(gs, r->when);
+			if (n == 0) {
+				gs->state = GS_IDLE;
+			}
+			break;
+		}
+		two_move(gs, te, r->when);
+		break;
+	case GS_WAIT:
+		if (n == 0) {
+			gs->state = GS_IDLE;
+		}
+		break;
+	}
+}
+
+/*
+ * gesture_name( ... )
+ *
+ * A name for a gesture type, for printing.
+ */
+const char *
+gesture_name(int type)
+{
+	if ((type < 0) || (type >= GESTURE_TYPES)) {
+		return "unknown";
+	}
+	return gesture_names[type];
+}
@@ -4,83 +4,212 @@
  */
 #include <stdio.h>
 #include <stdint.h>
+#include <string.h>
 #include "../util/util.h"
 
 /*
  * This code are some routines that implement a "classic"
  * hex dump style memory dump. So you can look at what is
  * in the RAM, alter it (in a couple of automated ways)
+ *
+ * The original version called printf() for every byte, which
+ * is fine for a page but takes forever on a few megabytes of
+ * SDRAM. Now each line is built in a buffer on the stack with
+ * a table lookup for each nibble and sent with one write. In
+ * bulk mode several lines are collected into a bigger buffer
+ * before they are written, and with HEXDUMP_SQUEEZE a run of
+ * identical lines (erased FLASH, zeroed RAM) is shown as a
+ * single "*" line like hexdump(1) does.
  */
-static uint8_t *dump_line(uint32_t, uint8_t *, int);
-static uint8_t *dump_page(uint32_t, uint8_t *, int);
+#define BULK_SIZE	1024
 
+static const char hex_digits[16] = "0123456789ABCDEF";
+
+static int put_str(char *out, const char *s);
+static void emit(const char *buf, int len);
+static int add_line(char *bulk, int nb, const char *line, int n, int flags);
 
 /*
- * This routine does a simple "hex" dump to the console
- * it keeps non-ascii characters from printing.
+ * Copy a string (a color escape) into the line, returns its length.
  */
-void
-hex_dump(uint32_t addr, uint8_t *data, unsigned int len)
+static int
+put_str(char *out, const char *s)
+{
+	int n = 0;
+
+	while (*s) {
+		out[n++] = *s++;
+	}
+	return n;
+}
+
+/*
+ * Send finished text to the console, it goes straight to the
+ * console (not through stdout) so there is no newline translation
+ * and no extra copy.
+ */
+static void
+emit(const char *buf, int len)
 {
-	dump_page(addr, data, len);
+	(void) console_write(buf, len);
 }
 
 /*
- * dump a 'line' (an address, up to 16 bytes, and then the
- * ASCII representation of those bytes) to the console.
- * Takes an address (and possiblye a 'base' parameter
- * so that you can offset the address) and sends 16
- * bytes out. Returns the address +16 so you can
- * just call it repeatedly and it will send the
- * next 16 bytes out.
+ * Add a line to the bulk buffer (sending what is there first if it
+ * won't fit), or just send it if we aren't in bulk mode. Returns how
+ * full the bulk buffer is now.
  */
-static uint8_t *
-dump_line(uint32_t addr, uint8_t *buf, int len)
+static int
+add_line(char *bulk, int nb, const char *line, int n, int flags)
 {
-	int i;
+	if ((flags & HEXDUMP_BULK) == 0) {
+		if (n) {
+			emit(line, n);
+		}
+		return 0;
+	}
+	if (nb + n > BULK_SIZE) {
+		emit(bulk, nb);
+		nb = 0;
+	}
+	memcpy(&bulk[nb], line, n);
+	return nb + n;
+}
+
+/*
+ * hex_dump_line( ... )
+ *
+ * Format one line (the address, up to 'width' bytes from 'buf' in
+ * hex, and then the ASCII representation of those bytes) into 'out'
+ * which must have room for HEXDUMP_LINE_MAX characters. 'len' is
+ * how many of the bytes are there, if it is less than 'width' the
+ * line is padded out. Returns the length of the line (it ends in
+ * "\r\n" and is not NUL terminated).
+ */
+int
+hex_dump_line(char *out, uint32_t addr, const uint8_t *buf, int len, int width,
+																	int flags)
+{
+	char *p = out;
+	int color = flags & HEXDUMP_COLOR;
+	int i, s;
 	uint8_t b;
 
-	printf(console_color(WHITE));
-	printf("%08X | ", (unsigned int) addr);
-	printf(console_color(GREEN));
-	for (i = 0; i < 16; i++) {
+	if (width > HEXDUMP_MAX_WIDTH) {
+		width = HEXDUMP_MAX_WIDTH;
+	}
+	if (color) {
+		p += put_str(p, console_color(WHITE));
+	}
+	for (s = 28; s >= 0; s -= 4) {
+		*p++ = hex_digits[(addr >> s) & 0xf];
+	}
+	*p++ = ' '; *p++ = '|'; *p++ = ' ';
+	if (color) {
+		p += put_str(p, console_color(GREEN));
+	}
+	for (i = 0; i < width; i++) {
 		if (i < len) {
-			printf("%02X ", (uint8_t) *(buf + i));
+			b = buf[i];
+			*p++ = hex_digits[b >> 4];
+			*p++ = hex_digits[b & 0xf];
 		} else {
-			printf("   ");
+			*p++ = ' ';
+			*p++ = ' ';
 		}
-		if (i == 7) {
-			printf("  ");
+		*p++ = ' ';
+		/* an extra gap every 8 bytes */
+		if (((i & 7) == 7) && (i != width - 1)) {
+			*p++ = ' ';
+			*p++ = ' ';
 		}
 	}
-	printf("%s| ", console_color(YELLOW));
-	for (i = 0; i < 16; i++) {
+	if (color) {
+		p += put_str(p, console_color(YELLOW));
+	}
+	*p++ = '|'; *p++ = ' ';
+	for (i = 0; i < width; i++) {
 		if (i < len) {
-			b = *buf++;
-			printf("%c", (((b == 126) || (b < 32) || (b == 255)) ? '.' : (char) b));
+			b = buf[i];
+			*p++ = ((b == 126) || (b < 32) || (b == 255)) ? '.' : (char) b;
 		} else {
-			printf(" ");
+			*p++ = ' ';
 		}
 	}
-	printf("%s\n", console_color(NONE));
-	return buf;
+	if (color) {
+		p += put_str(p, console_color(NONE));
+	}
+	*p++ = '\r';
+	*p++ = '\n';
+	return p - out;
 }
 
-
 /*
- * dump a 'page' like the function dump_line except this
- * does 16 lines for a total of 256 bytes. Back in the
- * day when you had a 24 x 80 terminal this fit nicely
- * on the screen with some other information.
+ * hex_dump_ex( ... )
+ *
+ * Dump 'len' bytes at 'data' (labeled starting at 'addr'), 'width'
+ * bytes per line. The flags are:
+ *	HEXDUMP_COLOR	- color the address, hex, and ASCII parts
+ *	HEXDUMP_BULK	- write a kilobyte of lines at a time rather
+ *			  than one line at a time, for really big dumps
+ *	HEXDUMP_SQUEEZE	- show repeated lines as "*"
  */
-static uint8_t *
-dump_page(uint32_t addr, uint8_t *buf, int len)
+void
+hex_dump_ex(uint32_t addr, const uint8_t *data, uint32_t len, int width,
+																	int flags)
 {
-	int i;
-	for (i = 0; (i < 16) && (len > 0); i++) {
-		buf = dump_line(addr, buf, (len < 16) ? len : 16);
-		addr += 16;
-		len -= 16;
+	char line[HEXDUMP_LINE_MAX];
+	char bulk[BULK_SIZE];
+	const uint8_t *prev = NULL;
+	int squeezed = 0;
+	int n, nb = 0;
+
+	if ((width <= 0) || (width > HEXDUMP_MAX_WIDTH)) {
+		width = 16;
+	}
+	fflush(stdout);
+	while (len > 0) {
+		n = (len < (uint32_t) width) ? (int) len : width;
+		if ((flags & HEXDUMP_SQUEEZE) && (prev != NULL) && (n == width) &&
+			(memcmp(prev, data, width) == 0)) {
+			if (! squeezed) {
+				squeezed = 1;
+				n = put_str(line, "*\r\n");
+			} else {
+				n = 0;
+			}
+		} else {
+			squeezed = 0;
+			prev = data;
+			n = hex_dump_line(line, addr, data, n, width, flags);
+		}
+		nb = add_line(bulk, nb, line, n, flags);
+		if (len <= (uint32_t) width) {
+			break;
+		}
+		data += width;
+		addr += width;
+		len -= width;
 	}
-	return buf;
+	/* show where a squeezed run stopped */
+	if (squeezed) {
+		n = hex_dump_line(line, addr, data, width, width, flags);
+		nb = add_line(bulk, nb, line, n, flags);
+	}
+	if (nb) {
+		emit(bulk, nb);
+	}
+}
+
+/*
+ * This routine does a simple "hex" dump to the console
+ * it keeps non-ascii characters from printing. It used to stop
+ * after 256 bytes (a "page", back in the day when you had a 24 x 80
+ * terminal that fit nicely on the screen) now it dumps all of it.
+ */
+void
+hex_dump(uint32_t addr, uint8_t *data, unsigned int len)
+{
+	/* console_color() hands back "" if color is turned off */
+	hex_dump_ex(addr, data, len, 16, (*console_color(NONE)) ? HEXDUMP_COLOR : 0);
 }
@@ -0,0 +1,233 @@
+/*
+ * console_test.c - console.c's receive ring and transmit buffer
+ *
+ * Copyright (c) 2016, Chuck McManis (cmcmanis@mcmanis.com)
+ *
+ * Runs console.c against the simulated USART and DMA in uart_sim.c.
+ * It checks that:
+ *	- a burst of characters is all there, in order, after the line
+ *	  goes idle, and the rx hook was called for it
+ *	- a long paste in random sized bursts, read a bit at a time,
+ *	  comes through without losing anything and with a lot fewer
+ *	  interrupts than characters
+ *	- falling a whole buffer behind is counted as lost and what is
+ *	  left to read is the end of what was sent
+ *	- overrun, framing, and noise errors are counted
+ *	- output comes out in order, with '\n' made "\n\r", including
+ *	  when interrupts are off part way through, and the drop policy
+ *	  counts what didn't fit
+ *	- console_gets() edits the line and echoes it
+ *
+ * Usage: console_test [seed]
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../util.h"
+#include "sim/stm32_sim.h"
+#include "host.h"
+
+#define RX_BUF		512		/* RECV_BUF_SIZE in console.c */
+#define PASTE_LEN	20000
+
+static int hooks;
+static char paste[PASTE_LEN];
+static char got[PASTE_LEN];
+
+static int read_all(char *buf, int max);
+static void test_burst(void);
+static void test_paste(void);
+static void test_lost(void);
+static void test_errors(void);
+static void test_tx(void);
+static void test_gets(void);
+
+/* replaces the weak one in console.c */
+void
+console_rx_hook(void)
+{
+	hooks++;
+}
+
+/*
+ * Read what is waiting, returns how many there were.
+ */
+static int
+read_all(char *buf, int max)
+{
+	int n = 0;
+	char c;
+
+	while ((n < max) && ((c = console_getc(0)) != 0)) {
+		buf[n++] = c;
+	}
+	return n;
+}
+
+static void
+test_burst(void)
+{
+	struct console_stats st;
+	struct uart_sim_stats ss;
+	char buf[16];
+
+	hooks = 0;
+	uart_sim_rx("hello\r", 6);
+	CHECK(hooks == 1);
+	CHECK(read_all(buf, sizeof(buf)) == 6);
+	CHECK(memcmp(buf, "hello\r", 6) == 0);
+	CHECK(console_getc(0) == 0);
+	console_get_stats(&st);
+	CHECK(st.rx_bytes == 6);
+	CHECK(st.rx_lost == 0);
+	uart_sim_get_stats(&ss);
+	CHECK(ss.usart_irqs == 1);
+	CHECK(ss.dma_irqs == 0);
+	CHECK(ss.baud == 57600);
+}
+
+static void
+test_paste(void)
+{
+	struct console_stats before, st;
+	struct uart_sim_stats sb, ss;
+	int sent = 0, rcvd = 0, len, n, irqs;
+
+	console_get_stats(&before);
+	uart_sim_get_stats(&sb);
+	for (n = 0; n < PASTE_LEN; n++) {
+		paste[n] = 'a' + test_rand() % 26;
+	}
+	while (rcvd < PASTE_LEN) {
+		len = 1 + test_rand() % 300;
+		if (len > PASTE_LEN - sent) {
+			len = PASTE_LEN - sent;
+		}
+		/* the program keeps up, only just */
+		if (sent - rcvd + len >= RX_BUF) {
+			rcvd += read_all(&got[rcvd], sent - rcvd + len - RX_BUF + 1);
+		}
+		uart_sim_rx(&paste[sent], len);
+		sent += len;
+		n = test_rand() % (sent - rcvd + 1);
+		rcvd += read_all(&got[rcvd], n);
+		if (sent == PASTE_LEN) {
+			rcvd += read_all(&got[rcvd], PASTE_LEN - rcvd);
+		}
+	}
+	CHECK(memcmp(got, paste, PASTE_LEN) == 0);
+	CHECK(console_getc(0) == 0);
+	console_get_stats(&st);
+	CHECK(st.rx_bytes - before.rx_bytes == PASTE_LEN);
+	CHECK(st.rx_lost == before.rx_lost);
+	uart_sim_get_stats(&ss);
+	irqs = (ss.usart_irqs - sb.usart_irqs) + (ss.dma_irqs - sb.dma_irqs);
+	printf("%d characters, %d interrupts\n", PASTE_LEN, irqs);
+	CHECK(irqs < PASTE_LEN / 16);
+}
+
+static void
+test_lost(void)
+{
+	struct console_stats before, st;
+	char buf[RX_BUF];
+	int n, i;
+
+	console_get_stats(&before);
+	for (i = 0; i < 700; i++) {
+		paste[i] = 'A' + i % 26;
+	}
+	uart_sim_rx(paste, 700);
+	console_get_stats(&st);
+	CHECK(st.rx_lost == before.rx_lost + 1);
+	n = read_all(buf, sizeof(buf));
+	CHECK(n < RX_BUF);
+	CHECK(memcmp(buf, &paste[700 - n], n) == 0);
+
+	/* and it carries on from there */
+	uart_sim_rx("ok\r", 3);
+	CHECK(read_all(buf, sizeof(buf)) == 3);
+	CHECK(memcmp(buf, "ok\r", 3) == 0);
+	console_get_stats(&st);
+	CHECK(st.rx_lost == before.rx_lost + 1);
+}
+
+static void
+test_errors(void)
+{
+	struct console_stats before, st;
+
+	console_get_stats(&before);
+	hooks = 0;
+	uart_sim_error(UART_SIM_FRAMING | UART_SIM_NOISE);
+	uart_sim_error(UART_SIM_OVERRUN);
+	uart_sim_error(UART_SIM_FRAMING);
+	console_get_stats(&st);
+	CHECK(st.rx_overrun - before.rx_overrun == 1);
+	CHECK(st.rx_framing - before.rx_framing == 2);
+	CHECK(st.rx_noise - before.rx_noise == 1);
+	/* nothing new to read */
+	CHECK(hooks == 0);
+	CHECK(console_getc(0) == 0);
+}
+
+static void
+test_tx(void)
+{
+	static char big[3000];
+	char buf[4096];
+	int n;
+
+	uart_sim_tx(NULL, 0);
+	console_puts("abc\ndef");
+	n = uart_sim_tx(buf, sizeof(buf));
+	CHECK((n == 8) && (memcmp(buf, "abc\n\rdef", 8) == 0));
+
+	/* queued, then sent polled with interrupts off, still in order */
+	console_write("123", 3);
+	cm_mask_interrupts(1);
+	console_write("456", 3);
+	cm_mask_interrupts(0);
+	n = uart_sim_tx(buf, sizeof(buf));
+	CHECK((n == 6) && (memcmp(buf, "123456", 6) == 0));
+
+	memset(big, 'x', sizeof(big));
+	console_tx_policy(CONSOLE_TX_DROP);
+	n = console_write(big, sizeof(big));
+	CHECK(n == 1023);
+	CHECK(console_tx_dropped() == sizeof(big) - 1023);
+	CHECK(uart_sim_tx(buf, sizeof(buf)) == 1023);
+	console_tx_policy(CONSOLE_TX_BLOCK);
+}
+
+static void
+test_gets(void)
+{
+	char line[32];
+	char buf[64];
+	int n;
+
+	uart_sim_tx(NULL, 0);
+	uart_sim_rx("12x\b3\r", 6);
+	n = console_gets(line, sizeof(line));
+	CHECK((n == 4) && (strcmp(line, "123\n") == 0));
+	n = uart_sim_tx(buf, sizeof(buf));
+	CHECK((n == 7) && (memcmp(buf, "12x\010 \0103", 7) == 0));
+}
+
+int
+main(int argc, char *argv[])
+{
+	test_srand((argc > 1) ? strtoul(argv[1], NULL, 0) : 1);
+	console_setup(57600);
+	test_burst();
+	test_paste();
+	test_lost();
+	test_errors();
+	test_tx();
+	test_gets();
+	printf("console_test: %s (%d failures)\n", (test_failures) ? "FAIL" : "PASS",
+															test_failures);
+	return (test_failures != 0);
+}
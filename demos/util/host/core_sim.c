@@ -0,0 +1,62 @@
+/*
+ * core_sim.c - the Cortex-M and RCC bits the simulated peripherals share
+ *
+ * Copyright (c) 2016, Chuck McManis (cmcmanis@mcmanis.com)
+ *
+ * Interrupt masking, which interrupts have been enabled in the NVIC,
+ * and the clock tree the way clock_setup() leaves it (168 MHz, APB1
+ * divided by 4 to 42 MHz). uart_sim.c and tim_sim.c ask this before
+ * they call a handler.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include "sim/stm32_sim.h"
+#include "host.h"
+
+uint32_t rcc_ahb_frequency = 168000000;
+uint32_t rcc_apb1_frequency = 42000000;
+uint32_t sim_rcc_cfgr = (5 << RCC_CFGR_PPRE1_SHIFT);	/* HCLK / 4 */
+uint32_t sim_rcc_dckcfgr;
+uint32_t sim_scb_icsr;
+
+static uint32_t irq_enabled[4];		/* a bit per NVIC interrupt */
+static uint32_t masked;
+
+void
+rcc_periph_clock_enable(uint32_t clken)
+{
+	(void) clken;
+}
+
+void
+nvic_enable_irq(uint8_t irqn)
+{
+	irq_enabled[(irqn >> 5) & 3] |= 1u << (irqn & 31);
+}
+
+bool
+sim_irq_enabled(uint8_t irqn)
+{
+	return (irq_enabled[(irqn >> 5) & 3] & (1u << (irqn & 31))) != 0;
+}
+
+void
+scb_reset_system(void)
+{
+	printf("core_sim: scb_reset_system() called\n");
+}
+
+uint32_t
+cm_mask_interrupts(uint32_t mask)
+{
+	uint32_t old = masked;
+
+	masked = mask;
+	return old;
+}
+
+bool
+cm_is_masked_interrupts(void)
+{
+	return masked;
+}
@@ -0,0 +1,200 @@
+/*
+ * gesture_replay.c - run saved touch records through gesture.c
+ *
+ * Copyright (c) 2016, Chuck McManis (cmcmanis@mcmanis.com)
+ *
+ * A trace is a text file of touch records, the way the dma2d demo
+ * prints them when you press 'g', with the gestures they should turn
+ * into written in between:
+ *
+ *	# a comment
+ *	T <when> <down|move|up> <n> <evt> <tid> <x> <y> <evt> <tid> <x> <y>
+ *	E <gesture>
+ *
+ * Each T line is one struct touch_record (both touch points, used or
+ * not). An E line is the next gesture that should have been reported
+ * by the time the records before it have been fed in. It is the name
+ * from gesture_name() followed by the direction for a swipe, the phase
+ * for a drag, pinch, or rotate (begin or end, the moves in between are
+ * left out so traces stay readable), and for the end of a pinch "in"
+ * or "out", of a rotate "cw" or "ccw". So "E swipe left", "E drag
+ * begin", "E pinch end out". Any gesture after the last E line is a
+ * failure too.
+ *
+ * gesture_tick() is called every 50mS of trace time between records,
+ * like the demo does every frame, so long presses happen when they
+ * would on the board.
+ *
+ * Usage: gesture_replay [-v] file.trace ...
+ *	-v prints every gesture as it is reported
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../util.h"
+#include "host.h"
+
+#define TICK_MS		50
+#define MAX_SEEN	256
+
+static char seen[MAX_SEEN][40];
+static int nseen;
+static int verbose;
+
+static void describe(const struct gesture *g, char *buf, int len);
+static void record(const struct gesture *g, void *arg);
+static void tick_until(struct gesture_state *gs, uint32_t *next, uint32_t t);
+static int replay(const char *path);
+
+/*
+ * The gesture the way E lines spell it
+ */
+static void
+describe(const struct gesture *g, char *buf, int len)
+{
+	static const char *dirs[] = { "", " left", " right", " up", " down" };
+	static const char *phases[] = { "", " begin", " move", " end" };
+	const char *extra = "";
+
+	if ((g->type == GESTURE_PINCH) && (g->phase == GESTURE_END)) {
+		extra = (g->scale >= 1.0f) ? " out" : " in";
+	} else if ((g->type == GESTURE_ROTATE) && (g->phase == GESTURE_END)) {
+		extra = (g->angle >= 0) ? " cw" : " ccw";
+	}
+	snprintf(buf, len, "%s%s%s%s", gesture_name(g->type),
+		dirs[((g->dir > 0) && (g->dir <= 4)) ? g->dir : 0],
+		phases[((g->phase > 0) && (g->phase <= 3)) ? g->phase : 0], extra);
+}
+
+static void
+record(const struct gesture *g, void *arg __attribute__((unused)))
+{
+	char buf[40];
+
+	describe(g, buf, sizeof(buf));
+	if (verbose) {
+		printf("  %8u %-20s at %3d, %3d  (%d, %d) scale %4.2f angle %6.1f\n",
+			(unsigned int) g->when, buf, g->x, g->y, g->dx, g->dy, g->scale,
+			g->angle);
+	}
+	if ((g->phase == GESTURE_MOVE) || (nseen >= MAX_SEEN)) {
+		return;
+	}
+	strcpy(seen[nseen++], buf);
+}
+
+/*
+ * Tick the recognizer every TICK_MS up to time 't'
+ */
+static void
+tick_until(struct gesture_state *gs, uint32_t *next, uint32_t t)
+{
+	while ((int32_t)(t - *next) >= 0) {
+		gesture_tick(gs, *next);
+		*next += TICK_MS;
+	}
+}
+
+/*
+ * Play one trace, returns the number of things that were wrong.
+ */
+static int
+replay(const char *path)
+{
+	struct gesture_state gs;
+	struct touch_record r;
+	char line[256], kind[8];
+	unsigned int when;
+	uint32_t next = 0, last = 0;
+	touch_point *a = &r.te.tp[0], *b = &r.te.tp[1];
+	int nexpect = 0, lineno = 0, records = 0, bad = 0;
+	int len;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (f == NULL) {
+		perror(path);
+		return 1;
+	}
+	nseen = 0;
+	gesture_init(&gs, NULL, record, NULL);
+	while (fgets(line, sizeof(line), f) != NULL) {
+		lineno++;
+		len = strlen(line);
+		while ((len > 0) && ((line[len - 1] == '\n') || (line[len - 1] == ' ') ||
+							(line[len - 1] == '\r') || (line[len - 1] == '\t'))) {
+			line[--len] = 0;
+		}
+		if ((len == 0) || (line[0] == '#')) {
+			continue;
+		}
+		if ((line[0] == 'E') && (line[1] == ' ')) {
+			if (nexpect >= nseen) {
+				printf("%s:%d: expected \"%s\", nothing was reported\n", path,
+											lineno, line + 2);
+				bad++;
+				break;
+			}
+			if (strcmp(seen[nexpect], line + 2) != 0) {
+				printf("%s:%d: expected \"%s\", got \"%s\"\n", path, lineno,
+											line + 2, seen[nexpect]);
+				bad++;
+				break;
+			}
+			nexpect++;
+			continue;
+		}
+		if ((line[0] != 'T') || (sscanf(line + 1,
+				" %u %7s %d %d %d %d %d %d %d %d %d", &when, kind, &r.te.n,
+				&a->evt, &a->tid, &a->x, &a->y,
+				&b->evt, &b->tid, &b->x, &b->y) != 11)) {
+			printf("%s:%d: can't read \"%s\"\n", path, lineno, line);
+			bad++;
+			continue;
+		}
+		if (strcmp(kind, "down") == 0) {
+			r.kind = TOUCH_DOWN;
+		} else if (strcmp(kind, "up") == 0) {
+			r.kind = TOUCH_UP;
+		} else {
+			r.kind = TOUCH_MOVE;
+		}
+		r.when = when;
+		if (records++ == 0) {
+			next = when;
+		}
+		a->weight = a->misc = b->weight = b->misc = 0;
+		tick_until(&gs, &next, when);
+		gesture_feed(&gs, &r);
+		last = when;
+	}
+	fclose(f);
+	/* give a finger that is still down time to become a long press */
+	tick_until(&gs, &next, last + 1000);
+
+	/* and anything left over wasn't supposed to be there */
+	if (! bad && (nseen > nexpect)) {
+		printf("%s: \"%s\" was reported after the last gesture expected\n",
+											path, seen[nexpect]);
+		bad++;
+	}
+	printf("%s: %d records, %d gestures, %s\n", path, records, nseen,
+						(bad) ? "FAIL" : "ok");
+	return bad;
+}
+
+int
+main(int argc, char *argv[])
+{
+	int i, bad = 0;
+
+	for (i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-v") == 0) {
+			verbose = 1;
+			continue;
+		}
+		bad += replay(argv[i]);
+	}
+	return (bad != 0);
+}
@@ -0,0 +1,83 @@
+/*
+ * host.h - things the host (PC) builds of the util code need
+ *
+ * Copyright (c) 2016, Chuck McManis (cmcmanis@mcmanis.com)
+ */
+#pragma once
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * A file standing in for the QSPI FLASH (nor_sim.c)
+ */
+#define NOR_SIZE		0x1000000	/* 16MB, same as the N25Q128 */
+
+struct nor_stats {
+	uint64_t	program_bytes;	/* bytes programmed */
+	uint64_t	read_bytes;
+	uint32_t	erases;			/* 4K sub-sector erases */
+	uint32_t	bad_bits;		/* tried to program a 0 back to 1 */
+};
+
+int nor_open(const char *path, uint32_t size);
+void nor_close(void);
+/* lose power after 'bytes' more bytes are programmed or erased */
+void nor_power_cut(long bytes);
+int nor_power_lost(void);
+void nor_power_on(void);
+uint32_t nor_erase_count(uint32_t addr);
+void nor_get_stats(struct nor_stats *st, int reset);
+
+/*
+ * A simulated USART3 and DMA1 stream 1 for console.c (uart_sim.c)
+ */
+#define UART_SIM_OVERRUN	1
+#define UART_SIM_FRAMING	2
+#define UART_SIM_NOISE		4
+
+struct uart_sim_stats {
+	uint32_t	rx_bytes;		/* characters that arrived */
+	uint32_t	tx_bytes;		/* characters sent */
+	uint32_t	usart_irqs;		/* times usart3_isr() was called */
+	uint32_t	dma_irqs;		/* times dma1_stream1_isr() was called */
+	uint32_t	baud;			/* last baud rate set */
+};
+
+/* 'len' characters arrive and then the line goes idle */
+void uart_sim_rx(const char *s, int len);
+void uart_sim_error(int errors);
+/* run the transmitter, returns the characters sent since last time */
+int uart_sim_tx(char *buf, int len);
+void uart_sim_get_stats(struct uart_sim_stats *st);
+
+/*
+ * A simulated TIM2 for timebase.c (tim_sim.c)
+ */
+struct tim_sim_stats {
+	uint32_t	irqs;			/* times tim2_isr() was called */
+	uint32_t	storms;			/* times it didn't clear what it was called for */
+};
+
+/* 'us' microseconds go by, with interrupts */
+void tim_sim_run(uint32_t us);
+/* or without, from a callback that takes a while */
+void tim_sim_spend(uint32_t us);
+void tim_sim_set_count(uint32_t cnt);
+void tim_sim_get_stats(struct tim_sim_stats *st);
+
+/*
+ * Tiny test helpers, CHECK() counts a failure and keeps going so
+ * one run shows everything that is wrong.
+ */
+extern int test_failures;
+
+#define CHECK(c)	do { \
+		if (! (c)) { \
+			printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #c); \
+			test_failures++; \
+		} \
+	} while (0)
+
+/* repeatable pseudo-random numbers (so a failure can be re-run) */
+uint32_t test_rand(void);
+void test_srand(uint32_t seed);
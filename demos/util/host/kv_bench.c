@@ -0,0 +1,116 @@
+/*
+ * kv_bench.c - write amplification of kvstore.c for a few workloads
+ *
+ * Copyright (c) 2016, Chuck McManis (cmcmanis@mcmanis.com)
+ *
+ * Write amplification is how many bytes end up programmed into the
+ * FLASH for each byte of key and value you gave kv_set(). It counts
+ * the record headers and padding, the records compaction copies
+ * forward, and the sub-sector headers. Along with that this prints
+ * how many erases it took and how even the wear is, because that is
+ * what actually uses up the FLASH.
+ *
+ * The workloads:
+ *	hot8		- 8 keys, 4 byte values, round robin (the demo's
+ *			  'stress' command)
+ *	uniform64	- 64 keys, 32 byte values, picked at random
+ *	skewed128	- 128 keys, 1 - 240 byte values, 90% of the writes
+ *			  go to 10% of the keys
+ *	full200		- 200 keys of 240 bytes (about 20% of the store is
+ *			  live all the time) picked at random
+ *
+ * Usage: kv_bench [writes]
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../util.h"
+#include "host.h"
+
+#define FLASH_FILE	"kv_bench.flash"
+#define KV_BASE		0xfc0000
+#define KV_SECTORS	64
+
+struct workload {
+	const char	*name;
+	int			keys;
+	int			min_len, max_len;
+	int			hot_pct;	/* % of writes to the hot keys, 0 for uniform */
+	int			round_robin;
+};
+
+static const struct workload workloads[] = {
+	{ "hot8", 8, 4, 4, 0, 1 },
+	{ "uniform64", 64, 32, 32, 0, 0 },
+	{ "skewed128", 128, 1, 240, 90, 0 },
+	{ "full200", 200, 240, 240, 0, 0 },
+};
+
+#define NWORKLOADS	((int) (sizeof(workloads) / sizeof(workloads[0])))
+
+static void run(const struct workload *w, int writes);
+
+static void
+run(const struct workload *w, int writes)
+{
+	struct kv_stats st;
+	struct nor_stats ns;
+	uint8_t val[KV_MAX_VALUE];
+	char key[16];
+	uint64_t user = 0;
+	int i, k, len, hot;
+
+	nor_close();
+	remove(FLASH_FILE);
+	if (nor_open(FLASH_FILE, NOR_SIZE) != 0) {
+		exit(1);
+	}
+	kv_init(KV_BASE, KV_SECTORS);
+	nor_get_stats(&ns, 1);
+	for (i = 0; i < writes; i++) {
+		if (w->round_robin) {
+			k = i % w->keys;
+		} else if (w->hot_pct && ((int) (test_rand() % 100) < w->hot_pct)) {
+			hot = (w->keys + 9) / 10;
+			k = test_rand() % hot;
+		} else {
+			k = test_rand() % w->keys;
+		}
+		len = w->min_len + test_rand() % (w->max_len - w->min_len + 1);
+		memset(val, i & 0xff, len);
+		sprintf(key, "key%03d", k);
+		if (kv_set(key, val, len) != 0) {
+			printf("%-10s kv_set failed after %d writes\n", w->name, i);
+			return;
+		}
+		user += strlen(key) + len;
+		kv_service();
+	}
+	kv_get_stats(&st);
+	nor_get_stats(&ns, 0);
+	printf("%-10s %9u %10llu %10llu %6.2f %7u %6.2f %5u %5u\n", w->name,
+		(unsigned int) writes, (unsigned long long) user,
+		(unsigned long long) ns.program_bytes,
+		(double) ns.program_bytes / (double) user,
+		(unsigned int) ns.erases, (double) ns.erases * 1000.0 / writes,
+		(unsigned int) st.min_erase, (unsigned int) st.max_erase);
+}
+
+int
+main(int argc, char *argv[])
+{
+	int writes = (argc > 1) ? atoi(argv[1]) : 100000;
+	int i;
+
+	test_srand(1);
+	printf("kvstore write amplification, %d sub-sectors\n\n", KV_SECTORS);
+	printf("%-10s %9s %10s %10s %6s %7s %6s %5s %5s\n", "Workload", "Writes",
+		"User B", "FLASH B", "WA", "Erases", "/1000", "Min", "Max");
+	for (i = 0; i < NWORKLOADS; i++) {
+		run(&workloads[i], writes);
+	}
+	nor_close();
+	remove(FLASH_FILE);
+	return 0;
+}
@@ -0,0 +1,348 @@
+/*
+ * kv_test.c - run kvstore.c against the simulated NOR FLASH
+ *
+ * Copyright (c) 2016, Chuck McManis (cmcmanis@mcmanis.com)
+ *
+ * Each test does things to the store and checks it against a copy
+ * of what should be in it (the "model"), a plain array of keys and
+ * values in RAM.
+ *
+ *	basic		- set, get, delete, and mount again
+ *	replay		- thousands of random sets and deletes with the file
+ *			  closed, opened, and the store mounted again every
+ *			  so often, everything has to come back
+ *	torn		- the same but the power goes out at a random byte
+ *			  in the middle of things. After mounting again
+ *			  every key has to have the value it had, except
+ *			  the one being written when the power went which
+ *			  can have its old value or its new one. The least
+ *			  worn sub-sector's erase count must never go down.
+ *	compaction	- re-write a few hot keys over and over with some
+ *			  cold ones that never change, the store has to
+ *			  keep compacting, keep the cold data, and keep the
+ *			  wear even
+ *
+ * Usage: kv_test [seed]
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../util.h"
+#include "host.h"
+
+#define FLASH_FILE	"kv_test.flash"
+#define KV_BASE		0xfc0000	/* same place as the kvstore demo */
+#define KV_SECTORS	64
+#define NKEYS		64
+
+struct model_key {
+	int		present;
+	int		len;
+	uint8_t	val[KV_MAX_VALUE];
+};
+
+static struct model_key model[NKEYS];
+
+static void key_name(int k, char *buf);
+static int make_value(uint8_t *val, int max);
+static int do_set(int k);
+static void model_reset(void);
+static int model_check(int skip);
+static int mount(int reopen);
+static void test_basic(void);
+static void test_replay(void);
+static void test_torn(void);
+static void test_compaction(void);
+
+static void
+key_name(int k, char *buf)
+{
+	sprintf(buf, "key%02d", k);
+}
+
+/*
+ * A value of random length (at least 1) full of random bytes.
+ */
+static int
+make_value(uint8_t *val, int max)
+{
+	int i, len = 1 + (test_rand() % max);
+
+	for (i = 0; i < len; i++) {
+		val[i] = test_rand() & 0xff;
+	}
+	return len;
+}
+
+/*
+ * Set key 'k' to something new in the store and the model. Returns
+ * what kv_set() did.
+ */
+static int
+do_set(int k)
+{
+	char key[16];
+	uint8_t val[KV_MAX_VALUE];
+	int len, res;
+
+	key_name(k, key);
+	len = make_value(val, 48);
+	res = kv_set(key, val, len);
+	if (res == 0) {
+		model[k].present = 1;
+		model[k].len = len;
+		memcpy(model[k].val, val, len);
+	}
+	return res;
+}
+
+static void
+model_reset(void)
+{
+	memset(model, 0, sizeof(model));
+}
+
+/*
+ * Check every key in the store against the model, except 'skip'.
+ * Returns the number that were wrong.
+ */
+static int
+model_check(int skip)
+{
+	char key[16];
+	uint8_t val[KV_MAX_VALUE];
+	int k, len, bad = 0;
+
+	for (k = 0; k < NKEYS; k++) {
+		if (k == skip) {
+			continue;
+		}
+		key_name(k, key);
+		len = kv_get(key, val, sizeof(val));
+		if (! model[k].present) {
+			if (len >= 0) {
+				printf("  %s should not be there\n", key);
+				bad++;
+			}
+		} else if ((len != model[k].len) ||
+					(memcmp(val, model[k].val, len) != 0)) {
+			printf("  %s is wrong (length %d, should be %d)\n", key, len,
+															model[k].len);
+			bad++;
+		}
+	}
+	return bad;
+}
+
+/*
+ * Mount the store again, like after a reset. With 'reopen' the
+ * FLASH file is closed and opened too.
+ */
+static int
+mount(int reopen)
+{
+	if (reopen) {
+		nor_close();
+		if (nor_open(FLASH_FILE, NOR_SIZE) != 0) {
+			exit(1);
+		}
+	}
+	return kv_init(KV_BASE, KV_SECTORS);
+}
+
+static void
+test_basic(void)
+{
+	uint8_t val[KV_MAX_VALUE];
+	char big[KV_MAX_KEY + 2];
+
+	printf("basic\n");
+	CHECK(mount(0) == 0);
+	CHECK(kv_get("nothing", val, sizeof(val)) == -1);
+	CHECK(kv_set("answer", (uint8_t *) "42", 2) == 0);
+	CHECK(kv_set("name", (uint8_t *) "discovery", 9) == 0);
+	CHECK(kv_set("answer", (uint8_t *) "forty two", 9) == 0);
+	CHECK(kv_get("answer", val, sizeof(val)) == 9);
+	CHECK(memcmp(val, "forty two", 9) == 0);
+	CHECK(kv_set("empty", NULL, 0) == 0);
+	CHECK(kv_get("empty", val, sizeof(val)) == 0);
+	CHECK(kv_delete("name") == 0);
+	CHECK(kv_delete("name") == -1);
+	memset(big, 'x', sizeof(big) - 1);
+	big[sizeof(big) - 1] = 0;
+	CHECK(kv_set(big, val, 1) == -1);
+	CHECK(kv_set("toobig", val, KV_MAX_VALUE + 1) == -1);
+
+	/* and after a reset */
+	CHECK(mount(1) == 2);
+	CHECK(kv_get("answer", val, sizeof(val)) == 9);
+	CHECK(memcmp(val, "forty two", 9) == 0);
+	CHECK(kv_get("name", val, sizeof(val)) == -1);
+	CHECK(kv_get("empty", val, sizeof(val)) == 0);
+	/* a short buffer gets the start of the value and the real length */
+	CHECK(kv_get("answer", val, 5) == 9);
+	CHECK(memcmp(val, "forty", 5) == 0);
+}
+
+static void
+test_replay(void)
+{
+	char key[16];
+	int i, k;
+
+	printf("replay\n");
+	model_reset();
+	nor_close();
+	remove(FLASH_FILE);
+	CHECK(mount(1) == 0);
+	for (i = 1; i <= 20000; i++) {
+		k = test_rand() % NKEYS;
+		if ((test_rand() % 8) == 0) {
+			key_name(k, key);
+			CHECK(kv_delete(key) == (model[k].present ? 0 : -1));
+			model[k].present = 0;
+		} else {
+			CHECK(do_set(k) == 0);
+		}
+		kv_service();
+		if ((i % 500) == 0) {
+			mount(i % 1000 == 0);
+			CHECK(model_check(-1) == 0);
+		}
+	}
+}
+
+static void
+test_torn(void)
+{
+	struct kv_stats st;
+	struct nor_stats ns;
+	char key[16];
+	uint8_t val[KV_MAX_VALUE];
+	int trial, op, k, len, was_present, was_len, is_new, is_old;
+	uint8_t was_val[KV_MAX_VALUE];
+	uint32_t min_erase;
+	int torn_records = 0;
+
+	printf("torn\n");
+	model_reset();
+	nor_close();
+	remove(FLASH_FILE);
+	mount(1);
+	nor_get_stats(&ns, 1);
+	for (trial = 0; trial < 3000; trial++) {
+		kv_get_stats(&st);
+		min_erase = st.min_erase;
+		nor_power_cut(test_rand() % 12000);
+		k = -1;
+		was_present = was_len = 0;
+		for (op = 0; (op < 500) && ! nor_power_lost(); op++) {
+			k = test_rand() % NKEYS;
+			was_present = model[k].present;
+			was_len = model[k].len;
+			memcpy(was_val, model[k].val, was_len);
+			if ((test_rand() % 8) == 0) {
+				key_name(k, key);
+				(void) kv_delete(key);
+				model[k].present = 0;
+			} else {
+				(void) do_set(k);
+			}
+			kv_service();
+		}
+		nor_power_on();
+		mount(trial & 1);
+
+		/* the key we were working on can be either way */
+		if (k >= 0) {
+			key_name(k, key);
+			len = kv_get(key, val, sizeof(val));
+			is_new = (model[k].present) ? ((len == model[k].len) &&
+							(memcmp(val, model[k].val, len) == 0)) : (len < 0);
+			is_old = (was_present) ? ((len == was_len) &&
+							(memcmp(val, was_val, len) == 0)) : (len < 0);
+			if (! is_new && is_old) {
+				model[k].present = was_present;
+				model[k].len = was_len;
+				memcpy(model[k].val, was_val, was_len);
+				torn_records++;
+			} else if (! is_new) {
+				printf("  trial %d: %s has neither its old nor new value\n",
+																trial, key);
+				test_failures++;
+			}
+		}
+		if (model_check(k) != 0) {
+			printf("  trial %d: store doesn't match after power loss\n", trial);
+			test_failures++;
+			break;
+		}
+		kv_get_stats(&st);
+		if (st.min_erase < min_erase) {
+			printf("  trial %d: least erase count went from %u to %u\n", trial,
+							(unsigned int) min_erase, (unsigned int) st.min_erase);
+			test_failures++;
+		}
+	}
+	nor_get_stats(&ns, 0);
+	CHECK(ns.bad_bits == 0);
+	printf("  %d power failures, %d lost the write in progress, %u erases\n",
+						trial, torn_records, (unsigned int) ns.erases);
+}
+
+static void
+test_compaction(void)
+{
+	struct kv_stats st;
+	int i;
+
+	printf("compaction\n");
+	model_reset();
+	nor_close();
+	remove(FLASH_FILE);
+	mount(1);
+	/* cold keys, written once */
+	for (i = 8; i < NKEYS; i++) {
+		CHECK(do_set(i) == 0);
+	}
+	for (i = 0; i < 100000; i++) {
+		if (do_set(i & 7) != 0) {
+			printf("  kv_set failed after %d writes\n", i);
+			test_failures++;
+			break;
+		}
+		kv_service();
+	}
+	kv_get_stats(&st);
+	CHECK(model_check(-1) == 0);
+	CHECK(st.compactions > 0);
+	CHECK(st.free_sectors >= 2);
+	/* wear leveling moves the cold data so everything gets erased */
+	CHECK(st.min_erase > 0);
+	CHECK(st.max_erase - st.min_erase <= 40);
+	printf("  %u compactions, erase counts %u - %u\n",
+		(unsigned int) st.compactions, (unsigned int) st.min_erase,
+		(unsigned int) st.max_erase);
+	CHECK(mount(1) == NKEYS);
+	CHECK(model_check(-1) == 0);
+}
+
+int
+main(int argc, char *argv[])
+{
+	test_srand((argc > 1) ? strtoul(argv[1], NULL, 0) : 1);
+	remove(FLASH_FILE);
+	if (nor_open(FLASH_FILE, NOR_SIZE) != 0) {
+		return 1;
+	}
+	test_basic();
+	test_replay();
+	test_torn();
+	test_compaction();
+	nor_close();
+	remove(FLASH_FILE);
+	printf("kv_test: %s (%d failures)\n", (test_failures) ? "FAIL" : "PASS",
+														test_failures);
+	return (test_failures != 0);
+}
@@ -0,0 +1,263 @@
+/*
+ * nor_sim.c - a file that behaves like the QSPI NOR FLASH
+ *
+ * Copyright (c) 2016, Chuck McManis (cmcmanis@mcmanis.com)
+ *
+ * This is the qspi_*() API from qspi.c with a file standing in for
+ * the N25Q128 so that code which keeps things in the FLASH (like
+ * kvstore.c) can be run and beaten on from a PC. It acts like NOR
+ * does:
+ *
+ *	- programming can only change bits from 1 to 0, the new byte is
+ *	  the old byte AND what you wrote. Trying to turn a 0 back into
+ *	  a 1 is counted (nor_stats.bad_bits) because it is always a bug.
+ *	- erase works in 4K sub-sectors and sets them to 0xff.
+ *
+ * It also knows how to lose power. nor_power_cut(n) lets 'n' more
+ * bytes be programmed (or erased, a sub-sector erase is 4096 of them)
+ * and then everything stops part way through, like pulling the plug.
+ * After that writes and erases do nothing until nor_power_on(), which
+ * is when you would mount the store again and see what survived.
+ *
+ * The file is mapped into memory so what is in the "FLASH" is still
+ * there after nor_close() and nor_open() again.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "../util.h"
+#include "host.h"
+
+#define SUB_SECTOR_SIZE		4096
+
+static uint8_t *nor_mem;
+static uint32_t nor_size;
+static int nor_fd = -1;
+static long nor_budget = -1;		/* bytes until the power goes, -1 never */
+static int nor_dead;
+static uint32_t *nor_erases;		/* per sub-sector */
+static struct nor_stats nor_stat;
+
+static int nor_spend(void);
+
+/*
+ * Use up one byte of the power budget, returns 0 if the power just
+ * went (or was already gone).
+ */
+static int
+nor_spend(void)
+{
+	if (nor_dead) {
+		return 0;
+	}
+	if (nor_budget == 0) {
+		nor_dead = 1;
+		return 0;
+	}
+	if (nor_budget > 0) {
+		nor_budget--;
+	}
+	return 1;
+}
+
+/*
+ * nor_open( ... )
+ *
+ * Use 'path' as a FLASH chip of 'size' bytes. If the file is new (or
+ * the wrong size) it is made that size and erased. Returns 0 or -1.
+ */
+int
+nor_open(const char *path, uint32_t size)
+{
+	struct stat st;
+	int fresh;
+
+	nor_close();
+	nor_fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (nor_fd < 0) {
+		perror(path);
+		return -1;
+	}
+	fresh = (fstat(nor_fd, &st) != 0) || (st.st_size != (off_t) size);
+	if (fresh && (ftruncate(nor_fd, size) != 0)) {
+		perror(path);
+		close(nor_fd);
+		nor_fd = -1;
+		return -1;
+	}
+	nor_mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, nor_fd, 0);
+	if (nor_mem == MAP_FAILED) {
+		perror(path);
+		close(nor_fd);
+		nor_fd = -1;
+		nor_mem = NULL;
+		return -1;
+	}
+	nor_size = size;
+	if (fresh) {
+		memset(nor_mem, 0xff, size);
+	}
+	nor_erases = calloc(size / SUB_SECTOR_SIZE, sizeof(uint32_t));
+	nor_budget = -1;
+	nor_dead = 0;
+	return 0;
+}
+
+void
+nor_close(void)
+{
+	if (nor_mem != NULL) {
+		munmap(nor_mem, nor_size);
+		nor_mem = NULL;
+	}
+	if (nor_fd >= 0) {
+		close(nor_fd);
+		nor_fd = -1;
+	}
+	free(nor_erases);
+	nor_erases = NULL;
+}
+
+/*
+ * nor_power_cut( ... )
+ *
+ * Let 'bytes' more bytes be programmed or erased and then lose
+ * power. -1 puts things back to normal.
+ */
+void
+nor_power_cut(long bytes)
+{
+	nor_budget = bytes;
+}
+
+/*
+ * True if the power went out.
+ */
+int
+nor_power_lost(void)
+{
+	return nor_dead;
+}
+
+void
+nor_power_on(void)
+{
+	nor_budget = -1;
+	nor_dead = 0;
+}
+
+/*
+ * How many times the sub-sector holding 'addr' has really been
+ * erased (since nor_open()).
+ */
+uint32_t
+nor_erase_count(uint32_t addr)
+{
+	return (addr < nor_size) ? nor_erases[addr / SUB_SECTOR_SIZE] : 0;
+}
+
+void
+nor_get_stats(struct nor_stats *st, int reset)
+{
+	*st = nor_stat;
+	if (reset) {
+		memset(&nor_stat, 0, sizeof(nor_stat));
+	}
+}
+
+/*
+ * The qspi.c API
+ */
+int
+qspi_read_flash(uint32_t addr, uint8_t *buf, int len)
+{
+	if ((len <= 0) || (addr >= nor_size) || ((uint32_t) len > nor_size - addr)) {
+		return 1;
+	}
+	memcpy(buf, nor_mem + addr, len);
+	nor_stat.read_bytes += len;
+	return 0;
+}
+
+int
+qspi_write_flash(uint32_t addr, uint8_t *buf, int len)
+{
+	uint8_t *p;
+	int i;
+
+	if ((len <= 0) || (addr >= nor_size) || ((uint32_t) len > nor_size - addr)) {
+		return 1;
+	}
+	p = nor_mem + addr;
+	for (i = 0; i < len; i++) {
+		if (! nor_spend()) {
+			return 1;
+		}
+		if (buf[i] & ~p[i]) {
+			nor_stat.bad_bits++;
+		}
+		p[i] &= buf[i];
+		nor_stat.program_bytes++;
+	}
+	return 0;
+}
+
+int
+qspi_write_flash_async(uint32_t addr, uint8_t *buf, int len)
+{
+	return qspi_write_flash(addr, buf, len);
+}
+
+/*
+ * Erases happen right away, the store still goes through the motions
+ * of waiting for them. An erase the power cuts off part way leaves the
+ * start of the sub-sector erased and the rest the way it was.
+ */
+int
+qspi_erase_range(uint32_t addr, uint32_t len)
+{
+	uint32_t a, end;
+	int i;
+
+	if ((len == 0) || (addr >= nor_size)) {
+		return 1;
+	}
+	end = addr + len;
+	if (end > nor_size) {
+		end = nor_size;
+	}
+	for (a = addr & ~(SUB_SECTOR_SIZE - 1); a < end; a += SUB_SECTOR_SIZE) {
+		for (i = 0; i < SUB_SECTOR_SIZE; i++) {
+			if (! nor_spend()) {
+				return 0;
+			}
+			nor_mem[a + i] = 0xff;
+		}
+		nor_erases[a / SUB_SECTOR_SIZE]++;
+		nor_stat.erases++;
+	}
+	return 0;
+}
+
+void
+qspi_erase_block(uint32_t block)
+{
+	(void) qspi_erase_range((block << 12) & 0xffffff, SUB_SECTOR_SIZE);
+}
+
+int
+qspi_busy(void)
+{
+	return 0;
+}
+
+int
+qspi_wait(void)
+{
+	return 0;
+}
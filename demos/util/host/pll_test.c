@@ -0,0 +1,106 @@
+/*
+ * pll_test.c - what pll_solve() picks for the clocks the demos use
+ *
+ * Copyright (c) 2016, Chuck McManis (cmcmanis@mcmanis.com)
+ *
+ * Checks that:
+ *	- 168 MHz from the 8 MHz HSE is the classic M=4 N=168 P=2 Q=7,
+ *	  with 48 MHz exact and the 384 MHz PLLSAI VCO the LCD wants
+ *	- 180 MHz with over-drive is exact (and without it is refused)
+ *	- 180 MHz can't make 48 MHz, so PLL_NEED_USB fails it
+ *	- the HSI (input 0) works for both, with the VCO input at 2 MHz
+ *	- every solution is inside the limits in RM0386
+ *
+ * Usage: pll_test [-v]
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "../util.h"
+#include "host.h"
+
+static int verbose;
+
+static int solve(uint32_t input, uint32_t sysclk, uint32_t sai_vco, int flags,
+														struct pll_solution *sol);
+
+/*
+ * Run the solver and check whatever it comes up with is legal.
+ */
+static int
+solve(uint32_t input, uint32_t sysclk, uint32_t sai_vco, int flags,
+													struct pll_solution *sol)
+{
+	struct pll_request req;
+	int res;
+
+	memset(&req, 0, sizeof(req));
+	memset(sol, 0, sizeof(*sol));
+	req.input = input;
+	req.sysclk = sysclk;
+	req.sai_vco = sai_vco;
+	req.flags = flags;
+	res = pll_solve(&req, sol);
+	if (res != 0) {
+		return res;
+	}
+	if (verbose) {
+		pll_print(sol);
+	}
+	CHECK((sol->p.pllm >= 2) && (sol->p.pllm <= 63));
+	CHECK((sol->p.plln >= 50) && (sol->p.plln <= 432));
+	CHECK((sol->p.pllq >= 2) && (sol->p.pllq <= 15));
+	CHECK((sol->p.pllr >= 2) && (sol->p.pllr <= 7));
+	CHECK((sol->p.pllp == 2) || (sol->p.pllp == 4) || (sol->p.pllp == 6) ||
+												(sol->p.pllp == 8));
+	CHECK(sol->p.pllp == 2 * (sol->p.pllp_real + 1));
+	CHECK((sol->vco_in >= 1000000) && (sol->vco_in <= 2000000));
+	CHECK((sol->vco >= 100000000) && (sol->vco <= 432000000));
+	CHECK(sol->sysclk <= ((flags & PLL_OVERDRIVE) ? PLL_SYSCLK_MAX_OD :
+													PLL_SYSCLK_MAX));
+	CHECK(sol->p.src == (input != 0));
+	return res;
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct pll_solution sol;
+
+	verbose = (argc > 1) && (strcmp(argv[1], "-v") == 0);
+
+	/* what clock_setup() asks for on the DISCO board */
+	CHECK(solve(8000000, 168000000, 384000000, 0, &sol) == 0);
+	CHECK((sol.p.pllm == 4) && (sol.p.plln == 168) && (sol.p.pllp == 2) &&
+												(sol.p.pllq == 7));
+	CHECK(sol.sysclk == 168000000);
+	CHECK(sol.usb == 48000000);
+	CHECK(sol.sai_vco == 384000000);
+
+	/* over-drive */
+	CHECK(solve(8000000, 180000000, 0, PLL_OVERDRIVE, &sol) == 0);
+	CHECK(sol.sysclk == 180000000);
+	CHECK(solve(8000000, 180000000, 0, 0, &sol) == -1);
+	/* 360 MHz VCO can't be divided down to 48 MHz */
+	CHECK(solve(8000000, 180000000, 0, PLL_OVERDRIVE | PLL_NEED_USB, &sol) == -1);
+	CHECK(solve(8000000, 168000000, 0, PLL_NEED_USB, &sol) == 0);
+
+	/* the HSI, 16 MHz */
+	CHECK(solve(0, 168000000, 384000000, PLL_NEED_USB, &sol) == 0);
+	CHECK((sol.p.pllm == 8) && (sol.p.plln == 168) && (sol.p.pllp == 2) &&
+												(sol.p.pllq == 7));
+	CHECK((sol.vco_in == 2000000) && (sol.sysclk == 168000000));
+	CHECK((sol.usb == 48000000) && (sol.sai_vco == 384000000));
+	CHECK(solve(0, 180000000, 0, PLL_OVERDRIVE, &sol) == 0);
+	CHECK(sol.sysclk == 180000000);
+	CHECK(solve(0, 48000000, 0, PLL_NEED_USB, &sol) == 0);
+	CHECK((sol.sysclk == 48000000) && (sol.usb == 48000000));
+
+	/* nonsense */
+	CHECK(solve(8000000, 0, 0, 0, &sol) == -1);
+	CHECK(solve(8000000, 200000000, 0, PLL_OVERDRIVE, &sol) == -1);
+
+	printf("pll_test: %s (%d failures)\n", (test_failures) ? "FAIL" : "PASS",
+															test_failures);
+	return (test_failures != 0);
+}
@@ -0,0 +1,312 @@
+/*
+ * region_bench.c - arenas and pools against TLSF and malloc
+ *
+ * Copyright (c) 2016, Chuck McManis (cmcmanis@mcmanis.com)
+ *
+ * Allocates and frees sample buffers (1K - 32K, like the mems demo's
+ * signal buffers) in a few different orders from each allocator and
+ * prints how long the calls took (nanoseconds, from profile.c built
+ * with PROFILE_HOST, the average and what 99.9% of them were faster
+ * than) and how much memory it needed to do it:
+ *
+ *	Peak live	- most bytes in buffers at any one time
+ *	High water	- most of the allocator's memory in use. For an
+ *			  arena how far it got, for a pool the objects in use
+ *			  times the object size, for TLSF how far into its
+ *			  heap the highest block went. Not measured for
+ *			  malloc.
+ *	Frag		- High water / Peak live
+ *	Fails		- allocations that didn't fit
+ *
+ * The orders:
+ *	lifo		- a few buffers allocated, then freed newest first
+ *	mostly		- the same but one free in ten is some other buffer
+ *	random		- up to 16 buffers, a random one is freed
+ *	fifo		- up to 16 buffers, the oldest is freed
+ *
+ * The arena is reset whenever every buffer has been freed, the way
+ * signal.c does it. The pool's objects are all 32K, the biggest
+ * buffer.
+ *
+ * Usage: region_bench [rounds]
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../util.h"
+#include "host.h"
+
+#define SDRAM_SIZE		(64 * 1024 * 1024)
+#define ARENA_SIZE		(4 * 1024 * 1024)
+#define HEAP_SIZE		(4 * 1024 * 1024)
+#define BUF_MIN			1024
+#define BUF_MAX			(32 * 1024)
+#define MAX_LIVE		16
+#define POOL_COUNT		64
+
+#define A_ARENA		0
+#define A_POOL		1
+#define A_TLSF		2
+#define A_MALLOC	3
+#define A_COUNT		4
+
+#define P_LIFO		0
+#define P_MOSTLY	1
+#define P_RANDOM	2
+#define P_FIFO		3
+#define P_COUNT		4
+
+static const char *alloc_names[A_COUNT] = { "arena", "pool", "tlsf", "malloc" };
+static const char *pattern_names[P_COUNT] = { "lifo", "mostly", "random", "fifo" };
+
+struct buf {
+	void		*p;
+	uint32_t	size;
+};
+
+static uint8_t *sdram;
+static struct arena arena;
+static struct pool pool;
+static tlsf_t *heap;
+static uint8_t *heap_mem;
+
+static struct buf live[MAX_LIVE];
+static int nlive;
+static uint32_t live_bytes, peak_live, high_water, fails, count;
+static int t_alloc, t_free;
+
+static void *do_alloc(int which, uint32_t size);
+static void do_free(int which, struct buf *b);
+static void drop(int which, int i);
+static uint32_t slowest(const struct prof_timer *t);
+static void run(int which, int pattern, int rounds);
+
+/*
+ * The host has no CCM or SDRAM, give region.c some memory to use
+ * instead.
+ */
+void
+local_region_setup(int r, uint8_t **start, uint8_t **end)
+{
+	if (r == REGION_SDRAM) {
+		if (sdram == NULL) {
+			/* touched now so page faults aren't counted */
+			sdram = malloc(SDRAM_SIZE);
+			memset(sdram, 0, SDRAM_SIZE);
+		}
+		*start = sdram;
+		*end = sdram + SDRAM_SIZE;
+	} else {
+		*start = NULL;
+		*end = NULL;
+	}
+}
+
+static void *
+do_alloc(int which, uint32_t size)
+{
+	uint32_t start = prof_start();
+	void *p = NULL;
+
+	switch (which) {
+	case A_ARENA:
+		p = arena_alloc(&arena, size, 8);
+		break;
+	case A_POOL:
+		p = pool_alloc(&pool);
+		break;
+	case A_TLSF:
+		p = tlsf_malloc(heap, size);
+		break;
+	default:
+		p = malloc(size);
+		break;
+	}
+	prof_stop(t_alloc, start);
+	return p;
+}
+
+static void
+do_free(int which, struct buf *b)
+{
+	uint32_t start = prof_start();
+
+	switch (which) {
+	case A_ARENA:
+		arena_free(&arena, b->p);
+		break;
+	case A_POOL:
+		pool_free(&pool, b->p);
+		break;
+	case A_TLSF:
+		tlsf_free(heap, b->p);
+		break;
+	default:
+		free(b->p);
+		break;
+	}
+	prof_stop(t_free, start);
+}
+
+/*
+ * Free live buffer 'i' and close up the list
+ */
+static void
+drop(int which, int i)
+{
+	do_free(which, &live[i]);
+	live_bytes -= live[i].size;
+	memmove(&live[i], &live[i + 1], (nlive - i - 1) * sizeof(struct buf));
+	nlive--;
+	if ((nlive == 0) && (which == A_ARENA)) {
+		arena_reset(&arena);
+	}
+}
+
+/*
+ * The time that 999 in 1000 calls beat (to the histogram's power of
+ * 2), the maximum on a PC is mostly how long the scheduler took.
+ */
+static uint32_t
+slowest(const struct prof_timer *t)
+{
+	uint32_t n = 0;
+	int b;
+
+	for (b = 0; b < PROF_HIST_BUCKETS - 1; b++) {
+		n += t->hist[b];
+		if (n >= t->count - t->count / 1000) {
+			break;
+		}
+	}
+	return 1u << (b + PROF_HIST_SHIFT + 1);
+}
+
+static void
+run(int which, int pattern, int rounds)
+{
+	const struct prof_timer *ta, *tf;
+	uint32_t size, hw;
+	uint8_t *end;
+	void *p;
+	int i, n;
+
+	t_alloc = prof_timer((which == A_ARENA) ? "arena alloc" :
+		(which == A_POOL) ? "pool alloc" :
+		(which == A_TLSF) ? "tlsf alloc" : "malloc alloc");
+	t_free = prof_timer((which == A_ARENA) ? "arena free" :
+		(which == A_POOL) ? "pool free" :
+		(which == A_TLSF) ? "tlsf free" : "malloc free");
+	nlive = 0;
+	live_bytes = peak_live = high_water = fails = count = 0;
+	arena_reset(&arena);
+	arena.high = 0;
+	pool.high = 0;
+	heap = tlsf_create(heap_mem, HEAP_SIZE);
+	test_srand(1);
+
+	while (count < (uint32_t) rounds) {
+		/* how many to allocate before freeing some */
+		n = 1 + test_rand() % ((pattern <= P_MOSTLY) ? 6 : MAX_LIVE);
+		for (i = 0; (i < n) && (nlive < MAX_LIVE); i++) {
+			size = BUF_MIN + test_rand() % (BUF_MAX - BUF_MIN + 1);
+			p = do_alloc(which, size);
+			count++;
+			if (p == NULL) {
+				fails++;
+				continue;
+			}
+			memset(p, 0, 64);
+			live[nlive].p = p;
+			live[nlive].size = size;
+			nlive++;
+			live_bytes += size;
+			if (live_bytes > peak_live) {
+				peak_live = live_bytes;
+			}
+			if (which == A_TLSF) {
+				end = (uint8_t *) p + tlsf_usable_size(p);
+				if ((uint32_t)(end - heap_mem) > high_water) {
+					high_water = end - heap_mem;
+				}
+			}
+		}
+		/* and free some */
+		n = (pattern <= P_MOSTLY) ? nlive : (int)(test_rand() % (nlive + 1));
+		while (n-- > 0) {
+			switch (pattern) {
+			case P_LIFO:
+				drop(which, nlive - 1);
+				break;
+			case P_MOSTLY:
+				drop(which, ((test_rand() % 10) == 0) ?
+						(int)(test_rand() % nlive) : nlive - 1);
+				break;
+			case P_RANDOM:
+				drop(which, test_rand() % nlive);
+				break;
+			default:
+				drop(which, 0);
+				break;
+			}
+		}
+	}
+	while (nlive > 0) {
+		drop(which, nlive - 1);
+	}
+
+	switch (which) {
+	case A_ARENA:
+		hw = arena.high;
+		break;
+	case A_POOL:
+		hw = pool.high * pool.size;
+		break;
+	case A_TLSF:
+		hw = high_water;
+		break;
+	default:
+		hw = 0;
+		break;
+	}
+	ta = prof_get(t_alloc);
+	tf = prof_get(t_free);
+	printf("%-8s %-8s %10u %10u ", pattern_names[pattern], alloc_names[which],
+								(unsigned int) peak_live, (unsigned int) hw);
+	if (hw) {
+		printf("%5.2f ", (double) hw / peak_live);
+	} else {
+		printf("%5s ", "-");
+	}
+	printf("%6u %7u %7u %7u %7u\n", (unsigned int) fails,
+		(unsigned int)(ta->total / ta->count), (unsigned int) slowest(ta),
+		(unsigned int)(tf->total / tf->count), (unsigned int) slowest(tf));
+}
+
+int
+main(int argc, char *argv[])
+{
+	int rounds = (argc > 1) ? atoi(argv[1]) : 200000;
+	int a, pat;
+
+	if ((arena_init(&arena, REGION_SDRAM, ARENA_SIZE) != 0) ||
+		(pool_init(&pool, REGION_SDRAM, BUF_MAX, POOL_COUNT) != 0)) {
+		printf("No room for the arena and pool\n");
+		return 1;
+	}
+	heap_mem = region_alloc(REGION_SDRAM, HEAP_SIZE, 8);
+	printf("%d buffers of %d - %d bytes, times in nS\n\n", rounds, BUF_MIN,
+																BUF_MAX);
+	printf("%-8s %-8s %10s %10s %5s %6s %7s %7s %7s %7s\n", "Order",
+		"Alloc", "Peak live", "High water", "Frag", "Fails", "Alloc",
+		"99.9%", "Free", "99.9%");
+	for (pat = 0; pat < P_COUNT; pat++) {
+		prof_reset();
+		for (a = 0; a < A_COUNT; a++) {
+			run(a, pat, rounds);
+		}
+		printf("\n");
+	}
+	return 0;
+}
@@ -0,0 +1,2 @@
+/* host stand-in, see stm32_sim.h */
+#include "stm32_sim.h"
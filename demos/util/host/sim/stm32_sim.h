@@ -0,0 +1,171 @@
+/*
+ * stm32_sim.h - just enough of libopencm3 for console.c and timebase.c
+ *
+ * Copyright (c) 2016, Chuck McManis (cmcmanis@mcmanis.com)
+ *
+ * The libopencm3 headers under sim/ all include this. The registers
+ * console.c touches are fields in uart_sim (uart_sim.c), the ones
+ * timebase.c touches are in tim_sim (tim_sim.c), and the core bits
+ * (interrupt masking, the NVIC, the RCC) are in core_sim.c. Most of
+ * the functions do nothing.
+ *
+ * Reading USART_SR or USART_DR goes through a function so the
+ * simulation sees the "read SR then DR" that clears the error flags
+ * and picks up characters written to DR. TIM_SR and TIM_EGR do too,
+ * so writing a 0 to a status bit clears it (and a 1 doesn't set it)
+ * and an event generated with EGR happens.
+ */
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+
+/* usleep_wfi() has a WFI in it, on the host it assembles to nothing */
+__asm__(".macro wfi\n.endm\n");
+
+struct uart_sim_regs {
+	uint32_t	sr;
+	uint32_t	dr;
+	uint32_t	cr1;
+	uint32_t	cr3;
+};
+
+extern struct uart_sim_regs uart_sim;
+volatile uint32_t *uart_sim_sr(void);
+volatile uint32_t *uart_sim_dr(void);
+
+struct tim_sim_regs {
+	uint32_t	cr1;
+	uint32_t	dier;
+	uint32_t	sr;			/* what the code last saw or wrote */
+	uint32_t	egr;
+	uint32_t	cnt;
+	uint32_t	psc;
+	uint32_t	arr;
+	uint32_t	ccr1;
+};
+
+extern struct tim_sim_regs tim_sim;
+volatile uint32_t *tim_sim_sr(void);
+volatile uint32_t *tim_sim_egr(void);
+
+/* the one USART and DMA stream there is */
+#define USART3					0x40004800
+#define DMA1					0x40026000
+#define DMA_STREAM1				1
+
+#define USART_SR(u)				(*uart_sim_sr())
+#define USART_DR(u)				(*uart_sim_dr())
+#define USART_CR1(u)			(uart_sim.cr1)
+#define USART_CR3(u)			(uart_sim.cr3)
+
+#define TIM2					0x40000000
+#define TIM_CR1(t)				(tim_sim.cr1)
+#define TIM_DIER(t)				(tim_sim.dier)
+#define TIM_SR(t)				(*tim_sim_sr())
+#define TIM_EGR(t)				(*tim_sim_egr())
+#define TIM_CNT(t)				(tim_sim.cnt)
+#define TIM_PSC(t)				(tim_sim.psc)
+#define TIM_ARR(t)				(tim_sim.arr)
+#define TIM_CCR1(t)				(tim_sim.ccr1)
+
+#define TIM_CR1_CEN				(1 << 0)
+#define TIM_DIER_UIE			(1 << 0)
+#define TIM_DIER_CC1IE			(1 << 1)
+#define TIM_SR_UIF				(1 << 0)
+#define TIM_SR_CC1IF			(1 << 1)
+#define TIM_EGR_UG				(1 << 0)
+#define TIM_EGR_CC1G			(1 << 1)
+
+extern uint32_t rcc_apb1_frequency, rcc_ahb_frequency;
+extern uint32_t sim_rcc_cfgr, sim_rcc_dckcfgr;
+#define RCC_CFGR				sim_rcc_cfgr
+#define RCC_DCKCFGR				sim_rcc_dckcfgr
+#define RCC_CFGR_PPRE1_SHIFT	10
+#define RCC_DCKCFGR_TIMPRE		(1 << 24)
+
+/* the active interrupt number, 0 is thread mode */
+extern uint32_t sim_scb_icsr;
+#define SCB_ICSR				sim_scb_icsr
+
+#define USART_SR_TXE			(1 << 7)
+#define USART_SR_TC				(1 << 6)
+#define USART_SR_IDLE			(1 << 4)
+#define USART_SR_ORE			(1 << 3)
+#define USART_SR_NE				(1 << 2)
+#define USART_SR_FE				(1 << 1)
+#define USART_CR1_TXEIE			(1 << 7)
+#define USART_CR1_IDLEIE		(1 << 4)
+#define USART_CR3_DMAR			(1 << 6)
+#define USART_CR3_EIE			(1 << 0)
+
+#define USART_STOPBITS_1		0
+#define USART_MODE_TX_RX		0
+#define USART_PARITY_NONE		0
+#define USART_FLOWCONTROL_NONE	0
+
+#define DMA_HTIF				(1 << 4)
+#define DMA_TCIF				(1 << 5)
+#define DMA_SxCR_CHSEL_4		(4 << 25)
+#define DMA_SxCR_PL_HIGH		(2 << 16)
+#define DMA_SxCR_DIR_PERIPHERAL_TO_MEM	0
+#define DMA_SxCR_MSIZE_8BIT		0
+#define DMA_SxCR_PSIZE_8BIT		0
+
+#define RCC_GPIOB				1
+#define RCC_USART3				2
+#define RCC_DMA1				3
+#define RCC_TIM2				4
+#define RST_TIM2				4
+#define GPIOB					0x40020400
+#define GPIO_MODE_AF			2
+#define GPIO_PUPD_NONE			0
+#define GPIO10					(1 << 10)
+#define GPIO11					(1 << 11)
+#define GPIO_AF7				7
+#define NVIC_USART3_IRQ			39
+#define NVIC_DMA1_STREAM1_IRQ	12
+#define NVIC_TIM2_IRQ			28
+
+void rcc_periph_clock_enable(uint32_t clken);
+void rcc_periph_reset_pulse(uint32_t rst);
+void gpio_mode_setup(uint32_t port, uint8_t mode, uint8_t pull, uint16_t pins);
+void gpio_set_af(uint32_t port, uint8_t af, uint16_t pins);
+void nvic_enable_irq(uint8_t irqn);
+/* not libopencm3, true if nvic_enable_irq() was called for it */
+bool sim_irq_enabled(uint8_t irqn);
+void scb_reset_system(void);
+uint32_t cm_mask_interrupts(uint32_t mask);
+bool cm_is_masked_interrupts(void);
+
+void usart_set_baudrate(uint32_t usart, uint32_t baud);
+void usart_set_databits(uint32_t usart, uint32_t bits);
+void usart_set_stopbits(uint32_t usart, uint32_t stopbits);
+void usart_set_mode(uint32_t usart, uint32_t mode);
+void usart_set_parity(uint32_t usart, uint32_t parity);
+void usart_set_flow_control(uint32_t usart, uint32_t flowcontrol);
+void usart_enable(uint32_t usart);
+void usart_enable_rx_dma(uint32_t usart);
+void usart_enable_tx_interrupt(uint32_t usart);
+void usart_disable_tx_interrupt(uint32_t usart);
+
+void dma_stream_reset(uint32_t dma, uint8_t stream);
+void dma_channel_select(uint32_t dma, uint8_t stream, uint32_t channel);
+void dma_set_priority(uint32_t dma, uint8_t stream, uint32_t prio);
+void dma_set_transfer_mode(uint32_t dma, uint8_t stream, uint32_t direction);
+void dma_set_memory_size(uint32_t dma, uint8_t stream, uint32_t mem_size);
+void dma_set_peripheral_size(uint32_t dma, uint8_t stream, uint32_t peripheral_size);
+void dma_enable_memory_increment_mode(uint32_t dma, uint8_t stream);
+void dma_enable_circular_mode(uint32_t dma, uint8_t stream);
+void dma_set_peripheral_address(uint32_t dma, uint8_t stream, uint32_t address);
+void dma_set_memory_address(uint32_t dma, uint8_t stream, uint32_t address);
+void dma_set_number_of_data(uint32_t dma, uint8_t stream, uint16_t number);
+uint16_t dma_get_number_of_data(uint32_t dma, uint8_t stream);
+void dma_enable_half_transfer_interrupt(uint32_t dma, uint8_t stream);
+void dma_enable_transfer_complete_interrupt(uint32_t dma, uint8_t stream);
+void dma_clear_interrupt_flags(uint32_t dma, uint8_t stream, uint32_t interrupts);
+void dma_enable_stream(uint32_t dma, uint8_t stream);
+
+/* the interrupt handlers, console.c and timebase.c have them */
+void usart3_isr(void);
+void dma1_stream1_isr(void);
+void tim2_isr(void);
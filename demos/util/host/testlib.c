@@ -0,0 +1,30 @@
+/*
+ * testlib.c - bits shared by the host tests
+ *
+ * Copyright (c) 2016, Chuck McManis (cmcmanis@mcmanis.com)
+ */
+#include <stdint.h>
+#include "host.h"
+
+int test_failures;
+
+static uint32_t test_seed = 1;
+
+/*
+ * xorshift32, the C library rand() is different on every host and
+ * a failure should happen the same way twice.
+ */
+uint32_t
+test_rand(void)
+{
+	test_seed ^= test_seed << 13;
+	test_seed ^= test_seed >> 17;
+	test_seed ^= test_seed << 5;
+	return test_seed;
+}
+
+void
+test_srand(uint32_t seed)
+{
+	test_seed = (seed) ? seed : 1;
+}
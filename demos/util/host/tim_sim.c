@@ -0,0 +1,202 @@
+/*
+ * tim_sim.c - TIM2, as timebase.c sees it
+ *
+ * Copyright (c) 2016, Chuck McManis (cmcmanis@mcmanis.com)
+ *
+ * timebase.c is built against the stand-in libopencm3 headers in sim/
+ * and this is the timer behind them. It counts one per microsecond
+ * (whatever the prescaler says, the test checks that separately) while
+ * CEN is set and:
+ *
+ *	- sets CC1IF when the count gets to CCR1
+ *	- sets UIF when it goes from ARR back to 0
+ *	- clears a status bit when a 0 is written to it, writing a 1
+ *	  leaves it alone (the "rc_w0" bits in RM0386)
+ *	- does what UG (count back to 0, UIF) and CC1G (CC1IF) say when
+ *	  they are written to EGR
+ *	- calls tim2_isr() when a flag is set that DIER lets through, the
+ *	  interrupt is enabled in the NVIC, and interrupts aren't masked
+ *
+ * Time only passes when the test calls tim_sim_run(), so it goes from
+ * one event to the next rather than a microsecond at a time and ten
+ * seconds of timers run in no time at all. tim_sim_spend() is time
+ * going by with nothing delivered, a callback calls it to be a slow
+ * interrupt handler.
+ *
+ * The code under test writes SR through a pointer, so the write isn't
+ * seen until the next time SR or EGR is looked at. tim_sim.sr is what
+ * the code has, 'sr_real' is the status register.
+ */
+#include <stdint.h>
+#include <string.h>
+#include "sim/stm32_sim.h"
+#include "host.h"
+
+#define STORM_LIMIT		1000	/* interrupts with no time passing */
+
+struct tim_sim_regs tim_sim = {
+	.arr = 0xffffffff,
+};
+
+static uint32_t sr_real;
+static uint32_t sr_seen;			/* what tim_sim.sr was set to */
+static struct tim_sim_stats sim_stat;
+
+static void sync_regs(void);
+static uint32_t step(uint32_t us);
+static void deliver(void);
+
+/*
+ * Fold in whatever the code wrote to SR and EGR since the last
+ * time, then hand it the status register again.
+ */
+static void
+sync_regs(void)
+{
+	if (tim_sim.sr != sr_seen) {
+		sr_real &= tim_sim.sr;
+	}
+	if (tim_sim.egr & TIM_EGR_UG) {
+		tim_sim.cnt = 0;
+		sr_real |= TIM_SR_UIF;
+	}
+	if (tim_sim.egr & TIM_EGR_CC1G) {
+		sr_real |= TIM_SR_CC1IF;
+	}
+	tim_sim.egr = 0;
+	tim_sim.sr = sr_seen = sr_real;
+}
+
+/*
+ * Count up to 'us' microseconds, stopping at the first compare match
+ * or wrap. Returns how far it got.
+ */
+static uint32_t
+step(uint32_t us)
+{
+	uint64_t to_wrap, to_cc, n = us;
+
+	sync_regs();
+	if (! (tim_sim.cr1 & TIM_CR1_CEN)) {
+		return us;
+	}
+	to_wrap = (uint64_t) tim_sim.arr - tim_sim.cnt + 1;
+	to_cc = (uint32_t)(tim_sim.ccr1 - tim_sim.cnt);
+	if (to_cc == 0) {
+		to_cc = 1ULL << 32;			/* just matched, next time around */
+	}
+	if (to_wrap < n) {
+		n = to_wrap;
+	}
+	if (to_cc < n) {
+		n = to_cc;
+	}
+	if (n == to_wrap) {
+		tim_sim.cnt = 0;
+		sr_real |= TIM_SR_UIF;
+	} else {
+		tim_sim.cnt += n;
+	}
+	if (n == to_cc) {
+		sr_real |= TIM_SR_CC1IF;
+	}
+	tim_sim.sr = sr_seen = sr_real;
+	return n;
+}
+
+/*
+ * Call the handler until it has cleared everything it asked to be
+ * interrupted for. If it doesn't, that's an interrupt storm on the
+ * real thing, count it and give up.
+ */
+static void
+deliver(void)
+{
+	int n = 0;
+
+	sync_regs();
+	while ((sr_real & tim_sim.dier & (TIM_SR_UIF | TIM_SR_CC1IF)) &&
+		sim_irq_enabled(NVIC_TIM2_IRQ) && ! cm_is_masked_interrupts()) {
+		if (++n > STORM_LIMIT) {
+			sim_stat.storms++;
+			return;
+		}
+		sim_stat.irqs++;
+		tim2_isr();
+		sync_regs();
+	}
+}
+
+volatile uint32_t *
+tim_sim_sr(void)
+{
+	sync_regs();
+	return &tim_sim.sr;
+}
+
+volatile uint32_t *
+tim_sim_egr(void)
+{
+	sync_regs();
+	return &tim_sim.egr;
+}
+
+/*
+ * tim_sim_run( ... )
+ *
+ * 'us' microseconds go by, with the interrupt handler called for
+ * everything that happens along the way.
+ */
+void
+tim_sim_run(uint32_t us)
+{
+	deliver();
+	while (us > 0) {
+		us -= step(us);
+		deliver();
+	}
+}
+
+/*
+ * tim_sim_spend( ... )
+ *
+ * 'us' microseconds go by without any interrupts, as if they were
+ * spent in a handler (or with interrupts off).
+ */
+void
+tim_sim_spend(uint32_t us)
+{
+	while (us > 0) {
+		us -= step(us);
+	}
+}
+
+/*
+ * Move the count somewhere else, to get near the wrap without
+ * waiting 71 minutes.
+ */
+void
+tim_sim_set_count(uint32_t cnt)
+{
+	sync_regs();
+	tim_sim.cnt = cnt;
+}
+
+void
+tim_sim_get_stats(struct tim_sim_stats *st)
+{
+	*st = sim_stat;
+}
+
+/*
+ * The libopencm3 function timebase.c calls that is about TIM2 (the
+ * others are in core_sim.c). TIM2 is the only thing reset.
+ */
+void
+rcc_periph_reset_pulse(uint32_t rst)
+{
+	(void) rst;
+	memset(&tim_sim, 0, sizeof(tim_sim));
+	tim_sim.arr = 0xffffffff;
+	sr_real = sr_seen = 0;
+}
@@ -0,0 +1,304 @@
+/*
+ * timebase_test.c - timebase.c's timer wheel
+ *
+ * Copyright (c) 2016, Chuck McManis (cmcmanis@mcmanis.com)
+ *
+ * Runs timebase.c against the simulated TIM2 in tim_sim.c. It checks
+ * that:
+ *	- timers fire in order, on the microsecond they are due, and one
+ *	  that is due now fires straight away
+ *	- a callback that starts itself again keeps exact time with an
+ *	  interrupt per call and nothing in between
+ *	- a timer more than a trip around the wheel (32mS) away fires on
+ *	  time, costing about an interrupt per trip
+ *	- timers either side of TIM2 wrapping fire on time and uclock64()
+ *	  carries on, even while the wrap interrupt is held off
+ *	- a callback can cancel other timers, in its own slot or not and
+ *	  even ones that are overdue, and cancelling itself does nothing
+ *	- a slow callback doesn't lose the timers that came due while it
+ *	  was running
+ *	- when the wheel is empty the compare interrupt is off
+ *
+ * Usage: timebase_test
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "../util.h"
+#include "sim/stm32_sim.h"
+#include "host.h"
+
+#define NTIMERS		8
+
+struct fired {
+	struct utimer	t;
+	uint32_t		due;		/* when it should go off */
+	uint32_t		at;			/* uclock() when it did */
+	int				count;
+	int				rearm;		/* times left to start itself again */
+	uint32_t		period;
+	uint32_t		spend;		/* microseconds to take doing it */
+	struct utimer	*cancel[2];	/* timers to cancel when it does */
+	int				cancelled[2];
+};
+
+static struct fired tm[NTIMERS];
+static int fire_order[NTIMERS * 4];
+static int fire_count;
+static int late;				/* periodic callback not on time */
+static uint64_t last64;
+static int went_back;			/* uclock64() went backwards */
+
+static void fired(void *arg);
+static void start(int n, uint32_t us);
+static uint32_t irqs(void);
+static void test_order(void);
+static void test_periodic(void);
+static void test_far(void);
+static void test_wrap(void);
+static void test_cancel(void);
+static void test_slow(void);
+
+/*
+ * What clock.c would have, timebase_init() asks for the time
+ * and then takes over.
+ */
+uint32_t
+mtime(void)
+{
+	return 0;
+}
+
+void
+clock_set_timebase(uint32_t (*now)(void), void (*sleep)(uint32_t))
+{
+	(void) now; (void) sleep;
+}
+
+static void
+fired(void *arg)
+{
+	struct fired *f = arg;
+	uint64_t now64 = uclock64();
+	int i;
+
+	f->at = uclock();
+	f->count++;
+	if (now64 < last64) {
+		went_back++;
+	}
+	last64 = now64;
+	if (fire_count < (int)(sizeof(fire_order) / sizeof(fire_order[0]))) {
+		fire_order[fire_count++] = f - tm;
+	}
+	if (f->spend) {
+		tim_sim_spend(f->spend);
+	}
+	for (i = 0; i < 2; i++) {
+		if (f->cancel[i]) {
+			f->cancelled[i] = utimer_cancel(f->cancel[i]);
+		}
+	}
+	if (f->rearm > 0) {
+		if (f->at != f->due) {
+			late++;
+		}
+		f->rearm--;
+		f->due += f->period;
+		utimer_start(&f->t, f->period, fired, f);
+	}
+}
+
+/*
+ * Start timer 'n' 'us' from now, with nothing else to do.
+ */
+static void
+start(int n, uint32_t us)
+{
+	memset(&tm[n], 0, sizeof(tm[n]));
+	tm[n].due = uclock() + us;
+	utimer_start(&tm[n].t, us, fired, &tm[n]);
+}
+
+static uint32_t
+irqs(void)
+{
+	struct tim_sim_stats st;
+
+	tim_sim_get_stats(&st);
+	CHECK(st.storms == 0);
+	return st.irqs;
+}
+
+static void
+test_order(void)
+{
+	uint32_t before = irqs();
+
+	fire_count = 0;
+	start(0, 5000);
+	start(1, 1200);
+	start(2, 1100);
+	start(3, 1200 + 1024 * 5);
+	start(4, 30000);
+	/* already due, the compare has gone by so it has to be made to happen */
+	start(5, 0);
+	tim_sim_run(40000);
+	CHECK(fire_count == 6);
+	CHECK((fire_order[0] == 5) && (fire_order[1] == 2) && (fire_order[2] == 1) &&
+			(fire_order[3] == 0) && (fire_order[4] == 3) && (fire_order[5] == 4));
+	CHECK((tm[0].at == tm[0].due) && (tm[1].at == tm[1].due) &&
+							(tm[2].at == tm[2].due) && (tm[3].at == tm[3].due) &&
+							(tm[4].at == tm[4].due) && (tm[5].at == tm[5].due));
+	CHECK(irqs() - before == 6);
+	CHECK((TIM_DIER(TIM2) & TIM_DIER_CC1IE) == 0);
+}
+
+static void
+test_periodic(void)
+{
+	uint32_t before = irqs();
+
+	late = 0;
+	start(0, 700);
+	tm[0].rearm = 99;
+	tm[0].period = 700;
+	tim_sim_run(100 * 700 + 5000);
+	CHECK(tm[0].count == 100);
+	CHECK(late == 0);
+	CHECK(tm[0].at == tm[0].due);
+	printf("100 periodic calls, %u interrupts\n", irqs() - before);
+	CHECK(irqs() - before == 100);
+	CHECK((TIM_DIER(TIM2) & TIM_DIER_CC1IE) == 0);
+}
+
+static void
+test_far(void)
+{
+	uint32_t before = irqs(), n;
+
+	start(0, 10000000);			/* 10 seconds */
+	start(1, 100000);
+	start(2, 1500);
+	tim_sim_run(9000000);
+	CHECK((tm[0].count == 0) && (tm[1].count == 1) && (tm[2].count == 1));
+	tim_sim_run(2000000);
+	CHECK((tm[0].count == 1) && (tm[0].at == tm[0].due));
+	CHECK((tm[1].at == tm[1].due) && (tm[2].at == tm[2].due));
+	n = irqs() - before;
+	printf("10 second timer, %u interrupts\n", n);
+	/* one a trip, plus the two short ones */
+	CHECK(n <= 10000000 / 32768 + 4);
+	CHECK((TIM_DIER(TIM2) & TIM_DIER_CC1IE) == 0);
+}
+
+static void
+test_wrap(void)
+{
+	uint32_t start_cnt = 0xffffffff - 5000;
+	uint64_t t64;
+	int i;
+
+	/* start again, just before the counter wraps */
+	timebase_init();
+	CHECK(TIM_PSC(TIM2) == 84 - 1);		/* APB1 is 42 MHz, TIM2 gets 84 */
+	tim_sim_set_count(start_cnt);
+	CHECK((uclock64() >> 32) == 0);
+	last64 = uclock64();
+	went_back = 0;
+	fire_count = 0;
+	start(0, 3000);				/* before */
+	start(1, 5000);				/* 0xffffffff */
+	start(2, 5001);				/* 0 */
+	start(3, 20000);			/* after */
+	start(4, 100000);
+	start(5, 4000 + 1024 * 31);	/* a whole trip, across the wrap */
+	tim_sim_run(200000);
+	CHECK(fire_count == 6);
+	for (i = 0; i < 6; i++) {
+		CHECK((tm[i].count == 1) && (tm[i].at == tm[i].due));
+	}
+	CHECK(tm[1].at == 0xffffffff);
+	CHECK(tm[2].at == 0);
+	CHECK(went_back == 0);
+	CHECK(uclock64() == (1ULL << 32) + 200000 - 5001);
+
+	/* wrap with interrupts off, uclock64() still sees it */
+	tim_sim_set_count(0xffffffff - 10);
+	cm_mask_interrupts(1);
+	tim_sim_run(20);
+	t64 = uclock64();
+	CHECK(t64 == (2ULL << 32) + 9);
+	cm_mask_interrupts(0);
+	tim_sim_run(1);
+	CHECK(uclock64() == t64 + 1);
+}
+
+static void
+test_cancel(void)
+{
+	fire_count = 0;
+	start(0, 1100);
+	start(1, 1200);				/* the same slot */
+	start(2, 9000);				/* another one */
+	start(3, 2500);				/* overdue when it's cancelled */
+	tm[0].cancel[0] = &tm[1].t;
+	tm[0].cancel[1] = &tm[2].t;
+	/* 3 cancels itself, after taking so long that 4 is due too */
+	start(4, 2600);
+	tm[3].spend = 500;
+	tm[3].cancel[0] = &tm[3].t;
+	tm[3].cancel[1] = &tm[4].t;
+	tim_sim_run(20000);
+	CHECK((tm[0].count == 1) && (tm[1].count == 0) && (tm[2].count == 0));
+	CHECK((tm[0].cancelled[0] == 1) && (tm[0].cancelled[1] == 1));
+	CHECK((tm[3].count == 1) && (tm[4].count == 0));
+	CHECK((tm[3].cancelled[0] == 0) && (tm[3].cancelled[1] == 1));
+	CHECK(fire_count == 2);
+	CHECK(utimer_cancel(&tm[2].t) == 0);
+	CHECK((TIM_DIER(TIM2) & TIM_DIER_CC1IE) == 0);
+}
+
+static void
+test_slow(void)
+{
+	uint32_t t0;
+
+	/*
+	 * 0 takes 3mS, 1 and 2 are due before it's done. Starting on a
+	 * slot boundary they are in the slots after 0's (1024uS each),
+	 * which weren't due when the interrupt came in.
+	 */
+	tim_sim_run(1024 - (uclock() & 1023));
+	fire_count = 0;
+	t0 = uclock();
+	start(0, 1000);
+	start(1, 2000);
+	start(2, 3500);
+	start(3, 6000);
+	tm[0].spend = 3000;
+	tim_sim_run(10000);
+	CHECK((tm[0].count == 1) && (tm[1].count == 1) && (tm[2].count == 1) &&
+												(tm[3].count == 1));
+	CHECK((tm[1].at == t0 + 4000) && (tm[2].at == t0 + 4000));
+	CHECK(tm[3].at == tm[3].due);
+	CHECK(fire_count == 4);
+	CHECK((TIM_DIER(TIM2) & TIM_DIER_CC1IE) == 0);
+}
+
+int
+main(void)
+{
+	timebase_init();
+	CHECK(TIM_CR1(TIM2) & TIM_CR1_CEN);
+	test_order();
+	test_periodic();
+	test_far();
+	test_wrap();
+	test_cancel();
+	test_slow();
+	CHECK(irqs() > 0);
+	printf("timebase_test: %s (%d failures)\n", (test_failures) ? "FAIL" : "PASS",
+															test_failures);
+	return (test_failures != 0);
+}
@@ -0,0 +1,346 @@
+/*
+ * tlsf_bench.c - tlsf.c against the C library's malloc
+ *
+ * Copyright (c) 2016, Chuck McManis (cmcmanis@mcmanis.com)
+ *
+ * Makes a trace of mallocs, reallocs and frees for a few made up
+ * programs and plays the same trace through tlsf.c (on a 16MB heap,
+ * like the SDRAM) and through glibc's malloc. Every call is timed
+ * with profile.c (built with PROFILE_HOST so the times are in
+ * nanoseconds) and for each of them it prints:
+ *
+ *	Peak live	- most bytes asked for and not freed at any one time
+ *	Footprint	- most memory the allocator needed for that. For TLSF
+ *			  it is how far into the heap the highest block went
+ *			  (the heap you would have to give it), for glibc
+ *			  what mallinfo() says it got from the system less
+ *			  the free space at the top it could give back.
+ *	Frag		- Footprint / Peak live, 1.00 would be perfect
+ *
+ * and then the call times with their histograms. Each trace is played
+ * once to measure the footprint (and warm things up) and a second time
+ * for the times. The times include reading the clock (a few tens of
+ * nS), it is the same for both.
+ *
+ * The traces:
+ *	editor		- like kilo, 2000 lines that grow a few bytes at a
+ *			  time as you type, some lines added and deleted,
+ *			  and now and then a 64K screen buffer
+ *	mixed		- random sizes (mostly small, some up to 32K) with
+ *			  random lifetimes
+ *	buffers		- 1K - 16K sample buffers freed oldest first with
+ *			  small long lived things allocated in between, the
+ *			  pattern that leaves holes in a first fit heap
+ *
+ * Usage: tlsf_bench [ops]
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "../util.h"
+#include "host.h"
+
+#define HEAP_SIZE	(16 * 1024 * 1024)
+#define NSLOTS		4096
+
+#define OP_MALLOC	0
+#define OP_REALLOC	1
+#define OP_FREE		2
+
+struct op {
+	uint8_t		kind;
+	uint16_t	slot;
+	uint32_t	size;
+};
+
+struct result {
+	uint64_t	peak_live;
+	uint64_t	footprint;
+	uint32_t	fails;
+};
+
+static struct op *trace;
+static int ntrace;
+static void *slot_ptr[NSLOTS];
+static uint32_t slot_size[NSLOTS];
+static uint8_t *heap_mem;
+static tlsf_t *heap;
+
+static void add(int kind, int slot, uint32_t size);
+static void make_editor(int ops);
+static void make_mixed(int ops);
+static void make_buffers(int ops);
+static uint64_t glibc_footprint(void);
+static void replay(int use_tlsf, int timed, struct result *res);
+static void run(const char *name, void (*make)(int), int ops);
+
+static void
+add(int kind, int slot, uint32_t size)
+{
+	trace[ntrace].kind = kind;
+	trace[ntrace].slot = slot;
+	trace[ntrace].size = size;
+	ntrace++;
+}
+
+static void
+make_editor(int ops)
+{
+	static uint8_t live[NSLOTS];
+	uint32_t r;
+	int s;
+
+	memset(live, 0, sizeof(live));
+	memset(slot_size, 0, sizeof(slot_size));
+	/* the file being loaded */
+	for (s = 0; s < 2000; s++) {
+		slot_size[s] = 1 + test_rand() % 80;
+		add(OP_MALLOC, s, slot_size[s]);
+		live[s] = 1;
+	}
+	while (ntrace < ops) {
+		r = test_rand() % 1000;
+		s = test_rand() % 4000;
+		if (r < 2) {
+			/* redraw, a big buffer that goes away again */
+			add(OP_MALLOC, NSLOTS - 1, 65536);
+			add(OP_FREE, NSLOTS - 1, 0);
+		} else if (! live[s]) {
+			slot_size[s] = 1 + test_rand() % 80;
+			add(OP_MALLOC, s, slot_size[s]);
+			live[s] = 1;
+		} else if (r < 950) {
+			/* typing, each row is re-allocated one bigger */
+			slot_size[s] += 1 + test_rand() % 4;
+			add(OP_REALLOC, s, slot_size[s]);
+		} else {
+			add(OP_FREE, s, 0);
+			live[s] = 0;
+		}
+	}
+}
+
+static void
+make_mixed(int ops)
+{
+	static uint8_t live[NSLOTS];
+	uint32_t r, size;
+	int s;
+
+	memset(live, 0, sizeof(live));
+	while (ntrace < ops) {
+		s = test_rand() % NSLOTS;
+		r = test_rand() % 100;
+		if (live[s]) {
+			if (r < 20) {
+				add(OP_REALLOC, s, 1 + test_rand() % 4096);
+			} else {
+				add(OP_FREE, s, 0);
+				live[s] = 0;
+			}
+			continue;
+		}
+		if (r < 70) {
+			size = 1 + test_rand() % 64;
+		} else if (r < 95) {
+			size = 64 + test_rand() % 960;
+		} else {
+			size = 1024 + test_rand() % (32 * 1024);
+		}
+		add(OP_MALLOC, s, size);
+		live[s] = 1;
+	}
+}
+
+static void
+make_buffers(int ops)
+{
+	int head = 0, tail = 0, small = 2048;
+
+	while (ntrace < ops) {
+		/* up to 1000 buffers in flight, freed in the order they came */
+		if ((head - tail < 1000) && ((test_rand() % 3) != 0)) {
+			add(OP_MALLOC, head % 1000, 1024 + test_rand() % (15 * 1024));
+			head++;
+		} else if (head != tail) {
+			add(OP_FREE, tail % 1000, 0);
+			tail++;
+		}
+		/* and a small thing that lives a lot longer */
+		if ((test_rand() % 4) == 0) {
+			if (slot_size[small] != 0) {
+				add(OP_FREE, small, 0);
+			}
+			slot_size[small] = 16 + test_rand() % 48;
+			add(OP_MALLOC, small, slot_size[small]);
+			small = (small + 1 < NSLOTS) ? small + 1 : 2048;
+		}
+	}
+}
+
+static uint64_t
+glibc_footprint(void)
+{
+#if defined(__GLIBC__) && ((__GLIBC__ > 2) || (__GLIBC_MINOR__ >= 33))
+	struct mallinfo2 mi = mallinfo2();
+#else
+	struct mallinfo mi = mallinfo();
+#endif
+
+	return (uint64_t) mi.arena - mi.keepcost + mi.hblkhd;
+}
+
+/*
+ * Play the trace through one allocator. With 'timed' each call is
+ * timed, otherwise the footprint is measured after each one.
+ */
+static void
+replay(int use_tlsf, int timed, struct result *res)
+{
+	int t_malloc, t_realloc, t_free;
+	uint64_t live = 0, base = 0, fp;
+	uint8_t *end;
+	uint32_t start;
+	struct op *o;
+	void *p;
+	int i;
+
+	t_malloc = prof_timer((use_tlsf) ? "tlsf malloc" : "glibc malloc");
+	t_realloc = prof_timer((use_tlsf) ? "tlsf realloc" : "glibc realloc");
+	t_free = prof_timer((use_tlsf) ? "tlsf free" : "glibc free");
+	memset(res, 0, sizeof(*res));
+	memset(slot_ptr, 0, sizeof(slot_ptr));
+	memset(slot_size, 0, sizeof(slot_size));
+	if (use_tlsf) {
+		heap = tlsf_create(heap_mem, HEAP_SIZE);
+	} else {
+		base = glibc_footprint();
+	}
+	for (i = 0, o = trace; i < ntrace; i++, o++) {
+		start = prof_start();
+		switch (o->kind) {
+		case OP_MALLOC:
+			p = (use_tlsf) ? tlsf_malloc(heap, o->size) : malloc(o->size);
+			break;
+		case OP_REALLOC:
+			p = (use_tlsf) ? tlsf_realloc(heap, slot_ptr[o->slot], o->size) :
+											realloc(slot_ptr[o->slot], o->size);
+			break;
+		default:
+			if (use_tlsf) {
+				tlsf_free(heap, slot_ptr[o->slot]);
+			} else {
+				free(slot_ptr[o->slot]);
+			}
+			p = NULL;
+			break;
+		}
+		if (timed) {
+			prof_stop((o->kind == OP_MALLOC) ? t_malloc :
+					(o->kind == OP_REALLOC) ? t_realloc : t_free, start);
+		}
+		if ((p == NULL) && (o->kind != OP_FREE)) {
+			res->fails++;
+			continue;
+		}
+		/* touch it, like a program would */
+		if (p) {
+			memset(p, i, (o->size < 64) ? o->size : 64);
+		}
+		live -= slot_size[o->slot];
+		slot_ptr[o->slot] = p;
+		slot_size[o->slot] = (p) ? o->size : 0;
+		live += slot_size[o->slot];
+		if (live > res->peak_live) {
+			res->peak_live = live;
+		}
+		if (timed) {
+			continue;
+		}
+		if (use_tlsf) {
+			if (p) {
+				end = (uint8_t *) p + tlsf_usable_size(p);
+				if ((uint64_t)(end - heap_mem) > res->footprint) {
+					res->footprint = end - heap_mem;
+				}
+			}
+		} else {
+			fp = glibc_footprint();
+			if (fp > base + res->footprint) {
+				res->footprint = fp - base;
+			}
+		}
+	}
+	/* clean up after it */
+	for (i = 0; i < NSLOTS; i++) {
+		if (slot_ptr[i] && ! use_tlsf) {
+			free(slot_ptr[i]);
+		}
+		slot_ptr[i] = NULL;
+	}
+	if (! use_tlsf) {
+		malloc_trim(0);
+	}
+}
+
+/*
+ * Each trace is run in a process of its own so glibc starts with an
+ * empty heap every time, rather than one full of holes left by the
+ * trace before.
+ */
+static void
+run(const char *name, void (*make)(int), int ops)
+{
+	struct result tr, gr, scratch;
+	pid_t pid;
+
+	fflush(stdout);
+	pid = fork();
+	if (pid != 0) {
+		if (pid > 0) {
+			waitpid(pid, NULL, 0);
+		}
+		return;
+	}
+	trace = malloc((ops + 4096) * sizeof(struct op));
+	heap_mem = malloc(HEAP_SIZE);
+	if ((trace == NULL) || (heap_mem == NULL)) {
+		exit(1);
+	}
+	/* so page faults aren't counted against TLSF */
+	memset(heap_mem, 0, HEAP_SIZE);
+	test_srand(1);
+	make(ops);
+	replay(1, 0, &tr);
+	replay(0, 0, &gr);
+	prof_reset();
+	replay(1, 1, &scratch);
+	replay(0, 1, &scratch);
+	printf("\n%s: %d calls\n", name, ntrace);
+	printf("%-10s %12s %12s %6s %6s\n", "", "Peak live", "Footprint", "Frag",
+																"Fails");
+	printf("%-10s %12llu %12llu %6.2f %6u\n", "tlsf",
+		(unsigned long long) tr.peak_live, (unsigned long long) tr.footprint,
+		(double) tr.footprint / tr.peak_live, (unsigned int) tr.fails);
+	printf("%-10s %12llu %12llu %6.2f %6u\n", "glibc",
+		(unsigned long long) gr.peak_live, (unsigned long long) gr.footprint,
+		(double) gr.footprint / gr.peak_live, (unsigned int) gr.fails);
+	prof_dump();
+	exit(0);
+}
+
+int
+main(int argc, char *argv[])
+{
+	int ops = (argc > 1) ? atoi(argv[1]) : 1000000;
+
+	printf("TLSF vs glibc %d.%d malloc\n", __GLIBC__, __GLIBC_MINOR__);
+	run("editor", make_editor, ops);
+	run("mixed", make_mixed, ops);
+	run("buffers", make_buffers, ops);
+	return 0;
+}
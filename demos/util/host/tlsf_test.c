@@ -0,0 +1,204 @@
+/*
+ * tlsf_test.c - beat on tlsf.c with random allocations
+ *
+ * Copyright (c) 2016, Chuck McManis (cmcmanis@mcmanis.com)
+ *
+ * Keeps a table of allocations, each one filled with a pattern only
+ * it uses, and does random mallocs, frees, reallocs and memaligns on
+ * a 1MB heap (which is small enough that it fills up now and then).
+ * It checks that:
+ *	- every pointer is inside the heap and aligned
+ *	- nothing is overwritten by anything else (the pattern is
+ *	  checked before a block is freed or re-allocated)
+ *	- realloc keeps what was in the block
+ *	- the heap's idea of how much is in use matches the table
+ *	- when it is all freed the heap is back to one free block
+ *
+ * Usage: tlsf_test [seed]
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../util.h"
+#include "host.h"
+
+#define HEAP_SIZE	(1024 * 1024)
+#define NSLOTS		2000
+#define NOPS		500000
+
+struct slot {
+	uint8_t		*p;
+	size_t		len;
+	uint8_t		tag;
+};
+
+static struct slot slots[NSLOTS];
+static uint8_t *heap_mem;
+static tlsf_t *heap;
+
+static size_t pick_size(void);
+static void fill(struct slot *s);
+static int verify(struct slot *s, size_t len);
+static int placed(uint8_t *p, size_t align);
+static uint32_t in_use(void);
+
+/*
+ * Mostly small things, some medium, a few big ones.
+ */
+static size_t
+pick_size(void)
+{
+	uint32_t r = test_rand() % 100;
+
+	if (r < 70) {
+		return 1 + test_rand() % 64;
+	} else if (r < 95) {
+		return 64 + test_rand() % 960;
+	}
+	return 1024 + test_rand() % (32 * 1024);
+}
+
+static void
+fill(struct slot *s)
+{
+	size_t i;
+
+	for (i = 0; i < s->len; i++) {
+		s->p[i] = (uint8_t)(s->tag + i * 7);
+	}
+}
+
+/*
+ * Check the first 'len' bytes of a slot, returns 0 if they are right.
+ */
+static int
+verify(struct slot *s, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		if (s->p[i] != (uint8_t)(s->tag + i * 7)) {
+			printf("  block %p (%u bytes) changed at byte %u\n", (void *) s->p,
+										(unsigned int) s->len, (unsigned int) i);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * True if 'p' is somewhere sensible
+ */
+static int
+placed(uint8_t *p, size_t align)
+{
+	return (p > heap_mem) && (p < heap_mem + HEAP_SIZE) &&
+			(((uintptr_t) p & (align - 1)) == 0);
+}
+
+static uint32_t
+in_use(void)
+{
+	uint32_t total = 0;
+	int i;
+
+	for (i = 0; i < NSLOTS; i++) {
+		if (slots[i].p) {
+			total += tlsf_usable_size(slots[i].p);
+		}
+	}
+	return total;
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct tlsf_stats st, empty;
+	struct slot *s;
+	uint8_t *p;
+	size_t len, align;
+	uint32_t r;
+	int i, op, full = 0;
+
+	test_srand((argc > 1) ? strtoul(argv[1], NULL, 0) : 1);
+	heap_mem = malloc(HEAP_SIZE);
+	/* start it off an odd address, tlsf_create() has to line it up */
+	CHECK(tlsf_create(heap_mem + 3, 64) == NULL);
+	heap = tlsf_create(heap_mem + 3, HEAP_SIZE - 3);
+	CHECK(heap != NULL);
+	tlsf_get_stats(heap, &empty);
+	CHECK(empty.used == 0);
+	CHECK(tlsf_malloc(heap, HEAP_SIZE) == NULL);
+
+	for (op = 0; op < NOPS; op++) {
+		s = &slots[test_rand() % NSLOTS];
+		r = test_rand() % 100;
+		if (s->p == NULL) {
+			len = pick_size();
+			align = 8;
+			if (r < 5) {
+				align = 16 << (test_rand() % 9);	/* 16 - 4096 */
+				p = tlsf_memalign(heap, align, len);
+			} else {
+				p = tlsf_malloc(heap, len);
+			}
+			if (p == NULL) {
+				full++;
+				continue;
+			}
+			CHECK(placed(p, align));
+			CHECK(tlsf_usable_size(p) >= len);
+			s->p = p;
+			s->len = len;
+			s->tag = test_rand() & 0xff;
+			fill(s);
+		} else if (r < 30) {
+			test_failures += verify(s, s->len);
+			len = pick_size();
+			p = tlsf_realloc(heap, s->p, len);
+			if (p == NULL) {
+				full++;
+				continue;	/* the old block is still good */
+			}
+			CHECK(placed(p, 8));
+			CHECK(tlsf_usable_size(p) >= len);
+			s->p = p;
+			test_failures += verify(s, (len < s->len) ? len : s->len);
+			s->len = len;
+			fill(s);
+		} else {
+			test_failures += verify(s, s->len);
+			tlsf_free(heap, s->p);
+			s->p = NULL;
+		}
+		if ((op % 1000) == 0) {
+			tlsf_get_stats(heap, &st);
+			CHECK(st.used == in_use());
+		}
+		if (test_failures > 20) {
+			break;
+		}
+	}
+
+	tlsf_get_stats(heap, &st);
+	printf("%u allocations, %u frees, %d times full, high water %u of %u\n",
+		(unsigned int) st.allocs, (unsigned int) st.frees, full,
+		(unsigned int) st.high, (unsigned int) st.size);
+	CHECK(st.used == in_use());
+	for (i = 0; i < NSLOTS; i++) {
+		if (slots[i].p) {
+			test_failures += verify(&slots[i], slots[i].len);
+			tlsf_free(heap, slots[i].p);
+			slots[i].p = NULL;
+		}
+	}
+	tlsf_get_stats(heap, &st);
+	CHECK(st.used == 0);
+	CHECK(st.largest_free == empty.largest_free);
+	CHECK(full > 0);
+	free(heap_mem);
+	printf("tlsf_test: %s (%d failures)\n", (test_failures) ? "FAIL" : "PASS",
+															test_failures);
+	return (test_failures != 0);
+}
@@ -0,0 +1,387 @@
+/*
+ * uart_sim.c - USART3 and DMA1 stream 1, as console.c sees them
+ *
+ * Copyright (c) 2016, Chuck McManis (cmcmanis@mcmanis.com)
+ *
+ * console.c is built against the stand-in libopencm3 headers in sim/
+ * and this is the other half, the registers and functions it uses
+ * and a model of the hardware behind them:
+ *
+ *	- received characters are stored by the "DMA" into the buffer
+ *	  console_setup() gave it, counting NDTR down and going around
+ *	  in circular mode. At half way and at the end it calls
+ *	  dma1_stream1_isr() if those interrupts are on.
+ *	- at the end of a burst the line goes idle, IDLE is set in the
+ *	  status register and usart3_isr() is called.
+ *	- errors set ORE, FE, or NE and call usart3_isr().
+ *	- reading SR then DR clears IDLE and the errors.
+ *	- the transmitter is infinitely fast, TXE and TC are always set
+ *	  and a character written to DR is sent the next time SR or DR
+ *	  is looked at. uart_sim_tx() runs the transmit interrupt until
+ *	  it turns itself off and hands back everything sent.
+ *
+ * Nothing happens on its own, characters only arrive when the test
+ * calls uart_sim_rx(), so they are never "interrupting" the code
+ * under test part way through. That is a limit of doing it this way,
+ * the races between the handlers and console_getc() aren't tested.
+ *
+ * console.c gives the DMA its buffer as a uint32_t, like the real
+ * thing. That only works on a PC if the program is built -no-pie so
+ * its data is in the bottom 4GB (see the Makefile).
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "sim/stm32_sim.h"
+#include "host.h"
+
+#define DR_EMPTY		0xffffffff
+#define TX_MAX			65536
+
+struct uart_sim_regs uart_sim = {
+	.sr = USART_SR_TXE | USART_SR_TC,
+	.dr = DR_EMPTY,
+};
+
+static struct {
+	uint8_t		*mem;
+	uint16_t	size;		/* what NDTR is reloaded with */
+	uint16_t	ndtr;
+	int			circular;
+	int			htie, tcie;
+	int			enabled;
+} dma;
+
+static char tx_out[TX_MAX];
+static int tx_len;
+static struct uart_sim_stats sim_stat;
+
+static void shift_out(void);
+static void usart_irq(void);
+static void dma_irq(void);
+
+/*
+ * A character written to DR goes out on the wire.
+ */
+static void
+shift_out(void)
+{
+	if (uart_sim.dr != DR_EMPTY) {
+		if (tx_len < TX_MAX) {
+			tx_out[tx_len++] = (char) uart_sim.dr;
+		}
+		sim_stat.tx_bytes++;
+		uart_sim.dr = DR_EMPTY;
+	}
+}
+
+static void
+usart_irq(void)
+{
+	if (sim_irq_enabled(NVIC_USART3_IRQ)) {
+		sim_stat.usart_irqs++;
+		usart3_isr();
+	}
+}
+
+static void
+dma_irq(void)
+{
+	if (sim_irq_enabled(NVIC_DMA1_STREAM1_IRQ)) {
+		sim_stat.dma_irqs++;
+		dma1_stream1_isr();
+	}
+}
+
+volatile uint32_t *
+uart_sim_sr(void)
+{
+	shift_out();
+	return &uart_sim.sr;
+}
+
+volatile uint32_t *
+uart_sim_dr(void)
+{
+	shift_out();
+	/* SR was read first (console.c always does), so this clears them */
+	uart_sim.sr &= ~(USART_SR_IDLE | USART_SR_ORE | USART_SR_FE | USART_SR_NE);
+	return &uart_sim.dr;
+}
+
+/*
+ * uart_sim_rx( ... )
+ *
+ * 'len' characters arrive back to back and then the line goes idle.
+ * If the DMA isn't set up to take them they are overruns.
+ */
+void
+uart_sim_rx(const char *s, int len)
+{
+	int i;
+
+	for (i = 0; i < len; i++) {
+		if (! dma.enabled || ! (uart_sim.cr3 & USART_CR3_DMAR) ||
+			(dma.ndtr == 0)) {
+			uart_sim.sr |= USART_SR_ORE;
+			continue;
+		}
+		dma.mem[dma.size - dma.ndtr] = s[i];
+		dma.ndtr--;
+		if ((dma.ndtr == dma.size / 2) && dma.htie) {
+			dma_irq();
+		}
+		if (dma.ndtr == 0) {
+			if (dma.circular) {
+				dma.ndtr = dma.size;
+			} else {
+				dma.enabled = 0;
+			}
+			if (dma.tcie) {
+				dma_irq();
+			}
+		}
+	}
+	sim_stat.rx_bytes += len;
+	uart_sim.sr |= USART_SR_IDLE;
+	if (uart_sim.cr1 & USART_CR1_IDLEIE) {
+		usart_irq();
+	}
+}
+
+/*
+ * uart_sim_error(int errors)
+ *
+ * The receiver saw some combination of UART_SIM_OVERRUN,
+ * UART_SIM_FRAMING, and UART_SIM_NOISE.
+ */
+void
+uart_sim_error(int errors)
+{
+	if (errors & UART_SIM_OVERRUN) {
+		uart_sim.sr |= USART_SR_ORE;
+	}
+	if (errors & UART_SIM_FRAMING) {
+		uart_sim.sr |= USART_SR_FE;
+	}
+	if (errors & UART_SIM_NOISE) {
+		uart_sim.sr |= USART_SR_NE;
+	}
+	if (uart_sim.cr3 & USART_CR3_EIE) {
+		usart_irq();
+	}
+}
+
+/*
+ * uart_sim_tx(char *buf, int len)
+ *
+ * Let the transmit interrupt send whatever is queued, then copy up
+ * to 'len' of the characters sent since the last call into 'buf'.
+ * Returns how many were sent.
+ */
+int
+uart_sim_tx(char *buf, int len)
+{
+	int n;
+
+	while (! cm_is_masked_interrupts() && (uart_sim.cr1 & USART_CR1_TXEIE)) {
+		usart_irq();
+	}
+	shift_out();
+	n = tx_len;
+	if (buf != NULL) {
+		memcpy(buf, tx_out, (n < len) ? n : len);
+	}
+	tx_len = 0;
+	return n;
+}
+
+void
+uart_sim_get_stats(struct uart_sim_stats *st)
+{
+	*st = sim_stat;
+}
+
+/*
+ * The libopencm3 functions console.c calls (the core ones are in
+ * core_sim.c).
+ */
+void
+gpio_mode_setup(uint32_t port, uint8_t mode, uint8_t pull, uint16_t pins)
+{
+	(void) port; (void) mode; (void) pull; (void) pins;
+}
+
+void
+gpio_set_af(uint32_t port, uint8_t af, uint16_t pins)
+{
+	(void) port; (void) af; (void) pins;
+}
+
+void
+usart_set_baudrate(uint32_t usart, uint32_t baud)
+{
+	(void) usart;
+	sim_stat.baud = baud;
+}
+
+void
+usart_set_databits(uint32_t usart, uint32_t bits)
+{
+	(void) usart; (void) bits;
+}
+
+void
+usart_set_stopbits(uint32_t usart, uint32_t stopbits)
+{
+	(void) usart; (void) stopbits;
+}
+
+void
+usart_set_mode(uint32_t usart, uint32_t mode)
+{
+	(void) usart; (void) mode;
+}
+
+void
+usart_set_parity(uint32_t usart, uint32_t parity)
+{
+	(void) usart; (void) parity;
+}
+
+void
+usart_set_flow_control(uint32_t usart, uint32_t flowcontrol)
+{
+	(void) usart; (void) flowcontrol;
+}
+
+void
+usart_enable(uint32_t usart)
+{
+	(void) usart;
+}
+
+void
+usart_enable_rx_dma(uint32_t usart)
+{
+	(void) usart;
+	uart_sim.cr3 |= USART_CR3_DMAR;
+}
+
+void
+usart_enable_tx_interrupt(uint32_t usart)
+{
+	(void) usart;
+	uart_sim.cr1 |= USART_CR1_TXEIE;
+}
+
+void
+usart_disable_tx_interrupt(uint32_t usart)
+{
+	(void) usart;
+	uart_sim.cr1 &= ~USART_CR1_TXEIE;
+}
+
+void
+dma_stream_reset(uint32_t d, uint8_t stream)
+{
+	(void) d; (void) stream;
+	memset(&dma, 0, sizeof(dma));
+}
+
+void
+dma_channel_select(uint32_t d, uint8_t stream, uint32_t channel)
+{
+	(void) d; (void) stream; (void) channel;
+}
+
+void
+dma_set_priority(uint32_t d, uint8_t stream, uint32_t prio)
+{
+	(void) d; (void) stream; (void) prio;
+}
+
+void
+dma_set_transfer_mode(uint32_t d, uint8_t stream, uint32_t direction)
+{
+	(void) d; (void) stream; (void) direction;
+}
+
+void
+dma_set_memory_size(uint32_t d, uint8_t stream, uint32_t mem_size)
+{
+	(void) d; (void) stream; (void) mem_size;
+}
+
+void
+dma_set_peripheral_size(uint32_t d, uint8_t stream, uint32_t peripheral_size)
+{
+	(void) d; (void) stream; (void) peripheral_size;
+}
+
+void
+dma_enable_memory_increment_mode(uint32_t d, uint8_t stream)
+{
+	(void) d; (void) stream;
+}
+
+void
+dma_enable_circular_mode(uint32_t d, uint8_t stream)
+{
+	(void) d; (void) stream;
+	dma.circular = 1;
+}
+
+void
+dma_set_peripheral_address(uint32_t d, uint8_t stream, uint32_t address)
+{
+	(void) d; (void) stream; (void) address;
+}
+
+void
+dma_set_memory_address(uint32_t d, uint8_t stream, uint32_t address)
+{
+	(void) d; (void) stream;
+	dma.mem = (uint8_t *)(uintptr_t) address;
+}
+
+void
+dma_set_number_of_data(uint32_t d, uint8_t stream, uint16_t number)
+{
+	(void) d; (void) stream;
+	dma.size = dma.ndtr = number;
+}
+
+uint16_t
+dma_get_number_of_data(uint32_t d, uint8_t stream)
+{
+	(void) d; (void) stream;
+	return dma.ndtr;
+}
+
+void
+dma_enable_half_transfer_interrupt(uint32_t d, uint8_t stream)
+{
+	(void) d; (void) stream;
+	dma.htie = 1;
+}
+
+void
+dma_enable_transfer_complete_interrupt(uint32_t d, uint8_t stream)
+{
+	(void) d; (void) stream;
+	dma.tcie = 1;
+}
+
+void
+dma_clear_interrupt_flags(uint32_t d, uint8_t stream, uint32_t interrupts)
+{
+	(void) d; (void) stream; (void) interrupts;
+}
+
+void
+dma_enable_stream(uint32_t d, uint8_t stream)
+{
+	(void) d; (void) stream;
+	dma.enabled = 1;
+}
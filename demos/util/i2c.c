@@ -4,6 +4,14 @@
  * This example talks to the XY screen touch controller
  * (its a peripheral already on the board) and prints
  * the co-ordinates pressed on the serial port.
+ *
+ * There are two ways to use it. i2c_write() and i2c_read() poll
+ * the status register and don't return until they're done, which
+ * is simple but ties up the CPU (and is awful inside an interrupt
+ * handler, the touch interrupt used to sit there for a few hundred
+ * microseconds reading 16 bytes). The other way is i2c_submit(),
+ * described further down, which queues the transfer and lets the
+ * I2C interrupts and the DMA do the work.
  */
 
 #include <stdint.h>
@@ -11,15 +19,33 @@
 #include <libopencm3/stm32/i2c.h>
 #include <libopencm3/stm32/gpio.h>
 #include <libopencm3/stm32/rcc.h>
+#include <libopencm3/stm32/dma.h>
+#include <libopencm3/stm32/timer.h>
 #include <libopencm3/cm3/nvic.h>
 #include <libopencm3/cm3/cortex.h>
 #include "../util/util.h"
 
 static int __i2c_event(i2c_dev *chan, uint8_t events);
+static int __i2c_timing(uint32_t dev, uint8_t baud);
+static void __i2c_async_setup(int i2c);
+static void __i2c_hold(int i2c);
+static void __i2c_release(int i2c);
+static int __i2c_write(i2c_dev *chan, uint8_t *buf, size_t size, int stop);
+static int __i2c_read(i2c_dev *chan, uint8_t *buf, size_t size, int stop);
+static void __i2c_start(int i2c);
+static void __i2c_finish(int i2c, int status);
+static void __i2c_dma_start(int i2c, int rx, const uint8_t *buf, uint16_t len);
+static void __i2c_dma_isr(int i2c, int rx);
+static void __i2c_ev(int i2c);
+static void __i2c_er(int i2c);
+static uint32_t __i2c_tick_clock(void);
+static void __i2c_tick_start(void);
 
 /* map units to registers */
 static uint32_t __i2c_clock[4] = {0, RCC_I2C1, RCC_I2C2, RCC_I2C3};
 static uint32_t __i2c_base[4] = {0, I2C1, I2C2, I2C3};
+/* what each port was set up for, 0 if it wasn't */
+static uint8_t __i2c_baud[4];
 
 #define MY_I2C_TIMEOUT	100000
 
@@ -43,6 +69,69 @@ __i2c_event(i2c_dev *chan, uint8_t events)
 	return (timeout < MY_I2C_TIMEOUT) ? 1 : 0;
 }
 
+/*
+ * Set the clock registers for 'baud' from the current APB1 clock,
+ * the peripheral has to be disabled. Returns -1 if APB1 is out of
+ * the range the I2C can use (2 to 45Mhz).
+ *
+ * Compute the clock delay, 
+ *   in normal mode this is (Freq(APB1) / 100Khz) / 2 
+ *	 in fast mode its either
+ *		- (Freq(APB1) / 400khz) / 3  (Duty 0)
+ *	 	- (Freq(APB1) / 400khz) / 25 (Duty 1)
+ * Duty 1 is the 9:16 ratio instead of 1:2 "regular"
+ * duty cycle mode (Duty = 0). For now we only support
+ * regular duty cycle mode until I can figure out when 
+ * you would need 9:16 mode.
+ *
+ * In fast mode the divide is rounded up, at 45Mhz (180Mhz with
+ * over-drive) rounding down would run the bus a bit over 400Khz.
+ */
+static int
+__i2c_timing(uint32_t dev, uint8_t baud)
+{
+	uint32_t fpclk = rcc_apb1_frequency / 1000000;
+
+	if ((fpclk < 2) || (fpclk > 45)) {
+		return -1;
+	}
+	I2C_CR2(dev) = (I2C_CR2(dev) & ~0x3f) | (fpclk & 0x3f); 
+	if (baud == I2C_400KHZ) {
+		/* fpclk x (1000 / 400) / 3 == f x 5 / 6 */
+		I2C_CCR(dev) = 0x8000 | (((fpclk * 5 + 5) / 6) & 0xfff);
+	} else {
+		/* fpclk x (1000 / 100) / 2 == fpclk x 5 */
+		I2C_CCR(dev) = (fpclk * 5) & 0xfff;
+	}
+	I2C_TRISE(dev) = (fpclk + 1) & 0x3f;
+	return 0;
+}
+
+/*
+ * i2c_reclock( ... )
+ *
+ * clock_setup() calls this when the APB1 clock changes, it redoes
+ * the timing on any port that was set up. Don't change the clock
+ * in the middle of a transfer.
+ */
+void
+i2c_reclock(void)
+{
+	uint32_t dev;
+	int i;
+
+	for (i = 1; i < 4; i++) {
+		if (__i2c_baud[i] == 0) {
+			continue;
+		}
+		dev = __i2c_base[i];
+		I2C_CR1(dev) &= ~I2C_CR1_PE;
+		if (__i2c_timing(dev, __i2c_baud[i] - 1) == 0) {
+			I2C_CR1(dev) |= I2C_CR1_PE;
+		}
+	}
+}
+
 /*
  * Initialize an I2C port.
  *
@@ -57,7 +146,6 @@ i2c_dev *
 i2c_init(int i2c, uint8_t addr, uint8_t baud)
 {
 	uint32_t dev = __i2c_base[i2c];
-	uint32_t fpclk;
 	i2c_dev *res;
 
 	if ((i2c < 1) || (i2c > 3)) {
@@ -81,36 +169,15 @@ i2c_init(int i2c, uint8_t addr, uint8_t baud)
 	gpio_set_af(GPIOB, GPIO_AF4, GPIO8 | GPIO9);
 
 	rcc_periph_clock_enable(__i2c_clock[i2c]);
-	fpclk = rcc_apb1_frequency / 1000000;
 
 	/* disable the peripheral to set clocks */
 	I2C_CR1(dev) = I2C_CR1(dev) & ~(I2C_CR1_PE); 
-    /* during init this check is fast enough */
-	if ((fpclk < 2) || (fpclk > 42)) {
+	if (__i2c_timing(dev, baud) != 0) {
+		free(res);
 		return NULL; /* can't run */
 	}
-	I2C_CR2(dev) = (fpclk & 0x3f); 
-
-	/*
- 	 * Compute the clock delay, 
-	 *   in normal mode this is (Freq(APB1) / 100Khz) / 2 
-	 *	 in fast mode its either
-	 *		- (Freq(APB1) / 400khz) / 3  (Duty 0)
-	 *	 	- (Freq(APB1) / 400khz) / 25 (Duty 1)
-	 * Duty 1 is the 9:16 ratio instead of 1:2 "regular"
-	 * duty cycle mode (Duty = 0). For now we only support
-	 * regular duty cycle mode until I can figure out when 
-	 * you would need 9:16 mode.
-	 *
-	 */
-	if (baud == I2C_400KHZ) {
-		/* fpclk x (1000 / 400) / 3 == f x 5 / 6 */
-		I2C_CCR(dev) = 0x8000 | (((fpclk * 5) / 6) & 0xfff);
-	} else {
-		/* fpclk x (1000 / 100) / 2 == fpclk x 5 */
-		I2C_CCR(dev) = (fpclk * 5) & 0xfff;
-	}
-	I2C_TRISE(dev) = (fpclk + 1) & 0x3f;
+	/* remembered (baud + 1) so that 0 means "not set up" */
+	__i2c_baud[i2c] = baud + 1;
 
 	/* enable the peripheral */
 	I2C_CR1(dev) |= I2C_CR1_PE;
@@ -133,18 +200,12 @@ i2c_init(int i2c, uint8_t addr, uint8_t baud)
  * Return value is number of bytes successfully sent or -1. If return != size
  * then it means stop was sent because a timeout occurred.
  */
-
-int
-i2c_write(i2c_dev *chan, uint8_t *buf, size_t size, int stop)
+static int
+__i2c_write(i2c_dev *chan, uint8_t *buf, size_t size, int stop)
 {
 	uint32_t	dev = __i2c_base[chan->i2c];
 	uint8_t addr = chan->addr;
 
-	/* doesn't support writing 0 bytes */
-	if ((size == 0) || (buf == NULL)) {
-		return -1;
-	}
-
 	/* send start */
 	I2C_CR1(dev) |= (I2C_CR1_START | I2C_CR1_PE);
 	if (! __i2c_event(chan, I2C_SR1_SB)) {
@@ -198,17 +259,12 @@ i2c_write(i2c_dev *chan, uint8_t *buf, size_t size, int stop)
  *
  * If an error occurs, stop is sent regardless.
  */
-int
-i2c_read(i2c_dev *chan, uint8_t *buf, size_t size, int stop)
+static int
+__i2c_read(i2c_dev *chan, uint8_t *buf, size_t size, int stop)
 {
 	uint32_t dev = __i2c_base[chan->i2c];
 	uint8_t addr = chan->addr;
 
-	/* doesn't support reading no bytes */
-	if ((size == 0) || (buf == NULL)) {
-		return -1;
-	}
-
 	I2C_CR1(dev) |= (I2C_CR1_START |  I2C_CR1_PE);
 	if (!__i2c_event(chan, I2C_SR1_SB)) {
 		return -1;
@@ -250,3 +306,532 @@ i2c_read(i2c_dev *chan, uint8_t *buf, size_t size, int stop)
 	return size;
 }
 
+/*
+ * The polled transfers share the bus with the queue (see below).
+ * They wait for anything queued to finish and then hold the bus
+ * until they send a STOP, a write without one is the first half of
+ * a write then read and the read has to follow it on the wire.
+ * Anything submitted meanwhile waits in the queue.
+ */
+int
+i2c_write(i2c_dev *chan, uint8_t *buf, size_t size, int stop)
+{
+	int res;
+
+	/* doesn't support writing 0 bytes */
+	if ((size == 0) || (buf == NULL)) {
+		return -1;
+	}
+	__i2c_hold(chan->i2c);
+	res = __i2c_write(chan, buf, size, stop);
+	if (stop || (res != (int) size)) {
+		__i2c_release(chan->i2c);
+	}
+	return res;
+}
+
+int
+i2c_read(i2c_dev *chan, uint8_t *buf, size_t size, int stop)
+{
+	int res;
+
+	/* doesn't support reading no bytes */
+	if ((size == 0) || (buf == NULL)) {
+		return -1;
+	}
+	__i2c_hold(chan->i2c);
+	res = __i2c_read(chan, buf, size, stop);
+	if (stop || (res != (int) size)) {
+		__i2c_release(chan->i2c);
+	}
+	return res;
+}
+
+/*
+ * Interrupt driven transfers
+ *
+ * Each bus has a queue of struct i2c_xfer, the one at the head is
+ * the one on the wire. A transfer goes like this (RM0386 has the
+ * pictures):
+ *
+ *	START, SB event		- send the address (write, or read if
+ *				  there is nothing to write)
+ *	ADDR event		- point the DMA at the buffer and clear ADDR,
+ *				  the DMA moves the bytes and the event
+ *				  interrupt is off while it does
+ *	TX DMA complete		- turn the event interrupt back on to catch BTF
+ *	BTF event		- the last byte is out, either a repeated
+ *				  START for the read or STOP and we're done
+ *	RX DMA complete		- LAST made the I2C NACK the final byte
+ *				  for us, send STOP and we're done
+ *
+ * Reading one byte doesn't use the DMA (the NACK and STOP have to be
+ * set up before ADDR is cleared), it waits for RXNE instead. NACKs,
+ * bus errors, and lost arbitration come in on the error interrupt.
+ *
+ * The timeout is real time, TIM7 ticks every millisecond while any
+ * transfer is in progress and when one has used up its time the I2C
+ * is reset and the transfer finishes with I2C_ERR_TIMEOUT.
+ */
+#define I2C_S_IDLE		0
+#define I2C_S_START_W	1	/* waiting for SB, then ADDR, to write */
+#define I2C_S_WRITE		2	/* DMA is writing, then BTF */
+#define I2C_S_START_R	3	/* waiting for SB, then ADDR, to read */
+#define I2C_S_READ		4	/* DMA (or RXNE) is reading */
+
+static struct i2c_port {
+	struct i2c_xfer	*head, *tail;
+	volatile int	state;
+	uint32_t		ticks;		/* mS left before it times out */
+	int				ready;		/* interrupts are set up */
+	volatile int	held;		/* a polled transfer has the bus */
+} __i2c_port[4];
+
+/*
+ * The DMA1 streams for each bus (RM0386, DMA1 request mapping),
+ * I2C2 gets stream 3 for receive because I2C3 can only use 2.
+ */
+static const struct i2c_dma {
+	uint8_t		rx_stream, tx_stream;
+	uint32_t	rx_chan, tx_chan;
+	uint8_t		rx_irq, tx_irq;
+} __i2c_dma[4] = {
+	{ 0, 0, 0, 0, 0, 0 },
+	{ DMA_STREAM0, DMA_STREAM6, DMA_SxCR_CHSEL_1, DMA_SxCR_CHSEL_1,
+		NVIC_DMA1_STREAM0_IRQ, NVIC_DMA1_STREAM6_IRQ },
+	{ DMA_STREAM3, DMA_STREAM7, DMA_SxCR_CHSEL_7, DMA_SxCR_CHSEL_7,
+		NVIC_DMA1_STREAM3_IRQ, NVIC_DMA1_STREAM7_IRQ },
+	{ DMA_STREAM2, DMA_STREAM4, DMA_SxCR_CHSEL_3, DMA_SxCR_CHSEL_3,
+		NVIC_DMA1_STREAM2_IRQ, NVIC_DMA1_STREAM4_IRQ },
+};
+
+static const uint8_t __i2c_ev_irq[4] = {0, NVIC_I2C1_EV_IRQ, NVIC_I2C2_EV_IRQ,
+															NVIC_I2C3_EV_IRQ};
+static const uint8_t __i2c_er_irq[4] = {0, NVIC_I2C1_ER_IRQ, NVIC_I2C2_ER_IRQ,
+															NVIC_I2C3_ER_IRQ};
+
+#define I2C_CR2_ASYNC	(I2C_CR2_ITEVTEN | I2C_CR2_ITERREN | I2C_CR2_ITBUFEN |\
+						 I2C_CR2_DMAEN | I2C_CR2_LAST)
+#define I2C_SR1_ERRORS	(I2C_SR1_BERR | I2C_SR1_ARLO | I2C_SR1_AF | I2C_SR1_OVR)
+
+/* CCM RAM is not reachable by the DMA controller */
+#define CCM_RAM_START		0x10000000U
+#define CCM_RAM_END			0x10010000U
+#define IN_CCM(p)	(((uint32_t)(p) >= CCM_RAM_START) && ((uint32_t)(p) < CCM_RAM_END))
+
+/*
+ * The first time a bus is used this way turn on its interrupts
+ * and the DMA.
+ */
+static void
+__i2c_async_setup(int i2c)
+{
+	const struct i2c_dma *d = &__i2c_dma[i2c];
+
+	rcc_periph_clock_enable(RCC_DMA1);
+	nvic_enable_irq(__i2c_ev_irq[i2c]);
+	nvic_enable_irq(__i2c_er_irq[i2c]);
+	nvic_enable_irq(d->rx_irq);
+	nvic_enable_irq(d->tx_irq);
+	__i2c_port[i2c].ready = 1;
+}
+
+/*
+ * Wait for the queue to empty and take the bus for a polled
+ * transfer (it may already have it, from the write before a read).
+ */
+static void
+__i2c_hold(int i2c)
+{
+	struct i2c_port *p = &__i2c_port[i2c];
+	uint32_t mask;
+
+	while (! p->held) {
+		mask = cm_mask_interrupts(1);
+		if (p->head == NULL) {
+			p->held = 1;
+		}
+		cm_mask_interrupts(mask);
+	}
+}
+
+/*
+ * The polled transfer is done with the bus, start anything that was
+ * queued while it had it.
+ */
+static void
+__i2c_release(int i2c)
+{
+	struct i2c_port *p = &__i2c_port[i2c];
+	uint32_t mask;
+
+	mask = cm_mask_interrupts(1);
+	p->held = 0;
+	if (p->head && (p->state == I2C_S_IDLE)) {
+		__i2c_start(i2c);
+	}
+	cm_mask_interrupts(mask);
+}
+
+/*
+ * The clock going into TIM7, twice APB1 if APB1 is divided down
+ * (same as TIM2 in timebase.c).
+ */
+static uint32_t
+__i2c_tick_clock(void)
+{
+	uint32_t ppre1 = (RCC_CFGR >> RCC_CFGR_PPRE1_SHIFT) & 0x7;
+
+	if (ppre1 < 4) {
+		return rcc_apb1_frequency;
+	}
+	if (RCC_DCKCFGR & RCC_DCKCFGR_TIMPRE) {
+		return (ppre1 <= 5) ? rcc_ahb_frequency : rcc_apb1_frequency * 4;
+	}
+	return rcc_apb1_frequency * 2;
+}
+
+/*
+ * Start the millisecond tick if it isn't running, 10kHz into the
+ * counter (so the prescaler fits in 16 bits) and an update every 10.
+ */
+static void
+__i2c_tick_start(void)
+{
+	if (TIM_CR1(TIM7) & TIM_CR1_CEN) {
+		return;
+	}
+	rcc_periph_clock_enable(RCC_TIM7);
+	TIM_PSC(TIM7) = (__i2c_tick_clock() / 10000) - 1;
+	TIM_ARR(TIM7) = 9;
+	TIM_EGR(TIM7) = TIM_EGR_UG;
+	TIM_SR(TIM7) = 0;
+	TIM_DIER(TIM7) = TIM_DIER_UIE;
+	nvic_enable_irq(NVIC_TIM7_IRQ);
+	TIM_CR1(TIM7) = TIM_CR1_CEN;
+}
+
+/*
+ * Count down the time left on every bus that is busy, the tick
+ * stops when none of them are.
+ */
+void
+tim7_isr(void)
+{
+	uint32_t dev;
+	int i, busy = 0;
+
+	TIM_SR(TIM7) = ~TIM_SR_UIF;
+	for (i = 1; i < 4; i++) {
+		/*
+		 * Only a transfer on the wire is timed, one waiting for a
+		 * polled transfer to let go of the bus hasn't started yet
+		 * (its ticks are loaded by __i2c_start()).
+		 */
+		if ((__i2c_port[i].state == I2C_S_IDLE) || __i2c_port[i].held) {
+			continue;
+		}
+		if (--__i2c_port[i].ticks > 0) {
+			busy++;
+			continue;
+		}
+		/* stuck, reset the I2C (it forgets its timing) */
+		dev = __i2c_base[i];
+		dma_disable_stream(DMA1, __i2c_dma[i].rx_stream);
+		dma_disable_stream(DMA1, __i2c_dma[i].tx_stream);
+		I2C_CR1(dev) |= I2C_CR1_SWRST;
+		I2C_CR1(dev) &= ~I2C_CR1_SWRST;
+		(void) __i2c_timing(dev, __i2c_baud[i] - 1);
+		I2C_CR1(dev) |= I2C_CR1_PE;
+		__i2c_finish(i, I2C_ERR_TIMEOUT);
+		if (__i2c_port[i].head) {
+			busy++;
+		}
+	}
+	if (! busy) {
+		TIM_CR1(TIM7) &= ~TIM_CR1_CEN;
+	}
+}
+
+/*
+ * Put the transfer at the head of the queue on the wire. If the
+ * last one ended with a STOP it has to finish going out before
+ * there can be a START (that is a few microseconds at most).
+ */
+static void
+__i2c_start(int i2c)
+{
+	struct i2c_port *p = &__i2c_port[i2c];
+	struct i2c_xfer *x = p->head;
+	uint32_t dev = __i2c_base[i2c];
+
+	p->ticks = (x->timeout) ? x->timeout : I2C_TIMEOUT_MS;
+	p->state = (x->wlen) ? I2C_S_START_W : I2C_S_START_R;
+	while (I2C_CR1(dev) & I2C_CR1_STOP) ;
+	I2C_SR1(dev) = ~I2C_SR1_ERRORS;
+	I2C_CR2(dev) = (I2C_CR2(dev) & ~I2C_CR2_ASYNC) |
+								I2C_CR2_ITEVTEN | I2C_CR2_ITERREN;
+	I2C_CR1(dev) |= I2C_CR1_PE | I2C_CR1_START;
+	__i2c_tick_start();
+}
+
+/*
+ * The transfer at the head of the queue is done (one way or another),
+ * tell whoever wanted it and start the next one.
+ */
+static void
+__i2c_finish(int i2c, int status)
+{
+	struct i2c_port *p = &__i2c_port[i2c];
+	struct i2c_xfer *x = p->head;
+	uint32_t dev = __i2c_base[i2c];
+
+	I2C_CR2(dev) &= ~I2C_CR2_ASYNC;
+	p->state = I2C_S_IDLE;
+	if (x == NULL) {
+		return;
+	}
+	p->head = x->next;
+	if (p->head == NULL) {
+		p->tail = NULL;
+	}
+	x->next = NULL;
+	x->status = status;
+	if (x->done) {
+		x->done(x);
+	}
+	/* the callback might have queued another one and started it */
+	if (p->head && (p->state == I2C_S_IDLE)) {
+		__i2c_start(i2c);
+	}
+}
+
+/*
+ * Set up the DMA to move 'len' bytes between 'buf' and the data
+ * register, it starts when the I2C asks for the first byte.
+ */
+static void
+__i2c_dma_start(int i2c, int rx, const uint8_t *buf, uint16_t len)
+{
+	const struct i2c_dma *d = &__i2c_dma[i2c];
+	uint8_t stream = (rx) ? d->rx_stream : d->tx_stream;
+	uint32_t dev = __i2c_base[i2c];
+
+	dma_stream_reset(DMA1, stream);
+	dma_channel_select(DMA1, stream, (rx) ? d->rx_chan : d->tx_chan);
+	dma_set_priority(DMA1, stream, DMA_SxCR_PL_HIGH);
+	dma_set_transfer_mode(DMA1, stream, (rx) ? DMA_SxCR_DIR_PERIPHERAL_TO_MEM :
+											DMA_SxCR_DIR_MEM_TO_PERIPHERAL);
+	dma_set_memory_size(DMA1, stream, DMA_SxCR_MSIZE_8BIT);
+	dma_set_peripheral_size(DMA1, stream, DMA_SxCR_PSIZE_8BIT);
+	dma_enable_memory_increment_mode(DMA1, stream);
+	dma_set_peripheral_address(DMA1, stream, (uint32_t) &I2C_DR(dev));
+	dma_set_memory_address(DMA1, stream, (uint32_t) buf);
+	dma_set_number_of_data(DMA1, stream, len);
+	dma_enable_transfer_complete_interrupt(DMA1, stream);
+	dma_enable_transfer_error_interrupt(DMA1, stream);
+	dma_enable_stream(DMA1, stream);
+	I2C_CR2(dev) |= I2C_CR2_DMAEN;
+}
+
+/*
+ * A DMA stream finished (or failed).
+ */
+static void
+__i2c_dma_isr(int i2c, int rx)
+{
+	const struct i2c_dma *d = &__i2c_dma[i2c];
+	uint8_t stream = (rx) ? d->rx_stream : d->tx_stream;
+	uint32_t dev = __i2c_base[i2c];
+	int err = dma_get_interrupt_flag(DMA1, stream, DMA_TEIF);
+
+	dma_clear_interrupt_flags(DMA1, stream, DMA_TCIF | DMA_TEIF | DMA_HTIF |
+											DMA_FEIF | DMA_DMEIF);
+	dma_disable_stream(DMA1, stream);
+	I2C_CR2(dev) &= ~I2C_CR2_DMAEN;
+	if (__i2c_port[i2c].head == NULL) {
+		return;
+	}
+	if (err) {
+		I2C_CR1(dev) |= I2C_CR1_STOP;
+		__i2c_finish(i2c, I2C_ERR_BUS);
+	} else if (rx) {
+		/* everything is in memory, the last byte was NACKed */
+		I2C_CR1(dev) |= I2C_CR1_STOP;
+		__i2c_finish(i2c, I2C_DONE);
+	} else {
+		/* the last byte is in the shift register, wait for BTF */
+		I2C_CR2(dev) |= I2C_CR2_ITEVTEN;
+	}
+}
+
+void dma1_stream0_isr(void) { __i2c_dma_isr(1, 1); }
+void dma1_stream6_isr(void) { __i2c_dma_isr(1, 0); }
+void dma1_stream3_isr(void) { __i2c_dma_isr(2, 1); }
+void dma1_stream7_isr(void) { __i2c_dma_isr(2, 0); }
+void dma1_stream2_isr(void) { __i2c_dma_isr(3, 1); }
+void dma1_stream4_isr(void) { __i2c_dma_isr(3, 0); }
+
+/*
+ * The event interrupt, see the list at the top of this section.
+ */
+static void
+__i2c_ev(int i2c)
+{
+	struct i2c_port *p = &__i2c_port[i2c];
+	struct i2c_xfer *x = p->head;
+	uint32_t dev = __i2c_base[i2c];
+	uint32_t sr1 = I2C_SR1(dev);
+
+	if (x == NULL) {
+		/* shouldn't happen, but don't get stuck here */
+		I2C_CR2(dev) &= ~I2C_CR2_ASYNC;
+		return;
+	}
+	if (sr1 & I2C_SR1_SB) {
+		/* writing DR after reading SR1 clears SB */
+		I2C_DR(dev) = (p->state == I2C_S_START_W) ? (x->dev->addr & 0xfe) :
+													(x->dev->addr | 1);
+		return;
+	}
+	if (sr1 & I2C_SR1_ADDR) {
+		if (p->state == I2C_S_START_W) {
+			p->state = I2C_S_WRITE;
+			I2C_CR2(dev) &= ~I2C_CR2_ITEVTEN;
+			__i2c_dma_start(i2c, 0, x->wbuf, x->wlen);
+		} else if (x->rlen == 1) {
+			p->state = I2C_S_READ;
+			I2C_CR1(dev) &= ~I2C_CR1_ACK;
+			(void) I2C_SR2(dev);
+			I2C_CR1(dev) |= I2C_CR1_STOP;
+			I2C_CR2(dev) |= I2C_CR2_ITBUFEN;
+			return;
+		} else {
+			p->state = I2C_S_READ;
+			I2C_CR1(dev) |= I2C_CR1_ACK;
+			I2C_CR2(dev) = (I2C_CR2(dev) & ~I2C_CR2_ITEVTEN) | I2C_CR2_LAST;
+			__i2c_dma_start(i2c, 1, x->rbuf, x->rlen);
+		}
+		(void) I2C_SR2(dev);	/* clears ADDR, off it goes */
+		return;
+	}
+	if ((sr1 & I2C_SR1_RxNE) && (p->state == I2C_S_READ)) {
+		x->rbuf[0] = I2C_DR(dev);
+		__i2c_finish(i2c, I2C_DONE);
+		return;
+	}
+	if ((sr1 & I2C_SR1_BTF) && (p->state == I2C_S_WRITE)) {
+		if (x->rlen) {
+			/* repeated START, this clears BTF */
+			p->state = I2C_S_START_R;
+			I2C_CR1(dev) |= I2C_CR1_START;
+		} else {
+			I2C_CR1(dev) |= I2C_CR1_STOP;
+			__i2c_finish(i2c, I2C_DONE);
+		}
+	}
+}
+
+/*
+ * The error interrupt, a NACK (AF), a bus error, lost arbitration,
+ * or an overrun. Stop what we were doing and give up on the transfer.
+ * After losing arbitration the bus belongs to someone else so we
+ * don't send a STOP.
+ */
+static void
+__i2c_er(int i2c)
+{
+	uint32_t dev = __i2c_base[i2c];
+	uint32_t sr1 = I2C_SR1(dev);
+	const struct i2c_dma *d = &__i2c_dma[i2c];
+
+	I2C_SR1(dev) = ~I2C_SR1_ERRORS;
+	dma_disable_stream(DMA1, d->rx_stream);
+	dma_disable_stream(DMA1, d->tx_stream);
+	if ((sr1 & I2C_SR1_ARLO) == 0) {
+		I2C_CR1(dev) |= I2C_CR1_STOP;
+	}
+	__i2c_finish(i2c, (sr1 & I2C_SR1_AF) ? I2C_ERR_NACK : I2C_ERR_BUS);
+}
+
+void i2c1_ev_isr(void) { __i2c_ev(1); }
+void i2c2_ev_isr(void) { __i2c_ev(2); }
+void i2c3_ev_isr(void) { __i2c_ev(3); }
+void i2c1_er_isr(void) { __i2c_er(1); }
+void i2c2_er_isr(void) { __i2c_er(2); }
+void i2c3_er_isr(void) { __i2c_er(3); }
+
+/*
+ * i2c_submit( ... )
+ *
+ * Add a transfer to the end of its bus's queue (and start it if the
+ * bus is idle and i2c_write() or i2c_read() isn't using it). Safe
+ * to call from an interrupt handler, including from a 'done'
+ * callback. Returns -1 if the transfer has nothing to do, the device
+ * wasn't set up with i2c_init(), or a buffer is in CCM RAM.
+ */
+int
+i2c_submit(struct i2c_xfer *x)
+{
+	struct i2c_port *p;
+	uint32_t mask;
+	int i2c;
+
+	if ((x == NULL) || (x->dev == NULL) || ((x->wlen == 0) && (x->rlen == 0))) {
+		return -1;
+	}
+	i2c = x->dev->i2c;
+	if ((i2c < 1) || (i2c > 3) || (__i2c_baud[i2c] == 0)) {
+		return -1;
+	}
+	if ((x->wlen && ((x->wbuf == NULL) || IN_CCM(x->wbuf))) ||
+		(x->rlen && ((x->rbuf == NULL) || IN_CCM(x->rbuf)))) {
+		return -1;
+	}
+	p = &__i2c_port[i2c];
+	x->next = NULL;
+	x->status = I2C_PENDING;
+	mask = cm_mask_interrupts(1);
+	if (! p->ready) {
+		__i2c_async_setup(i2c);
+	}
+	if (p->tail) {
+		p->tail->next = x;
+	} else {
+		p->head = x;
+	}
+	p->tail = x;
+	if ((p->state == I2C_S_IDLE) && ! p->held) {
+		__i2c_start(i2c);
+	}
+	cm_mask_interrupts(mask);
+	return 0;
+}
+
+/*
+ * i2c_xfer_wait( ... )
+ *
+ * Wait for a transfer to finish, returns I2C_DONE or one of the
+ * errors. It can't finish if the I2C interrupts can't get in, so
+ * don't call this from a handler of the same or higher priority.
+ */
+int
+i2c_xfer_wait(struct i2c_xfer *x)
+{
+	while (x->status == I2C_PENDING) ;
+	return x->status;
+}
+
+/*
+ * i2c_busy( ... )
+ *
+ * True if there are transfers queued (or on the wire) on bus 'i2c'.
+ */
+int
+i2c_busy(int i2c)
+{
+	if ((i2c < 1) || (i2c > 3)) {
+		return 0;
+	}
+	return (__i2c_port[i2c].head != NULL);
+}
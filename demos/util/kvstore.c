@@ -0,0 +1,815 @@
+/*
+ * kvstore.c - a small log structured key/value store in QSPI FLASH
+ *
+ * Copyright (c) 2016, Chuck McManis (cmcmanis@mcmanis.com)
+ *
+ * This is for things like configuration and calibration values
+ * that have to survive a reset. NOR FLASH can only change bits
+ * from 1 to 0 and can only be erased 4K at a time, so rather than
+ * re-writing a block every time a value changes, updates are
+ * appended to a log of records and the newest record for a key
+ * wins.
+ *
+ * Layout:
+ *	The store uses 'n' consecutive 4K sub-sectors of the FLASH.
+ *	Each sub-sector starts with a 16 byte header:
+ *		magic		- 'KVS1' if the header has been written
+ *		erase_count	- number of times this sub-sector was erased
+ *		seq		- order of this sub-sector in the log,
+ *				  0xffffffff if it is free.
+ *		seq_check	- ~seq (0xffffffff if it is free)
+ *	The magic number is always written last, by itself, so a header
+ *	that was only partly written when the power went out doesn't
+ *	count. Likewise seq_check is written after seq when a free
+ *	sub-sector becomes part of the log, if they don't agree the
+ *	power went out before anything was put in it.
+ *	Followed by records, each of which is:
+ *		magic (0x5a), flags, key length, reserved
+ *		value length (16 bits), CRC16 (16 bits)
+ *		key bytes, value bytes, padded to 4 bytes with 0xff
+ *	The first byte after the last record is 0xff (erased).
+ *	A record is written with the KV_REC_PENDING flag still 1 and
+ *	once all of it is in the FLASH that bit is programmed to 0. One
+ *	that was cut off part way keeps the flag, so it is never taken
+ *	for a good one even if the CRC happens to match (1 in 65536
+ *	times it will).
+ *
+ * RAM:
+ *	An open addressed hash table maps keys to the FLASH address
+ *	of their newest record (so finding a key is O(1) plus one
+ *	read of the key from FLASH to confirm it). Per sub-sector
+ *	we keep the erase count, how much is used, and how much of
+ *	that is still "live" (not replaced by a newer record).
+ *
+ * Compaction:
+ *	kv_service() is meant to be called from the main loop. When
+ *	free sub-sectors run low it picks the one with the least live
+ *	data, copies the live records to the head of the log (waiting
+ *	for those writes), and starts erasing it in the background. If
+ *	a write can't find room it does the same thing itself (and
+ *	waits for the erase too).
+ *
+ * Wear leveling:
+ *	New sub-sectors for the log are always taken from the free
+ *	ones with the lowest erase count. If the spread between the
+ *	most and least erased sub-sectors gets bigger than
+ *	KV_WEAR_DELTA, compaction picks the least erased one even if
+ *	it is full of live data so that "cold" data doesn't pin a
+ *	sub-sector forever.
+ *
+ * This code is not re-entrant, call it from one place.
+ */
+#include <stdint.h>
+#include <string.h>
+#include "../util/util.h"
+
+#define KV_SECTOR_SIZE		4096
+#define KV_SECTOR_MAGIC		0x3153564b	/* 'KVS1' */
+#define KV_FREE_SEQ		0xffffffff
+#define KV_REC_MAGIC		0x5a
+#define KV_REC_DELETED		0x01
+#define KV_REC_PENDING		0x80	/* cleared when the record is complete */
+#define KV_INDEX_SIZE		256		/* must be a power of 2 */
+#define KV_GC_RESERVE		2		/* free sectors kept for compaction */
+#define KV_GC_THRESHOLD		4		/* compact in background below this */
+#define KV_WEAR_DELTA		32
+
+#define KV_EMPTY		0xffffffff	/* unused index slot */
+#define KV_TOMB			0xfffffffe	/* deleted index slot */
+
+#define KV_ALIGN(x)		(((x) + 3) & ~3)
+
+struct kv_sector_hdr {
+	uint32_t	magic;
+	uint32_t	erase_count;
+	uint32_t	seq;
+	uint32_t	seq_check;
+};
+
+struct kv_rec_hdr {
+	uint8_t		magic;
+	uint8_t		flags;
+	uint8_t		key_len;
+	uint8_t		reserved;
+	uint16_t	val_len;
+	uint16_t	crc;
+};
+
+#define KV_SHDR_SIZE		((int) sizeof(struct kv_sector_hdr))
+#define KV_RHDR_SIZE		((int) sizeof(struct kv_rec_hdr))
+#define KV_MAX_RECORD		KV_ALIGN(KV_RHDR_SIZE + KV_MAX_KEY + KV_MAX_VALUE)
+
+/* What we know about each sub-sector */
+static struct kv_sector {
+	uint32_t	erase_count;
+	uint32_t	seq;		/* KV_FREE_SEQ if free */
+	uint16_t	used;		/* bytes used, including the header */
+	uint16_t	live;		/* bytes of records still current */
+	uint8_t		formatted;	/* header has been written */
+} kv_sect[KV_MAX_SECTORS];
+
+/* Key hash to newest record */
+static struct kv_index {
+	uint32_t	hash;
+	uint32_t	addr;
+	uint16_t	size;
+} kv_ndx[KV_INDEX_SIZE];
+
+static uint32_t kv_base;	/* FLASH address of the first sub-sector */
+static int kv_nsect;		/* number of sub-sectors in the store */
+static int kv_head = -1;	/* sub-sector being appended to */
+static int kv_erasing = -1;	/* sub-sector being erased in the background */
+static uint32_t kv_next_seq;
+static int kv_in_gc;		/* compaction may use the reserve */
+static struct kv_stats kv_stat;
+
+/* one record worth of staging space, and one for compaction copies */
+static uint8_t kv_buf[KV_MAX_RECORD];
+static uint8_t kv_copy[KV_MAX_RECORD];
+
+static uint32_t kv_hash(const char *key, int len);
+static uint16_t kv_crc(const uint8_t *data, int len, uint16_t crc);
+static int kv_find(const char *key, int key_len, uint32_t hash);
+static int kv_slot(uint32_t hash);
+static uint32_t kv_sector_addr(int s);
+static int kv_sector_of(uint32_t addr);
+static int kv_read_record(uint32_t addr, int room);
+static void kv_apply(uint32_t addr, int size);
+static void kv_scan(int s);
+static int kv_free_count(void);
+static int kv_new_head(void);
+static void kv_finish_erase(void);
+static void kv_write_header(int s, uint32_t erase_count, uint32_t seq);
+static uint32_t kv_write_record(uint8_t flags, const char *key, int key_len,
+						const uint8_t *val, int val_len);
+static int kv_append(uint8_t flags, const char *key, int key_len,
+						const uint8_t *val, int val_len);
+static int kv_compact(int wait);
+
+/*
+ * 32 bit FNV-1a hash of the key.
+ */
+static uint32_t
+kv_hash(const char *key, int len)
+{
+	uint32_t h = 0x811c9dc5;
+
+	while (len-- > 0) {
+		h ^= (uint8_t) *key++;
+		h *= 0x01000193;
+	}
+	return h;
+}
+
+/*
+ * CRC-16/CCITT, bit at a time (records are small).
+ */
+static uint16_t
+kv_crc(const uint8_t *data, int len, uint16_t crc)
+{
+	int i;
+
+	while (len-- > 0) {
+		crc ^= (uint16_t) (*data++) << 8;
+		for (i = 0; i < 8; i++) {
+			crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : (crc << 1);
+		}
+	}
+	return crc;
+}
+
+static uint32_t
+kv_sector_addr(int s)
+{
+	return kv_base + (uint32_t) s * KV_SECTOR_SIZE;
+}
+
+static int
+kv_sector_of(uint32_t addr)
+{
+	return (int) ((addr - kv_base) / KV_SECTOR_SIZE);
+}
+
+/*
+ * Read the record at 'addr' into kv_buf and check it. 'room' is
+ * how many bytes are left in the sub-sector. Returns the size of
+ * the record (padded), 0 if this is erased FLASH (end of the log
+ * in this sub-sector) or -1 if the record is damaged.
+ */
+static int
+kv_read_record(uint32_t addr, int room)
+{
+	struct kv_rec_hdr *rh = (struct kv_rec_hdr *) kv_buf;
+	int size;
+	uint16_t crc;
+
+	if (room < KV_RHDR_SIZE) {
+		return 0;
+	}
+	qspi_read_flash(addr, kv_buf, KV_RHDR_SIZE);
+	if (rh->magic == 0xff) {
+		return 0;
+	}
+	size = KV_ALIGN(KV_RHDR_SIZE + rh->key_len + rh->val_len);
+	if ((rh->magic != KV_REC_MAGIC) || (rh->flags & KV_REC_PENDING) ||
+		(rh->key_len == 0) || (rh->key_len > KV_MAX_KEY) ||
+		(rh->val_len > KV_MAX_VALUE) || (size > room)) {
+		return -1;
+	}
+	qspi_read_flash(addr + KV_RHDR_SIZE, kv_buf + KV_RHDR_SIZE,
+									rh->key_len + rh->val_len);
+	crc = kv_crc(kv_buf, 6, 0xffff);
+	crc = kv_crc(kv_buf + KV_RHDR_SIZE, rh->key_len + rh->val_len, crc);
+	return (crc == rh->crc) ? size : -1;
+}
+
+/*
+ * Look for a key in the index, returns the slot or -1. The
+ * hash narrows it down and the key is read back from FLASH to
+ * make sure.
+ */
+static int
+kv_find(const char *key, int key_len, uint32_t hash)
+{
+	struct kv_rec_hdr rh;
+	char	k[KV_MAX_KEY];
+	int	i, n;
+
+	i = hash & (KV_INDEX_SIZE - 1);
+	for (n = 0; n < KV_INDEX_SIZE; n++) {
+		if (kv_ndx[i].addr == KV_EMPTY) {
+			return -1;
+		}
+		if ((kv_ndx[i].addr != KV_TOMB) && (kv_ndx[i].hash == hash)) {
+			qspi_read_flash(kv_ndx[i].addr, (uint8_t *) &rh, KV_RHDR_SIZE);
+			if (rh.key_len == key_len) {
+				qspi_read_flash(kv_ndx[i].addr + KV_RHDR_SIZE,
+											(uint8_t *) k, key_len);
+				if (memcmp(k, key, key_len) == 0) {
+					return i;
+				}
+			}
+		}
+		i = (i + 1) & (KV_INDEX_SIZE - 1);
+	}
+	return -1;
+}
+
+/*
+ * Find an unused index slot for a new key, -1 if the index is full.
+ */
+static int
+kv_slot(uint32_t hash)
+{
+	int	i, n;
+
+	i = hash & (KV_INDEX_SIZE - 1);
+	for (n = 0; n < KV_INDEX_SIZE; n++) {
+		if ((kv_ndx[i].addr == KV_EMPTY) || (kv_ndx[i].addr == KV_TOMB)) {
+			return i;
+		}
+		i = (i + 1) & (KV_INDEX_SIZE - 1);
+	}
+	return -1;
+}
+
+/*
+ * The record in kv_buf (from 'addr') is the newest for its key,
+ * update the index and the live byte counts to match.
+ */
+static void
+kv_apply(uint32_t addr, int size)
+{
+	struct kv_rec_hdr *rh = (struct kv_rec_hdr *) kv_buf;
+	const char *key = (const char *)(kv_buf + KV_RHDR_SIZE);
+	uint32_t hash;
+	int i;
+
+	hash = kv_hash(key, rh->key_len);
+	i = kv_find(key, rh->key_len, hash);
+	if (i >= 0) {
+		/* the old record is now garbage */
+		kv_sect[kv_sector_of(kv_ndx[i].addr)].live -= kv_ndx[i].size;
+		if (rh->flags & KV_REC_DELETED) {
+			kv_ndx[i].addr = KV_TOMB;
+			kv_stat.keys--;
+			return;
+		}
+	} else {
+		if (rh->flags & KV_REC_DELETED) {
+			return;
+		}
+		i = kv_slot(hash);
+		if (i < 0) {
+			return;	/* index full, key is lost until it is re-written */
+		}
+		kv_stat.keys++;
+	}
+	kv_ndx[i].hash = hash;
+	kv_ndx[i].addr = addr;
+	kv_ndx[i].size = size;
+	kv_sect[kv_sector_of(addr)].live += size;
+}
+
+/*
+ * Replay all of the records in a sub-sector into the index.
+ */
+static void
+kv_scan(int s)
+{
+	uint32_t addr = kv_sector_addr(s);
+	int off, size;
+
+	off = KV_SHDR_SIZE;
+	while (off < KV_SECTOR_SIZE) {
+		size = kv_read_record(addr + off, KV_SECTOR_SIZE - off);
+		if (size == 0) {
+			break;
+		}
+		if (size < 0) {
+			/* damaged (power lost while writing?) don't append here */
+			off = KV_SECTOR_SIZE;
+			break;
+		}
+		kv_apply(addr + off, size);
+		off += size;
+	}
+	kv_sect[s].used = off;
+}
+
+static int
+kv_free_count(void)
+{
+	int i, n;
+
+	for (i = 0, n = 0; i < kv_nsect; i++) {
+		if ((kv_sect[i].seq == KV_FREE_SEQ) && (i != kv_erasing)) {
+			n++;
+		}
+	}
+	return n;
+}
+
+/*
+ * Write the header of an erased sub-sector, everything but the
+ * magic number first and then the magic number.
+ */
+static void
+kv_write_header(int s, uint32_t erase_count, uint32_t seq)
+{
+	struct kv_sector_hdr sh;
+
+	sh.magic = KV_SECTOR_MAGIC;
+	sh.erase_count = erase_count;
+	sh.seq = seq;
+	sh.seq_check = (seq == KV_FREE_SEQ) ? KV_FREE_SEQ : ~seq;
+	qspi_write_flash(kv_sector_addr(s) + 4, (uint8_t *) &sh.erase_count,
+													KV_SHDR_SIZE - 4);
+	qspi_write_flash(kv_sector_addr(s), (uint8_t *) &sh.magic, 4);
+}
+
+/*
+ * Finish off a background erase by writing the sub-sector header
+ * back with the new erase count.
+ */
+static void
+kv_finish_erase(void)
+{
+	int s = kv_erasing;
+
+	if (s < 0) {
+		return;
+	}
+	qspi_wait();
+	kv_sect[s].erase_count++;
+	kv_write_header(s, kv_sect[s].erase_count, KV_FREE_SEQ);
+	kv_sect[s].formatted = 1;
+	kv_sect[s].seq = KV_FREE_SEQ;
+	kv_sect[s].used = KV_SHDR_SIZE;
+	kv_sect[s].live = 0;
+	kv_stat.erases++;
+	kv_erasing = -1;
+}
+
+/*
+ * Pick the least worn free sub-sector and make it the head of
+ * the log. Returns -1 if there isn't one.
+ */
+static int
+kv_new_head(void)
+{
+	uint32_t check;
+	int i, s;
+
+	s = -1;
+	for (i = 0; i < kv_nsect; i++) {
+		if ((kv_sect[i].seq != KV_FREE_SEQ) || (i == kv_erasing)) {
+			continue;
+		}
+		if ((s < 0) || (kv_sect[i].erase_count < kv_sect[s].erase_count)) {
+			s = i;
+		}
+	}
+	if (s < 0) {
+		return -1;
+	}
+	if (kv_sect[s].formatted) {
+		/* seq is still all 1's so it can be programmed in place */
+		check = ~kv_next_seq;
+		qspi_write_flash(kv_sector_addr(s) + 8,
+							(uint8_t *) &kv_next_seq, 4);
+		qspi_write_flash(kv_sector_addr(s) + 12, (uint8_t *) &check, 4);
+	} else {
+		kv_write_header(s, kv_sect[s].erase_count, kv_next_seq);
+		kv_sect[s].formatted = 1;
+	}
+	kv_sect[s].seq = kv_next_seq++;
+	kv_sect[s].used = KV_SHDR_SIZE;
+	kv_sect[s].live = 0;
+	kv_head = s;
+	return s;
+}
+
+/*
+ * Write a record to the head of the log. Moves to a new head
+ * sub-sector if it doesn't fit, compacting if it has to. Returns
+ * the FLASH address of the record or 0 if there is no room.
+ */
+static uint32_t
+kv_write_record(uint8_t flags, const char *key, int key_len,
+						const uint8_t *val, int val_len)
+{
+	struct kv_rec_hdr *rh = (struct kv_rec_hdr *) kv_buf;
+	uint32_t addr;
+	int size;
+	uint16_t crc;
+
+	size = KV_ALIGN(KV_RHDR_SIZE + key_len + val_len);
+	if ((kv_head < 0) || (kv_sect[kv_head].used + size > KV_SECTOR_SIZE)) {
+		/* leave the reserve for compaction to use */
+		while ((! kv_in_gc) && (kv_free_count() <= KV_GC_RESERVE)) {
+			if (kv_compact(1) != 0) {
+				break;
+			}
+		}
+		if (kv_new_head() < 0) {
+			return 0;
+		}
+	}
+
+	memset(kv_buf, 0xff, size);
+	rh->magic = KV_REC_MAGIC;
+	rh->flags = flags & ~KV_REC_PENDING;
+	rh->key_len = key_len;
+	rh->reserved = 0xff;
+	rh->val_len = val_len;
+	memcpy(kv_buf + KV_RHDR_SIZE, key, key_len);
+	if (val_len) {
+		memcpy(kv_buf + KV_RHDR_SIZE + key_len, val, val_len);
+	}
+	crc = kv_crc(kv_buf, 6, 0xffff);
+	rh->crc = kv_crc(kv_buf + KV_RHDR_SIZE, key_len + val_len, crc);
+
+	addr = kv_sector_addr(kv_head) + kv_sect[kv_head].used;
+	/* the CRC is of the finished record, write it as pending first */
+	rh->flags |= KV_REC_PENDING;
+	qspi_write_flash(addr, kv_buf, size);
+	rh->flags &= ~KV_REC_PENDING;
+	qspi_write_flash(addr + 1, &rh->flags, 1);
+	kv_sect[kv_head].used += size;
+	kv_stat.flash_bytes += size;
+	return addr;
+}
+
+/*
+ * Append a new record and make it the current one for its key.
+ */
+static int
+kv_append(uint8_t flags, const char *key, int key_len,
+						const uint8_t *val, int val_len)
+{
+	uint32_t addr;
+
+	addr = kv_write_record(flags, key, key_len, val, val_len);
+	if (addr == 0) {
+		return -1;
+	}
+	/* kv_buf still holds the record we just wrote */
+	kv_apply(addr, KV_ALIGN(KV_RHDR_SIZE + key_len + val_len));
+	return 0;
+}
+
+/*
+ * Compact one sub-sector. Normally the one with the least live
+ * data, unless wear leveling says otherwise. Live records are
+ * copied to the head of the log and the sub-sector is erased
+ * (in the background unless 'wait' is set). Returns 0 if it did
+ * something, -1 if there was nothing worth doing.
+ */
+static int
+kv_compact(int wait)
+{
+	struct kv_rec_hdr *rh = (struct kv_rec_hdr *) kv_buf;
+	uint32_t addr, naddr, oldest_seq, hash;
+	int i, s, cold, off, size, slot;
+
+	if (kv_erasing >= 0) {
+		kv_finish_erase();
+	}
+	s = -1;
+	cold = -1;
+	oldest_seq = KV_FREE_SEQ;
+	for (i = 0; i < kv_nsect; i++) {
+		if (kv_sect[i].seq < oldest_seq) {
+			oldest_seq = kv_sect[i].seq;
+		}
+		if ((kv_sect[i].seq == KV_FREE_SEQ) || (i == kv_head)) {
+			continue;
+		}
+		if ((s < 0) || (kv_sect[i].live < kv_sect[s].live)) {
+			s = i;
+		}
+		if ((cold < 0) || (kv_sect[i].erase_count < kv_sect[cold].erase_count)) {
+			cold = i;
+		}
+	}
+	if (s < 0) {
+		return -1;
+	}
+	for (i = 0; i < kv_nsect; i++) {
+		if (kv_sect[i].erase_count > kv_sect[cold].erase_count + KV_WEAR_DELTA) {
+			s = cold;	/* move the cold data out of the way */
+			break;
+		}
+	}
+	if ((s != cold) && (kv_sect[s].live + KV_SHDR_SIZE >= kv_sect[s].used)) {
+		return -1;	/* nothing but live data, no point */
+	}
+
+	/* copy the live records (and tombstones that still matter) */
+	addr = kv_sector_addr(s);
+	for (off = KV_SHDR_SIZE; off < kv_sect[s].used; off += size) {
+		size = kv_read_record(addr + off, kv_sect[s].used - off);
+		if (size <= 0) {
+			break;
+		}
+		hash = kv_hash((char *)(kv_buf + KV_RHDR_SIZE), rh->key_len);
+		slot = kv_find((char *)(kv_buf + KV_RHDR_SIZE), rh->key_len, hash);
+		/* kv_find() uses its own buffer, kv_buf is still the record */
+		if (rh->flags & KV_REC_DELETED) {
+			/* an older value might still be out there */
+			if ((slot >= 0) || (kv_sect[s].seq == oldest_seq)) {
+				continue;
+			}
+		} else if ((slot < 0) || (kv_ndx[slot].addr != addr + off)) {
+			continue;
+		}
+		memcpy(kv_copy, kv_buf, size);
+		rh = (struct kv_rec_hdr *) kv_copy;
+		kv_in_gc = 1;
+		naddr = kv_write_record(rh->flags,
+					(char *)(kv_copy + KV_RHDR_SIZE), rh->key_len,
+					kv_copy + KV_RHDR_SIZE + rh->key_len, rh->val_len);
+		kv_in_gc = 0;
+		rh = (struct kv_rec_hdr *) kv_buf;
+		if (naddr == 0) {
+			return -1;
+		}
+		if (slot >= 0) {
+			kv_ndx[slot].addr = naddr;
+			kv_sect[s].live -= size;
+			kv_sect[kv_head].live += size;
+		}
+	}
+
+	kv_stat.compactions++;
+	kv_sect[s].seq = KV_FREE_SEQ;
+	kv_sect[s].live = 0;
+	kv_erasing = s;
+	qspi_erase_range(addr, KV_SECTOR_SIZE);
+	if (wait) {
+		kv_finish_erase();
+	}
+	return 0;
+}
+
+/*
+ * kv_init( ... )
+ *
+ * Mount the store in 'nsect' 4K sub-sectors of FLASH starting
+ * at 'base' (must be 4K aligned). Sub-sectors that have never
+ * been used are fine, they will be erased as needed. Returns
+ * the number of keys found or -1 if the parameters are bad.
+ */
+int
+kv_init(uint32_t base, int nsect)
+{
+	struct kv_sector_hdr sh;
+	int i, s;
+	uint32_t seq, max_erase;
+
+	if ((nsect < KV_GC_RESERVE + 2) || (nsect > KV_MAX_SECTORS) ||
+		(base & (KV_SECTOR_SIZE - 1))) {
+		return -1;
+	}
+	kv_base = base;
+	kv_nsect = nsect;
+	kv_head = -1;
+	kv_erasing = -1;
+	kv_next_seq = 0;
+	memset(&kv_stat, 0, sizeof(kv_stat));
+	for (i = 0; i < KV_INDEX_SIZE; i++) {
+		kv_ndx[i].addr = KV_EMPTY;
+	}
+
+	for (i = 0; i < nsect; i++) {
+		qspi_read_flash(kv_sector_addr(i), (uint8_t *) &sh, KV_SHDR_SIZE);
+		kv_sect[i].live = 0;
+		kv_sect[i].used = KV_SHDR_SIZE;
+		kv_sect[i].formatted = 0;
+		kv_sect[i].seq = KV_FREE_SEQ;
+		if (sh.magic != KV_SECTOR_MAGIC) {
+			/* never used, or something else was here */
+			kv_sect[i].erase_count = KV_FREE_SEQ;	/* don't know */
+			continue;
+		}
+		kv_sect[i].erase_count = sh.erase_count;
+		if ((sh.seq == KV_FREE_SEQ) && (sh.seq_check == KV_FREE_SEQ)) {
+			kv_sect[i].formatted = 1;
+		} else if (sh.seq_check == ~sh.seq) {
+			kv_sect[i].formatted = 1;
+			kv_sect[i].seq = sh.seq;
+			if (sh.seq >= kv_next_seq) {
+				kv_next_seq = sh.seq + 1;
+			}
+		}
+		/* otherwise it was becoming the head, nothing is in it yet */
+	}
+
+	/*
+	 * Unformatted sub-sectors might not be erased, fix that now. If
+	 * one was in use and the power went out before its header was
+	 * written back after an erase, its erase count is gone. Rather
+	 * than start it over at 0 (which would make it look like the
+	 * least worn one) assume it is as worn as the most worn one we
+	 * know about.
+	 */
+	max_erase = 0;
+	for (i = 0; i < nsect; i++) {
+		if ((kv_sect[i].erase_count != KV_FREE_SEQ) &&
+			(kv_sect[i].erase_count > max_erase)) {
+			max_erase = kv_sect[i].erase_count;
+		}
+	}
+	for (i = 0; i < nsect; i++) {
+		if (! kv_sect[i].formatted) {
+			if (kv_sect[i].erase_count == KV_FREE_SEQ) {
+				kv_sect[i].erase_count = max_erase;
+			}
+			kv_erasing = i;
+			qspi_erase_range(kv_sector_addr(i), KV_SECTOR_SIZE);
+			kv_finish_erase();
+		}
+	}
+	kv_stat.erases = 0;
+
+	/* replay the log, oldest sub-sector first */
+	seq = 0;
+	while (1) {
+		s = -1;
+		for (i = 0; i < nsect; i++) {
+			if ((kv_sect[i].seq != KV_FREE_SEQ) && (kv_sect[i].seq >= seq) &&
+				((s < 0) || (kv_sect[i].seq < kv_sect[s].seq))) {
+				s = i;
+			}
+		}
+		if (s < 0) {
+			break;
+		}
+		kv_scan(s);
+		kv_head = s;
+		seq = kv_sect[s].seq + 1;
+	}
+	return kv_stat.keys;
+}
+
+/*
+ * kv_get( ... )
+ *
+ * Copy the value of 'key' into 'val' (at most 'max_len' bytes).
+ * Returns the length of the value, or -1 if there isn't one.
+ */
+int
+kv_get(const char *key, uint8_t *val, int max_len)
+{
+	struct kv_rec_hdr rh;
+	int	i, key_len;
+
+	key_len = strlen(key);
+	if ((key_len == 0) || (key_len > KV_MAX_KEY)) {
+		return -1;
+	}
+	i = kv_find(key, key_len, kv_hash(key, key_len));
+	if (i < 0) {
+		return -1;
+	}
+	qspi_read_flash(kv_ndx[i].addr, (uint8_t *) &rh, KV_RHDR_SIZE);
+	if (rh.val_len < max_len) {
+		max_len = rh.val_len;
+	}
+	if (max_len > 0) {
+		qspi_read_flash(kv_ndx[i].addr + KV_RHDR_SIZE + key_len, val, max_len);
+	}
+	return rh.val_len;
+}
+
+/*
+ * kv_set( ... )
+ *
+ * Store 'len' bytes of 'val' as the value of 'key'. Returns 0
+ * on success, -1 if the key or value is too big or the store
+ * is full.
+ */
+int
+kv_set(const char *key, const uint8_t *val, int len)
+{
+	int key_len;
+
+	key_len = strlen(key);
+	if ((key_len == 0) || (key_len > KV_MAX_KEY) ||
+		(len < 0) || (len > KV_MAX_VALUE)) {
+		return -1;
+	}
+	kv_stat.user_bytes += key_len + len;
+	return kv_append(0, key, key_len, val, len);
+}
+
+/*
+ * kv_delete( ... )
+ *
+ * Remove 'key' from the store. Returns 0 if it was there, -1 if not.
+ */
+int
+kv_delete(const char *key)
+{
+	int key_len;
+
+	key_len = strlen(key);
+	if ((key_len == 0) || (key_len > KV_MAX_KEY) ||
+		(kv_find(key, key_len, kv_hash(key, key_len)) < 0)) {
+		return -1;
+	}
+	return kv_append(KV_REC_DELETED, key, key_len, NULL, 0);
+}
+
+/*
+ * kv_service()
+ *
+ * Background housekeeping, call it from the main loop. It does
+ * at most one step (finish an erase, or compact one sub-sector).
+ * The erase, which is the slow part (a few hundred mS), happens in
+ * the background and it doesn't wait for that. It does wait for
+ * the writes, which are the live records copied out of a sub-sector
+ * when it is compacted (at most 4K, about 8mS of page programming)
+ * and the 16 byte header after an erase. Returns 1 if there is
+ * more to do, 0 if it is idle.
+ */
+int
+kv_service(void)
+{
+	if (kv_erasing >= 0) {
+		if (qspi_busy()) {
+			return 1;
+		}
+		kv_finish_erase();
+		return 1;
+	}
+	if (kv_free_count() < KV_GC_THRESHOLD) {
+		return (kv_compact(0) == 0);
+	}
+	return 0;
+}
+
+/*
+ * kv_get_stats( ... )
+ *
+ * Fill in the statistics, write amplification is flash_bytes
+ * divided by user_bytes.
+ */
+void
+kv_get_stats(struct kv_stats *st)
+{
+	int i;
+
+	*st = kv_stat;
+	st->free_sectors = kv_free_count();
+	st->min_erase = st->max_erase = kv_sect[0].erase_count;
+	for (i = 1; i < kv_nsect; i++) {
+		if (kv_sect[i].erase_count < st->min_erase) {
+			st->min_erase = kv_sect[i].erase_count;
+		}
+		if (kv_sect[i].erase_count > st->max_erase) {
+			st->max_erase = kv_sect[i].erase_count;
+		}
+	}
+}
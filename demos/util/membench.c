@@ -0,0 +1,337 @@
+/*
+ * membench.c - measure how fast a chunk of memory is
+ *
+ * Copyright (c) 2016, Chuck McManis (cmcmanis@mcmanis.com)
+ *
+ * When you change the FMC timing for the SDRAM (or where the frame
+ * buffers are, or how big the bursts are) you want to know if it
+ * made things better or worse. This code runs the same set of tests
+ * over a buffer and times each one with the DWT cycle counter, so
+ * the results are in CPU clocks rather than milliseconds. The tests
+ * are:
+ *
+ *	seq write	- 32 bit stores, one after the other
+ *	seq read	- 32 bit loads, one after the other
+ *	rand read	- 32 bit loads from pseudo random addresses, this is
+ *			  mostly the latency of opening a new row
+ *	rand write	- same for stores (the write buffer hides some of it)
+ *	ldm/stm copy	- copy half the buffer to the other half 32 bytes
+ *			  at a time with LDM/STM bursts
+ *	memcpy		- same copy with newlib's memcpy()
+ *	dma2d r2m	- DMA2D filling the buffer with a color
+ *	dma2d m2m	- DMA2D copying half the buffer to the other half
+ *
+ * If the LTDC is running when the tests start, the sequential read
+ * and the DMA2D copy are run again in a second pass with the label
+ * saying so, the LTDC is reading the frame buffer out of the same
+ * SDRAM so that shows you how much the display costs everyone else.
+ * (run the tests once with the display off and once with it on to
+ * compare) Note the DSI display on this board runs in command mode,
+ * the LTDC only reads the frame buffer while a frame is being sent
+ * (after lcd_flip()), so the contention you see depends on how often
+ * your program flips.
+ *
+ * The cycle counts include a few clocks per access for the loop
+ * itself, and the SysTick interrupt is still running, so treat the
+ * small differences with some suspicion.
+ *
+ * Whatever was in the buffer is destroyed.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <libopencm3/stm32/rcc.h>
+#include <libopencm3/stm32/fsmc.h>
+#include <libopencm3/stm32/ltdc.h>
+#include <libopencm3/stm32/dma2d.h>
+#include <libopencm3/cm3/dwt.h>
+#include "../util/util.h"
+#include "../util/helpers.h"
+
+#define RAND_COUNT		65536
+#define DMA2D_LINE		1024	/* pixels (4K bytes) per DMA2D line */
+
+static volatile uint32_t bench_sink;
+
+static void bench_start(struct membench_result *r, const char *name,
+										uint32_t bytes, uint32_t count);
+static void bench_stop(struct membench_result *r);
+static void seq_write(uint32_t *p, uint32_t words);
+static void seq_read(uint32_t *p, uint32_t words);
+static void rand_read(uint32_t *p, uint32_t mask);
+static void rand_write(uint32_t *p, uint32_t mask);
+static void burst_copy(uint32_t *dst, const uint32_t *src, uint32_t words);
+static void dma2d_wait(void);
+static void dma2d_r2m(uint8_t *dst, uint32_t lines);
+static void dma2d_m2m(uint8_t *dst, uint8_t *src, uint32_t lines);
+static int cpu_tests(uint8_t *buf, uint32_t len, struct membench_result *res,
+												int max, int ltdc);
+
+/*
+ * Record the start of a test, the counter is read last so that
+ * the bookkeeping isn't counted.
+ */
+static void
+bench_start(struct membench_result *r, const char *name, uint32_t bytes,
+															uint32_t count)
+{
+	r->name = name;
+	r->bytes = bytes;
+	r->count = count;
+	r->cycles = dwt_read_cycle_counter();
+}
+
+static void
+bench_stop(struct membench_result *r)
+{
+	r->cycles = dwt_read_cycle_counter() - r->cycles;
+}
+
+/*
+ * The loops are unrolled by 8 so the loop overhead is small
+ * compared to the accesses, 'words' is a multiple of 8.
+ */
+static void
+seq_write(uint32_t *p, uint32_t words)
+{
+	uint32_t v = 0x5a5aa5a5;
+
+	while (words) {
+		p[0] = v; p[1] = v; p[2] = v; p[3] = v;
+		p[4] = v; p[5] = v; p[6] = v; p[7] = v;
+		p += 8;
+		words -= 8;
+	}
+}
+
+static void
+seq_read(uint32_t *p, uint32_t words)
+{
+	uint32_t sum = 0;
+
+	while (words) {
+		sum += p[0] + p[1] + p[2] + p[3];
+		sum += p[4] + p[5] + p[6] + p[7];
+		p += 8;
+		words -= 8;
+	}
+	bench_sink = sum;
+}
+
+/*
+ * Random addresses come from a simple LCG, 'mask' is the
+ * buffer size in words minus 1 (a power of 2).
+ */
+static void
+rand_read(uint32_t *p, uint32_t mask)
+{
+	uint32_t x = 1, sum = 0;
+	int i;
+
+	for (i = 0; i < RAND_COUNT; i++) {
+		x = x * 1664525 + 1013904223;
+		sum += p[(x >> 8) & mask];
+	}
+	bench_sink = sum;
+}
+
+static void
+rand_write(uint32_t *p, uint32_t mask)
+{
+	uint32_t x = 1;
+	int i;
+
+	for (i = 0; i < RAND_COUNT; i++) {
+		x = x * 1664525 + 1013904223;
+		p[(x >> 8) & mask] = x;
+	}
+}
+
+/*
+ * Copy 32 bytes at a time with LDM/STM, which the FMC sees as
+ * 8 beat bursts. 'words' is a multiple of 8. (r7 is left alone
+ * since it may be the frame pointer)
+ */
+static void
+burst_copy(uint32_t *dst, const uint32_t *src, uint32_t words)
+{
+	__asm__ volatile (
+		"1:	ldmia	%1!, {r3, r4, r5, r6, r8, r9, r10, r12}\n"
+		"	stmia	%0!, {r3, r4, r5, r6, r8, r9, r10, r12}\n"
+		"	subs	%2, %2, #8\n"
+		"	bne	1b\n"
+		: "+r" (dst), "+r" (src), "+r" (words)
+		:
+		: "r3", "r4", "r5", "r6", "r8", "r9", "r10", "r12", "cc", "memory");
+}
+
+static void
+dma2d_wait(void)
+{
+	while (DMA2D_CR & DMA2D_CR_START) ;
+}
+
+/*
+ * The DMA2D moves DMA2D_LINE ARGB8888 pixels per line, and
+ * as many lines as it takes to cover the buffer.
+ */
+static void
+dma2d_r2m(uint8_t *dst, uint32_t lines)
+{
+	DMA2D_IFCR |= 0x3F;
+	DMA2D_CR = DMA2D_SET(CR, MODE, DMA2D_CR_MODE_R2M);
+	DMA2D_OPFCCR = 0x0; /* ARGB8888 */
+	DMA2D_OCOLR = 0xff5a5aa5;
+	DMA2D_OOR = 0;
+	DMA2D_NLR = DMA2D_SET(NLR, PL, DMA2D_LINE) | lines;
+	DMA2D_OMAR = (uint32_t) dst;
+	DMA2D_CR |= DMA2D_CR_START;
+	dma2d_wait();
+}
+
+static void
+dma2d_m2m(uint8_t *dst, uint8_t *src, uint32_t lines)
+{
+	DMA2D_IFCR |= 0x3F;
+	DMA2D_CR = DMA2D_SET(CR, MODE, DMA2D_CR_MODE_M2M);
+	DMA2D_FGPFCCR = 0x0;
+	DMA2D_FGMAR = (uint32_t) src;
+	DMA2D_FGOR = 0;
+	DMA2D_OOR = 0;
+	DMA2D_NLR = DMA2D_SET(NLR, PL, DMA2D_LINE) | lines;
+	DMA2D_OMAR = (uint32_t) dst;
+	DMA2D_CR |= DMA2D_CR_START;
+	dma2d_wait();
+}
+
+/*
+ * One pass of the tests, the full set or (if 'ltdc' is set) just
+ * the ones that are repeated while the LTDC is running.
+ */
+static int
+cpu_tests(uint8_t *buf, uint32_t len, struct membench_result *res, int max,
+																int ltdc)
+{
+	uint32_t *p = (uint32_t *) buf;
+	uint32_t half = len / 2;
+	uint32_t mask;
+	int n = 0;
+
+	if (ltdc) {
+		if (max < 2) {
+			return 0;
+		}
+		bench_start(&res[n], "seq read (LTDC on)", len, len / 4);
+		seq_read(p, len / 4);
+		bench_stop(&res[n++]);
+		bench_start(&res[n], "dma2d m2m (LTDC on)", half, half / 4);
+		dma2d_m2m(buf + half, buf, half / (DMA2D_LINE * 4));
+		bench_stop(&res[n++]);
+		return n;
+	}
+
+	/* largest power of 2 number of words that fits */
+	for (mask = 1; (mask * 2) <= len / 4; mask *= 2) ;
+	mask--;
+
+	if (n < max) {
+		bench_start(&res[n], "seq write", len, len / 4);
+		seq_write(p, len / 4);
+		bench_stop(&res[n++]);
+	}
+	if (n < max) {
+		bench_start(&res[n], "seq read", len, len / 4);
+		seq_read(p, len / 4);
+		bench_stop(&res[n++]);
+	}
+	if (n < max) {
+		bench_start(&res[n], "rand read", RAND_COUNT * 4, RAND_COUNT);
+		rand_read(p, mask);
+		bench_stop(&res[n++]);
+	}
+	if (n < max) {
+		bench_start(&res[n], "rand write", RAND_COUNT * 4, RAND_COUNT);
+		rand_write(p, mask);
+		bench_stop(&res[n++]);
+	}
+	if (n < max) {
+		bench_start(&res[n], "ldm/stm copy", half, half / 32);
+		burst_copy((uint32_t *)(buf + half), p, half / 4);
+		bench_stop(&res[n++]);
+	}
+	if (n < max) {
+		bench_start(&res[n], "memcpy", half, half / 4);
+		memcpy(buf + half, buf, half);
+		bench_stop(&res[n++]);
+	}
+	if (n < max) {
+		bench_start(&res[n], "dma2d r2m", len, len / 4);
+		dma2d_r2m(buf, len / (DMA2D_LINE * 4));
+		bench_stop(&res[n++]);
+	}
+	if (n < max) {
+		bench_start(&res[n], "dma2d m2m", half, half / 4);
+		dma2d_m2m(buf + half, buf, half / (DMA2D_LINE * 4));
+		bench_stop(&res[n++]);
+	}
+	return n;
+}
+
+/*
+ * membench_run( ... )
+ *
+ * Run the benchmarks over 'len' bytes at 'buf' (rounded down to a
+ * multiple of 8K so the DMA2D lines come out even). Fills in up to
+ * 'max' results and returns how many there are, or -1 if the buffer
+ * is too small.
+ */
+int
+membench_run(uint8_t *buf, uint32_t len, struct membench_result *res, int max)
+{
+	int n;
+
+	len &= ~(2 * DMA2D_LINE * 4 - 1);
+	if ((len < 64 * 1024) || (max <= 0)) {
+		return -1;
+	}
+	rcc_periph_clock_enable(RCC_DMA2D);
+	dwt_enable_cycle_counter();
+	/* the DMA2D might be busy with someone else's work */
+	dma2d_wait();
+	n = cpu_tests(buf, len, res, max, 0);
+	if (LTDC_GCR & LTDC_GCR_LTDCEN) {
+		n += cpu_tests(buf, len, res + n, max - n, 1);
+	}
+	return n;
+}
+
+/*
+ * membench_print( ... )
+ *
+ * Print the results as a table, along with the FMC settings
+ * they were measured with.
+ */
+void
+membench_print(const struct membench_result *res, int n)
+{
+	uint32_t mhz = rcc_ahb_frequency / 1000000;
+	uint32_t kbs, cpa;
+	int i;
+
+	printf("FMC SDCR1 0x%08x, SDTR1 0x%08x, HCLK %u MHz\n",
+		(unsigned int) FMC_SDCR1, (unsigned int) FMC_SDTR1, (unsigned int) mhz);
+	printf("%-20s %9s %10s %9s %10s\n", "Test", "Bytes", "Cycles", "MB/sec",
+															"Cyc/access");
+	for (i = 0; i < n; i++) {
+		/* bytes / (cycles / MHz) is bytes per microsecond (MB/sec) */
+		kbs = (res[i].cycles) ?
+			(uint32_t)(((uint64_t) res[i].bytes * mhz * 1000) / res[i].cycles) : 0;
+		/* hundredths of a cycle */
+		cpa = (res[i].count) ?
+			(uint32_t)(((uint64_t) res[i].cycles * 100) / res[i].count) : 0;
+		printf("%-20s %9u %10u %5u.%03u %7u.%02u\n", res[i].name,
+			(unsigned int) res[i].bytes, (unsigned int) res[i].cycles,
+			(unsigned int)(kbs / 1000), (unsigned int)(kbs % 1000),
+			(unsigned int)(cpa / 100), (unsigned int)(cpa % 100));
+	}
+}
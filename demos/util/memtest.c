@@ -0,0 +1,344 @@
+/*
+ * memtest.c - test the SDRAM (or any other RAM)
+ *
+ * Copyright (c) 2016, Chuck McManis (cmcmanis@mcmanis.com)
+ *
+ * A few classic memory tests:
+ *
+ *	Data bus	- walk a 1 across all 32 data lines at one address,
+ *			  finds shorted or open data lines.
+ *	Address bus	- write a different value at every power of 2
+ *			  offset and make sure none of them alias, finds
+ *			  shorted or open address lines (and bank selects).
+ *	Pattern		- fill everything with a pattern using the DMA2D
+ *			  and read it back with the CPU. The DMA2D writes
+ *			  as fast as the FMC will take it so this is the
+ *			  quick check of all the cells.
+ *	March-C		- the real test for stuck, transition, and coupling
+ *			  faults. Each element walks the memory (up or down)
+ *			  reading the old value and writing the new one:
+ *			    (w0) up(r0,w1) up(r1,w0) down(r0,w1) down(r1,w0) (r0)
+ *			  The first (w0) is done with the DMA2D, the rest
+ *			  have to read each word before writing it so they
+ *			  are done by the CPU with unrolled loops.
+ *
+ * The DMA2D can't compare anything, so every read back is done by
+ * the CPU. memtest_quick() (data bus, address bus, and two patterns)
+ * over all 16MB takes well under a second, good enough for a boot
+ * time check. March-C over 16MB takes a few seconds, so there is
+ * also an incremental version that does March-C one chunk at a time
+ * and stops when its time is up, call memtest_bg_step() from your
+ * main loop to keep testing in the background.
+ *
+ * All of these destroy what was in the memory.
+ */
+#include <stdint.h>
+#include <libopencm3/stm32/rcc.h>
+#include <libopencm3/stm32/dma2d.h>
+#include "../util/util.h"
+#include "../util/helpers.h"
+
+#define MT_DMA2D_LINE	1024		/* pixels (4K bytes) per DMA2D line */
+#define MT_DMA2D_BYTES	(MT_DMA2D_LINE * 4)
+
+static void mt_fail(struct memtest_result *r, volatile uint32_t *addr,
+											uint32_t expect, uint32_t got);
+static void mt_fill(uint32_t *base, uint32_t len, uint32_t pattern);
+static int mt_check(uint32_t *base, uint32_t words, uint32_t pattern,
+													struct memtest_result *r);
+static int mt_up(uint32_t *base, uint32_t words, uint32_t rd, uint32_t wr,
+													struct memtest_result *r);
+static int mt_down(uint32_t *base, uint32_t words, uint32_t rd, uint32_t wr,
+													struct memtest_result *r);
+
+/*
+ * Record an error, the first one is kept.
+ */
+static void
+mt_fail(struct memtest_result *r, volatile uint32_t *addr, uint32_t expect,
+																uint32_t got)
+{
+	if (r->errors++ == 0) {
+		r->fail_addr = (uint32_t *) addr;
+		r->expected = expect;
+		r->actual = got;
+	}
+}
+
+/*
+ * Fill 'len' bytes with 'pattern', the DMA2D does all the whole
+ * 4K pieces and the CPU does whatever is left over.
+ */
+static void
+mt_fill(uint32_t *base, uint32_t len, uint32_t pattern)
+{
+	uint32_t lines = len / MT_DMA2D_BYTES;
+	uint32_t *p;
+
+	if (lines) {
+		rcc_periph_clock_enable(RCC_DMA2D);
+		while (DMA2D_CR & DMA2D_CR_START) ;
+		DMA2D_IFCR |= 0x3F;
+		DMA2D_CR = DMA2D_SET(CR, MODE, DMA2D_CR_MODE_R2M);
+		DMA2D_OPFCCR = 0x0; /* ARGB8888, so the color is the pattern */
+		DMA2D_OCOLR = pattern;
+		DMA2D_OOR = 0;
+		DMA2D_NLR = DMA2D_SET(NLR, PL, MT_DMA2D_LINE) | lines;
+		DMA2D_OMAR = (uint32_t) base;
+		DMA2D_CR |= DMA2D_CR_START;
+		while (DMA2D_CR & DMA2D_CR_START) ;
+	}
+	for (p = base + lines * MT_DMA2D_LINE; p < base + len / 4; p++) {
+		*p = pattern;
+	}
+}
+
+/*
+ * Check 'words' words all hold 'pattern'. The fast path reads 8
+ * at a time and only looks closer if one of them is wrong.
+ */
+static int
+mt_check(uint32_t *base, uint32_t words, uint32_t pattern,
+												struct memtest_result *r)
+{
+	volatile uint32_t *p = base;
+	uint32_t bad, i;
+	int errors = 0;
+
+	while (words >= 8) {
+		bad = (p[0] ^ pattern) | (p[1] ^ pattern) | (p[2] ^ pattern) |
+			  (p[3] ^ pattern) | (p[4] ^ pattern) | (p[5] ^ pattern) |
+			  (p[6] ^ pattern) | (p[7] ^ pattern);
+		if (bad) {
+			for (i = 0; i < 8; i++) {
+				if (p[i] != pattern) {
+					mt_fail(r, &p[i], pattern, p[i]);
+					errors++;
+				}
+			}
+		}
+		p += 8;
+		words -= 8;
+	}
+	while (words--) {
+		if (*p != pattern) {
+			mt_fail(r, p, pattern, *p);
+			errors++;
+		}
+		p++;
+	}
+	return errors;
+}
+
+/*
+ * One ascending March element, read 'rd' and write 'wr' at
+ * each address in turn.
+ */
+static int
+mt_up(uint32_t *base, uint32_t words, uint32_t rd, uint32_t wr,
+												struct memtest_result *r)
+{
+	volatile uint32_t *p = base;
+	volatile uint32_t *end = base + words;
+	uint32_t v;
+	int errors = 0;
+
+	while (p < end) {
+		v = *p;
+		if (v != rd) {
+			mt_fail(r, p, rd, v);
+			errors++;
+		}
+		*p++ = wr;
+	}
+	return errors;
+}
+
+/*
+ * And the descending version.
+ */
+static int
+mt_down(uint32_t *base, uint32_t words, uint32_t rd, uint32_t wr,
+												struct memtest_result *r)
+{
+	volatile uint32_t *p = base + words;
+	uint32_t v;
+	int errors = 0;
+
+	while (p > base) {
+		p--;
+		v = *p;
+		if (v != rd) {
+			mt_fail(r, p, rd, v);
+			errors++;
+		}
+		*p = wr;
+	}
+	return errors;
+}
+
+/*
+ * memtest_data_bus( ... )
+ *
+ * Walk a 1 across the data bus at 'addr'. Returns the number
+ * of bad bits.
+ */
+int
+memtest_data_bus(uint32_t *addr, struct memtest_result *r)
+{
+	volatile uint32_t *p = addr;
+	uint32_t bit;
+	int errors = 0;
+
+	for (bit = 1; bit != 0; bit <<= 1) {
+		*p = bit;
+		if (*p != bit) {
+			mt_fail(r, p, bit, *p);
+			errors++;
+		}
+	}
+	return errors;
+}
+
+/*
+ * memtest_addr_bus( ... )
+ *
+ * Write a marker at every power of 2 word offset in 'len' bytes
+ * at 'base', then write the opposite at each one in turn and make
+ * sure it didn't show up anywhere else. Returns the number of
+ * errors.
+ */
+int
+memtest_addr_bus(uint32_t *base, uint32_t len, struct memtest_result *r)
+{
+	volatile uint32_t *p = base;
+	uint32_t words = len / 4;
+	uint32_t off, test;
+	int errors = 0;
+
+	for (off = 1; off < words; off <<= 1) {
+		p[off] = 0xaaaaaaaa;
+	}
+	p[0] = 0x55555555;
+	for (off = 1; off < words; off <<= 1) {
+		if (p[off] != 0xaaaaaaaa) {
+			/* stuck high, address 0 showed up here */
+			mt_fail(r, &p[off], 0xaaaaaaaa, p[off]);
+			errors++;
+		}
+	}
+	p[0] = 0xaaaaaaaa;
+	for (test = 1; test < words; test <<= 1) {
+		p[test] = 0x55555555;
+		if (p[0] != 0xaaaaaaaa) {
+			mt_fail(r, &p[0], 0xaaaaaaaa, p[0]);
+			errors++;
+		}
+		for (off = 1; off < words; off <<= 1) {
+			if ((off != test) && (p[off] != 0xaaaaaaaa)) {
+				mt_fail(r, &p[off], 0xaaaaaaaa, p[off]);
+				errors++;
+			}
+		}
+		p[test] = 0xaaaaaaaa;
+	}
+	return errors;
+}
+
+/*
+ * memtest_pattern( ... )
+ *
+ * Fill 'len' bytes with 'pattern' (DMA2D) and check it (CPU).
+ */
+int
+memtest_pattern(uint32_t *base, uint32_t len, uint32_t pattern,
+												struct memtest_result *r)
+{
+	mt_fill(base, len, pattern);
+	return mt_check(base, len / 4, pattern, r);
+}
+
+/*
+ * memtest_march_c( ... )
+ *
+ * March-C over 'len' bytes at 'base'. Returns the number of errors.
+ */
+int
+memtest_march_c(uint32_t *base, uint32_t len, struct memtest_result *r)
+{
+	uint32_t words = len / 4;
+	int errors;
+
+	mt_fill(base, len, 0);
+	errors = mt_up(base, words, 0, 0xffffffff, r);
+	errors += mt_up(base, words, 0xffffffff, 0, r);
+	errors += mt_down(base, words, 0, 0xffffffff, r);
+	errors += mt_down(base, words, 0xffffffff, 0, r);
+	errors += mt_check(base, words, 0, r);
+	return errors;
+}
+
+/*
+ * memtest_quick( ... )
+ *
+ * The boot time test, data bus, address bus, and alternating bit
+ * patterns (both ways) over the whole thing.
+ */
+int
+memtest_quick(uint32_t *base, uint32_t len, struct memtest_result *r)
+{
+	int errors;
+
+	errors = memtest_data_bus(base, r);
+	errors += memtest_addr_bus(base, len, r);
+	errors += memtest_pattern(base, len, 0x55aa55aa, r);
+	errors += memtest_pattern(base, len, 0xaa55aa55, r);
+	return errors;
+}
+
+/*
+ * memtest_bg_start( ... )
+ *
+ * Set up an incremental March-C of 'len' bytes at 'base',
+ * done MEMTEST_CHUNK bytes at a time.
+ */
+void
+memtest_bg_start(struct memtest_bg *bg, uint32_t *base, uint32_t len)
+{
+	bg->base = base;
+	bg->len = len & ~(MEMTEST_CHUNK - 1);
+	bg->pos = 0;
+	bg->passes = 0;
+	bg->result.errors = 0;
+	bg->result.fail_addr = NULL;
+	bg->result.expected = 0;
+	bg->result.actual = 0;
+}
+
+/*
+ * memtest_bg_step( ... )
+ *
+ * Test chunks until 'max_ms' milliseconds have gone by (at
+ * least one chunk is done each call). Returns 1 when that
+ * finished a pass over the whole range, 0 if not.
+ */
+int
+memtest_bg_step(struct memtest_bg *bg, uint32_t max_ms)
+{
+	uint32_t t0 = mtime();
+
+	if (bg->len == 0) {
+		return 0;
+	}
+	do {
+		(void) memtest_march_c(bg->base + bg->pos / 4, MEMTEST_CHUNK,
+															&bg->result);
+		bg->pos += MEMTEST_CHUNK;
+		if (bg->pos >= bg->len) {
+			bg->pos = 0;
+			bg->passes++;
+			return 1;
+		}
+	} while ((mtime() - t0) < max_ms);
+	return 0;
+}
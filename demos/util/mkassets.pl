@@ -0,0 +1,165 @@
+#!/usr/bin/env perl
+#
+# mkassets.pl - pack bitmaps into an asset archive for the QSPI FLASH
+#
+# Usage: mkassets.pl <manifest> <output.bin>
+#
+# The manifest has one asset per line:
+#
+#	<name> <image file> <mode> [fg] [bg] [clut color ...]
+#
+# Where the image is a binary PGM (P5) or PPM (P6) file, mode is
+# one of ARGB8888, RGB888, RGB565, L8, L4, A8, or A4, and the colors
+# are ARGB8888 hex values (0xff00ff00 is opaque green). PPM files can
+# be packed as ARGB8888, RGB888, or RGB565, PGM files as L8, L4, A8,
+# or A4 (the gray value is the index or the alpha). Blank lines and
+# lines starting with '#' are ignored.
+#
+# The output is the archive described in assets.c, write it into the
+# FLASH at the address you pass to asset_open() (STM32CubeProgrammer
+# with the N25Q128A_STM32F469I-DISCO external loader does this, the
+# FLASH appears at 0x90000000).
+#
+use strict;
+use warnings;
+
+my %modes = (
+	ARGB8888 => 0, RGB888 => 1, RGB565 => 2,
+	L8 => 5, L4 => 8, A8 => 9, A4 => 10
+);
+
+die "Usage: $0 <manifest> <output.bin>\n" if (scalar @ARGV != 2);
+my ($manifest, $output) = @ARGV;
+
+sub align16 {
+	my ($n) = @_;
+	return ($n + 15) & ~15;
+}
+
+#
+# Read a PGM or PPM file, returns (width, height, channels, pixel bytes)
+#
+sub read_pnm {
+	my ($file) = @_;
+	open (my $fh, "<:raw", $file) or die "Can't open $file\n";
+	local $/;
+	my $data = <$fh>;
+	close $fh;
+	# strip comments from the header
+	my @fields;
+	while (scalar @fields < 4) {
+		$data =~ s/^\s*(#[^\n]*\n\s*)*//;
+		$data =~ s/^(\S+)// or die "$file: bad header\n";
+		push @fields, $1;
+	}
+	$data =~ s/^\s//;
+	my ($magic, $w, $h, $max) = @fields;
+	die "$file: only 8 bit binary PGM/PPM files are supported\n"
+		if ((($magic ne "P5") && ($magic ne "P6")) || ($max > 255));
+	my $ch = ($magic eq "P5") ? 1 : 3;
+	die "$file: short file\n" if (length($data) < $w * $h * $ch);
+	return ($w, $h, $ch, substr($data, 0, $w * $h * $ch));
+}
+
+#
+# Convert the pixels into the DMA2D's format, returns (stride, bytes)
+#
+sub convert {
+	my ($name, $mode, $w, $h, $ch, $pix) = @_;
+	my $out = "";
+	my @p = unpack("C*", $pix);
+
+	if ($mode =~ /^(ARGB8888|RGB888|RGB565)$/) {
+		die "$name: $mode needs a PPM image\n" if ($ch != 3);
+		for (my $i = 0; $i < $w * $h; $i++) {
+			my ($r, $g, $b) = @p[$i * 3 .. $i * 3 + 2];
+			if ($mode eq "ARGB8888") {
+				$out .= pack("CCCC", $b, $g, $r, 0xff);
+			} elsif ($mode eq "RGB888") {
+				$out .= pack("CCC", $b, $g, $r);
+			} else {
+				$out .= pack("v", (($r >> 3) << 11) | (($g >> 2) << 5) | ($b >> 3));
+			}
+		}
+		my $bpp = ($mode eq "ARGB8888") ? 4 : ($mode eq "RGB888") ? 3 : 2;
+		return ($w * $bpp, $out);
+	}
+	die "$name: $mode needs a PGM image\n" if ($ch != 1);
+	if (($mode eq "L8") || ($mode eq "A8")) {
+		return ($w, $pix);
+	}
+	# 4 bit modes, two pixels per byte, even pixel in the low nybble
+	my $stride = int(($w + 1) / 2);
+	for (my $y = 0; $y < $h; $y++) {
+		for (my $x = 0; $x < $w; $x += 2) {
+			my $lo = $p[$y * $w + $x] >> 4;
+			my $hi = ($x + 1 < $w) ? $p[$y * $w + $x + 1] >> 4 : 0;
+			$out .= pack("C", ($hi << 4) | $lo);
+		}
+	}
+	return ($stride, $out);
+}
+
+#
+# Pass 1, read the manifest and convert everything
+#
+my @assets;
+open (my $fh, "<", $manifest) or die "Can't open $manifest\n";
+while (my $line = <$fh>) {
+	chomp($line);
+	next if ($line =~ /^\s*(#|$)/);
+	my ($name, $file, $mode, @colors) = split(/\s+/, $line);
+	die "$manifest: bad line '$line'\n" if (not defined $mode);
+	die "$name: unknown mode $mode\n" if (not exists $modes{$mode});
+	die "$name: name is longer than 15 characters\n" if (length($name) > 15);
+	my ($w, $h, $ch, $pix) = read_pnm($file);
+	my ($stride, $data) = convert($name, $mode, $w, $h, $ch, $pix);
+	@colors = map { hex($_) } @colors;
+	my $fg = (scalar @colors) ? shift @colors : 0xffffffff;
+	my $bg = (scalar @colors) ? shift @colors : 0xff000000;
+	push @assets, { name => $name, mode => $modes{$mode}, w => $w, h => $h,
+					stride => $stride, data => $data, fg => $fg, bg => $bg,
+					clut => [ @colors ] };
+}
+close $fh;
+die "$manifest: no assets\n" if (scalar @assets == 0);
+
+#
+# Pass 2, lay out the archive
+#
+my $count = scalar @assets;
+my $offset = align16(16 + $count * 48);
+my $dir = "";
+my $body = "";
+foreach my $a (@assets) {
+	my $size = length($a->{data});
+	my $clut_len = scalar @{$a->{clut}};
+	my $clut_offset = 0;
+	$body .= $a->{data} . ("\0" x (align16($size) - $size));
+	my $data_offset = $offset;
+	$offset += align16($size);
+	if ($clut_len) {
+		$clut_offset = $offset;
+		$body .= pack("V*", @{$a->{clut}});
+		$body .= "\0" x (align16($clut_len * 4) - $clut_len * 4);
+		$offset += align16($clut_len * 4);
+	}
+	$dir .= pack("a16 V V v v v C C V V V v v", $a->{name}, $data_offset,
+				$size, $a->{w}, $a->{h}, $a->{stride}, $a->{mode}, 0,
+				$a->{fg}, $a->{bg}, $clut_offset, $clut_len, 0);
+	printf("%-16s %4d x %-4d mode %2d, %7d bytes at 0x%06x\n", $a->{name},
+				$a->{w}, $a->{h}, $a->{mode}, $size, $data_offset);
+}
+
+# FNV-1a of the directory
+my $check = 0x811c9dc5;
+foreach my $b (unpack("C*", $dir)) {
+	$check = (($check ^ $b) * 0x01000193) & 0xffffffff;
+}
+
+my $hdr = pack("V v v V V", 0x54455341, 1, $count, $offset, $check);
+my $pad = "\0" x (align16(16 + $count * 48) - (16 + $count * 48));
+open (my $out, ">:raw", $output) or die "Can't create $output\n";
+print $out $hdr, $dir, $pad, $body;
+close $out;
+printf("Wrote %d assets, %d bytes to %s\n", $count, $offset, $output);
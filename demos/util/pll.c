@@ -0,0 +1,223 @@
+/*
+ * pll.c - find the best main PLL settings for a clock
+ *
+ * Copyright (c) 2016, Chuck McManis (cmcmanis@mcmanis.com)
+ *
+ * The main PLL takes the input clock (HSE or HSI), divides it by M to
+ * get the VCO input, multiplies that by N to get the VCO, and then
+ * divides the VCO by P for SYSCLK, by Q for the 48 MHz USB/SDIO clock,
+ * and by R for the DSI. The limits (from RM0386) are:
+ *
+ *	VCO input	1 - 2 MHz (2 MHz is recommended, it has less jitter)
+ *	VCO output	100 - 432 MHz
+ *	M		2 - 63
+ *	N		50 - 432
+ *	P		2, 4, 6, or 8
+ *	Q		2 - 15
+ *	R		2 - 7
+ *	SYSCLK		168 MHz, or 180 MHz with over-drive on
+ *
+ * The old code in clock.c tried P values until the VCO was in range
+ * and then hunted for an M that made N come out even. That works for
+ * the easy numbers but it would take whatever it found first, didn't
+ * care if USB was going to work, and just picked R. This code tries
+ * every legal M, N, and P and gives each one a score, the lowest score
+ * wins. Getting SYSCLK right counts the most, then 48 MHz on Q, then
+ * what you asked for on R and from the PLLSAI, and last having the VCO
+ * input close to 2 MHz. For a given VCO the best Q (or R) is just the
+ * one closest to VCO / target so those are computed rather than
+ * searched.
+ *
+ * The PLLSAI (and PLLI2S) don't have their own M divider, they use the
+ * same VCO input as the main PLL. So if you need a particular VCO out
+ * of the PLLSAI (lcd_init() wants 384 MHz) the choice of M matters to
+ * it too, that is what 'sai_vco' is for.
+ *
+ * There is nothing in here that touches the hardware so it compiles
+ * and runs on the host as well, if you want to see what it picks for
+ * some clock call it from a main() of your own and pll_print() it.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include "../util/util.h"
+
+/* The internal clock frequency on the F4 chip */
+#define HSI_FREQUENCY		16000000
+
+#define VCO_IN_MIN			1000000
+#define VCO_IN_MAX			2000000
+#define VCO_MIN				100000000
+#define VCO_MAX				432000000
+#define USB_FREQUENCY		48000000
+#define USB_PPM_MAX			2500	/* USB full speed wants +/- 0.25% */
+
+/*
+ * How much an error costs, per part per million. SYSCLK has to be
+ * the most important, off by 1 ppm there costs more than 48 MHz
+ * being off by 100 ppm.
+ */
+#define SYSCLK_WEIGHT		1000
+#define USB_WEIGHT			10
+#define PLLR_WEIGHT			1
+#define SAI_WEIGHT			1
+
+static const int pllp_values[4] = {2, 4, 6, 8};
+
+static uint32_t ppm_error(uint32_t got, uint32_t want);
+static uint32_t best_div(uint32_t vco, uint32_t want, uint32_t lo, uint32_t hi);
+
+/*
+ * How far 'got' is from 'want' in parts per million.
+ */
+static uint32_t
+ppm_error(uint32_t got, uint32_t want)
+{
+	uint32_t diff = (got > want) ? got - want : want - got;
+
+	if (want == 0) {
+		return 0;
+	}
+	return (uint32_t)(((uint64_t) diff * 1000000) / want);
+}
+
+/*
+ * The divider between 'lo' and 'hi' that gets 'vco' closest
+ * to 'want'.
+ */
+static uint32_t
+best_div(uint32_t vco, uint32_t want, uint32_t lo, uint32_t hi)
+{
+	uint32_t d = (vco + (want / 2)) / want;
+
+	if (d < lo) {
+		d = lo;
+	}
+	if (d > hi) {
+		d = hi;
+	}
+	return d;
+}
+
+/*
+ * pll_solve( ... )
+ *
+ * Find the best PLL settings for 'req' and put them (and the clocks
+ * they really make) in 'sol'. Returns 0 if it found some, or -1 if
+ * nothing legal comes out at or under the SYSCLK limit (or nothing
+ * that makes the best SYSCLK it can also makes 48 MHz, and you said
+ * you needed it).
+ */
+int
+pll_solve(const struct pll_request *req, struct pll_solution *sol)
+{
+	uint32_t input = (req->input) ? req->input : HSI_FREQUENCY;
+	uint32_t max_sysclk = (req->flags & PLL_OVERDRIVE) ? PLL_SYSCLK_MAX_OD :
+														 PLL_SYSCLK_MAX;
+	uint32_t m, n, q, r, vco_in, vco, sysclk, usb, rclk, sai, sai_n;
+	uint32_t usb_ppm, sys_ppm, best_sys_ppm = 0xffffffff;
+	uint64_t score, sai_score;
+	int i, found = 0;
+
+	if ((req->sysclk == 0) || (req->sysclk > max_sysclk)) {
+		return -1;
+	}
+	for (m = 2; m <= 63; m++) {
+		if ((input < (VCO_IN_MIN * m)) || (input > (VCO_IN_MAX * m))) {
+			continue;
+		}
+		vco_in = input / m;
+		/* what the PLLSAI can do with this VCO input */
+		sai = 0;
+		sai_score = 0;
+		if (req->sai_vco) {
+			sai_n = best_div(req->sai_vco, vco_in, 50, 432);
+			sai = (uint32_t)(((uint64_t) input * sai_n) / m);
+			if ((sai < VCO_MIN) || (sai > VCO_MAX)) {
+				continue;
+			}
+			sai_score = (uint64_t) ppm_error(sai, req->sai_vco) * SAI_WEIGHT;
+		}
+		for (n = 50; n <= 432; n++) {
+			vco = (uint32_t)(((uint64_t) input * n) / m);
+			if ((vco < VCO_MIN) || (vco > VCO_MAX)) {
+				continue;
+			}
+			q = best_div(vco, USB_FREQUENCY, 2, 15);
+			usb = vco / q;
+			usb_ppm = ppm_error(usb, USB_FREQUENCY);
+			if (req->pllr) {
+				r = best_div(vco, req->pllr, 2, 7);
+			} else {
+				/* nobody cares, about 60 MHz like it always was */
+				r = best_div(vco, 60000000, 2, 7);
+			}
+			rclk = vco / r;
+			for (i = 0; i < 4; i++) {
+				sysclk = vco / pllp_values[i];
+				if (sysclk > max_sysclk) {
+					continue;
+				}
+				sys_ppm = ppm_error(sysclk, req->sysclk);
+				if (sys_ppm < best_sys_ppm) {
+					best_sys_ppm = sys_ppm;
+				}
+				if ((req->flags & PLL_NEED_USB) && (usb_ppm > USB_PPM_MAX)) {
+					continue;
+				}
+				score = (uint64_t) sys_ppm * SYSCLK_WEIGHT +
+						(uint64_t) usb_ppm * USB_WEIGHT + sai_score +
+						(VCO_IN_MAX - vco_in) / 1000;
+				if (req->pllr) {
+					score += (uint64_t) ppm_error(rclk, req->pllr) * PLLR_WEIGHT;
+				}
+				if (found && (score >= sol->score)) {
+					continue;
+				}
+				found = 1;
+				sol->score = score;
+				sol->p.pllm = m;
+				sol->p.plln = n;
+				sol->p.pllp = pllp_values[i];
+				sol->p.pllp_real = i;
+				sol->p.pllq = q;
+				sol->p.pllr = r;
+				sol->p.src = (req->input) ? 1 : 0;
+				sol->vco_in = vco_in;
+				sol->vco = vco;
+				sol->sysclk = sysclk;
+				sol->usb = usb;
+				sol->pllr = rclk;
+				sol->sai_vco = sai;
+			}
+		}
+	}
+	/*
+	 * Needing USB doesn't mean settling for a slower SYSCLK to get
+	 * it (180 MHz would quietly become 168 MHz), if 48 MHz costs any
+	 * SYSCLK accuracy that is a failure.
+	 */
+	if (found && (req->flags & PLL_NEED_USB) &&
+		(ppm_error(sol->sysclk, req->sysclk) > best_sys_ppm)) {
+		found = 0;
+	}
+	return (found) ? 0 : -1;
+}
+
+/*
+ * pll_print( ... )
+ *
+ * Print the settings and the clocks they make.
+ */
+void
+pll_print(const struct pll_solution *sol)
+{
+	printf("PLL: M=%d N=%d P=%d Q=%d R=%d (%s)\n", sol->p.pllm, sol->p.plln,
+			sol->p.pllp, sol->p.pllq, sol->p.pllr, (sol->p.src) ? "HSE" : "HSI");
+	printf("     VCO in %u Hz, VCO %u Hz, SYSCLK %u Hz, 48MHz %u Hz, R %u Hz\n",
+			(unsigned int) sol->vco_in, (unsigned int) sol->vco,
+			(unsigned int) sol->sysclk, (unsigned int) sol->usb,
+			(unsigned int) sol->pllr);
+	if (sol->sai_vco) {
+		printf("     PLLSAI VCO %u Hz\n", (unsigned int) sol->sai_vco);
+	}
+}
@@ -0,0 +1,338 @@
+/*
+ * profile.c - time bits of code with the DWT cycle counter
+ *
+ * Copyright (c) 2016, Chuck McManis (cmcmanis@mcmanis.com)
+ *
+ * mtime() counts milliseconds, which is fine for how long a frame
+ * took but useless for a single blit (a few microseconds). The
+ * Cortex-M4 has a cycle counter in the DWT (Data Watchpoint and
+ * Trace) unit which counts every CPU clock, so that is what this
+ * code uses instead. At 168 MHz that is about 6nS per count, and it
+ * wraps every 25 seconds or so, which doesn't matter as long as the
+ * thing you're timing takes less time than that.
+ *
+ * There are two kinds of things here:
+ *
+ * Timers - you get one with prof_timer("name") and then wrap the
+ *	code you want to time with prof_start() / prof_stop(), or put
+ *	PROF_SCOPE(id) at the top of a block and the time is recorded
+ *	when the block is left (it uses gcc's cleanup attribute). Each
+ *	timer keeps the count, min, max, and total, and a histogram of
+ *	the times by power of 2 so you can see if there are outliers.
+ *
+ * Trace - prof_trace(id, arg) drops an (id, arg, time) event into a
+ *	ring buffer, the newest PROF_TRACE_SIZE events are kept. This is
+ *	cheap enough to call from interrupt handlers and shows you what
+ *	happened in what order and how far apart.
+ *
+ * prof_dump() and prof_trace_dump() print it all out.
+ *
+ * If you compile this with -DPROFILE_HOST it uses clock_gettime()
+ * (in nanoseconds) instead so the same instrumented code can be run
+ * on Linux, the "cycles" are then nanoseconds.
+ */
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#ifdef PROFILE_HOST
+#include <time.h>
+#else
+#include <libopencm3/stm32/rcc.h>
+#include <libopencm3/cm3/cortex.h>
+#include <libopencm3/cm3/dwt.h>
+#endif
+#include "../util/util.h"
+
+static struct prof_timer prof_timers[PROF_MAX_TIMERS];
+static int prof_ntimers;
+
+static struct prof_event prof_ring[PROF_TRACE_SIZE];
+static volatile uint32_t prof_ring_count;	/* events ever recorded */
+
+static uint32_t prof_hz(void);
+static int prof_bucket(uint32_t cycles);
+static void prof_print_time(uint32_t cycles);
+
+#ifdef PROFILE_HOST
+/*
+ * On the host the "cycle" counter is nanoseconds.
+ */
+uint32_t
+prof_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint32_t)((uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+static uint32_t
+prof_hz(void)
+{
+	return 1000000000;
+}
+
+#define PROF_LOCK(m)	((void) (m))
+#define PROF_UNLOCK(m)	((void) (m))
+#else
+uint32_t
+prof_now(void)
+{
+	return dwt_read_cycle_counter();
+}
+
+static uint32_t
+prof_hz(void)
+{
+	return rcc_ahb_frequency;
+}
+
+#define PROF_LOCK(m)	(m) = cm_mask_interrupts(1)
+#define PROF_UNLOCK(m)	cm_mask_interrupts(m)
+#endif
+
+/*
+ * Histogram bucket n holds times from 2^(n + PROF_HIST_SHIFT) up to
+ * (but not including) twice that, the first one holds everything
+ * shorter and the last one everything longer.
+ */
+static int
+prof_bucket(uint32_t cycles)
+{
+	int b = 0;
+
+	cycles >>= PROF_HIST_SHIFT;
+	while (cycles > 1) {
+		cycles >>= 1;
+		b++;
+	}
+	return (b < PROF_HIST_BUCKETS) ? b : PROF_HIST_BUCKETS - 1;
+}
+
+/*
+ * Print a cycle count as microseconds (with a fraction) so that
+ * the columns line up.
+ */
+static void
+prof_print_time(uint32_t cycles)
+{
+	uint32_t ns = (uint32_t)(((uint64_t) cycles * 1000000000ULL) / prof_hz());
+
+	printf(" %7u.%03u", (unsigned int)(ns / 1000), (unsigned int)(ns % 1000));
+}
+
+/*
+ * prof_init( ... )
+ *
+ * Turn on the cycle counter and forget all the timers and the
+ * trace. Called by prof_timer() the first time if you don't.
+ */
+void
+prof_init(void)
+{
+#ifndef PROFILE_HOST
+	dwt_enable_cycle_counter();
+#endif
+	prof_ntimers = 0;
+	prof_ring_count = 0;
+}
+
+/*
+ * prof_timer( ... )
+ *
+ * Returns the id of the timer called 'name', creating it if it
+ * doesn't exist yet, or -1 if there is no room for another one.
+ * Look them up once (they are not meant to be found in a hot path).
+ */
+int
+prof_timer(const char *name)
+{
+	int i;
+
+	if (prof_ntimers == 0) {
+		prof_init();
+	}
+	for (i = 0; i < prof_ntimers; i++) {
+		if (strcmp(prof_timers[i].name, name) == 0) {
+			return i;
+		}
+	}
+	if (prof_ntimers >= PROF_MAX_TIMERS) {
+		return -1;
+	}
+	memset(&prof_timers[i], 0, sizeof(struct prof_timer));
+	prof_timers[i].name = name;
+	prof_timers[i].min = 0xffffffff;
+	return prof_ntimers++;
+}
+
+/*
+ * prof_stop( ... )
+ *
+ * Record the time since 'start' (from prof_start()) against
+ * timer 'id', returns the time in cycles.
+ */
+uint32_t
+prof_stop(int id, uint32_t start)
+{
+	uint32_t dt = prof_now() - start;
+	struct prof_timer *t;
+
+	if ((id < 0) || (id >= prof_ntimers)) {
+		return dt;
+	}
+	t = &prof_timers[id];
+	t->count++;
+	t->total += dt;
+	if (dt < t->min) {
+		t->min = dt;
+	}
+	if (dt > t->max) {
+		t->max = dt;
+	}
+	t->hist[prof_bucket(dt)]++;
+	return dt;
+}
+
+/*
+ * For PROF_SCOPE(), called by the compiler when the scope
+ * variable goes away.
+ */
+void
+prof_scope_end(struct prof_scope *s)
+{
+	(void) prof_stop(s->id, s->start);
+}
+
+/*
+ * prof_trace( ... )
+ *
+ * Add an event to the trace ring, overwriting the oldest one
+ * if it is full. Safe to call from an interrupt handler.
+ */
+void
+prof_trace(uint16_t id, uint16_t arg)
+{
+	struct prof_event *e;
+	uint32_t mask;
+
+	PROF_LOCK(mask);
+	e = &prof_ring[prof_ring_count++ % PROF_TRACE_SIZE];
+	e->when = prof_now();
+	e->id = id;
+	e->arg = arg;
+	PROF_UNLOCK(mask);
+}
+
+/*
+ * prof_get( ... )
+ *
+ * Returns timer 'id' (so you can look at the numbers yourself)
+ * or NULL if there isn't one.
+ */
+const struct prof_timer *
+prof_get(int id)
+{
+	return ((id < 0) || (id >= prof_ntimers)) ? NULL : &prof_timers[id];
+}
+
+/*
+ * prof_reset( ... )
+ *
+ * Zero the numbers in all the timers (they keep their names
+ * and ids) and empty the trace.
+ */
+void
+prof_reset(void)
+{
+	int i;
+
+	for (i = 0; i < prof_ntimers; i++) {
+		memset(&prof_timers[i].count, 0,
+				sizeof(struct prof_timer) - offsetof(struct prof_timer, count));
+		prof_timers[i].min = 0xffffffff;
+	}
+	prof_ring_count = 0;
+}
+
+/*
+ * prof_dump( ... )
+ *
+ * Print a table of all the timers (times in microseconds) and
+ * their histograms.
+ */
+void
+prof_dump(void)
+{
+	struct prof_timer *t;
+	uint32_t lo;
+	int i, b;
+
+	printf("%-16s %8s %11s %11s %11s\n", "Timer (uS)", "Count", "Min", "Avg",
+																"Max");
+	for (i = 0; i < prof_ntimers; i++) {
+		t = &prof_timers[i];
+		printf("%-16s %8u", t->name, (unsigned int) t->count);
+		if (t->count == 0) {
+			printf("\n");
+			continue;
+		}
+		prof_print_time(t->min);
+		prof_print_time((uint32_t)(t->total / t->count));
+		prof_print_time(t->max);
+		printf("\n");
+	}
+	/* the histograms, only the buckets that have something in them */
+	for (i = 0; i < prof_ntimers; i++) {
+		t = &prof_timers[i];
+		if (t->count == 0) {
+			continue;
+		}
+		printf("%s:\n", t->name);
+		for (b = 0; b < PROF_HIST_BUCKETS; b++) {
+			if (t->hist[b] == 0) {
+				continue;
+			}
+			lo = (b == 0) ? 0 : (1u << (b + PROF_HIST_SHIFT));
+			printf("  >= %9u cycles: %u\n", (unsigned int) lo,
+											(unsigned int) t->hist[b]);
+		}
+	}
+}
+
+/*
+ * prof_trace_dump( ... )
+ *
+ * Print the last 'n' trace events (0 for all of them), oldest
+ * first, with the time since the one before in microseconds.
+ */
+void
+prof_trace_dump(int n)
+{
+	uint32_t count = prof_ring_count;
+	uint32_t first, i, prev;
+	struct prof_event *e;
+
+	if (count == 0) {
+		printf("No trace events\n");
+		return;
+	}
+	if ((n <= 0) || (n > PROF_TRACE_SIZE)) {
+		n = PROF_TRACE_SIZE;
+	}
+	if ((uint32_t) n > count) {
+		n = count;
+	}
+	first = count - n;
+	prev = prof_ring[first % PROF_TRACE_SIZE].when;
+	printf("%8s %6s %6s %12s\n", "Event", "Id", "Arg", "Delta (uS)");
+	for (i = first; i < count; i++) {
+		e = &prof_ring[i % PROF_TRACE_SIZE];
+		printf("%8u %6u %6u ", (unsigned int) i, (unsigned int) e->id,
+														(unsigned int) e->arg);
+		prof_print_time(e->when - prev);
+		printf("\n");
+		prev = e->when;
+	}
+}
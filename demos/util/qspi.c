@@ -9,6 +9,9 @@
 #include <libopencm3/stm32/gpio.h>
 #include <libopencm3/stm32/quadspi.h>
 #include <libopencm3/stm32/dma.h>
+#include <libopencm3/stm32/dma2d.h>
+#include <libopencm3/cm3/nvic.h>
+#include <libopencm3/cm3/cortex.h>
 #include <gfx.h>
 #include "../util/util.h"
 
@@ -22,17 +25,53 @@
 #define FLASH_WRITE_PAGE	0x02
 #define FLASH_RESET_ENABLE	0x66
 #define FLASH_RESET_MEMORY	0x99
+#define FLASH_BULK_ERASE	0xc7
+
+/* Erase granularity of the N25Q128 */
+#define FLASH_SUB_SECTOR_SIZE	0x1000
+#define FLASH_SECTOR_SIZE	0x10000
+#define FLASH_CHIP_SIZE		0x1000000
 
 enum flash_reg {
 	STATUS_REG, VOLATILE_REG, NONVOLATILE_REG,
 	ENHANCED_VOLATILE_REG, FLAG_REG, LOCK_REG };
 
+/*
+ * The write engine uses DMA2 Stream 7, Channel 3 which is the
+ * QUADSPI request on the STM32F469 (RM0386, DMA2 request mapping)
+ */
+#define QSPI_DMA		DMA2
+#define QSPI_DMA_STREAM		DMA_STREAM7
+#define QSPI_DMA_CHANNEL	DMA_SxCR_CHSEL_3
+
+/* Flag bits in QUADSPI_FCR (same positions as in QUADSPI_SR) */
+#define QSPI_FLAG_TEF		0x01
+#define QSPI_FLAG_TCF		0x02
+#define QSPI_FLAG_SMF		0x08
+
+/* Bit 0 of the FLASH status register, write in progress */
+#define FLASH_STATUS_WIP	0x01
+
+/* FLASH program page size */
+#define FLASH_PAGE_SIZE		256
+
+/* CCM RAM is not reachable by the DMA controller */
+#define CCM_RAM_START		0x10000000U
+#define CCM_RAM_END		0x10010000U
+
 /*
  * Simple API for flash access (indirect API)
 		void qspi_init(void);
 		int qspi_read_flash(uint32_t addr, uint8_t *buf, int len);
 		int qspi_write_flash(uint32_t addr, uint8_t *buf, int len);
 		void qspi_erase_block(uint32_t addr);
+		int qspi_write_flash_async(uint32_t addr, uint8_t *buf, int len);
+		int qspi_erase_range(uint32_t addr, uint32_t len);
+		int qspi_busy(void);
+		int qspi_wait(void);
+		void qspi_begin_update(void);
+		void qspi_end_update(void);
+		uint8_t *qspi_mapped_addr(uint32_t addr);
  */
 
 /*
@@ -42,7 +81,70 @@ static void qspi_enable(uint8_t cmd);
 static uint16_t read_flash_register(enum flash_reg r);
 static void write_flash_register(enum flash_reg r, uint16_t value);
 static int qspi_read_data(uint8_t *buf, int max_len);
-static void qspi_write_data(uint32_t addr, uint8_t *buf, int len);
+static int page_fragment(uint32_t addr, int len);
+static int dma_reachable(uint8_t *buf);
+static void qspi_start_page(void);
+static void qspi_start_poll(void);
+static void qspi_stage_page(void);
+static void qspi_start_erase(void);
+static void qspi_indirect(void);
+static void qspi_restore(void);
+
+/*
+ * If qspi_cache.o is linked in, it gets told about every write
+ * and erase so that it can drop the lines that are now stale.
+ * Otherwise these calls end up in the empty function.
+ */
+void qspi_null_invalidate(uint32_t addr, uint32_t len);
+#pragma weak qspi_cache_invalidate = qspi_null_invalidate
+
+void
+qspi_null_invalidate(uint32_t addr __attribute__((unused)),
+					 uint32_t len __attribute__((unused)))
+{
+	return;
+}
+
+/*
+ * State of the current background operation. The write engine
+ * is driven from the QUADSPI interrupt, the foreground only
+ * starts it off and (optionally) waits for it to finish.
+ *
+ * While the FLASH chip is busy programming one page the ISR
+ * has already worked out where the next page comes from, and
+ * if the source can't be reached by DMA, copied it into the
+ * other half of the staging buffer.
+ */
+#define QSPI_OP_NONE		0
+#define QSPI_OP_WRITE		1
+#define QSPI_OP_ERASE		2
+
+static volatile struct {
+	int		op;		/* operation in progress */
+	uint32_t	addr;		/* FLASH address of the current page */
+	uint8_t		*src;		/* caller data for the current page */
+	int		len;		/* bytes in the current page */
+	int		remain;		/* bytes left after the current page */
+	uint32_t	erase_end;	/* end of the range being erased */
+	int		stage;		/* staging buffer in use (0 or 1) */
+	int		error;		/* set if the QUADSPI flagged an error */
+} qspi_job;
+
+static uint8_t qspi_stage_buf[2][FLASH_PAGE_SIZE];
+
+/*
+ * Mode tracking. The QUADSPI is either in memory mapped mode (and
+ * the FLASH can be read at 0x90000000) or in indirect mode. Reads,
+ * writes and erases need indirect mode, so if the FLASH is mapped
+ * they un-map it, do their thing, and map it again afterward. For
+ * background operations the re-map happens in the interrupt
+ * handler when the operation finishes. Between qspi_begin_update()
+ * and qspi_end_update() the re-map is held off so that a batch of
+ * writes only pays for one switch each way.
+ */
+static volatile int qspi_mapped;	/* FLASH is memory mapped now */
+static volatile int qspi_remap;		/* map it again when we're done */
+static int qspi_batch;			/* qspi_begin_update() depth */
 
 /*
  * This function sends a command to the FLASH
@@ -204,25 +306,77 @@ qspi_read_data(uint8_t *buf, int max_len)
 
 
 /*
- * Data writer for the flash. It does not check to insure the
- * area it is writing is erased. So if you haven't checked
- * for that you may not write what you expect (it can only
- * change bits from 1 to 0.
+ * Returns the number of bytes from 'addr' that can be written
+ * before hitting the end of a page (a page write that crosses
+ * the boundary wraps around to the beginning of the page),
+ * limited to 'len'.
+ */
+static int
+page_fragment(uint32_t addr, int len)
+{
+	int frac_len;
+
+	frac_len = FLASH_PAGE_SIZE - (addr & (FLASH_PAGE_SIZE - 1));
+	return (len < frac_len) ? len : frac_len;
+}
+
+/*
+ * Returns true if the DMA controller can read from this buffer.
+ */
+static int
+dma_reachable(uint8_t *buf)
+{
+	uint32_t a = (uint32_t) buf;
+
+	return ((a < CCM_RAM_START) || (a >= CCM_RAM_END));
+}
+
+/*
+ * Work out the next page to program and, if the caller's data
+ * isn't reachable by DMA, copy it into the free staging buffer.
+ * This is called while the chip is busy with the previous page
+ * so the copy is "free".
+ */
+static void
+qspi_stage_page(void)
+{
+	int i;
+	uint8_t *dst;
+
+	qspi_job.len = page_fragment(qspi_job.addr, qspi_job.remain);
+	qspi_job.remain -= qspi_job.len;
+	if (dma_reachable(qspi_job.src)) {
+		return;
+	}
+	qspi_job.stage ^= 1;
+	dst = &qspi_stage_buf[qspi_job.stage][0];
+	for (i = 0; i < qspi_job.len; i++) {
+		dst[i] = qspi_job.src[i];
+	}
+}
+
+/*
+ * Start programming the current page. The FLASH is write enabled,
+ * the command is loaded into the QUADSPI and the DMA controller
+ * is left to feed the data in. When the last byte has been sent
+ * the QUADSPI will interrupt with TCF set.
  *
- * The other quirk is I've set the flash to write sequentially
- * but the limit is 256 bytes *ASSUMING* they don't cross a
- * page boundary (lower 8 bits of the address are 0). The api
- * interface (qspi_write_flash()) will automatically fragment
- * the write to insure it meets that requirement.
+ * Note that I've set the flash to write sequentially but the limit
+ * is 256 bytes *ASSUMING* they don't cross a page boundary, which
+ * qspi_stage_page() insures.
  */
 static void
-qspi_write_data(uint32_t addr, uint8_t *buf, int len)
+qspi_start_page(void)
 {
-	uint32_t ccr, sr;
-	int tmp;
-	int status;
+	uint32_t ccr;
+	uint8_t *src;
 
+	src = qspi_job.src;
+	if (! dma_reachable(src)) {
+		src = &qspi_stage_buf[qspi_job.stage][0];
+	}
 	qspi_enable(FLASH_WRITE_ENABLE);
+
 	ccr = QUADSPI_SET(CCR, FMODE, QUADSPI_CCR_FMODE_IWRITE);
 	/* adjusting this to 0 fixed the write issue. */
 	ccr |= QUADSPI_SET(CCR, DCYC, 0);
@@ -232,25 +386,225 @@ qspi_write_data(uint32_t addr, uint8_t *buf, int len)
 	ccr |= QUADSPI_SET(CCR, ADMODE, QUADSPI_CCR_MODE_1LINE);
 	ccr |= QUADSPI_SET(CCR, ADSIZE, 2);	/* 24 bit address */
 	ccr |= QUADSPI_SET(CCR, DMODE, QUADSPI_CCR_MODE_4LINE);
-	QUADSPI_DLR = len - 1;
-	QUADSPI_AR = addr;
-	QUADSPI_CCR = ccr; /* go write a page */
-	tmp = 0;
-	do {
-		sr = QUADSPI_SR;
-		if (sr & QUADSPI_SR_TCF) {
-			break;
-		}
-		tmp++;
-		QUADSPI_BYTE_DR = *buf++;
-	} while (QUADSPI_SR & QUADSPI_SR_BUSY);
-	do {
-		status = read_flash_register(STATUS_REG);
-	} while (status & 1); /* write in progress */
-	if (tmp != len) {
-		fprintf(stderr, "Warning: wrote %d bytes, expected to write %d\n", tmp, len);
+	QUADSPI_DLR = qspi_job.len - 1;
+	QUADSPI_CCR = ccr;
+	QUADSPI_AR = qspi_job.addr;
+
+	/* Bytes go from memory into the QUADSPI data register */
+	dma_stream_reset(QSPI_DMA, QSPI_DMA_STREAM);
+	dma_channel_select(QSPI_DMA, QSPI_DMA_STREAM, QSPI_DMA_CHANNEL);
+	dma_set_priority(QSPI_DMA, QSPI_DMA_STREAM, DMA_SxCR_PL_HIGH);
+	dma_set_transfer_mode(QSPI_DMA, QSPI_DMA_STREAM,
+						DMA_SxCR_DIR_MEM_TO_PERIPHERAL);
+	dma_set_memory_size(QSPI_DMA, QSPI_DMA_STREAM, DMA_SxCR_MSIZE_8BIT);
+	dma_set_peripheral_size(QSPI_DMA, QSPI_DMA_STREAM, DMA_SxCR_PSIZE_8BIT);
+	dma_enable_memory_increment_mode(QSPI_DMA, QSPI_DMA_STREAM);
+	dma_set_peripheral_address(QSPI_DMA, QSPI_DMA_STREAM,
+						(uint32_t) &QUADSPI_BYTE_DR);
+	dma_set_memory_address(QSPI_DMA, QSPI_DMA_STREAM, (uint32_t) src);
+	dma_set_number_of_data(QSPI_DMA, QSPI_DMA_STREAM, qspi_job.len);
+	dma_enable_stream(QSPI_DMA, QSPI_DMA_STREAM);
+
+	/* interrupt when the last byte is out, then let DMA go */
+	QUADSPI_CR |= QUADSPI_CR_TCIE | QUADSPI_CR_TEIE;
+	QUADSPI_CR |= QUADSPI_CR_DMAEN;
+}
+
+/*
+ * Rather than having the CPU read the status register over and
+ * over, put the QUADSPI into automatic polling mode. It will read
+ * the status register every 16 clocks and interrupt (SMF) when the
+ * write in progress bit goes to 0. Automatic stop (APMS) drops the
+ * peripheral out of polling mode when it matches.
+ */
+static void
+qspi_start_poll(void)
+{
+	uint32_t ccr;
+
+	QUADSPI_PSMKR = FLASH_STATUS_WIP;	/* only look at WIP */
+	QUADSPI_PSMAR = 0;			/* wait for it to be clear */
+	QUADSPI_PIR = 0x10;			/* poll every 16 clocks */
+	QUADSPI_DLR = 0;			/* 1 byte of status */
+	QUADSPI_CR |= QUADSPI_CR_APMS | QUADSPI_CR_SMIE | QUADSPI_CR_TEIE;
+	ccr = QUADSPI_SET(CCR, FMODE, QUADSPI_CCR_FMODE_APOLL);
+	ccr |= QUADSPI_SET(CCR, INST, FLASH_READ_STATUS);
+	ccr |= QUADSPI_SET(CCR, IMODE, QUADSPI_CCR_MODE_1LINE);
+	ccr |= QUADSPI_SET(CCR, DMODE, QUADSPI_CCR_MODE_1LINE);
+	QUADSPI_CCR = ccr;	/* no address, so this starts polling */
+}
+
+/*
+ * Start the next erase of a range erase. It picks the biggest
+ * erase the chip supports that fits the remaining range: the
+ * whole chip (bulk erase), a 64K sector if we're on a sector
+ * boundary and have at least a sector left, otherwise a 4K
+ * sub-sector. Typical times from the datasheet are 0.25 seconds
+ * for a sub-sector, 0.7 seconds for a sector, and 170 seconds
+ * for the whole chip, so a sector erase is ~6x faster per byte.
+ *
+ * Once the command is sent, auto-polling takes over and the SMF
+ * interrupt brings us back here for the next piece.
+ */
+static void
+qspi_start_erase(void)
+{
+	uint32_t ccr, len;
+	uint8_t cmd;
+
+	len = qspi_job.erase_end - qspi_job.addr;
+	if ((qspi_job.addr == 0) && (len >= FLASH_CHIP_SIZE)) {
+		cmd = FLASH_BULK_ERASE;
+		len = FLASH_CHIP_SIZE;
+	} else if (((qspi_job.addr & (FLASH_SECTOR_SIZE - 1)) == 0) &&
+				(len >= FLASH_SECTOR_SIZE)) {
+		cmd = FLASH_SECTOR_ERASE;
+		len = FLASH_SECTOR_SIZE;
+	} else {
+		cmd = FLASH_SUB_SECTOR_ERASE;
+		len = FLASH_SUB_SECTOR_SIZE;
 	}
+
+	qspi_enable(FLASH_WRITE_ENABLE); /* set the write latch */
+	ccr  = QUADSPI_SET(CCR, FMODE, QUADSPI_CCR_FMODE_IWRITE);
+	ccr |= QUADSPI_SET(CCR, INST, cmd);
+	ccr |= QUADSPI_SET(CCR, IMODE, QUADSPI_CCR_MODE_1LINE);
+	if (cmd != FLASH_BULK_ERASE) {
+		ccr |= QUADSPI_SET(CCR, ADSIZE, 2);
+		ccr |= QUADSPI_SET(CCR, ADMODE, QUADSPI_CCR_MODE_1LINE);
+		QUADSPI_CCR = ccr;
+		QUADSPI_AR = qspi_job.addr;
+	} else {
+		QUADSPI_CCR = ccr;	/* no address, this starts it */
+	}
+	while (QUADSPI_SR & QUADSPI_SR_BUSY) ;
 	QUADSPI_FCR = 0x1f;
+
+	qspi_job.addr += len;
+	qspi_start_poll();
+}
+
+/*
+ * Get the QUADSPI into indirect mode for a read, write or erase.
+ * If the FLASH is mapped, wait for the DMA2D to finish whatever it
+ * is doing (it may well be blitting out of the FLASH) and then un-map
+ * it, remembering to map it again when we're done.
+ */
+static void
+qspi_indirect(void)
+{
+	if (! qspi_mapped) {
+		return;
+	}
+	while (DMA2D_CR & DMA2D_CR_START) ;
+	qspi_unmap_flash();
+	qspi_remap = 1;
+}
+
+/*
+ * Put things back the way we found them, unless there is more
+ * to do. Called from the foreground after a synchronous operation
+ * and from the interrupt handler when a background one finishes.
+ */
+static void
+qspi_restore(void)
+{
+	if (qspi_remap && (qspi_batch == 0) && (qspi_job.op == QSPI_OP_NONE)) {
+		qspi_remap = 0;
+		qspi_map_flash();
+	}
+}
+
+/*
+ * The QUADSPI interrupt drives the write engine:
+ *	TCF - the DMA has pushed out the last byte of the page, the
+ *	      chip is now programming it. Start auto-polling and, while
+ *	      that is happening, stage the next page.
+ *	SMF - the chip has finished programming, start the next page
+ *	      or the next erase (or mark the operation done).
+ *	TEF - something went wrong, stop and remember the error.
+ */
+void
+quadspi_isr(void)
+{
+	uint32_t sr = QUADSPI_SR;
+
+	if (sr & QUADSPI_SR_TEF) {
+		QUADSPI_CR &= ~(QUADSPI_CR_TCIE | QUADSPI_CR_SMIE |
+						QUADSPI_CR_TEIE | QUADSPI_CR_DMAEN);
+		dma_disable_stream(QSPI_DMA, QSPI_DMA_STREAM);
+		/*
+		 * If it went wrong while auto-polling the peripheral stays
+		 * BUSY forever, and anything that waits for it to be idle
+		 * (like mapping the FLASH again) would hang. So abort what
+		 * it is doing, wait for it to stop, and turn off APMS
+		 * before clearing the flags.
+		 */
+		QUADSPI_CR |= QUADSPI_CR_ABORT;
+		while (QUADSPI_CR & QUADSPI_CR_ABORT) ;
+		while (QUADSPI_SR & QUADSPI_SR_BUSY) ;
+		QUADSPI_CR &= ~QUADSPI_CR_APMS;
+		QUADSPI_FCR = 0x1f;
+		qspi_job.error = 1;
+		qspi_job.op = QSPI_OP_NONE;
+		qspi_restore();
+		return;
+	}
+
+	if ((sr & QUADSPI_SR_TCF) && (QUADSPI_CR & QUADSPI_CR_TCIE)) {
+		QUADSPI_CR &= ~(QUADSPI_CR_TCIE | QUADSPI_CR_DMAEN);
+		QUADSPI_FCR = QSPI_FLAG_TCF;
+		dma_disable_stream(QSPI_DMA, QSPI_DMA_STREAM);
+		qspi_start_poll();
+		/* chip is busy now, get the next page ready */
+		qspi_job.addr += qspi_job.len;
+		qspi_job.src += qspi_job.len;
+		if (qspi_job.remain > 0) {
+			qspi_stage_page();
+		} else {
+			qspi_job.len = 0;
+		}
+		return;
+	}
+
+	if (sr & QUADSPI_SR_SMF) {
+		QUADSPI_CR &= ~(QUADSPI_CR_SMIE | QUADSPI_CR_APMS);
+		QUADSPI_FCR = QSPI_FLAG_SMF;
+		if ((qspi_job.op == QSPI_OP_ERASE) &&
+			(qspi_job.addr < qspi_job.erase_end)) {
+			qspi_start_erase();
+		} else if ((qspi_job.op == QSPI_OP_WRITE) && (qspi_job.len > 0)) {
+			qspi_start_page();
+		} else {
+			QUADSPI_CR &= ~QUADSPI_CR_TEIE;
+			qspi_job.op = QSPI_OP_NONE;
+			qspi_restore();
+		}
+	}
+}
+
+/*
+ * qspi_busy()
+ *
+ * Returns true if a background FLASH operation is in progress.
+ */
+int
+qspi_busy(void)
+{
+	return (qspi_job.op != QSPI_OP_NONE);
+}
+
+/*
+ * qspi_wait()
+ *
+ * Wait for any background FLASH operation to complete. Returns
+ * 1 if the operation ended with an error, 0 otherwise.
+ */
+int
+qspi_wait(void)
+{
+	while (qspi_job.op != QSPI_OP_NONE) ;
+	return qspi_job.error;
 }
 
 /* External API for the FLASH chip
@@ -324,6 +678,10 @@ qspi_init(void)
 	qspi_enable(FLASH_RESET_MEMORY);
 	/* note this is only for the flash chip on the 469I board ! */
 	write_flash_register(VOLATILE_REG, 0xAB);
+
+	/* The write engine needs the DMA controller and QUADSPI interrupt */
+	rcc_periph_clock_enable(RCC_DMA2);
+	nvic_enable_irq(NVIC_QUADSPI_IRQ);
 }
 
 /*
@@ -341,6 +699,8 @@ qspi_read_flash(uint32_t addr, uint8_t *buf, int len)
 	uint32_t ccr;
 	int bcnt;
 
+	qspi_wait();
+	qspi_indirect();
 	QUADSPI_DLR = len - 1;
 	ccr = QUADSPI_SET(CCR, FMODE, QUADSPI_CCR_FMODE_IREAD);
 	ccr |= QUADSPI_SET(CCR, DCYC, 10);
@@ -355,6 +715,7 @@ qspi_read_flash(uint32_t addr, uint8_t *buf, int len)
 	QUADSPI_AR = addr;
 	bcnt = qspi_read_data(buf, len);
 	QUADSPI_FCR = 0x1f;
+	qspi_restore();
 	return (bcnt != len);
 }
 
@@ -368,6 +729,9 @@ qspi_erase_block(uint32_t block)
 	uint32_t ccr, sr;
 	uint8_t	status;
 
+	qspi_wait();
+	qspi_cache_invalidate((block << 12) & 0xffffff, FLASH_SUB_SECTOR_SIZE);
+	qspi_indirect();
 	qspi_enable(FLASH_WRITE_ENABLE); /* set the write latch */
 	ccr  = QUADSPI_SET(CCR, FMODE, QUADSPI_CCR_FMODE_IWRITE);
 	ccr |= QUADSPI_SET(CCR, ADSIZE, 2);
@@ -383,38 +747,97 @@ qspi_erase_block(uint32_t block)
 		status = read_flash_register(STATUS_REG);
 	} while (status & 1); /* write in progress */
 	QUADSPI_FCR = 0x1f;
+	qspi_restore();
+}
+
+/*
+ * qspi_erase_range()
+ *
+ * Erase all of the FLASH from 'addr' up to 'addr + len' in the
+ * background. The start is rounded down, and the end rounded up,
+ * to a 4K sub-sector boundary (that is as fine as the chip can
+ * erase). In between, 64K sector erases are used wherever the
+ * alignment allows and if the range is the whole chip it uses
+ * bulk erase.
+ *
+ * Returns 1 if the range is bad or an operation is already in
+ * progress, 0 if the erase has been started. Use qspi_wait() or
+ * qspi_busy() to find out when it is done.
+ */
+int
+qspi_erase_range(uint32_t addr, uint32_t len)
+{
+	uint32_t end;
+
+	if ((len == 0) || (addr >= FLASH_CHIP_SIZE) ||
+		(qspi_job.op != QSPI_OP_NONE)) {
+		return 1;
+	}
+	/* clamp before adding, a huge 'len' would wrap 'end' below 'addr' */
+	if (len > FLASH_CHIP_SIZE - addr) {
+		len = FLASH_CHIP_SIZE - addr;
+	}
+	end = addr + len;
+	qspi_job.addr = addr & ~(FLASH_SUB_SECTOR_SIZE - 1);
+	qspi_job.erase_end = (end + FLASH_SUB_SECTOR_SIZE - 1) &
+								~(FLASH_SUB_SECTOR_SIZE - 1);
+	qspi_job.error = 0;
+	qspi_cache_invalidate(qspi_job.addr, qspi_job.erase_end - qspi_job.addr);
+	qspi_indirect();
+	qspi_job.op = QSPI_OP_ERASE;
+	qspi_start_erase();
+	return 0;
+}
+
+/*
+ * qspi_write_flash_async()
+ *
+ * Start writing 'len' bytes to the FLASH at 'addr' and return
+ * right away. The write is broken up into pages (256 bytes or
+ * less, never crossing a page boundary) which are streamed to
+ * the chip with DMA. The QUADSPI interrupt starts the next page
+ * as soon as the chip reports the previous one has programmed.
+ *
+ * The buffer must not be changed until qspi_busy() returns false
+ * (or qspi_wait() returns). Returns 1 if 'len' is bad, if it would
+ * run off the end of the chip, or if an operation is already in
+ * progress, 0 otherwise.
+ */
+int
+qspi_write_flash_async(uint32_t addr, uint8_t *buf, int len)
+{
+	if ((len <= 0) || (qspi_job.op != QSPI_OP_NONE) ||
+		(addr >= FLASH_CHIP_SIZE) || ((uint32_t) len > FLASH_CHIP_SIZE - addr)) {
+		return 1;
+	}
+	qspi_cache_invalidate(addr, len);
+	qspi_indirect();
+	qspi_job.addr = addr;
+	qspi_job.src = buf;
+	qspi_job.remain = len;
+	qspi_job.stage = 0;
+	qspi_job.error = 0;
+	qspi_stage_page();
+	qspi_job.op = QSPI_OP_WRITE;
+	qspi_start_page();
+	return 0;
 }
 
 /*
  * qspi_write_flash()
  *
  * This is the "high level" API for writing to the flash
- * chip. It breaks up the writes internally to insure
- * that they are less than or equal to 256 bytes and
- * that they do not cross page boundaries (which leads
- * to wrap around).
+ * chip. It uses the pipelined write engine above and waits
+ * for it to finish. Returns 0 on success, 1 on error.
  */
 int
 qspi_write_flash(uint32_t addr, uint8_t *buf, int len)
 {
-	uint32_t cur_addr;
-	int frac_len;
-
-	cur_addr = addr;
-	while (len > 0) {
-		/* check the case where it crosses a page boundry */
-		if ((cur_addr & ~0xff) != ((cur_addr + len - 1) & ~0xff)) {
-			frac_len = ((cur_addr + 256) & ~0xff) - cur_addr;
-			qspi_write_data(cur_addr, buf, frac_len);
-			cur_addr = cur_addr + frac_len;
-			len = len - frac_len;
-			buf = buf + frac_len;
-		} else {
-			qspi_write_data(cur_addr, buf, len);
-			len = 0;
-		}
+	qspi_wait();
+	if (qspi_write_flash_async(addr, buf, len)) {
+		return 1;
 	}
-	return 0; /* XXX have this return error if write_data fails */
+	return qspi_wait();
 }
 
 /*
@@ -428,6 +851,11 @@ void
 qspi_map_flash(void)
 {
 	uint32_t	ccr;
+
+	qspi_wait();
+	if (qspi_mapped) {
+		return;
+	}
 	write_flash_register(VOLATILE_REG, 0xA3); /* enable XIP mode */
 	ccr = QUADSPI_SET(CCR, INST, FLASH_QUAD_READ); 	/* this will be our read mode */
 	ccr |= QUADSPI_SET(CCR, FMODE, QUADSPI_CCR_FMODE_MEMMAP);
@@ -438,6 +866,7 @@ qspi_map_flash(void)
 	ccr |= QUADSPI_SET(CCR, ADSIZE, 2);
 	ccr |= QUADSPI_CCR_SIOO;
 	QUADSPI_CCR = ccr;
+	qspi_mapped = 1;
 }
 
 /*
@@ -456,4 +885,61 @@ qspi_unmap_flash(void)
 	qspi_enable(FLASH_RESET_MEMORY);
 	/* note this is only for the flash chip on the 469I board ! */
 	write_flash_register(VOLATILE_REG, 0xAB);
+	qspi_mapped = 0;
+	qspi_remap = 0;
+}
+
+/*
+ * qspi_begin_update()
+ *
+ * Start a batch of writes and/or erases. The FLASH is un-mapped
+ * by the first of them (if it was mapped) and stays un-mapped
+ * until the matching qspi_end_update(), rather than switching
+ * back and forth for every operation. These calls nest.
+ */
+void
+qspi_begin_update(void)
+{
+	qspi_batch++;
+}
+
+/*
+ * qspi_end_update()
+ *
+ * End a batch started with qspi_begin_update(). If the FLASH was
+ * mapped before the batch, it will be mapped again as soon as the
+ * last operation finishes (this does not wait for that).
+ */
+void
+qspi_end_update(void)
+{
+	if (qspi_batch == 0) {
+		return;
+	}
+	cm_disable_interrupts();
+	qspi_batch--;
+	qspi_restore();
+	cm_enable_interrupts();
+}
+
+/*
+ * qspi_mapped_addr()
+ *
+ * Returns a pointer to FLASH address 'addr' in the memory mapped
+ * window. If the FLASH is un-mapped because something is being
+ * written, this waits for it to finish and be mapped again first,
+ * so the pointer is safe to read from (or hand to the DMA2D) until
+ * the next write or erase is started. Returns NULL if the FLASH is
+ * not mapped and nothing is going to map it.
+ */
+uint8_t *
+qspi_mapped_addr(uint32_t addr)
+{
+	if (qspi_batch == 0) {
+		qspi_wait();
+	}
+	if (! qspi_mapped) {
+		return NULL;
+	}
+	return FLASH_BASE_ADDRESS + (addr & (FLASH_CHIP_SIZE - 1));
 }
@@ -0,0 +1,208 @@
+/*
+ * qspi_cache.c - read cache for the indirect QSPI API
+ *
+ * Copyright (c) 2016, Chuck McManis (cmcmanis@mcmanis.com)
+ *
+ * Every call to qspi_read_flash() pays for the instruction, the
+ * address, and 10 dummy cycles before the first byte of data shows
+ * up. That is fine for big reads, but code that picks out a few
+ * bytes here and there (glyphs out of a font, an entry out of a
+ * table) spends most of its time on overhead. When the FLASH is
+ * mapped the QUADSPI's own prefetch takes care of that, but when
+ * it isn't (while programming say) this cache sits in front of
+ * qspi_read_flash() and keeps recently used lines in RAM.
+ *
+ * It is set associative, QSPI_CACHE_WAYS lines per set, and the
+ * caller supplies the memory for the line data so it can live in
+ * SRAM or SDRAM as makes sense. The tags are kept here. Replacement
+ * is least recently used within a set.
+ *
+ * qspi.c calls qspi_cache_invalidate() whenever it writes or erases
+ * part of the FLASH so the cache never returns stale data. (if this
+ * file isn't linked in, that call goes to an empty function)
+ */
+#include <stdint.h>
+#include <string.h>
+#include "../util/util.h"
+
+#define QSPI_CACHE_LINE		64		/* bytes per line */
+#define QSPI_CACHE_WAYS		4		/* lines per set */
+#define QSPI_CACHE_MAX_SETS	256
+#define QSPI_CACHE_BYPASS	1024	/* reads this big skip the cache */
+
+#define LINE_VALID		0x1		/* tags are line addresses, so bit 0 is free */
+
+static struct {
+	uint32_t	tag;		/* FLASH address of the line | LINE_VALID */
+	uint32_t	used;		/* "time" of the last hit */
+} cache_tags[QSPI_CACHE_MAX_SETS][QSPI_CACHE_WAYS];
+
+static uint8_t *cache_data;
+static int cache_sets;		/* 0 if the cache is not set up */
+static uint32_t cache_clock;
+static struct qspi_cache_stats cache_stat;
+
+static uint8_t *cache_line(uint32_t line);
+
+/*
+ * qspi_cache_init( ... )
+ *
+ * Set up the cache using 'size' bytes at 'mem' for the line
+ * data. The number of sets is the largest power of 2 that fits
+ * (up to QSPI_CACHE_MAX_SETS). Returns the number of bytes
+ * actually used, 0 if 'size' is too small to be useful.
+ */
+uint32_t
+qspi_cache_init(uint8_t *mem, uint32_t size)
+{
+	int sets;
+
+	sets = 1;
+	while ((sets * 2 <= QSPI_CACHE_MAX_SETS) &&
+		   ((uint32_t) (sets * 2 * QSPI_CACHE_WAYS * QSPI_CACHE_LINE) <= size)) {
+		sets = sets * 2;
+	}
+	if ((uint32_t) (sets * QSPI_CACHE_WAYS * QSPI_CACHE_LINE) > size) {
+		cache_sets = 0;
+		return 0;
+	}
+	cache_data = mem;
+	cache_sets = sets;
+	memset(cache_tags, 0, sizeof(cache_tags));
+	memset(&cache_stat, 0, sizeof(cache_stat));
+	cache_clock = 0;
+	return sets * QSPI_CACHE_WAYS * QSPI_CACHE_LINE;
+}
+
+/*
+ * Return a pointer to the data for the line at FLASH address
+ * 'line', reading it in (over the least recently used way in
+ * its set) if it isn't already here.
+ */
+static uint8_t *
+cache_line(uint32_t line)
+{
+	int set, way, victim;
+
+	set = (line / QSPI_CACHE_LINE) & (cache_sets - 1);
+	victim = 0;
+	cache_clock++;
+	for (way = 0; way < QSPI_CACHE_WAYS; way++) {
+		if (cache_tags[set][way].tag == (line | LINE_VALID)) {
+			cache_tags[set][way].used = cache_clock;
+			cache_stat.hits++;
+			return cache_data + (set * QSPI_CACHE_WAYS + way) * QSPI_CACHE_LINE;
+		}
+		if ((cache_tags[set][victim].tag & LINE_VALID) &&
+			(((cache_tags[set][way].tag & LINE_VALID) == 0) ||
+			 (cache_tags[set][way].used < cache_tags[set][victim].used))) {
+			victim = way;
+		}
+	}
+	cache_stat.misses++;
+	cache_stat.flash_bytes += QSPI_CACHE_LINE;
+	cache_tags[set][victim].tag = 0;
+	if (qspi_read_flash(line, cache_data +
+			(set * QSPI_CACHE_WAYS + victim) * QSPI_CACHE_LINE, QSPI_CACHE_LINE)) {
+		return NULL;
+	}
+	cache_tags[set][victim].tag = line | LINE_VALID;
+	cache_tags[set][victim].used = cache_clock;
+	return cache_data + (set * QSPI_CACHE_WAYS + victim) * QSPI_CACHE_LINE;
+}
+
+/*
+ * qspi_cache_read( ... )
+ *
+ * Same as qspi_read_flash() (returns 0 on success, 1 on error)
+ * but served out of the cache when it can be. If the cache has
+ * not been set up, or the read is large, it goes straight to
+ * the FLASH.
+ */
+int
+qspi_cache_read(uint32_t addr, uint8_t *buf, int len)
+{
+	uint32_t line;
+	uint8_t *data;
+	int off, n;
+
+	if ((cache_sets == 0) || (len >= QSPI_CACHE_BYPASS)) {
+		cache_stat.bypass++;
+		cache_stat.flash_bytes += len;
+		return qspi_read_flash(addr, buf, len);
+	}
+	while (len > 0) {
+		line = addr & ~(QSPI_CACHE_LINE - 1);
+		off = addr - line;
+		n = QSPI_CACHE_LINE - off;
+		if (n > len) {
+			n = len;
+		}
+		data = cache_line(line);
+		if (data == NULL) {
+			return 1;
+		}
+		memcpy(buf, data + off, n);
+		buf += n;
+		addr += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/*
+ * qspi_cache_invalidate( ... )
+ *
+ * Forget any cached lines that overlap 'addr' to 'addr + len'.
+ * qspi.c calls this before it writes or erases the FLASH.
+ */
+void
+qspi_cache_invalidate(uint32_t addr, uint32_t len)
+{
+	uint32_t line, end;
+	int set, way;
+
+	if ((cache_sets == 0) || (len == 0)) {
+		return;
+	}
+	end = addr + len;
+	line = addr & ~(QSPI_CACHE_LINE - 1);
+	/* big ranges (erases) it is quicker to just look at every tag */
+	if ((end - line) / QSPI_CACHE_LINE >= (uint32_t) cache_sets) {
+		for (set = 0; set < cache_sets; set++) {
+			for (way = 0; way < QSPI_CACHE_WAYS; way++) {
+				if ((cache_tags[set][way].tag & LINE_VALID) &&
+					((cache_tags[set][way].tag & ~LINE_VALID) + QSPI_CACHE_LINE > addr) &&
+					((cache_tags[set][way].tag & ~LINE_VALID) < end)) {
+					cache_tags[set][way].tag = 0;
+					cache_stat.invalidates++;
+				}
+			}
+		}
+		return;
+	}
+	for (; line < end; line += QSPI_CACHE_LINE) {
+		set = (line / QSPI_CACHE_LINE) & (cache_sets - 1);
+		for (way = 0; way < QSPI_CACHE_WAYS; way++) {
+			if (cache_tags[set][way].tag == (line | LINE_VALID)) {
+				cache_tags[set][way].tag = 0;
+				cache_stat.invalidates++;
+			}
+		}
+	}
+}
+
+/*
+ * qspi_cache_get_stats( ... )
+ *
+ * Copy out the hit/miss counts. If 'reset' is non-zero the
+ * counts start over.
+ */
+void
+qspi_cache_get_stats(struct qspi_cache_stats *st, int reset)
+{
+	*st = cache_stat;
+	if (reset) {
+		memset(&cache_stat, 0, sizeof(cache_stat));
+	}
+}
@@ -0,0 +1,377 @@
+/*
+ * region.c - put memory allocations where they belong
+ *
+ * Copyright (c) 2016, Chuck McManis (cmcmanis@mcmanis.com)
+ *
+ * The STM32F469I-DISCO has three kinds of RAM that you care
+ * about, and malloc() only knows about one of them (wherever
+ * local_heap_setup() put the heap):
+ *
+ *	SRAM	- 320K of internal RAM, fast, DMA can reach it
+ *	CCM	- 64K of "core coupled" RAM, fastest for the CPU but
+ *		  the DMA controllers (and DMA2D) can't reach it
+ *	SDRAM	- 16MB of external RAM, slower, lots of it, where the
+ *		  frame buffers live
+ *
+ * This code gives you named regions over those and two kinds of
+ * allocator that take their memory from a region:
+ *
+ *	Arenas - "bump" allocators, allocation is just moving a
+ *		pointer and everything is freed at once with
+ *		arena_reset(). They are also a stack, arena_free()
+ *		gives memory back once it and everything allocated
+ *		after it have been freed (in any order). Good for
+ *		per-frame or per-run scratch buffers.
+ *	Pools - fixed size objects on a free list, O(1) allocate and
+ *		free, no fragmentation. Good for lots of small things
+ *		that come and go.
+ *
+ * region_alloc() hands out memory from a region that is never
+ * given back, which is how arenas and pools get theirs. For the
+ * SRAM region it just calls malloc() since that is where newlib's
+ * heap normally is.
+ *
+ * The CCM and SDRAM regions cover all of CCM and the first 12MB
+ * of SDRAM (the frame buffers are in the top 4MB). If your program
+ * has moved the heap into the SDRAM with local_heap_setup(), or
+ * uses the SDRAM for other things, define local_region_setup() to
+ * tell this code what it can use.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <malloc.h>
+#include "../util/util.h"
+
+#pragma weak local_region_setup = __local_region
+
+static struct mem_region {
+	const char	*name;
+	uint8_t		*start;		/* NULL means "use malloc" */
+	uint8_t		*cur;
+	uint8_t		*end;
+} regions[REGION_MAX] = {
+	{ "sram", NULL, NULL, NULL },
+	{ "ccm", NULL, NULL, NULL },
+	{ "sdram", NULL, NULL, NULL },
+};
+
+static int regions_ready;
+
+/*
+ * In front of every arena allocation, so the arena can be popped
+ * back one allocation at a time. The newest one is a->top and each
+ * one points at the one before it.
+ */
+struct arena_hdr {
+	struct arena_hdr	*prev;
+	uint8_t				*start;		/* a->cur before this allocation */
+	uint32_t			freed;
+};
+
+static void __local_region(int r, uint8_t **start, uint8_t **end);
+static void region_setup(void);
+
+/*
+ * Default region boundaries.
+ */
+static void
+__local_region(int r, uint8_t **start, uint8_t **end)
+{
+	switch (r) {
+		case REGION_CCM:
+			*start = (uint8_t *) 0x10000000;
+			*end = (uint8_t *) 0x10010000;
+			break;
+		case REGION_SDRAM:
+			*start = SDRAM_BASE_ADDRESS;
+			*end = SDRAM_BASE_ADDRESS + (12 * 1024 * 1024);
+			break;
+		default:
+			*start = NULL;
+			*end = NULL;
+			break;
+	}
+}
+
+static void
+region_setup(void)
+{
+	int i;
+
+	for (i = 0; i < REGION_MAX; i++) {
+		local_region_setup(i, &regions[i].start, &regions[i].end);
+		regions[i].cur = regions[i].start;
+	}
+	regions_ready = 1;
+}
+
+/*
+ * region_find( ... )
+ *
+ * Look up a region by name, returns -1 if there isn't one.
+ */
+int
+region_find(const char *name)
+{
+	int i;
+
+	for (i = 0; i < REGION_MAX; i++) {
+		if (strcmp(name, regions[i].name) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+/*
+ * region_alloc( ... )
+ *
+ * Take 'size' bytes, aligned to 'align' (a power of 2), from
+ * region 'r'. This memory is never given back. Returns NULL if
+ * the region is full.
+ */
+void *
+region_alloc(int r, uint32_t size, uint32_t align)
+{
+	struct mem_region *rg;
+	uint8_t *p;
+
+	if ((r < 0) || (r >= REGION_MAX)) {
+		return NULL;
+	}
+	if (! regions_ready) {
+		region_setup();
+	}
+	rg = &regions[r];
+	if (align < 4) {
+		align = 4;
+	}
+	if (rg->start == NULL) {
+		/* newlib's heap, which is 8 byte aligned */
+		if (align <= 8) {
+			return malloc(size);
+		}
+		return memalign(align, size);
+	}
+	p = (uint8_t *)(((uintptr_t) rg->cur + align - 1) & ~(uintptr_t)(align - 1));
+	if ((p + size > rg->end) || (p + size < p)) {
+		return NULL;
+	}
+	rg->cur = p + size;
+	return p;
+}
+
+/*
+ * region_avail( ... )
+ *
+ * How many bytes are left in a region (0 for the malloc region
+ * since we don't know).
+ */
+uint32_t
+region_avail(int r)
+{
+	if ((r < 0) || (r >= REGION_MAX)) {
+		return 0;
+	}
+	if (! regions_ready) {
+		region_setup();
+	}
+	if (regions[r].start == NULL) {
+		return 0;
+	}
+	return regions[r].end - regions[r].cur;
+}
+
+/*
+ * arena_init( ... )
+ *
+ * Set up an arena of 'size' bytes taken from region 'r'.
+ * Returns 0 on success, -1 if the region doesn't have room.
+ */
+int
+arena_init(struct arena *a, int r, uint32_t size)
+{
+	a->base = region_alloc(r, size, 32);
+	if (a->base == NULL) {
+		a->cur = a->end = NULL;
+		a->top = NULL;
+		return -1;
+	}
+	a->cur = a->base;
+	a->top = NULL;
+	a->end = a->base + size;
+	a->high = 0;
+	a->fails = 0;
+	return 0;
+}
+
+/*
+ * arena_alloc( ... )
+ *
+ * Take 'size' bytes, aligned to 'align', from the arena. Each
+ * allocation costs a struct arena_hdr (12 bytes) as well.
+ */
+void *
+arena_alloc(struct arena *a, uint32_t size, uint32_t align)
+{
+	struct arena_hdr *h;
+	uint8_t *p;
+
+	if (align < sizeof(void *)) {
+		align = sizeof(void *);
+	}
+	p = (uint8_t *)(((uintptr_t) a->cur + sizeof(struct arena_hdr) +
+								align - 1) & ~(uintptr_t)(align - 1));
+	if ((a->base == NULL) || (p + size > a->end) || (p + size < p)) {
+		a->fails++;
+		return NULL;
+	}
+	h = (struct arena_hdr *)(p - sizeof(struct arena_hdr));
+	h->prev = a->top;
+	h->start = a->cur;
+	h->freed = 0;
+	a->top = h;
+	a->cur = p + size;
+	if ((uint32_t)(a->cur - a->base) > a->high) {
+		a->high = a->cur - a->base;
+	}
+	return p;
+}
+
+/*
+ * arena_free( ... )
+ *
+ * Mark an allocation free. If it is the newest one the arena is
+ * popped back past it and past any older ones that were already
+ * freed, so freeing in the reverse order gives the memory back
+ * right away and freeing in some other order gives it back when
+ * the newer ones go. Pointers that aren't from this arena (or were
+ * already given back) are ignored.
+ */
+void
+arena_free(struct arena *a, void *p)
+{
+	struct arena_hdr *h;
+
+	if ((p == NULL) || ((uint8_t *) p < a->base + sizeof(struct arena_hdr)) ||
+		((uint8_t *) p >= a->cur)) {
+		return;
+	}
+	h = (struct arena_hdr *)((uint8_t *) p - sizeof(struct arena_hdr));
+	h->freed = 1;
+	while ((a->top != NULL) && a->top->freed) {
+		a->cur = a->top->start;
+		a->top = a->top->prev;
+	}
+}
+
+/*
+ * arena_reset( ... )
+ *
+ * Free everything in the arena.
+ */
+void
+arena_reset(struct arena *a)
+{
+	a->cur = a->base;
+	a->top = NULL;
+}
+
+/*
+ * pool_init( ... )
+ *
+ * Set up a pool of 'count' objects of 'size' bytes each, from
+ * region 'r'. Returns 0 on success, -1 if there isn't room.
+ */
+int
+pool_init(struct pool *p, int r, uint32_t size, uint32_t count)
+{
+	uint8_t *obj;
+	uint32_t i;
+
+	/* each free object holds the free list pointer */
+	size = (size + 7) & ~7;
+	p->mem = region_alloc(r, size * count, 8);
+	p->free = NULL;
+	p->size = size;
+	p->count = count;
+	p->used = 0;
+	p->high = 0;
+	p->fails = 0;
+	if (p->mem == NULL) {
+		p->count = 0;
+		return -1;
+	}
+	for (i = count, obj = p->mem + size * count; i > 0; i--) {
+		obj -= size;
+		*(void **) obj = p->free;
+		p->free = obj;
+	}
+	return 0;
+}
+
+/*
+ * pool_alloc( ... )
+ *
+ * Get an object from the pool, NULL if they are all in use.
+ */
+void *
+pool_alloc(struct pool *p)
+{
+	void *obj = p->free;
+
+	if (obj == NULL) {
+		p->fails++;
+		return NULL;
+	}
+	p->free = *(void **) obj;
+	p->used++;
+	if (p->used > p->high) {
+		p->high = p->used;
+	}
+	return obj;
+}
+
+/*
+ * pool_free( ... )
+ *
+ * Put an object back in the pool.
+ */
+void
+pool_free(struct pool *p, void *obj)
+{
+	if (obj == NULL) {
+		return;
+	}
+	*(void **) obj = p->free;
+	p->free = obj;
+	p->used--;
+}
+
+/*
+ * region_dump()
+ *
+ * Print out how much of each region has been handed out.
+ */
+void
+region_dump(void)
+{
+	int i;
+
+	if (! regions_ready) {
+		region_setup();
+	}
+	for (i = 0; i < REGION_MAX; i++) {
+		if (regions[i].start == NULL) {
+			printf("%-6s: (malloc heap)\n", regions[i].name);
+		} else {
+			printf("%-6s: 0x%08x - 0x%08x, %u used, %u free\n", regions[i].name,
+				(unsigned int)(uintptr_t) regions[i].start,
+				(unsigned int)(uintptr_t) regions[i].end,
+				(unsigned int)(regions[i].cur - regions[i].start),
+				(unsigned int)(regions[i].end - regions[i].cur));
+		}
+	}
+}
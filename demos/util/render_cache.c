@@ -0,0 +1,216 @@
+/*
+ * render_cache.c - keep the results of slow drawing code in FLASH
+ *
+ * Copyright (c) 2016, Chuck McManis (cmcmanis@mcmanis.com)
+ *
+ * A lot of the demos draw things at boot (backgrounds, digits,
+ * reticles) with the graphics library a pixel at a time. The
+ * result is the same every time unless the parameters change, so
+ * this code hashes a name and the parameters, and looks for a blob
+ * in the QSPI FLASH with that hash. If there is one you get a
+ * pointer to it in the mapped FLASH. If not the generator is run
+ * into the buffer you provide and the result is written to the FLASH
+ * for next time.
+ *
+ * Layout of the cache region:
+ *	The first 4K sub-sector is the directory, 16 byte entries:
+ *		entry 0		- magic, version, and two unused words
+ *		entry 1 ...	- key, offset, length, ~key
+ *	An entry is written after its blob, so a reset in the middle of
+ *	writing a blob leaves no entry pointing at it. Blobs start on 4K
+ *	boundaries and their FLASH is erased just before they are
+ *	written. When either the directory or the space runs out the
+ *	directory is erased and the whole thing starts over.
+ */
+#include <stdint.h>
+#include <string.h>
+#include "../util/util.h"
+
+#define RC_MAGIC		0x31414352	/* 'RCA1' */
+#define RC_BLOCK		4096
+#define RC_ENTRIES		(RC_BLOCK / sizeof(struct rc_entry))
+#define RC_ROUND(x)		(((x) + RC_BLOCK - 1) & ~(RC_BLOCK - 1))
+
+struct rc_entry {
+	uint32_t	key;
+	uint32_t	offset;
+	uint32_t	len;
+	uint32_t	check;
+};
+
+static uint32_t rc_base;	/* FLASH address of the cache */
+static uint32_t rc_size;	/* and its size */
+static uint32_t rc_free;	/* offset of the first unused block */
+static int rc_next;			/* next unused directory entry */
+static struct rc_stats rc_stat;
+
+static uint32_t rc_hash(uint32_t h, const uint8_t *data, int len);
+static void rc_format(void);
+static const struct rc_entry *rc_directory(void);
+
+/*
+ * The directory is read through the mapped FLASH, rather than with
+ * qspi_read_flash(), so that looking things up doesn't bounce the
+ * QUADSPI between modes.
+ */
+static const struct rc_entry *
+rc_directory(void)
+{
+	qspi_map_flash();
+	return (const struct rc_entry *) qspi_mapped_addr(rc_base);
+}
+
+/*
+ * FNV-1a, continued from 'h'
+ */
+static uint32_t
+rc_hash(uint32_t h, const uint8_t *data, int len)
+{
+	while (len-- > 0) {
+		h ^= *data++;
+		h *= 0x01000193;
+	}
+	return h;
+}
+
+/*
+ * Throw everything away and write an empty directory.
+ */
+static void
+rc_format(void)
+{
+	struct rc_entry hdr;
+
+	qspi_erase_range(rc_base, RC_BLOCK);
+	qspi_wait();
+	hdr.key = RC_MAGIC;
+	hdr.offset = 1;		/* version */
+	hdr.len = 0;
+	hdr.check = 0;
+	qspi_write_flash(rc_base, (uint8_t *) &hdr, sizeof(hdr));
+	rc_next = 1;
+	rc_free = RC_BLOCK;
+}
+
+/*
+ * rc_init( ... )
+ *
+ * Use 'size' bytes of FLASH at 'base' (both multiples of 4K) for
+ * the render cache. Returns the number of cached blobs found.
+ */
+int
+rc_init(uint32_t base, uint32_t size)
+{
+	const struct rc_entry *dir;
+	uint32_t end;
+	int i;
+
+	rc_base = base;
+	rc_size = size;
+	memset(&rc_stat, 0, sizeof(rc_stat));
+	dir = rc_directory();
+	if ((dir[0].key != RC_MAGIC) || (dir[0].offset != 1)) {
+		rc_format();
+		return 0;
+	}
+	rc_free = RC_BLOCK;
+	for (i = 1; i < (int) RC_ENTRIES; i++) {
+		if (dir[i].key == 0xffffffff) {
+			break;
+		}
+		if (dir[i].check == ~dir[i].key) {
+			end = RC_ROUND(dir[i].offset + dir[i].len);
+			if (end > rc_free) {
+				rc_free = end;
+			}
+		}
+	}
+	rc_next = i;
+	return i - 1;
+}
+
+/*
+ * render_cache( ... )
+ *
+ * Look for the blob called 'name' generated with the 'plen' bytes
+ * of parameters at 'params'. If it is in the cache this returns a
+ * pointer to it in the mapped FLASH. If not, 'gen' is called to draw
+ * it into 'buf' ('len' bytes), it is written into the cache, and the
+ * FLASH copy is returned. If it can't be written to the cache (too
+ * big say) you get 'buf' back, so if the result isn't 'buf' you can
+ * free it.
+ */
+void *
+render_cache(const char *name, const void *params, int plen, void *buf,
+			uint32_t len, void (*gen)(void *buf, const void *params))
+{
+	const struct rc_entry *dir;
+	struct rc_entry e;
+	uint32_t key;
+	int i;
+
+	key = rc_hash(0x811c9dc5, (const uint8_t *) name, strlen(name));
+	key = rc_hash(key, (const uint8_t *) params, plen);
+	key = rc_hash(key, (const uint8_t *) &len, sizeof(len));
+	if (key == 0xffffffff) {
+		key--;	/* that one means "unused" */
+	}
+
+	/* newest entry wins */
+	dir = rc_directory();
+	for (i = rc_next - 1; i > 0; i--) {
+		if ((dir[i].key == key) && (dir[i].check == ~key) &&
+			(dir[i].len == len)) {
+			rc_stat.hits++;
+			return qspi_mapped_addr(rc_base + dir[i].offset);
+		}
+	}
+
+	rc_stat.misses++;
+	gen(buf, params);
+	if ((len == 0) || (RC_ROUND(len) + RC_BLOCK > rc_size)) {
+		return buf;
+	}
+	if ((rc_next >= (int) RC_ENTRIES) || (rc_free + RC_ROUND(len) > rc_size)) {
+		rc_stat.resets++;
+		rc_format();
+	}
+	e.key = key;
+	e.offset = rc_free;
+	e.len = len;
+	e.check = ~key;
+	/*
+	 * If the blob didn't make it into the FLASH the directory entry
+	 * isn't written, later boots would trust it. The space isn't used
+	 * up either, the next blob erases it again.
+	 */
+	qspi_begin_update();
+	(void) qspi_wait();
+	if (qspi_erase_range(rc_base + e.offset, len) || qspi_wait() ||
+		qspi_write_flash(rc_base + e.offset, buf, len) ||
+		qspi_write_flash(rc_base + rc_next * sizeof(e), (uint8_t *) &e,
+															sizeof(e))) {
+		qspi_end_update();
+		rc_stat.failed++;
+		return buf;
+	}
+	qspi_end_update();
+	rc_next++;
+	rc_free += RC_ROUND(len);
+	rc_stat.stored += len;
+	qspi_map_flash();
+	return qspi_mapped_addr(rc_base + e.offset);
+}
+
+/*
+ * rc_get_stats( ... )
+ *
+ * How well the cache is doing.
+ */
+void
+rc_get_stats(struct rc_stats *st)
+{
+	*st = rc_stat;
+	st->used = rc_free;
+	st->entries = rc_next - 1;
+}
@@ -49,6 +49,7 @@ static void SystemInit(void);
  */
 int _write (int fd, char *ptr, int len);
 int _read (int fd, char *ptr, int len);
+int _isatty (int fd);
 
 /*
  * A 128 byte buffer for getting a string from the
@@ -57,13 +58,40 @@ int _read (int fd, char *ptr, int len);
 static char buf[BUFLEN+1] = {0};
 static char *next_char;
 
+/*
+ * Buffers for stdout and stderr so that setting their buffering
+ * mode doesn't need malloc.
+ */
+#define STDOUT_BUFLEN	256
+#define STDERR_BUFLEN	128
+static char stdout_buf[STDOUT_BUFLEN];
+static char stderr_buf[STDERR_BUFLEN];
+
+/* Is the text currently YELLOW because of stderr? */
+static int stderr_colored;
+
+/*
+ * Tell newlib the console is a terminal, so it line buffers
+ * stdout rather than waiting for it to fill up.
+ */
+int
+_isatty (int fd)
+{
+	return (fd >= 0) && (fd <= 2);
+}
+
 /* 
  * Called by libc stdio functions
+ *
+ * Each run of characters up to a newline goes straight into
+ * the console's transmit buffer in one piece (no copying it
+ * here first), and '\n' gets a '\r' added after it.
  */
 int 
 _write (int fd, char *ptr, int len)
 {
 	int i = 0;
+	int j;
 
 	/* 
 	 * Write "len" of char from "ptr" to file id "fd"
@@ -72,31 +100,67 @@ _write (int fd, char *ptr, int len)
 	if (fd > 2) {
 		return -1;  // STDOUT, STDIN, STDERR
 	}
-	if (fd == 2) {
-		/* set the text output YELLOW when sending to stderr */
-		console_puts("\033[33;40;1m");
+	/*
+	 * Set the text output YELLOW when sending to stderr, and back
+	 * again for stdout. Only when it changes so that a bunch of
+	 * writes to stderr in a row don't each send the escapes.
+	 */
+	if ((fd == 2) && (! stderr_colored)) {
+		console_puts(console_color(YELLOW));
+		stderr_colored = 1;
+	} else if ((fd != 2) && stderr_colored) {
+		console_puts(console_color(NONE));
+		stderr_colored = 0;
 	}
-	while (*ptr && (i < len)) {
-		console_putc(*ptr);
-		if (*ptr == '\n') {
-			console_putc('\r');
+	while ((i < len) && ptr[i]) {
+		/* queue everything up to the next newline in one go */
+		for (j = i; (j < len) && ptr[j] && (ptr[j] != '\n'); j++) ;
+		if (j > i) {
+			(void) console_write(&ptr[i], j - i);
+		}
+		i = j;
+		if ((i < len) && (ptr[i] == '\n')) {
+			(void) console_write("\n\r", 2);
+			i++;
 		}
-		i++;
-		ptr++;
 	}
-	if (fd == 2) {
-		/* return text out to its default state */
-		console_puts("\033[0m");
+	/* return text out to its default state at the end of a line */
+	if (stderr_colored && (i > 0) && (ptr[i - 1] == '\n')) {
+		console_puts(console_color(NONE));
+		stderr_colored = 0;
 	}
-  return i;
+	return i;
 }
 
+/*
+ * console_stdio_mode(int fd, int mode)
+ *
+ * Set the buffering for stdout (1) or stderr (2) to _IONBF (none), _IOLBF
+ * (a line at a time) or _IOFBF (when the buffer fills or you call
+ * fflush()). Fully buffered output is the fastest for big dumps,
+ * but don't forget the fflush(). Returns 0 or -1 if it couldn't.
+ */
+int
+console_stdio_mode(int fd, int mode)
+{
+	if (fd == 1) {
+		fflush(stdout);
+		return setvbuf(stdout, stdout_buf, mode, STDOUT_BUFLEN);
+	} else if (fd == 2) {
+		fflush(stderr);
+		return setvbuf(stderr, stderr_buf, mode, STDERR_BUFLEN);
+	}
+	return -1;
+}
 
 /*
  * Depending on the implementation, this function can call
  * with a buffer length of 1 to 1024. However it does no
  * editing on console reading. So, the console_gets code 
  * implements a simple line editing input style.
+ *
+ * If the caller's buffer has room for a whole line the
+ * line is edited right in it rather than in 'buf'.
  */
 int
 _read (int fd, char *ptr, int len)
@@ -107,6 +171,11 @@ _read (int fd, char *ptr, int len)
 		return -1;
 	}
 
+	/* room for BUFLEN characters plus the newline and NUL */
+	if ((next_char == NULL) && (len >= BUFLEN + 2)) {
+		return console_gets(ptr, BUFLEN);
+	}
+
 	/* If not null we've got more characters to return */
 	if (next_char == NULL) {
 		console_gets(buf, BUFLEN);
@@ -132,11 +201,13 @@ _read (int fd, char *ptr, int len)
 __attribute__((constructor))
 static void SystemInit()
 {
-	clock_setup(168000000, 8000000);
+	clock_setup(SYSTEM_CLOCK, 8000000);
 	/* Sadly the "virtual" COM port that ST provides
 	 * on the ST-Link is unable to keep up at 115,200
 	 */
 	console_setup(57600);
+	console_stdio_mode(1, _IOLBF);
+	console_stdio_mode(2, _IONBF);
 	led_init();
 	sdram_init();
 	qspi_init();
@@ -10,7 +10,12 @@
  * 		(HCLK) which is typically equal to SysCLK.
  *		So it can either be HCLK/2 or HCLK/3
  *		This code uses retarget.c which configs a 168Mhz Sysclk
- *  	At 168Mhz, SD CLK can be either 84Mhz, or 54Mhz.
+ *  	At 168Mhz, SD CLK can be either 84Mhz, or 56Mhz (at 180Mhz
+ *		it is 90Mhz or 60Mhz). The timing is worked out from the
+ *		chip's data sheet numbers and the actual HCLK, and there are
+ *		a few "profiles" (CAS latency, read pipe delay, read burst)
+ *		you can switch between with sdram_set_profile() to see which
+ *		one is fastest (see membench.c).
  *		This requires an OSPEED of 100Mhz (rather than 50Mhz)
  *	Chip
  *		The chip used on the disco board is a MT48LC4M32B2
@@ -141,52 +146,187 @@ static struct pin_defines {
 	{0x00,(enum rcc_periph_clken) 0 , 0x00}
 };
 
-/* same parameters as ST used for this DRAM chip */
-static struct sdram_timing timing = {
-	.trcd = 2,		/* RCD Delay */
-	.trp = 2,		/* RP Delay */
-	.twr = 2,		/* Write Recovery Time */
-	.trc = 6,		/* Row Cycle Delay */
-	.tras = 4,		/* Self Refresh Time */
-	.txsr = 6,		/* Exit Self Refresh Time */
-	.tmrd = 2,		/* Load to Active Delay */
+/*
+ * The timing parameters for the MT48LC4M32B2-6A out of its data
+ * sheet, in nS (except tMRD which is in clocks). These get turned
+ * into SDCLK cycles for whatever HCLK we're running at.
+ */
+static const struct sdram_chip {
+	uint32_t	trcd;		/* Active to Read/Write */
+	uint32_t	trp;		/* Precharge to Active */
+	uint32_t	twr;		/* Write Recovery Time */
+	uint32_t	trc;		/* Active to Active (Row Cycle) */
+	uint32_t	tras;		/* Active to Precharge */
+	uint32_t	txsr;		/* Exit Self Refresh to Active */
+	uint32_t	tmrd;		/* Load Mode to Active (clocks) */
+	uint32_t	refresh_ms;	/* all rows refreshed every ... */
+	uint32_t	rows;		/* ... this many rows */
+} mt48lc4m32b2 = {
+	.trcd = 18,
+	.trp = 18,
+	.twr = 12,
+	.trc = 60,
+	.tras = 42,
+	.txsr = 70,
+	.tmrd = 2,
+	.refresh_ms = 64,
+	.rows = 4096,
 };
 
 /*
- * Initialize the SD RAM controller.
+ * The things you can trade off against each other. The SDCLK
+ * is HCLK/2 or HCLK/3 and can't be more than 90Mhz. The chip
+ * manages CAS latency 2 up to 100Mhz. RPIPE delays when the
+ * FMC samples read data (giving the signals more time to settle)
+ * and RBURST lets the FMC read ahead into its FIFO when it sees
+ * back to back reads.
  */
-void
-sdram_init(void)
+static const struct sdram_profile {
+	const char	*name;
+	uint32_t	hclk_div;	/* 2 or 3 */
+	uint32_t	cas;		/* 2 or 3 */
+	uint32_t	rpipe;		/* 0, 1, or 2 HCLK cycles */
+	int			rburst;
+} sdram_profiles[] = {
+	{ "cas3",			2, 3, 0, 1 },	/* what ST uses */
+	{ "cas3-rpipe1",	2, 3, 1, 1 },
+	{ "cas2-rpipe1",	2, 2, 1, 1 },
+	{ "cas3-noburst",	2, 3, 0, 0 },
+	{ "hclk/3-cas2",	3, 2, 0, 1 },	/* slow but safe */
+};
+
+#define SDRAM_PROFILES	(int)(sizeof(sdram_profiles) / sizeof(struct sdram_profile))
+#define SDRAM_MAX_CLOCK	90000000
+
+static int sdram_cur_profile = -1;
+
+static uint32_t ns_to_clocks(uint32_t ns, uint32_t sdclk_khz);
+static uint32_t sdram_tr(const struct sdram_chip *chip, uint32_t khz);
+static uint32_t sdram_refresh(const struct sdram_chip *chip, uint32_t khz);
+
+/*
+ * Round up nS to whole SDCLK cycles, the FMC fields
+ * hold 1 to 16 cycles.
+ */
+static uint32_t
+ns_to_clocks(uint32_t ns, uint32_t sdclk_khz)
 {
-	struct pin_defines *pd = &sdram_pins[0];
-	uint32_t cr_tmp, tr_tmp; /* control, timing registers */
+	uint32_t clocks = (ns * sdclk_khz + 999999) / 1000000;
 
+	if (clocks < 1) {
+		clocks = 1;
+	}
+	return (clocks > 16) ? 16 : clocks;
+}
+
+/*
+ * The timing register value for 'chip' with an SDCLK of 'khz'.
+ */
+static uint32_t
+sdram_tr(const struct sdram_chip *chip, uint32_t khz)
+{
+	struct sdram_timing timing;
+	int min_wr;
+
+	timing.trcd = ns_to_clocks(chip->trcd, khz);
+	timing.trp = ns_to_clocks(chip->trp, khz);
+	timing.trc = ns_to_clocks(chip->trc, khz);
+	timing.tras = ns_to_clocks(chip->tras, khz);
+	timing.txsr = ns_to_clocks(chip->txsr, khz);
+	timing.tmrd = chip->tmrd;
 	/*
-	* First all the GPIO pins that end up as SDRAM pins
-	*/
-	while (pd->gpio != 0) {
-		/* enable the GPIO's clock */
-		rcc_periph_clock_enable(pd->clk);
-		/* Set them to alternate function */
-		gpio_mode_setup(pd->gpio, GPIO_MODE_AF, GPIO_PUPD_NONE, pd->pins);
-		/* Output speed 100Mhz */
-		gpio_set_output_options(pd->gpio, GPIO_OTYPE_PP, GPIO_OSPEED_100MHZ, pd->pins);
-		/* And Alternate function #12 */
-		gpio_set_af(pd->gpio, GPIO_AF12, pd->pins);
-		pd++;
+	 * The FMC needs TWR >= TRAS - TRCD and TWR >= TRC - TRCD - TRP
+	 * and the chip wants at least two clocks.
+	 */
+	timing.twr = ns_to_clocks(chip->twr, khz);
+	min_wr = 2;
+	if (timing.tras - timing.trcd > min_wr) {
+		min_wr = timing.tras - timing.trcd;
+	}
+	if ((timing.trc > timing.trcd + timing.trp) &&
+		(timing.trc - timing.trcd - timing.trp > min_wr)) {
+		min_wr = timing.trc - timing.trcd - timing.trp;
 	}
+	if (timing.twr < min_wr) {
+		timing.twr = min_wr;
+	}
+	return sdram_timing(&timing);
+}
 
-	/* Enable the SDRAM Controller */
-	rcc_periph_clock_enable(RCC_FSMC);
+/*
+ * Refresh rate, 64ms / 4096 rows = 15.62uS per row, which at an
+ * SDCLK of 84Mhz (168/2) is 1312 clocks (1406 at 90Mhz). Subtract 20
+ * clocks so it will catch up if its held off by CPU access to the
+ * same memory.
+ */
+static uint32_t
+sdram_refresh(const struct sdram_chip *chip, uint32_t khz)
+{
+	return (((chip->refresh_ms * khz) / chip->rows) - 20) << 1;
+}
 
-	/* Note the STM32F469I-DISCO board has the ram attached to bank 1 */
-	/* Timing parameters computed for a 168Mhz clock */
-	/* These parameters are specific to the SDRAM chip on the board */
+/*
+ * sdram_profile_name( ... )
+ *
+ * The name of profile 'p', or NULL if there isn't one (so you
+ * can loop over them).
+ */
+const char *
+sdram_profile_name(int p)
+{
+	if ((p < 0) || (p >= SDRAM_PROFILES)) {
+		return NULL;
+	}
+	return sdram_profiles[p].name;
+}
 
-	cr_tmp  = FMC_SDCR_RPIPE_NONE;
-	cr_tmp |= FMC_SDCR_RBURST;
-	cr_tmp |= FMC_SDCR_SDCLK_2HCLK;
-	cr_tmp |= FMC_SDCR_CAS_3CYC;
+/*
+ * sdram_get_profile()
+ *
+ * Which profile is in use.
+ */
+int
+sdram_get_profile(void)
+{
+	return sdram_cur_profile;
+}
+
+/*
+ * sdram_set_profile( ... )
+ *
+ * Program the controller with profile 'p', working the timing out
+ * from the chip parameters and the current HCLK. This re-runs the
+ * SDRAM start up sequence, so don't count on what was in the SDRAM
+ * surviving, and make sure nothing else (LTDC, DMA2D, etc) is using
+ * it at the time. Returns 0, or -1 if the profile doesn't exist or
+ * would run the SDRAM too fast.
+ */
+int
+sdram_set_profile(int p)
+{
+	const struct sdram_profile *pr;
+	const struct sdram_chip *chip = &mt48lc4m32b2;
+	uint32_t cr_tmp, tr_tmp; /* control, timing registers */
+	uint32_t sdclk, khz;
+
+	if ((p < 0) || (p >= SDRAM_PROFILES)) {
+		return -1;
+	}
+	pr = &sdram_profiles[p];
+	sdclk = rcc_ahb_frequency / pr->hclk_div;
+	if (sdclk > SDRAM_MAX_CLOCK) {
+		return -1;
+	}
+	khz = sdclk / 1000;
+
+	/* Note the STM32F469I-DISCO board has the ram attached to bank 1 */
+	cr_tmp = (pr->rpipe == 2) ? FMC_SDCR_RPIPE_2CLK :
+				(pr->rpipe == 1) ? FMC_SDCR_RPIPE_1CLK : FMC_SDCR_RPIPE_NONE;
+	if (pr->rburst) {
+		cr_tmp |= FMC_SDCR_RBURST;
+	}
+	cr_tmp |= (pr->hclk_div == 3) ? FMC_SDCR_SDCLK_3HCLK : FMC_SDCR_SDCLK_2HCLK;
+	cr_tmp |= (pr->cas == 2) ? FMC_SDCR_CAS_2CYC : FMC_SDCR_CAS_3CYC;
 	cr_tmp |= FMC_SDCR_NB4;
 	cr_tmp |= FMC_SDCR_MWID_32b;
 	cr_tmp |= FMC_SDCR_NR_12;		/* 12 rows x 8 columns = 1MB x 4 banks = 4MB */
@@ -195,9 +335,7 @@ sdram_init(void)
 	/* We're programming BANK 1 */
 	FMC_SDCR1 = cr_tmp;
 
-	tr_tmp = sdram_timing(&timing);
-	FMC_SDTR1 = tr_tmp;
-
+	FMC_SDTR1 = sdram_tr(chip, khz);
 
 	/* Now start up the Controller per the manual
 	 *	- Clock config enable
@@ -211,17 +349,76 @@ sdram_init(void)
 	sdram_command(SDRAM_BANK1, SDRAM_AUTO_REFRESH, 8, 0);
 	tr_tmp = SDRAM_MODE_BURST_LENGTH_1				|
 				SDRAM_MODE_BURST_TYPE_SEQUENTIAL	|
-				SDRAM_MODE_CAS_LATENCY_3		|
+				((pr->cas == 2) ? SDRAM_MODE_CAS_LATENCY_2 :
+								SDRAM_MODE_CAS_LATENCY_3)	|
 				SDRAM_MODE_OPERATING_MODE_STANDARD	|
 				SDRAM_MODE_WRITEBURST_MODE_SINGLE;
 	sdram_command(SDRAM_BANK1, SDRAM_LOAD_MODE, 1, tr_tmp);
 
-	/*
-	 * Refresh rate, 64ms / 4096 = 15.62uS
-	 * SD Clock is 90Mhz (180/2) so 15.62uS * 90x10e6 = 1405.8 "clocks"
-	 * Subtract 20 clocks so it will catch up if its held off by CPU access
- 	 * to the same memory 1405.8 - 20 = 1386 clocks. 
-	 */
-	FMC_SDRTR = 1386 << 1;
+	FMC_SDRTR = sdram_refresh(chip, khz);
+	sdram_cur_profile = p;
 	/* et Voila' DRAM memory at 0xC0000000 */
+	return 0;
+}
+
+/*
+ * sdram_reclock( ... )
+ *
+ * clock_setup() calls this when HCLK changes. The refresh count and
+ * the timing are worked out again for the new SDCLK without running
+ * the start up sequence, so what is in the SDRAM stays there. If the
+ * profile's divider would run the SDRAM too fast now it has to go to
+ * the HCLK/3 profile, and that does start it over.
+ */
+void
+sdram_reclock(void)
+{
+	const struct sdram_profile *pr;
+	const struct sdram_chip *chip = &mt48lc4m32b2;
+	uint32_t sdclk, khz;
+
+	if (sdram_cur_profile < 0) {
+		return;
+	}
+	pr = &sdram_profiles[sdram_cur_profile];
+	sdclk = rcc_ahb_frequency / pr->hclk_div;
+	if (sdclk > SDRAM_MAX_CLOCK) {
+		(void) sdram_set_profile(SDRAM_PROFILES - 1);
+		return;
+	}
+	khz = sdclk / 1000;
+	FMC_SDTR1 = sdram_tr(chip, khz);
+	FMC_SDRTR = sdram_refresh(chip, khz);
+}
+
+/*
+ * Initialize the SD RAM controller.
+ */
+void
+sdram_init(void)
+{
+	struct pin_defines *pd = &sdram_pins[0];
+
+	/*
+	* First all the GPIO pins that end up as SDRAM pins
+	*/
+	while (pd->gpio != 0) {
+		/* enable the GPIO's clock */
+		rcc_periph_clock_enable(pd->clk);
+		/* Set them to alternate function */
+		gpio_mode_setup(pd->gpio, GPIO_MODE_AF, GPIO_PUPD_NONE, pd->pins);
+		/* Output speed 100Mhz */
+		gpio_set_output_options(pd->gpio, GPIO_OTYPE_PP, GPIO_OSPEED_100MHZ, pd->pins);
+		/* And Alternate function #12 */
+		gpio_set_af(pd->gpio, GPIO_AF12, pd->pins);
+		pd++;
+	}
+
+	/* Enable the SDRAM Controller */
+	rcc_periph_clock_enable(RCC_FSMC);
+
+	/* if HCLK is too fast for HCLK/2, use the HCLK/3 profile */
+	if (sdram_set_profile(SDRAM_DEFAULT_PROFILE) != 0) {
+		(void) sdram_set_profile(SDRAM_PROFILES - 1);
+	}
 }
@@ -0,0 +1,228 @@
+/*
+ * telemetry.c - binary frames over the console link
+ *
+ * Copyright (c) 2016, Chuck McManis (cmcmanis@mcmanis.com)
+ *
+ * Reporting numbers with printf is slow (formatting floats on the
+ * board takes a while) and the output is a pain to parse on the other
+ * end. This code sends them as small binary frames instead, which
+ * telemetry.pl on the host decodes. The frames share the serial port
+ * with regular printf output, the decoder prints anything that isn't
+ * a good frame as text.
+ *
+ * A frame, before encoding, is:
+ *	channel		- TELEM_LOG, TELEM_METRIC, TELEM_BULK, or your own
+ *	sequence	- counts up by one each frame (so lost ones show up)
+ *	payload		- up to TELEM_MAX_PAYLOAD bytes
+ *	crc		- CRC16-CCITT of the above, low byte first
+ *
+ * That is COBS (Consistent Overhead Byte Stuffing) encoded, which
+ * gets rid of all the zero bytes for at most one extra byte per 254,
+ * and sent with a zero byte in front and after. The zeros mark where
+ * frames start and end so the decoder can always find the next frame.
+ *
+ * Payloads:
+ *	TELEM_LOG	- text, no NUL
+ *	TELEM_METRIC	- timestamp (mS, 32 bits), id (16 bits), value (32 bit
+ *			  signed), all little endian
+ *	TELEM_BULK	- stream (16 bits), offset (32 bits), then data
+ *
+ * The frames go out through telem_output(), which defaults to the
+ * console. Define your own to send them somewhere else (USB CDC say).
+ */
+#include <stdint.h>
+#include <string.h>
+#include "../util/util.h"
+
+#define TELEM_FRAME_MAX		(TELEM_MAX_PAYLOAD + 4)
+/* COBS adds one byte per 254 plus one, and the two zeros */
+#define TELEM_ENCODED_MAX	(TELEM_FRAME_MAX + (TELEM_FRAME_MAX / 254) + 3)
+#define TELEM_BULK_CHUNK	(TELEM_MAX_PAYLOAD - 6)
+
+#pragma weak telem_output = __telem_console
+
+static uint8_t telem_seq;
+static struct telem_stats telem_stat;
+
+static void __telem_console(const uint8_t *buf, int len);
+static uint16_t telem_crc(const uint8_t *data, int len, uint16_t crc);
+static int cobs_encode(const uint8_t *src, int len, uint8_t *dst);
+static void put16(uint8_t *p, uint16_t v);
+static void put32(uint8_t *p, uint32_t v);
+
+/*
+ * Default output, the console.
+ */
+static void
+__telem_console(const uint8_t *buf, int len)
+{
+	(void) console_write((const char *) buf, len);
+}
+
+/*
+ * CRC16-CCITT (polynomial 0x1021) a bit at a time, it is only
+ * a few hundred bytes per frame.
+ */
+static uint16_t
+telem_crc(const uint8_t *data, int len, uint16_t crc)
+{
+	int i;
+
+	while (len-- > 0) {
+		crc ^= (uint16_t) (*data++) << 8;
+		for (i = 0; i < 8; i++) {
+			crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : (crc << 1);
+		}
+	}
+	return crc;
+}
+
+/*
+ * COBS encode 'len' bytes from 'src' into 'dst', returns the
+ * number of bytes written (no zero on the end). Each block starts
+ * with a "code" byte that says how far it is to the next zero.
+ */
+static int
+cobs_encode(const uint8_t *src, int len, uint8_t *dst)
+{
+	uint8_t *code = dst;
+	uint8_t *out = dst + 1;
+	uint8_t n = 1;
+
+	while (len-- > 0) {
+		if (*src == 0) {
+			*code = n;
+			code = out++;
+			n = 1;
+		} else {
+			*out++ = *src;
+			if (++n == 0xff) {
+				*code = n;
+				code = out++;
+				n = 1;
+			}
+		}
+		src++;
+	}
+	*code = n;
+	return out - dst;
+}
+
+static void
+put16(uint8_t *p, uint16_t v)
+{
+	p[0] = v & 0xff;
+	p[1] = (v >> 8) & 0xff;
+}
+
+static void
+put32(uint8_t *p, uint32_t v)
+{
+	p[0] = v & 0xff;
+	p[1] = (v >> 8) & 0xff;
+	p[2] = (v >> 16) & 0xff;
+	p[3] = (v >> 24) & 0xff;
+}
+
+/*
+ * telem_send( ... )
+ *
+ * Send 'len' bytes of 'data' as a frame on channel 'chan'.
+ * Returns 0, or -1 if it is too big.
+ */
+int
+telem_send(int chan, const void *data, int len)
+{
+	uint8_t frame[TELEM_FRAME_MAX];
+	uint8_t out[TELEM_ENCODED_MAX];
+	uint16_t crc;
+	int n;
+
+	if ((len < 0) || (len > TELEM_MAX_PAYLOAD)) {
+		telem_stat.errors++;
+		return -1;
+	}
+	frame[0] = chan;
+	frame[1] = telem_seq++;
+	memcpy(&frame[2], data, len);
+	crc = telem_crc(frame, len + 2, 0xffff);
+	put16(&frame[len + 2], crc);
+	out[0] = 0;
+	n = cobs_encode(frame, len + 4, &out[1]) + 1;
+	out[n++] = 0;
+	telem_output(out, n);
+	telem_stat.frames++;
+	telem_stat.payload_bytes += len;
+	telem_stat.wire_bytes += n;
+	return 0;
+}
+
+/*
+ * telem_log( ... )
+ *
+ * Send a string on the log channel (long ones are cut off).
+ */
+int
+telem_log(const char *s)
+{
+	int len = strlen(s);
+
+	return telem_send(TELEM_LOG, s,
+				(len > TELEM_MAX_PAYLOAD) ? TELEM_MAX_PAYLOAD : len);
+}
+
+/*
+ * telem_metric( ... )
+ *
+ * Send one number, tagged with 'id' and the time.
+ */
+int
+telem_metric(uint16_t id, int32_t value)
+{
+	uint8_t buf[10];
+
+	put32(&buf[0], mtime());
+	put16(&buf[4], id);
+	put32(&buf[6], (uint32_t) value);
+	return telem_send(TELEM_METRIC, buf, sizeof(buf));
+}
+
+/*
+ * telem_bulk( ... )
+ *
+ * Send a block of data as part of 'stream', in as many frames
+ * as it takes. 'offset' is where this block goes in the stream
+ * so the host can put it back together. Returns 0 or -1.
+ */
+int
+telem_bulk(uint16_t stream, uint32_t offset, const uint8_t *data, uint32_t len)
+{
+	uint8_t buf[TELEM_MAX_PAYLOAD];
+	uint32_t n;
+
+	do {
+		n = (len > TELEM_BULK_CHUNK) ? TELEM_BULK_CHUNK : len;
+		put16(&buf[0], stream);
+		put32(&buf[2], offset);
+		memcpy(&buf[6], data, n);
+		if (telem_send(TELEM_BULK, buf, n + 6) != 0) {
+			return -1;
+		}
+		data += n;
+		offset += n;
+		len -= n;
+	} while (len > 0);
+	return 0;
+}
+
+/*
+ * telem_get_stats( ... )
+ *
+ * Frame and byte counts, wire_bytes / payload_bytes is the
+ * overhead.
+ */
+void
+telem_get_stats(struct telem_stats *st)
+{
+	*st = telem_stat;
+}
@@ -0,0 +1,165 @@
+#!/usr/bin/env perl
+#
+# telemetry.pl - decode the frames sent by telemetry.c
+#
+# Usage: telemetry.pl [-b prefix] [-n id=name ...] [device or file]
+#
+# Reads the console output (the serial port, a file captured from it,
+# or stdin) and prints each frame on its own line:
+#
+#	LOG    <seq> <text>
+#	METRIC <seq> <time mS> <id or name> <value>
+#	BULK   <seq> <stream> <offset> <length>
+#	CHAN<n> <seq> <payload in hex>
+#
+# Anything that isn't a good frame (regular printf output) is printed
+# as is. With -b the bulk data is also written into <prefix>.<stream>
+# at the offset it came with. -n gives a metric id a name. Put the
+# serial port into raw mode first, for example:
+#
+#	stty -F /dev/ttyUSB0 57600 raw -echo
+#
+use strict;
+use warnings;
+use IO::Select;
+
+my $bulk_prefix;
+my %names;
+my $input;
+
+while (my $arg = shift @ARGV) {
+	if ($arg eq '-b') {
+		$bulk_prefix = shift @ARGV;
+		die "-b needs a prefix\n" if (!defined $bulk_prefix);
+	} elsif ($arg eq '-n') {
+		my $n = shift @ARGV;
+		die "-n needs id=name\n" if (!defined $n || $n !~ /^(\d+)=(.+)$/);
+		$names{$1} = $2;
+	} elsif (!defined $input) {
+		$input = $arg;
+	} else {
+		die "Usage: $0 [-b prefix] [-n id=name ...] [device or file]\n";
+	}
+}
+
+my $fh;
+if (defined $input) {
+	open ($fh, "<:raw", $input) or die "Can't open $input\n";
+} else {
+	$fh = \*STDIN;
+	binmode $fh;
+}
+$| = 1;
+
+my %bulk_fh;
+my $last_seq;
+my $lost = 0;
+
+#
+# CRC16-CCITT, the same one telemetry.c uses
+#
+sub crc16 {
+	my ($data) = @_;
+	my $crc = 0xffff;
+	foreach my $b (unpack("C*", $data)) {
+		$crc ^= $b << 8;
+		for (my $i = 0; $i < 8; $i++) {
+			$crc = ($crc & 0x8000) ? (($crc << 1) ^ 0x1021) : ($crc << 1);
+			$crc &= 0xffff;
+		}
+	}
+	return $crc;
+}
+
+#
+# Undo the COBS encoding, returns undef if it isn't valid
+#
+sub cobs_decode {
+	my ($data) = @_;
+	my @in = unpack("C*", $data);
+	my $out = '';
+	my $i = 0;
+	while ($i < scalar @in) {
+		my $code = $in[$i++];
+		return undef if ($code == 0 || $i + $code - 1 > scalar @in);
+		$out .= pack("C*", @in[$i .. $i + $code - 2]) if ($code > 1);
+		$i += $code - 1;
+		$out .= "\0" if ($code < 0xff && $i < scalar @in);
+	}
+	return $out;
+}
+
+sub bulk_write {
+	my ($stream, $offset, $data) = @_;
+	return if (!defined $bulk_prefix);
+	if (!defined $bulk_fh{$stream}) {
+		my $name = "$bulk_prefix.$stream";
+		open (my $bfh, "+>:raw", $name) or die "Can't create $name\n";
+		$bulk_fh{$stream} = $bfh;
+	}
+	seek($bulk_fh{$stream}, $offset, 0);
+	print {$bulk_fh{$stream}} $data;
+}
+
+#
+# Print one chunk (the bytes between two zeros) as a frame if it
+# is one, or as text if it isn't.
+#
+sub chunk {
+	my ($raw) = @_;
+	return if ($raw eq '');
+	my $f = cobs_decode($raw);
+	if (!defined $f || length($f) < 4 ||
+		crc16(substr($f, 0, -2)) != unpack("v", substr($f, -2))) {
+		print $raw;
+		return;
+	}
+	my ($chan, $seq) = unpack("CC", $f);
+	my $p = substr($f, 2, -2);
+	if (defined $last_seq && $seq != (($last_seq + 1) & 0xff)) {
+		$lost += ($seq - $last_seq - 1) & 0xff;
+		printf "LOST   %d frame(s) before %d\n", ($seq - $last_seq - 1) & 0xff, $seq;
+	}
+	$last_seq = $seq;
+	if ($chan == 0) {
+		printf "LOG    %3d %s\n", $seq, $p;
+	} elsif ($chan == 1 && length($p) == 10) {
+		my ($t, $id, $v) = unpack("V v l<", $p);
+		my $name = (defined $names{$id}) ? $names{$id} : $id;
+		printf "METRIC %3d %10u %s %d\n", $seq, $t, $name, $v;
+	} elsif ($chan == 2 && length($p) >= 6) {
+		my ($stream, $offset) = unpack("v V", $p);
+		my $data = substr($p, 6);
+		printf "BULK   %3d %d %u %d\n", $seq, $stream, $offset, length($data);
+		bulk_write($stream, $offset, $data);
+	} else {
+		printf "CHAN%-2d %3d %s\n", $chan, $seq, unpack("H*", $p);
+	}
+}
+
+#
+# Frames start and end with a zero, so split on those. Text that
+# arrives without a zero after it is printed once things go quiet.
+#
+my $sel = IO::Select->new($fh);
+my $buf = '';
+while (1) {
+	my $data;
+	if (!$sel->can_read(0.2)) {
+		chunk($buf);
+		$buf = '';
+		next;
+	}
+	my $n = sysread($fh, $data, 4096);
+	last if (!$n);
+	$buf .= $data;
+	while ((my $z = index($buf, "\0")) >= 0) {
+		chunk(substr($buf, 0, $z));
+		$buf = substr($buf, $z + 1);
+	}
+}
+chunk($buf);
+print "$lost frame(s) lost\n" if ($lost);
+foreach my $bfh (values %bulk_fh) {
+	close $bfh;
+}
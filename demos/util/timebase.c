@@ -0,0 +1,380 @@
+/*
+ * timebase.c - microsecond clock and one-shot timers on TIM2
+ *
+ * Copyright (c) 2016, Chuck McManis (cmcmanis@mcmanis.com)
+ *
+ * The SysTick in clock.c interrupts every millisecond whether or not
+ * anyone is waiting for anything, and msleep() can't do better than
+ * a millisecond. TIM2 is a 32 bit timer, so if it counts at 1 MHz it
+ * is a microsecond clock that only wraps every 71 minutes. This code
+ * uses it three ways:
+ *
+ *	uclock()	- the time in microseconds (uclock64() never wraps)
+ *	utimer_start()	- call a function (from the TIM2 interrupt) some
+ *			  number of microseconds from now
+ *	usleep_wfi()	- sleep, with the CPU halted in WFI until it is time
+ *
+ * The timers live in a "timer wheel", an array of WHEEL_SLOTS lists,
+ * each for about a millisecond (1024 uS) of time. Starting or cancelling
+ * a timer just adds or removes it from one list. Only the capture
+ * compare interrupt for the next timer that is due is set up, so when
+ * nothing is scheduled nothing interrupts (timers more than a trip
+ * around the wheel away cost one interrupt per trip, 32mS).
+ *
+ * timebase_init() also turns off the SysTick interrupt and tells
+ * clock.c to use this clock for mtime() and msleep(), so once it is
+ * called the CPU only wakes up when something actually needs doing.
+ * If you change the clock speed call timebase_init() again.
+ */
+#include <stdint.h>
+#include <libopencm3/stm32/rcc.h>
+#include <libopencm3/stm32/timer.h>
+#include <libopencm3/cm3/nvic.h>
+#include <libopencm3/cm3/cortex.h>
+#include <libopencm3/cm3/scb.h>
+#include "../util/util.h"
+
+#define WHEEL_SLOTS		32
+#define WHEEL_SHIFT		10		/* 1024 uS per slot */
+#define SLOT(t)			(((t) >> WHEEL_SHIFT) & (WHEEL_SLOTS - 1))
+
+static struct utimer *wheel[WHEEL_SLOTS];
+static uint32_t wheel_pos;			/* slot time we have run up to */
+static int wheel_count;				/* timers on the wheel */
+static volatile uint32_t tb_high;	/* TIM2 wraps, top half of uclock64() */
+static uint32_t tb_base_ms;			/* mtime() when we took over */
+
+static uint32_t tim2_clock(void);
+static void wheel_add(struct utimer *t);
+static void wheel_remove(struct utimer *t);
+static void wheel_program(void);
+static void wheel_run(void);
+static uint32_t tb_mtime(void);
+static void tb_msleep(uint32_t ms);
+static void sleep_done(void *arg);
+
+/*
+ * The clock going into TIM2, which is twice the APB1 clock if APB1
+ * is divided down (or up to HCLK if TIMPRE is set, see the timer
+ * demo for that adventure).
+ */
+static uint32_t
+tim2_clock(void)
+{
+	uint32_t ppre1 = (RCC_CFGR >> RCC_CFGR_PPRE1_SHIFT) & 0x7;
+
+	if (ppre1 < 4) {
+		return rcc_apb1_frequency;	/* not divided */
+	}
+	if (RCC_DCKCFGR & RCC_DCKCFGR_TIMPRE) {
+		return (ppre1 <= 5) ? rcc_ahb_frequency : rcc_apb1_frequency * 4;
+	}
+	return rcc_apb1_frequency * 2;
+}
+
+/*
+ * Put a timer in its slot, the lists are doubly linked (with a
+ * pointer to the previous 'next') so taking one out doesn't need
+ * a search. Called with interrupts off.
+ */
+static void
+wheel_add(struct utimer *t)
+{
+	struct utimer **head = &wheel[SLOT(t->when)];
+
+	if (wheel_count++ == 0) {
+		wheel_pos = uclock() >> WHEEL_SHIFT;
+	}
+	t->next = *head;
+	if (t->next) {
+		t->next->pprev = &t->next;
+	}
+	t->pprev = head;
+	*head = t;
+}
+
+static void
+wheel_remove(struct utimer *t)
+{
+	*(t->pprev) = t->next;
+	if (t->next) {
+		t->next->pprev = t->pprev;
+	}
+	t->next = NULL;
+	t->pprev = NULL;
+	wheel_count--;
+}
+
+/*
+ * Find the next timer that is due and set the compare register for
+ * it. Looking forward one slot at a time, the first slot that has
+ * a timer due in this trip around the wheel has the next one. If
+ * the compare time has already gone by, make the compare event
+ * happen now. Called with interrupts off.
+ */
+static void
+wheel_program(void)
+{
+	struct utimer *t;
+	uint32_t slot_end, next = 0;
+	int i, found = 0;
+
+	if (wheel_count == 0) {
+		TIM_DIER(TIM2) &= ~TIM_DIER_CC1IE;
+		return;
+	}
+	for (i = 0; (i < WHEEL_SLOTS) && ! found; i++) {
+		slot_end = (wheel_pos + i + 1) << WHEEL_SHIFT;
+		for (t = wheel[SLOT((wheel_pos + i) << WHEEL_SHIFT)]; t; t = t->next) {
+			if ((int32_t)(t->when - slot_end) < 0) {
+				if (! found || ((int32_t)(t->when - next) < 0)) {
+					next = t->when;
+				}
+				found = 1;
+			}
+		}
+	}
+	if (! found) {
+		/* everything is further out, come back in one trip */
+		next = (wheel_pos + WHEEL_SLOTS) << WHEEL_SHIFT;
+	}
+	TIM_CCR1(TIM2) = next;
+	TIM_SR(TIM2) = ~TIM_SR_CC1IF;
+	TIM_DIER(TIM2) |= TIM_DIER_CC1IE;
+	if ((int32_t)(next - TIM_CNT(TIM2)) <= 0) {
+		TIM_EGR(TIM2) = TIM_EGR_CC1G;
+	}
+}
+
+/*
+ * Fire all the timers that are due, in the slots from where we
+ * were last time up to now. A callback may start or cancel other
+ * timers so after each one the slot is looked at again from the
+ * start. A callback can also take long enough that timers in later
+ * slots come due, so how far to go is worked out again too, otherwise
+ * they are behind wheel_pos when we're done and never get run.
+ */
+static void
+wheel_run(void)
+{
+	struct utimer *t;
+	uint32_t now = uclock();
+	uint32_t slots = (now >> WHEEL_SHIFT) - wheel_pos + 1;
+	uint32_t i;
+
+	for (i = 0; (i < slots) && (i < WHEEL_SLOTS); i++) {
+		t = wheel[SLOT((wheel_pos + i) << WHEEL_SHIFT)];
+		while (t) {
+			if ((int32_t)(t->when - now) <= 0) {
+				wheel_remove(t);
+				t->func(t->arg);
+				now = uclock();
+				slots = (now >> WHEEL_SHIFT) - wheel_pos + 1;
+				t = wheel[SLOT((wheel_pos + i) << WHEEL_SHIFT)];
+			} else {
+				t = t->next;
+			}
+		}
+	}
+	wheel_pos = now >> WHEEL_SHIFT;
+}
+
+void
+tim2_isr(void)
+{
+	uint32_t sr = TIM_SR(TIM2);
+
+	if (sr & TIM_SR_UIF) {
+		TIM_SR(TIM2) = ~TIM_SR_UIF;
+		tb_high++;
+	}
+	if (sr & TIM_SR_CC1IF) {
+		TIM_SR(TIM2) = ~TIM_SR_CC1IF;
+		wheel_run();
+		wheel_program();
+	}
+}
+
+/*
+ * These are what clock.c uses for mtime() and msleep() once
+ * we have taken over.
+ */
+static uint32_t
+tb_mtime(void)
+{
+	return tb_base_ms + (uint32_t)(uclock64() / 1000);
+}
+
+static void
+tb_msleep(uint32_t ms)
+{
+	while (ms > 1000000) {
+		usleep_wfi(1000000000);
+		ms -= 1000000;
+	}
+	usleep_wfi(ms * 1000);
+}
+
+/*
+ * timebase_init( ... )
+ *
+ * Start TIM2 counting microseconds and take over mtime() and
+ * msleep() from the SysTick (which is turned off). Calling it
+ * again (after a clock change) restarts the count and drops any
+ * timers that were running.
+ */
+void
+timebase_init(void)
+{
+	int i;
+
+	tb_base_ms = mtime();
+	rcc_periph_clock_enable(RCC_TIM2);
+	rcc_periph_reset_pulse(RST_TIM2);
+	TIM_PSC(TIM2) = (tim2_clock() / 1000000) - 1;
+	TIM_ARR(TIM2) = 0xffffffff;
+	/* load the prescaler, that sets UIF so clear it */
+	TIM_EGR(TIM2) = TIM_EGR_UG;
+	TIM_SR(TIM2) = 0;
+	tb_high = 0;
+	/* any timers that were running are forgotten */
+	for (i = 0; i < WHEEL_SLOTS; i++) {
+		while (wheel[i]) {
+			wheel_remove(wheel[i]);
+		}
+	}
+	wheel_count = 0;
+	TIM_DIER(TIM2) = TIM_DIER_UIE;
+	nvic_enable_irq(NVIC_TIM2_IRQ);
+	TIM_CR1(TIM2) = TIM_CR1_CEN;
+	clock_set_timebase(tb_mtime, tb_msleep);
+}
+
+/*
+ * uclock( ... )
+ *
+ * Microseconds since timebase_init(), wraps every 71 minutes.
+ */
+uint32_t
+uclock(void)
+{
+	return TIM_CNT(TIM2);
+}
+
+/*
+ * uclock64( ... )
+ *
+ * Same thing but 64 bits. If the counter wrapped while we were
+ * reading it (or the interrupt hasn't been handled yet) read it
+ * again.
+ */
+uint64_t
+uclock64(void)
+{
+	uint32_t hi, lo;
+
+	do {
+		hi = tb_high;
+		lo = TIM_CNT(TIM2);
+		if (TIM_SR(TIM2) & TIM_SR_UIF) {
+			/* wrapped and the interrupt is pending (or masked) */
+			lo = TIM_CNT(TIM2);
+			hi++;
+			break;
+		}
+	} while (hi != tb_high);
+	return ((uint64_t) hi << 32) | lo;
+}
+
+/*
+ * udelay( ... )
+ *
+ * Spin for 'us' microseconds, for short hardware waits.
+ */
+void
+udelay(uint32_t us)
+{
+	uint32_t t0 = uclock();
+
+	while ((uclock() - t0) < us) ;
+}
+
+/*
+ * utimer_start( ... )
+ *
+ * Call 'func(arg)' from the timer interrupt 'us' microseconds from
+ * now (up to about 35 minutes). If the timer was already running it
+ * is moved.
+ */
+void
+utimer_start(struct utimer *t, uint32_t us, void (*func)(void *), void *arg)
+{
+	uint32_t mask = cm_mask_interrupts(1);
+
+	if (t->pprev) {
+		wheel_remove(t);
+	}
+	t->func = func;
+	t->arg = arg;
+	t->when = uclock() + us;
+	wheel_add(t);
+	wheel_program();
+	cm_mask_interrupts(mask);
+}
+
+/*
+ * utimer_cancel( ... )
+ *
+ * Stop a timer if it is running, returns 1 if it was.
+ */
+int
+utimer_cancel(struct utimer *t)
+{
+	uint32_t mask = cm_mask_interrupts(1);
+	int running = (t->pprev != NULL);
+
+	if (running) {
+		wheel_remove(t);
+		wheel_program();
+	}
+	cm_mask_interrupts(mask);
+	return running;
+}
+
+static void
+sleep_done(void *arg)
+{
+	*(volatile int *) arg = 1;
+}
+
+/*
+ * usleep_wfi( ... )
+ *
+ * Sleep for 'us' microseconds with the CPU stopped in WFI. The flag
+ * is checked with interrupts off, WFI still wakes up for a pending
+ * interrupt, so the timer can't fire between the check and the WFI
+ * and leave us asleep. If interrupts are off (or we're in a handler)
+ * the timer can't run at all, so it spins instead.
+ */
+void
+usleep_wfi(uint32_t us)
+{
+	struct utimer t = { 0 };
+	volatile int done = 0;
+	uint32_t mask;
+
+	if (cm_is_masked_interrupts() || ((SCB_ICSR & 0x1ff) != 0)) {
+		udelay(us);
+		return;
+	}
+	utimer_start(&t, us, sleep_done, (void *) &done);
+	while (1) {
+		mask = cm_mask_interrupts(1);
+		if (done) {
+			cm_mask_interrupts(mask);
+			break;
+		}
+		__asm__ volatile ("wfi");
+		cm_mask_interrupts(mask);
+	}
+}
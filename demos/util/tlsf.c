@@ -0,0 +1,616 @@
+/*
+ * tlsf.c - a "Two Level Segregated Fit" memory allocator
+ *
+ * Copyright (c) 2016, Chuck McManis (cmcmanis@mcmanis.com)
+ *
+ * newlib's malloc() is fine, but how long it takes depends on what
+ * the heap looks like, and a program that mixes lots of small
+ * allocations with big ones (kilo re-allocating every row as you
+ * type, sample buffers, etc) can fragment it badly. TLSF (from the
+ * paper by Masmano, Ripoll, Crespo, and Real) does malloc and free
+ * in constant time, and its "good fit" policy keeps fragmentation
+ * down.
+ *
+ * How it works:
+ *	Free blocks are kept on lists by size. The first level splits
+ *	sizes by powers of 2, the second level splits each power of 2
+ *	into TLSF_SL_COUNT equal pieces. A bitmap for each level says
+ *	which lists have something on them so finding a free block
+ *	that is big enough is a couple of "find first set bit"
+ *	instructions, no searching.
+ *
+ *	Every block has an 8 byte header (16 on a 64 bit PC), a pointer
+ *	to the block before it in memory and its size (the low bit is set
+ *	if it is free).
+ *	Free blocks also keep their list pointers in what would be the
+ *	data. Blocks are merged with their free neighbors when they are
+ *	freed. The last block in a heap is a zero sized "used" block so
+ *	nothing ever merges past the end.
+ *
+ * You can create as many heaps as you like with tlsf_create() (one
+ * per memory region say). If this file is linked in it also replaces
+ * malloc(), free(), realloc(), calloc() and memalign() (and their
+ * newlib _r versions) with a heap that uses the memory that
+ * local_heap_setup() describes, so you will need sbrk.o as well (or
+ * your own local_heap_setup).
+ *
+ * If you compile this with -DTLSF_HOST it leaves malloc() and friends
+ * alone, that is how util/host runs it side by side with the C
+ * library's malloc on a PC.
+ *
+ * None of this is safe to call from an interrupt handler.
+ */
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#ifndef TLSF_HOST
+#include <errno.h>
+#include <reent.h>
+#include <malloc.h>
+#endif
+#include "../util/util.h"
+
+#define TLSF_ALIGN		8
+#define TLSF_SL_LOG2	5
+#define TLSF_SL_COUNT	(1 << TLSF_SL_LOG2)
+#define TLSF_FL_SHIFT	(TLSF_SL_LOG2 + 3)		/* 3 is log2(TLSF_ALIGN) */
+#define TLSF_FL_MAX		26						/* blocks up to 64MB */
+#define TLSF_FL_COUNT	(TLSF_FL_MAX - TLSF_FL_SHIFT + 1)
+#define TLSF_SMALL		(1 << TLSF_FL_SHIFT)	/* 256 bytes */
+
+typedef struct tlsf_block {
+	struct tlsf_block	*prev_phys;	/* block before this one in memory */
+	uint32_t			size;		/* of the data, BLOCK_FREE if free */
+	/* these two are only there when it is free */
+	struct tlsf_block	*next_free;
+	struct tlsf_block	*prev_free;
+} tlsf_block;
+
+#define BLOCK_FREE		1
+/* these are 8 bytes on the ARM, 16 with 64 bit pointers */
+#define BLOCK_OVERHEAD	offsetof(tlsf_block, next_free)	/* prev_phys + size */
+#define BLOCK_MIN		(2 * sizeof(tlsf_block *))	/* room for the list pointers */
+#define BLOCK_MAX		((1U << TLSF_FL_MAX) - 1)
+
+struct tlsf {
+	uint32_t	fl_bitmap;
+	uint32_t	sl_bitmap[TLSF_FL_COUNT];
+	tlsf_block	*blocks[TLSF_FL_COUNT][TLSF_SL_COUNT];
+	uint8_t		*start, *end;
+	uint32_t	used;		/* bytes handed out */
+	uint32_t	high;		/* most bytes ever handed out */
+	uint32_t	allocs, frees, fails;
+};
+
+#define block_size(b)	((b)->size & ~BLOCK_FREE)
+#define block_free(b)	((b)->size & BLOCK_FREE)
+#define block_ptr(b)	((void *)((uint8_t *)(b) + BLOCK_OVERHEAD))
+#define ptr_block(p)	((tlsf_block *)((uint8_t *)(p) - BLOCK_OVERHEAD))
+#define block_next(b)	((tlsf_block *)((uint8_t *)(b) + BLOCK_OVERHEAD + \
+															block_size(b)))
+#define align_up(x)		(((x) + TLSF_ALIGN - 1) & ~(TLSF_ALIGN - 1))
+
+static int fls32(uint32_t x);
+static int ffs32(uint32_t x);
+static void mapping_insert(uint32_t size, int *fl, int *sl);
+static void mapping_search(uint32_t size, int *fl, int *sl);
+static tlsf_block *find_free(tlsf_t *t, uint32_t size);
+static void remove_free(tlsf_t *t, tlsf_block *b);
+static void insert_free(tlsf_t *t, tlsf_block *b);
+static tlsf_block *merge(tlsf_t *t, tlsf_block *b);
+static void split(tlsf_t *t, tlsf_block *b, uint32_t size);
+static uint32_t adjust_size(size_t size);
+
+/* bit number of the highest / lowest set bit */
+static int
+fls32(uint32_t x)
+{
+	return 31 - __builtin_clz(x);
+}
+
+static int
+ffs32(uint32_t x)
+{
+	return __builtin_ctz(x);
+}
+
+/*
+ * Which list a block of 'size' bytes goes on.
+ */
+static void
+mapping_insert(uint32_t size, int *fl, int *sl)
+{
+	int f;
+
+	if (size < TLSF_SMALL) {
+		*fl = 0;
+		*sl = size / (TLSF_SMALL / TLSF_SL_COUNT);
+		return;
+	}
+	f = fls32(size);
+	*sl = (size >> (f - TLSF_SL_LOG2)) ^ TLSF_SL_COUNT;
+	*fl = f - (TLSF_FL_SHIFT - 1);
+}
+
+/*
+ * Which list to start looking on for a block of 'size' bytes.
+ * The size is rounded up to the next list so that any block on
+ * that list (or a later one) is big enough.
+ */
+static void
+mapping_search(uint32_t size, int *fl, int *sl)
+{
+	if (size >= TLSF_SMALL) {
+		size += (1 << (fls32(size) - TLSF_SL_LOG2)) - 1;
+	}
+	mapping_insert(size, fl, sl);
+}
+
+static tlsf_block *
+find_free(tlsf_t *t, uint32_t size)
+{
+	uint32_t map;
+	int fl, sl;
+
+	mapping_search(size, &fl, &sl);
+	if (fl >= TLSF_FL_COUNT) {
+		return NULL;
+	}
+	map = t->sl_bitmap[fl] & (~0U << sl);
+	if (map == 0) {
+		if (fl + 1 >= TLSF_FL_COUNT) {
+			return NULL;
+		}
+		map = t->fl_bitmap & (~0U << (fl + 1));
+		if (map == 0) {
+			return NULL;
+		}
+		fl = ffs32(map);
+		map = t->sl_bitmap[fl];
+	}
+	sl = ffs32(map);
+	return t->blocks[fl][sl];
+}
+
+static void
+remove_free(tlsf_t *t, tlsf_block *b)
+{
+	int fl, sl;
+
+	mapping_insert(block_size(b), &fl, &sl);
+	if (b->prev_free) {
+		b->prev_free->next_free = b->next_free;
+	} else {
+		t->blocks[fl][sl] = b->next_free;
+		if (b->next_free == NULL) {
+			t->sl_bitmap[fl] &= ~(1U << sl);
+			if (t->sl_bitmap[fl] == 0) {
+				t->fl_bitmap &= ~(1U << fl);
+			}
+		}
+	}
+	if (b->next_free) {
+		b->next_free->prev_free = b->prev_free;
+	}
+	b->size &= ~BLOCK_FREE;
+}
+
+static void
+insert_free(tlsf_t *t, tlsf_block *b)
+{
+	int fl, sl;
+
+	mapping_insert(block_size(b), &fl, &sl);
+	b->size |= BLOCK_FREE;
+	b->prev_free = NULL;
+	b->next_free = t->blocks[fl][sl];
+	if (b->next_free) {
+		b->next_free->prev_free = b;
+	}
+	t->blocks[fl][sl] = b;
+	t->sl_bitmap[fl] |= 1U << sl;
+	t->fl_bitmap |= 1U << fl;
+}
+
+/*
+ * Merge free block 'b' (not on a list) with any free neighbors,
+ * returns the merged block.
+ */
+static tlsf_block *
+merge(tlsf_t *t, tlsf_block *b)
+{
+	tlsf_block *n;
+
+	if (b->prev_phys && block_free(b->prev_phys)) {
+		n = b->prev_phys;
+		remove_free(t, n);
+		n->size += BLOCK_OVERHEAD + block_size(b);
+		b = n;
+		block_next(b)->prev_phys = b;
+	}
+	n = block_next(b);
+	if (block_free(n)) {
+		remove_free(t, n);
+		b->size += BLOCK_OVERHEAD + block_size(n);
+		block_next(b)->prev_phys = b;
+	}
+	return b;
+}
+
+/*
+ * Trim used block 'b' down to 'size' bytes if what is left over
+ * is big enough to be a block of its own.
+ */
+static void
+split(tlsf_t *t, tlsf_block *b, uint32_t size)
+{
+	tlsf_block *rest;
+	uint32_t have = block_size(b);
+
+	if (have < size + BLOCK_OVERHEAD + BLOCK_MIN) {
+		return;
+	}
+	b->size = size;
+	rest = block_next(b);
+	rest->prev_phys = b;
+	rest->size = have - size - BLOCK_OVERHEAD;
+	block_next(rest)->prev_phys = rest;
+	insert_free(t, merge(t, rest));
+}
+
+static uint32_t
+adjust_size(size_t size)
+{
+	if (size > BLOCK_MAX) {
+		return 0;
+	}
+	size = align_up(size);
+	return (size < BLOCK_MIN) ? BLOCK_MIN : size;
+}
+
+/*
+ * tlsf_create( ... )
+ *
+ * Make a heap out of 'bytes' bytes at 'mem'. The control
+ * structure lives at the start of that memory. Returns NULL if
+ * it is too small to be useful.
+ */
+tlsf_t *
+tlsf_create(void *mem, uint32_t bytes)
+{
+	tlsf_t *t;
+	tlsf_block *b;
+	uint8_t *p, *end;
+
+	p = (uint8_t *) align_up((uintptr_t) mem);
+	end = (uint8_t *)(((uintptr_t) mem + bytes) & ~(TLSF_ALIGN - 1));
+	t = (tlsf_t *) p;
+	p += align_up(sizeof(tlsf_t));
+	if (p + 2 * BLOCK_OVERHEAD + BLOCK_MIN > end) {
+		return NULL;
+	}
+	memset(t, 0, sizeof(tlsf_t));
+	t->start = p;
+	t->end = end;
+
+	/* one big free block, then the zero sized sentinel */
+	b = (tlsf_block *) p;
+	b->prev_phys = NULL;
+	b->size = (end - p) - 2 * BLOCK_OVERHEAD;
+	if (b->size > BLOCK_MAX) {
+		b->size = BLOCK_MAX & ~(TLSF_ALIGN - 1);
+	}
+	block_next(b)->prev_phys = b;
+	block_next(b)->size = 0;
+	insert_free(t, b);
+	return t;
+}
+
+/*
+ * tlsf_malloc( ... )
+ */
+void *
+tlsf_malloc(tlsf_t *t, size_t size)
+{
+	tlsf_block *b;
+	uint32_t adj;
+
+	adj = adjust_size(size);
+	b = (adj) ? find_free(t, adj) : NULL;
+	if (b == NULL) {
+		t->fails++;
+		return NULL;
+	}
+	remove_free(t, b);
+	split(t, b, adj);
+	t->allocs++;
+	t->used += block_size(b);
+	if (t->used > t->high) {
+		t->high = t->used;
+	}
+	return block_ptr(b);
+}
+
+/*
+ * tlsf_free( ... )
+ */
+void
+tlsf_free(tlsf_t *t, void *ptr)
+{
+	tlsf_block *b;
+
+	if (ptr == NULL) {
+		return;
+	}
+	b = ptr_block(ptr);
+	t->frees++;
+	t->used -= block_size(b);
+	insert_free(t, merge(t, b));
+}
+
+/*
+ * tlsf_realloc( ... )
+ *
+ * Grows in place if the next block is free and big enough,
+ * otherwise it is malloc, copy, free.
+ */
+void *
+tlsf_realloc(tlsf_t *t, void *ptr, size_t size)
+{
+	tlsf_block *b, *n;
+	uint32_t adj, cur;
+	void *p;
+
+	if (ptr == NULL) {
+		return tlsf_malloc(t, size);
+	}
+	if (size == 0) {
+		tlsf_free(t, ptr);
+		return NULL;
+	}
+	adj = adjust_size(size);
+	if (adj == 0) {
+		t->fails++;
+		return NULL;
+	}
+	b = ptr_block(ptr);
+	cur = block_size(b);
+	n = block_next(b);
+	if ((adj > cur) && block_free(n) &&
+		(cur + BLOCK_OVERHEAD + block_size(n) >= adj)) {
+		remove_free(t, n);
+		b->size += BLOCK_OVERHEAD + block_size(n);
+		block_next(b)->prev_phys = b;
+	}
+	if (block_size(b) >= adj) {
+		split(t, b, adj);
+		t->used += block_size(b) - cur;
+		if (t->used > t->high) {
+			t->high = t->used;
+		}
+		return ptr;
+	}
+	p = tlsf_malloc(t, size);
+	if (p) {
+		memcpy(p, ptr, cur);
+		tlsf_free(t, ptr);
+	}
+	return p;
+}
+
+/*
+ * tlsf_memalign( ... )
+ *
+ * Allocate with more than the usual 8 byte alignment. It over
+ * allocates and gives back the part in front of the aligned
+ * address.
+ */
+void *
+tlsf_memalign(tlsf_t *t, size_t align, size_t size)
+{
+	tlsf_block *b, *ab;
+	uint8_t *p, *ap;
+	uint32_t gap, adj, was;
+
+	if (align <= TLSF_ALIGN) {
+		return tlsf_malloc(t, size);
+	}
+	adj = adjust_size(size);
+	if (adj == 0) {
+		t->fails++;
+		return NULL;
+	}
+	p = tlsf_malloc(t, adj + align + BLOCK_OVERHEAD + BLOCK_MIN);
+	if (p == NULL) {
+		return NULL;
+	}
+	b = ptr_block(p);
+	ap = (uint8_t *)(((uintptr_t) p + align - 1) & ~(align - 1));
+	gap = ap - p;
+	if (gap != 0) {
+		/* the front piece has to be big enough to be a block */
+		while (gap < BLOCK_OVERHEAD + BLOCK_MIN) {
+			ap += align;
+			gap += align;
+		}
+		ab = ptr_block(ap);
+		ab->prev_phys = b;
+		ab->size = block_size(b) - gap;
+		block_next(ab)->prev_phys = ab;
+		b->size = gap - BLOCK_OVERHEAD;
+		insert_free(t, merge(t, b));
+		t->used -= gap;
+		b = ab;
+	}
+	was = block_size(b);
+	split(t, b, adj);
+	t->used -= was - block_size(b);
+	return ap;
+}
+
+/*
+ * tlsf_usable_size( ... )
+ */
+size_t
+tlsf_usable_size(void *ptr)
+{
+	return (ptr) ? block_size(ptr_block(ptr)) : 0;
+}
+
+/*
+ * tlsf_get_stats( ... )
+ *
+ * Fill in the heap statistics. Finding the largest free block
+ * walks one free list, everything else is just copied.
+ */
+void
+tlsf_get_stats(tlsf_t *t, struct tlsf_stats *st)
+{
+	tlsf_block *b;
+	int fl, sl;
+
+	st->size = t->end - t->start;
+	st->used = t->used;
+	st->high = t->high;
+	st->allocs = t->allocs;
+	st->frees = t->frees;
+	st->fails = t->fails;
+	st->largest_free = 0;
+	if (t->fl_bitmap) {
+		fl = fls32(t->fl_bitmap);
+		sl = fls32(t->sl_bitmap[fl]);
+		for (b = t->blocks[fl][sl]; b != NULL; b = b->next_free) {
+			if (block_size(b) > st->largest_free) {
+				st->largest_free = block_size(b);
+			}
+		}
+	}
+}
+
+#ifndef TLSF_HOST
+/*
+ * The default heap, which replaces newlib's malloc. It is set up
+ * the first time something is allocated.
+ */
+static tlsf_t *tlsf_heap;
+
+tlsf_t *
+tlsf_default_heap(void)
+{
+	uint8_t *start, *end;
+
+	if (tlsf_heap == NULL) {
+		local_heap_setup(&start, &end);
+		tlsf_heap = tlsf_create(start, end - start);
+	}
+	return tlsf_heap;
+}
+
+void *
+_malloc_r(struct _reent *r, size_t size)
+{
+	void *p = NULL;
+
+	if (tlsf_default_heap()) {
+		p = tlsf_malloc(tlsf_heap, size);
+	}
+	if (p == NULL) {
+		r->_errno = ENOMEM;
+	}
+	return p;
+}
+
+void
+_free_r(struct _reent *r __attribute__((unused)), void *ptr)
+{
+	if (tlsf_heap) {
+		tlsf_free(tlsf_heap, ptr);
+	}
+}
+
+void *
+_realloc_r(struct _reent *r, void *ptr, size_t size)
+{
+	void *p = NULL;
+
+	if (tlsf_default_heap()) {
+		p = tlsf_realloc(tlsf_heap, ptr, size);
+	}
+	if ((p == NULL) && (size != 0)) {
+		r->_errno = ENOMEM;
+	}
+	return p;
+}
+
+void *
+_calloc_r(struct _reent *r, size_t n, size_t size)
+{
+	void *p;
+
+	if ((size != 0) && (n > 0xffffffffU / size)) {
+		r->_errno = ENOMEM;
+		return NULL;
+	}
+	p = _malloc_r(r, n * size);
+	if (p) {
+		memset(p, 0, n * size);
+	}
+	return p;
+}
+
+void *
+_memalign_r(struct _reent *r, size_t align, size_t size)
+{
+	void *p = NULL;
+
+	if (tlsf_default_heap()) {
+		p = tlsf_memalign(tlsf_heap, align, size);
+	}
+	if (p == NULL) {
+		r->_errno = ENOMEM;
+	}
+	return p;
+}
+
+size_t
+_malloc_usable_size_r(struct _reent *r __attribute__((unused)), void *ptr)
+{
+	return tlsf_usable_size(ptr);
+}
+
+void *
+malloc(size_t size)
+{
+	return _malloc_r(_REENT, size);
+}
+
+void
+free(void *ptr)
+{
+	_free_r(_REENT, ptr);
+}
+
+void *
+realloc(void *ptr, size_t size)
+{
+	return _realloc_r(_REENT, ptr, size);
+}
+
+void *
+calloc(size_t n, size_t size)
+{
+	return _calloc_r(_REENT, n, size);
+}
+
+void *
+memalign(size_t align, size_t size)
+{
+	return _memalign_r(_REENT, align, size);
+}
+
+size_t
+malloc_usable_size(void *ptr)
+{
+	return tlsf_usable_size(ptr);
+}
+#endif
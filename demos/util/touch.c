@@ -37,12 +37,13 @@ static i2c_dev *__touch_device;
  * on it's falling edge.
  *
  * When the routine is entered, it resets the pending interrupt
- * and grabs all of the registers from the chip. This works because
- * the I2C code is polled and not interrupt driven. If you later decide
- * to make both use interrupts you must insure that the I2C channel has
- * higher priority (lower priority number) other wise when this code
- * talks to the device those interrupts won't fire and you'll just
- * wait forever in your code.
+ * and queues a read of all the registers from the chip with
+ * i2c_submit(). It used to do the read right there with the polled
+ * I2C code, which kept the CPU in this handler for the whole transfer.
+ * Now the I2C interrupts and DMA do the reading and touch_read_done()
+ * takes the data apart when it arrives. If the panel interrupts again
+ * before the last read is finished, another read is done right after
+ * it so the latest state is never missed.
  *
  * State for touches is maintained in a touch_event structure. It is
  * double buffered so that if you're looking at the most recent
@@ -51,9 +52,28 @@ static i2c_dev *__touch_device;
  *
  * The flip flopping between the active buffer and the one in use is
  * done by the get_touch() function.
+ *
+ * The trouble with get_touch() is that it only has the latest touch,
+ * if you don't call it often enough a press and release can happen
+ * between calls and you never see them. So each touch is also put in
+ * a ring of touch_record's with the time it happened (mtime()) and
+ * whether it was a press, a move, or a release, and touch_drain()
+ * takes them out. The interrupt only ever writes 'head' and the
+ * drain only writes 'tail' so nothing has to turn interrupts off.
+ *
+ * A finger sliding across the panel makes a lot of moves, and nobody
+ * needs all of them, so if the newest record in the ring is a move
+ * with the same number of fingers a new move just replaces it. Presses
+ * and releases are never replaced. If the ring is full a move is
+ * dropped (there will be another one) and a press or release takes
+ * the place of the newest record if that is a move.
  *                                                                  ***/
 
 static touch_event	touch_data[2];
+
+/* called with each new touch, event.c uses this */
+static void null_touch_hook(touch_event *te);
+#pragma weak touch_hook = null_touch_hook
 static int 		touch_ndx = 0;			/* index into touch_data */
 
 /*
@@ -65,35 +85,137 @@ static int 		touch_ndx = 0;			/* index into touch_data */
  */
 static touch_event * volatile cur_touch = &touch_data[0];
 
+/* the register read the interrupt queues up */
+static const uint8_t touch_reg = 0;
+static uint8_t touch_buf[16];
+static struct i2c_xfer touch_xfer;
+static volatile int touch_again;	/* interrupted while reading */
+
+/* the timestamped record ring, head and tail are running counts */
+static struct touch_record touch_ring[TOUCH_RING_SIZE];
+static volatile uint32_t touch_head, touch_tail;
+static struct touch_ring_stats touch_stat;
+
+static void touch_read_done(struct i2c_xfer *x);
+static int touch_kind(touch_event *te);
+static void touch_record_add(touch_event *te);
+
 /*
  * This interrupt it called when the touch device gets a touch
  */
 void
 exti9_5_isr(void)
 {
-	uint8_t buf[16];
+	/* acknowledge the interrupt */
+	EXTI_PR = (1 << 5);
+	if (touch_xfer.status == I2C_PENDING) {
+		touch_again = 1;
+		return;
+	}
+	touch_again = 0;
+	(void) i2c_submit(&touch_xfer);
+}
+
+/*
+ * Called (from the I2C interrupt) when the registers have been
+ * read.
+ */
+static void
+touch_read_done(struct i2c_xfer *x)
+{
+	uint8_t *buf = touch_buf;
 	touch_event	*te = cur_touch;
 
-	/* fetch the registers */
-	buf[0] = 0;
-	i2c_write(__touch_device, buf, 1, !SEND_I2C_STOP);
-	i2c_read(__touch_device, buf, 16, SEND_I2C_STOP);
-
-	/* extract touch points */
-	for (int i = 0; i < 2; i++) {
-		int tsx, tsy;
-		int ndx = i*6 + 3;
-		te->tp[i].evt = (buf[ndx] & 0xc0) >> 6;
-		tsx = ((buf[ndx] & 0x3f) << 8) | (buf[ndx+1] & 0xff);
-		te->tp[i].tid = (buf[ndx+2] & 0xf0) >> 4;
-		tsy = ((buf[ndx+2] & 0xf) << 8) | (buf[ndx+3] & 0xff);
-		te->tp[i].x = tsy;
-		te->tp[i].y = 480 - tsx;
+	if (x->status == I2C_DONE) {
+		/* extract touch points */
+		for (int i = 0; i < 2; i++) {
+			int tsx, tsy;
+			int ndx = i*6 + 3;
+			te->tp[i].evt = (buf[ndx] & 0xc0) >> 6;
+			tsx = ((buf[ndx] & 0x3f) << 8) | (buf[ndx+1] & 0xff);
+			te->tp[i].tid = (buf[ndx+2] & 0xf0) >> 4;
+			tsy = ((buf[ndx+2] & 0xf) << 8) | (buf[ndx+3] & 0xff);
+			te->tp[i].x = tsy;
+			te->tp[i].y = 480 - tsx;
+		}
+		te->n = buf[2];
+		touch_record_add(te);
+		touch_hook(te);
 	}
-	te->n = buf[2];
+	if (touch_again) {
+		/* it changed while we were reading, read it again */
+		touch_again = 0;
+		(void) i2c_submit(x);
+	}
+}
 
-	/* acknowledge the interrupt */
-	EXTI_PR = (1 << 5);
+/*
+ * What sort of touch this is. The FT6206 event flag is 0 for a press,
+ * 1 for a lift, 2 for contact, and 3 for nothing (an unused point). If
+ * either point just went down it is a press, if either came up (or
+ * there aren't any fingers left) it is a release.
+ */
+static int
+touch_kind(touch_event *te)
+{
+	if ((te->n > 0) &&
+		((te->tp[0].evt == 0) || ((te->n > 1) && (te->tp[1].evt == 0)))) {
+		return TOUCH_DOWN;
+	}
+	if ((te->tp[0].evt == 1) || (te->tp[1].evt == 1) || (te->n == 0)) {
+		return TOUCH_UP;
+	}
+	return TOUCH_MOVE;
+}
+
+/*
+ * Add a touch to the ring (called from the I2C interrupt). The drain
+ * may be part way through copying the record at 'tail', so the newest
+ * record is only written over if it isn't that one.
+ */
+static void
+touch_record_add(touch_event *te)
+{
+	uint32_t head = touch_head;
+	uint32_t count = head - touch_tail;
+	struct touch_record *last = &touch_ring[(head - 1) % TOUCH_RING_SIZE];
+	struct touch_record *r;
+	int kind = touch_kind(te);
+
+	touch_stat.records++;
+	if ((count > 1) && (last->kind == TOUCH_MOVE) &&
+		((kind != TOUCH_MOVE) || (last->te.n == te->n))) {
+		if (kind == TOUCH_MOVE) {
+			touch_stat.coalesced++;
+		} else if (count < TOUCH_RING_SIZE) {
+			last = NULL;	/* there is room, keep the move */
+		} else {
+			touch_stat.dropped++;	/* a move lost to make room */
+		}
+		if (last != NULL) {
+			last->when = mtime();
+			last->kind = kind;
+			last->te = *te;
+			return;
+		}
+	}
+	if (count >= TOUCH_RING_SIZE) {
+		touch_stat.dropped++;
+		return;
+	}
+	r = &touch_ring[head % TOUCH_RING_SIZE];
+	r->when = mtime();
+	r->kind = kind;
+	r->te = *te;
+	/* the record has to be there before the drain can see it */
+	__asm__ volatile ("dmb" ::: "memory");
+	touch_head = head + 1;
+}
+
+static void
+null_touch_hook(touch_event *te __attribute__((unused)))
+{
+	return;
 }
 
 /*
@@ -132,6 +254,45 @@ get_touch(int wait)
 	return res;
 }
 
+/*
+ * touch_drain( ... )
+ *
+ * Copy up to 'max' touch records, oldest first, into 'out' and take
+ * them out of the ring. Returns how many there were. Don't call it
+ * from more than one place at a time (it's the only reader).
+ */
+int
+touch_drain(struct touch_record *out, int max)
+{
+	uint32_t tail = touch_tail;
+	int n = 0;
+
+	while ((n < max) && (tail != touch_head)) {
+		out[n++] = touch_ring[tail % TOUCH_RING_SIZE];
+		/* done with the record before the interrupt can reuse it */
+		__asm__ volatile ("dmb" ::: "memory");
+		touch_tail = ++tail;
+	}
+	return n;
+}
+
+/*
+ * touch_pending( ... )
+ *
+ * How many touch records are waiting to be drained.
+ */
+int
+touch_pending(void)
+{
+	return (int)(touch_head - touch_tail);
+}
+
+void
+touch_get_stats(struct touch_ring_stats *st)
+{
+	*st = touch_stat;
+}
+
 /*
  * Initialize things for the touch device
  */
@@ -141,10 +302,16 @@ touch_init(uint8_t threshold)
 	uint8_t	buf[2];
 
 	/* initialize the i2c_device handle for the touch panel controller */
-	__touch_device = i2c_init(1, I2C_400KHZ, 0x54);
+	__touch_device = i2c_init(1, 0x54, I2C_400KHZ);
 	if (__touch_device == NULL) {
 		return;
 	}
+	touch_xfer.dev = __touch_device;
+	touch_xfer.wbuf = &touch_reg;
+	touch_xfer.wlen = 1;
+	touch_xfer.rbuf = touch_buf;
+	touch_xfer.rlen = sizeof(touch_buf);
+	touch_xfer.done = touch_read_done;
 
 	buf[0] = FT6206_DEVICE_ID;
 	i2c_write(__touch_device, buf, 1 , !SEND_I2C_STOP);
@@ -158,6 +325,17 @@ touch_init(uint8_t threshold)
 			return;
 	}
 
+	/*
+ 	 * Sets the trigger threshold mid point? If it is "too touchy" you
+ 	 * can increase this number, if it is missing your touches then make
+ 	 * it lower.
+ 	 */
+	buf[0] = FT6206_THRESH;
+	buf[1] = threshold;
+	i2c_write(__touch_device, buf, 2 , SEND_I2C_STOP);
+
+	/* the panel is set up, now it can interrupt */
+
 	/*** interrupt setup
 	 *
 	 *  Set up pin PJ5 as an input
@@ -178,13 +356,5 @@ touch_init(uint8_t threshold)
 	/* Turn on interrupts */
 	nvic_enable_irq(NVIC_EXTI9_5_IRQ);
 
-	/*
- 	 * Sets the trigger threshold mid point? If it is "too touchy" you
- 	 * can increase this number, if it is missing your touches then make
- 	 * it lower.
- 	 */
-	buf[0] = FT6206_THRESH;
-	buf[1] = threshold;
-	i2c_write(__touch_device, buf, 2 , SEND_I2C_STOP);
 	return;
 }
@@ -32,12 +32,50 @@ struct pll_parameters {
 };
 struct pll_parameters *dump_clock(void);
 
+/*
+ * The PLL solver (pll.c), clock_setup() uses it to pick the PLL
+ * settings so anything with clock.o needs pll.o too.
+ */
+#define PLL_SYSCLK_MAX		168000000
+#define PLL_SYSCLK_MAX_OD	180000000	/* with over-drive on */
+#define PLL_OVERDRIVE		0x01	/* allow up to PLL_SYSCLK_MAX_OD */
+#define PLL_NEED_USB		0x02	/* fail if Q can't make 48 MHz at that SYSCLK */
+
+struct pll_request {
+	uint32_t	input;		/* HSE frequency, or 0 for the HSI */
+	uint32_t	sysclk;		/* the SYSCLK you want */
+	uint32_t	pllr;		/* what you want out of R (0 if you don't care) */
+	uint32_t	sai_vco;	/* PLLSAI VCO you need (0 if you don't care) */
+	int			flags;
+};
+
+struct pll_solution {
+	struct pll_parameters	p;
+	uint32_t	vco_in;		/* these are what you really get */
+	uint32_t	vco;
+	uint32_t	sysclk;
+	uint32_t	usb;
+	uint32_t	pllr;
+	uint32_t	sai_vco;
+	uint64_t	score;		/* lower is better */
+};
+
+/* Find the best settings, returns 0 or -1 if there aren't any */
+int pll_solve(const struct pll_request *req, struct pll_solution *sol);
+void pll_print(const struct pll_solution *sol);
+
 void hsi_clock_setup(uint32_t hsi_frequency);
 void hse_clock_setup(uint32_t hse_frequency);
 void pll_clock_setup(uint32_t pll_parameters, uint32_t input_frequency);
 uint32_t clock_setup(uint32_t desired_frequency, uint32_t input_frequency);
+/* What retarget.c sets the clock to, 180Mhz turns on over-drive */
+#ifndef SYSTEM_CLOCK
+#define SYSTEM_CLOCK		168000000
+#endif
 uint32_t mtime(void);
 void msleep(uint32_t millis);
+/* let some other clock (timebase.c) do mtime() and msleep() */
+void clock_set_timebase(uint32_t (*now)(void), void (*sleep)(uint32_t));
 unsigned char *time_string(uint32_t millis);
 
 /*
@@ -52,11 +90,35 @@ char * console_color(TERM_COLOR c);
 void console_color_enable(void);
 void console_color_disable(void);
 void console_putc(char c);
+/* Queue 'len' characters for the USART (no newline translation) */
+int console_write(const char *s, int len);
+/* Wait for everything queued to be sent */
+void console_flush(void);
+/* When the transmit buffer is full, wait (default) or drop */
+#define CONSOLE_TX_BLOCK	0
+#define CONSOLE_TX_DROP		1
+void console_tx_policy(int policy);
+uint32_t console_tx_dropped(void);
+struct console_stats {
+	uint32_t	rx_bytes;		/* characters received */
+	uint32_t	rx_lost;		/* times the receive buffer overflowed */
+	uint32_t	rx_overrun;		/* USART overrun errors */
+	uint32_t	rx_framing;		/* framing errors */
+	uint32_t	rx_noise;		/* noise errors */
+	uint32_t	tx_dropped;		/* characters dropped (CONSOLE_TX_DROP) */
+};
+void console_get_stats(struct console_stats *st);
+/* called (from an interrupt) when characters arrive (see event.c) */
+void console_rx_hook(void);
+/* stdout (1) or stderr (2) buffering, _IONBF, _IOLBF, or _IOFBF (retarget.c) */
+int console_stdio_mode(int fd, int mode);
 char console_getc(int wait);
 void console_puts(char *s);
 int console_gets(char *s, int len);
 void console_setup(int baud);
 void console_baud(int baud);
+/* Redo the baud rate for a new APB1 clock (clock_setup() calls it) */
+void console_reclock(void);
 uint32_t console_getnumber(void);
 
 /* this is for fun, if you type ^C to this example it will reset */
@@ -72,6 +134,17 @@ typedef enum led_color_e {
 
 /* dump memory contents as hex bytes */
 void hex_dump(uint32_t addr, uint8_t *data, unsigned int len);
+#define HEXDUMP_COLOR		1	/* color the parts of each line */
+#define HEXDUMP_BULK		2	/* write many lines at once */
+#define HEXDUMP_SQUEEZE		4	/* show repeated lines as '*' */
+#define HEXDUMP_MAX_WIDTH	32	/* bytes per line */
+#define HEXDUMP_LINE_MAX	192	/* longest formatted line (with color) */
+/* the same with a choice of width and the flags above */
+void hex_dump_ex(uint32_t addr, const uint8_t *data, uint32_t len, int width,
+																int flags);
+/* format one line into 'out', returns its length */
+int hex_dump_line(char *out, uint32_t addr, const uint8_t *buf, int len,
+														int width, int flags);
 
 void on_led(LED_COLOR c);
 void off_led(LED_COLOR c);
@@ -83,7 +156,17 @@ void led_init(void);
 /* Defines and prototypes for the sdram code */
 
 #define SDRAM_BASE_ADDRESS ((uint8_t *)(0xC0000000))
+#ifndef SDRAM_DEFAULT_PROFILE
+#define SDRAM_DEFAULT_PROFILE	0
+#endif
 void sdram_init(void);
+/* Switch FMC timing profiles (re-initializes the SDRAM) */
+int sdram_set_profile(int p);
+int sdram_get_profile(void);
+/* Name of profile 'p', NULL past the last one */
+const char *sdram_profile_name(int p);
+/* Redo the timing and refresh for a new HCLK (clock_setup() calls it) */
+void sdram_reclock(void);
 
 /* QSPI FLASH utility functions */
 void qspi_init(void);
@@ -91,15 +174,79 @@ void qspi_init(void);
 int qspi_read_flash(uint32_t addr, uint8_t *buf, int len);
 /* Write date to FLASH (0 - 16MB worth) */
 int qspi_write_flash(uint32_t addr, uint8_t *buf, int len);
+/* Start a write to FLASH in the background, buf must stay valid */
+int qspi_write_flash_async(uint32_t addr, uint8_t *buf, int len);
+/* Is a background FLASH operation running? */
+int qspi_busy(void);
+/* Wait for background FLASH operation to finish (returns 1 on error) */
+int qspi_wait(void);
 /* Erase a 4K block of FLASH */
 void qspi_erase_block(uint32_t addr);
+/* Erase a range of FLASH in the background (4K, 64K, or chip erases) */
+int qspi_erase_range(uint32_t addr, uint32_t len);
 /* Map FLASH into the address space */
 void qspi_map_flash(void);
 /* Unmap FLASH from the address space */
 void qspi_unmap_flash(void);
+/* Hold the FLASH un-mapped across a batch of writes/erases */
+void qspi_begin_update(void);
+void qspi_end_update(void);
+/* Pointer to mapped FLASH, waits for any update to finish */
+uint8_t *qspi_mapped_addr(uint32_t addr);
 
 #define FLASH_BASE_ADDRESS ((uint8_t *)(0x90000000))
 
+/*
+ * Read cache for the indirect QSPI API (if you've included qspi_cache.o)
+ */
+struct qspi_cache_stats {
+	uint32_t	hits;			/* lines found in the cache */
+	uint32_t	misses;			/* lines read from FLASH */
+	uint32_t	bypass;			/* reads too big to cache */
+	uint32_t	invalidates;	/* lines dropped by writes/erases */
+	uint32_t	flash_bytes;	/* bytes actually read from FLASH */
+};
+
+/* Set up the cache using 'size' bytes at 'mem' for data */
+uint32_t qspi_cache_init(uint8_t *mem, uint32_t size);
+/* qspi_read_flash() through the cache */
+int qspi_cache_read(uint32_t addr, uint8_t *buf, int len);
+/* Drop cached lines in a range (qspi.c does this for you) */
+void qspi_cache_invalidate(uint32_t addr, uint32_t len);
+/* Hit/miss statistics */
+void qspi_cache_get_stats(struct qspi_cache_stats *st, int reset);
+
+/*
+ * Key/Value store in QSPI FLASH (if you've included kvstore.o)
+ */
+#define KV_MAX_KEY		32
+#define KV_MAX_VALUE	240
+#define KV_MAX_SECTORS	64
+
+struct kv_stats {
+	uint32_t	keys;			/* keys currently stored */
+	uint32_t	user_bytes;		/* key + value bytes passed to kv_set() */
+	uint32_t	flash_bytes;	/* bytes actually programmed */
+	uint32_t	erases;			/* sub-sector erases */
+	uint32_t	compactions;	/* sub-sectors compacted */
+	uint32_t	free_sectors;	/* sub-sectors ready for use */
+	uint32_t	min_erase;		/* least erased sub-sector */
+	uint32_t	max_erase;		/* most erased sub-sector */
+};
+
+/* Mount the store in 'nsect' 4K blocks at 'base' */
+int kv_init(uint32_t base, int nsect);
+/* Read a value, returns its length or -1 */
+int kv_get(const char *key, uint8_t *val, int max_len);
+/* Write a value */
+int kv_set(const char *key, const uint8_t *val, int len);
+/* Remove a key */
+int kv_delete(const char *key);
+/* Background compaction, call from the main loop */
+int kv_service(void);
+/* Statistics (write amplification is flash_bytes / user_bytes) */
+void kv_get_stats(struct kv_stats *st);
+
 /*
  * LCD function (if you've included lcd.o)
  */
@@ -268,11 +415,238 @@ void dma2d_draw_32bpp(DMA2D_BITMAP *fb, int x, int y, uint32_t pixel);
 #define DMA2D_COLOR_YELLOW		(DMA2D_COLOR){.argb8888={0x55, 0xff, 0xff, 0xff}}
 #define DMA2D_COLOR_LTYELLOW	(DMA2D_COLOR){.argb8888={0xaa, 0xff, 0xff, 0xff}}
 
+/*
+ * Bitmap archives in QSPI FLASH (if you've included assets.o)
+ */
+/* Open the archive at FLASH address 'addr', returns asset count or -1 */
+int asset_open(uint32_t addr);
+/* Describe an asset, the pixels stay in the (mapped) FLASH */
+int asset_get(const char *name, DMA2D_BITMAP *bm);
+
+/*
+ * Render cache in QSPI FLASH (if you've included render_cache.o)
+ */
+struct rc_stats {
+	uint32_t	hits;		/* found in FLASH */
+	uint32_t	misses;		/* had to run the generator */
+	uint32_t	stored;		/* bytes written to FLASH */
+	uint32_t	resets;		/* times the cache filled up */
+	uint32_t	failed;		/* couldn't be written to FLASH */
+	uint32_t	used;		/* bytes of the cache in use */
+	uint32_t	entries;	/* blobs in the directory */
+};
+
+/* Use 'size' bytes of FLASH at 'base' for the cache */
+int rc_init(uint32_t base, uint32_t size);
+/* Cached result of gen(buf, params), or buf if it couldn't be cached */
+void *render_cache(const char *name, const void *params, int plen, void *buf,
+			uint32_t len, void (*gen)(void *buf, const void *params));
+void rc_get_stats(struct rc_stats *st);
+
 /* If you are going to move the heap, implement this function to set the start
  * and end points for the heap.
  */
 void local_heap_setup(uint8_t **start, uint8_t **end);
 
+/*
+ * Memory regions, arenas, and pools (if you've included region.o)
+ */
+#define REGION_SRAM		0	/* internal SRAM (the malloc heap) */
+#define REGION_CCM		1	/* 64K CCM, no DMA! */
+#define REGION_SDRAM	2	/* external SDRAM */
+#define REGION_MAX		3
+
+/* Bump allocator, freed all at once or like a stack */
+struct arena {
+	uint8_t		*base, *cur, *end;
+	struct arena_hdr *top;	/* the newest allocation */
+	uint32_t	high;		/* most bytes ever in use */
+	uint32_t	fails;		/* allocations that didn't fit */
+};
+
+/* Fixed size objects */
+struct pool {
+	uint8_t		*mem;
+	void		*free;		/* free list */
+	uint32_t	size, count;
+	uint32_t	used, high;	/* objects in use now, and at most */
+	uint32_t	fails;		/* allocations with none left */
+};
+
+/* Override to change where the CCM and SDRAM regions are */
+void local_region_setup(int r, uint8_t **start, uint8_t **end);
+int region_find(const char *name);
+void *region_alloc(int r, uint32_t size, uint32_t align);
+uint32_t region_avail(int r);
+void region_dump(void);
+int arena_init(struct arena *a, int r, uint32_t size);
+void *arena_alloc(struct arena *a, uint32_t size, uint32_t align);
+void arena_free(struct arena *a, void *p);
+void arena_reset(struct arena *a);
+int pool_init(struct pool *p, int r, uint32_t size, uint32_t count);
+void *pool_alloc(struct pool *p);
+void pool_free(struct pool *p, void *obj);
+
+/*
+ * Memory benchmarks (if you've included membench.o)
+ */
+struct membench_result {
+	const char	*name;
+	uint32_t	bytes;		/* bytes read, written, or copied */
+	uint32_t	count;		/* number of accesses (or bursts) */
+	uint32_t	cycles;		/* DWT cycles it took */
+};
+
+#define MEMBENCH_MAX	10
+
+/* Run the tests over a buffer (it gets overwritten) */
+int membench_run(uint8_t *buf, uint32_t len, struct membench_result *res, int max);
+/* Print results as a table */
+void membench_print(const struct membench_result *res, int n);
+
+/*
+ * Memory tests (if you've included memtest.o), these all destroy
+ * what is in the memory they test
+ */
+struct memtest_result {
+	uint32_t	errors;
+	uint32_t	*fail_addr;		/* first failure */
+	uint32_t	expected, actual;
+};
+
+/* Incremental March-C state */
+#define MEMTEST_CHUNK	65536
+struct memtest_bg {
+	uint32_t	*base;
+	uint32_t	len;
+	uint32_t	pos;			/* next chunk to test (bytes from base) */
+	uint32_t	passes;			/* complete passes so far */
+	struct memtest_result	result;
+};
+
+int memtest_data_bus(uint32_t *addr, struct memtest_result *r);
+int memtest_addr_bus(uint32_t *base, uint32_t len, struct memtest_result *r);
+int memtest_pattern(uint32_t *base, uint32_t len, uint32_t pattern,
+												struct memtest_result *r);
+int memtest_march_c(uint32_t *base, uint32_t len, struct memtest_result *r);
+/* Data bus, address bus, and two patterns, fast enough for boot */
+int memtest_quick(uint32_t *base, uint32_t len, struct memtest_result *r);
+/* March-C a chunk at a time from the main loop */
+void memtest_bg_start(struct memtest_bg *bg, uint32_t *base, uint32_t len);
+int memtest_bg_step(struct memtest_bg *bg, uint32_t max_ms);
+
+/*
+ * TLSF allocator (if you've included tlsf.o it also replaces malloc
+ * and friends, with a heap on the memory from local_heap_setup())
+ */
+typedef struct tlsf tlsf_t;
+
+struct tlsf_stats {
+	uint32_t	size;			/* bytes the heap manages */
+	uint32_t	used, high;		/* bytes allocated now, and at most */
+	uint32_t	largest_free;	/* biggest block malloc could return */
+	uint32_t	allocs, frees, fails;
+};
+
+/* Make a heap in 'bytes' bytes of memory at 'mem' */
+tlsf_t *tlsf_create(void *mem, uint32_t bytes);
+void *tlsf_malloc(tlsf_t *t, size_t size);
+void tlsf_free(tlsf_t *t, void *ptr);
+void *tlsf_realloc(tlsf_t *t, void *ptr, size_t size);
+void *tlsf_memalign(tlsf_t *t, size_t align, size_t size);
+size_t tlsf_usable_size(void *ptr);
+void tlsf_get_stats(tlsf_t *t, struct tlsf_stats *st);
+/* The heap behind malloc(), created on first use */
+tlsf_t *tlsf_default_heap(void);
+
+/*
+ * Microsecond clock and timers on TIM2 (if you've included timebase.o)
+ */
+struct utimer {
+	struct utimer	*next, **pprev;
+	uint32_t		when;			/* uclock() time it fires */
+	void			(*func)(void *);
+	void			*arg;
+};
+
+/* start TIM2, mtime() and msleep() use it from then on */
+void timebase_init(void);
+uint32_t uclock(void);
+uint64_t uclock64(void);
+void udelay(uint32_t us);
+/* call func(arg) from the TIM2 interrupt 'us' microseconds from now */
+void utimer_start(struct utimer *t, uint32_t us, void (*func)(void *), void *arg);
+int utimer_cancel(struct utimer *t);
+void usleep_wfi(uint32_t us);
+
+/*
+ * Cycle counter profiling (if you've included profile.o), times
+ * are in CPU cycles (nanoseconds if built with PROFILE_HOST)
+ */
+#define PROF_MAX_TIMERS		32
+#define PROF_HIST_BUCKETS	16
+#define PROF_HIST_SHIFT		4	/* first bucket is < 32 cycles */
+#define PROF_TRACE_SIZE		256
+
+struct prof_timer {
+	const char	*name;
+	uint32_t	count;
+	uint32_t	min, max;
+	uint64_t	total;
+	uint32_t	hist[PROF_HIST_BUCKETS];
+};
+
+struct prof_event {
+	uint32_t	when;
+	uint16_t	id, arg;
+};
+
+struct prof_scope {
+	int			id;
+	uint32_t	start;
+};
+
+void prof_init(void);
+/* find (or create) a timer by name, returns its id */
+int prof_timer(const char *name);
+uint32_t prof_now(void);
+#define prof_start()	prof_now()
+uint32_t prof_stop(int id, uint32_t start);
+/* time from here to the end of the enclosing block against timer 'id' */
+#define PROF_SCOPE(id)	PROF_SCOPE_(id, __LINE__)
+#define PROF_SCOPE_(id, l)	PROF_SCOPE__(id, l)
+#define PROF_SCOPE__(id, l)	struct prof_scope __prof_scope_##l \
+			__attribute__((cleanup(prof_scope_end))) = { (id), prof_now() }
+void prof_scope_end(struct prof_scope *s);
+void prof_trace(uint16_t id, uint16_t arg);
+const struct prof_timer *prof_get(int id);
+void prof_reset(void);
+void prof_dump(void);
+void prof_trace_dump(int n);
+
+/*
+ * Binary telemetry frames (if you've included telemetry.o), decode
+ * them on the host with telemetry.pl
+ */
+#define TELEM_LOG			0	/* text */
+#define TELEM_METRIC		1	/* timestamped 32 bit values */
+#define TELEM_BULK			2	/* blocks of data */
+#define TELEM_USER			3	/* your own channels start here */
+#define TELEM_MAX_PAYLOAD	250
+
+struct telem_stats {
+	uint32_t	frames, errors;
+	uint32_t	payload_bytes, wire_bytes;
+};
+
+int telem_send(int chan, const void *data, int len);
+int telem_log(const char *s);
+int telem_metric(uint16_t id, int32_t value);
+int telem_bulk(uint16_t stream, uint32_t offset, const uint8_t *data, uint32_t len);
+void telem_get_stats(struct telem_stats *st);
+/* Where the frames go, the console unless you supply your own */
+void telem_output(const uint8_t *buf, int len);
+
 /*
  *
  * The utility functions for i2c
@@ -297,10 +671,49 @@ typedef struct {
  */
 
 i2c_dev *i2c_init(int i2c, uint8_t addr, uint8_t baud);
+/* Redo the bus timing for a new APB1 clock (clock_setup() calls it) */
+void i2c_reclock(void);
 
 int	i2c_write(i2c_dev *chan, uint8_t *buf, size_t buf_size, int send_stop);
 int	i2c_read(i2c_dev *chan, uint8_t *buf, size_t buf_size, int send_stop);
 
+/*
+ * Interrupt driven I2C, a transfer writes 'wlen' bytes and then (after
+ * a repeated START) reads 'rlen' bytes, either can be 0. Transfers are
+ * queued per bus and run one after the other, 'done' is called from
+ * the interrupt when each one finishes. The buffers have to stay put
+ * until then and can't be in CCM RAM (the DMA moves the data).
+ */
+#define I2C_DONE			0
+#define I2C_PENDING			1
+#define I2C_ERR_NACK		-1	/* the device didn't answer */
+#define I2C_ERR_BUS			-2	/* bus error or lost arbitration */
+#define I2C_ERR_TIMEOUT		-3	/* took longer than 'timeout' */
+#define I2C_TIMEOUT_MS		10	/* if 'timeout' is 0 */
+
+struct i2c_xfer;
+typedef void (*i2c_callback)(struct i2c_xfer *x);
+
+struct i2c_xfer {
+	struct i2c_xfer	*next;		/* used by the driver */
+	i2c_dev			*dev;
+	const uint8_t	*wbuf;
+	uint16_t		wlen;
+	uint8_t			*rbuf;
+	uint16_t		rlen;
+	uint16_t		timeout;	/* in mS */
+	volatile int	status;		/* I2C_PENDING until it is done */
+	i2c_callback	done;		/* can be NULL */
+	void			*arg;		/* for 'done' */
+};
+
+/* Queue a transfer, returns 0 or -1 if it can't be done */
+int i2c_submit(struct i2c_xfer *x);
+/* Wait for a transfer to finish and return its status */
+int i2c_xfer_wait(struct i2c_xfer *x);
+/* True if bus 'i2c' has transfers queued or running */
+int i2c_busy(int i2c);
+
 /*
  * Touch panel controller parameters
  */
@@ -322,3 +735,160 @@ typedef struct {
 /* check for touch event, block if wait is true */
 touch_event *get_touch(int wait);
 void touch_init(uint8_t threshold);
+/* called from the touch interrupt with each new touch (see event.c) */
+void touch_hook(touch_event *te);
+
+/* Every touch, with when it happened, queued for touch_drain() */
+#define TOUCH_RING_SIZE	32		/* must be a power of 2 */
+#define TOUCH_DOWN		0
+#define TOUCH_MOVE		1
+#define TOUCH_UP		2
+
+struct touch_record {
+	uint32_t	when;	/* mtime() when it was read */
+	int			kind;	/* TOUCH_DOWN, TOUCH_MOVE, or TOUCH_UP */
+	touch_event	te;
+};
+
+struct touch_ring_stats {
+	uint32_t	records;	/* touches read */
+	uint32_t	coalesced;	/* moves that replaced the move before */
+	uint32_t	dropped;	/* lost because the ring was full */
+};
+
+/* take up to 'max' records out of the ring, returns how many */
+int touch_drain(struct touch_record *out, int max);
+/* how many records are waiting */
+int touch_pending(void);
+void touch_get_stats(struct touch_ring_stats *st);
+
+/*
+ * Gestures, from touch records (gesture.o, no hardware so it runs
+ * on a PC too)
+ */
+#define GESTURE_NONE		0
+#define GESTURE_TAP			1
+#define GESTURE_DOUBLE_TAP	2
+#define GESTURE_LONG_PRESS	3
+#define GESTURE_SWIPE		4
+#define GESTURE_DRAG		5
+#define GESTURE_PINCH		6
+#define GESTURE_ROTATE		7
+#define GESTURE_TYPES		8
+
+/* phases of the ones that go on for a while (drag, pinch, rotate) */
+#define GESTURE_BEGIN		1
+#define GESTURE_MOVE		2
+#define GESTURE_END			3
+
+/* swipe directions */
+#define GESTURE_LEFT		1
+#define GESTURE_RIGHT		2
+#define GESTURE_UP			3
+#define GESTURE_DOWN		4
+
+struct gesture_config {
+	int			tap_slop;		/* pixels a tap (or long press) can wander */
+	uint32_t	tap_ms;			/* longest a tap can be held down */
+	uint32_t	double_ms;		/* longest from one tap to the next */
+	int			double_slop;	/* furthest apart the two taps can be */
+	uint32_t	long_ms;		/* held still this long is a long press */
+	int			swipe_dist;		/* pixels a swipe has to travel */
+	uint32_t	swipe_ms;		/* in at most this long */
+	int			pinch_slop;		/* pixels the spacing changes to be a pinch */
+	int			rotate_slop;	/* degrees turned to be a rotate */
+};
+
+struct gesture {
+	int			type;		/* GESTURE_TAP ... */
+	int			phase;		/* GESTURE_BEGIN, _MOVE, _END (or 0) */
+	int			dir;		/* for a swipe, GESTURE_LEFT ... */
+	int			x, y;		/* where (between the fingers for two) */
+	int			dx, dy;		/* how far it went (swipe and drag) */
+	float		scale;		/* pinch, spacing now / spacing at first */
+	float		angle;		/* rotate, degrees turned (clockwise on screen) */
+	uint32_t	start;		/* mtime() of the first finger down */
+	uint32_t	when;		/* mtime() of the record that finished it */
+};
+
+typedef void (*gesture_handler)(const struct gesture *g, void *arg);
+
+/* the recognizer's state, one per touch panel (look but don't touch) */
+struct gesture_state {
+	const struct gesture_config *cfg;
+	gesture_handler	func;
+	void		*arg;
+	int			state;
+	int			x0, y0, x, y;		/* first and latest position */
+	uint32_t	t0;					/* first finger down */
+	int			tap_ok, tap_x, tap_y;	/* the last tap, for double tap */
+	uint32_t	tap_t;
+	float		d0, a0;				/* two finger spacing and angle */
+	int			pinching, rotating;
+	float		last_scale, last_angle;
+	uint32_t	count[GESTURE_TYPES];	/* how many of each were seen */
+};
+
+extern const struct gesture_config gesture_defaults;
+
+/* start recognizing, 'cfg' can be NULL for the defaults */
+void gesture_init(struct gesture_state *gs, const struct gesture_config *cfg,
+											gesture_handler func, void *arg);
+/* the next record from touch_drain() */
+void gesture_feed(struct gesture_state *gs, const struct touch_record *r);
+/* call every 50 - 100mS so held fingers become long presses */
+void gesture_tick(struct gesture_state *gs, uint32_t now);
+const char *gesture_name(int type);
+
+/*
+ * Event loop (if you've included event.o, event timers also
+ * need timebase.o)
+ */
+#define EV_CONSOLE		1	/* console has characters */
+#define EV_TOUCH		2	/* new touch panel data */
+#define EV_DMA2D		3	/* DMA2D transfer complete */
+#define EV_LCD_TE		4	/* display tearing effect line */
+#define EV_USER			8	/* your own events start here */
+#define EV_MAX_TYPES	32
+
+#define EV_PRIO_HIGH	0
+#define EV_PRIO_NORMAL	1
+#define EV_PRIO_LOW		2
+#define EV_PRIOS		3
+#define EV_QUEUE_SIZE	32	/* events per priority */
+
+struct event {
+	uint16_t	type;
+	uint8_t		prio;
+	uint8_t		once;		/* posted with event_post_once() */
+	uint32_t	arg;
+};
+
+typedef void (*event_handler)(struct event *ev);
+
+struct event_timer {
+	struct utimer	timer;
+	uint32_t		period;		/* uS, 0 for one shot */
+	int				type, prio;
+	uint32_t		arg;
+};
+
+struct event_stats {
+	uint32_t	posted, dispatched, dropped;
+	uint32_t	idle;		/* times the loop went to sleep */
+};
+
+void event_init(void);
+void event_handler_set(int type, event_handler h);
+int event_post(int type, int prio, uint32_t arg);
+/* doesn't post if one of these is already waiting */
+int event_post_once(int type, int prio, uint32_t arg);
+int event_dispatch(void);
+void event_loop(void);
+/* called by event_loop() before it sleeps, define your own */
+void event_idle(void);
+void event_timer_start(struct event_timer *et, uint32_t us, uint32_t period,
+											int type, int prio, uint32_t arg);
+int event_timer_cancel(struct event_timer *et);
+void event_te_enable(void);
+void event_get_stats(struct event_stats *st);